@@ -0,0 +1,506 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * batch_io.c - Batched reads of files.
+ *
+ * Reading blocks of a file one at a time keeps a single request in flight,
+ * which leaves fast storage, NVMe drives in particular, mostly idle. When many
+ * blocks are known to be needed in advance (e.g. when prefetching during a
+ * scan), they're instead read in a batch, keeping up to `BATCH_IO_DEPTH'
+ * requests in flight with `io_uring' on Linux. Elsewhere, or if the kernel
+ * refuses `io_uring', a pool of `BATCH_IO_THREADS' threads issues them with
+ * `pread()', one each at a time.
+ *
+ * Everything is set up on first use, so that files never read in batches
+ * cost nothing. Batches are read with the GIL released; callers serialize
+ * them.
+ */
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#endif
+
+#include "batch_io.h"
+
+#ifdef BATCH_IO_URING
+#include <sys/syscall.h>
+
+/* Older C library headers may lack the system call numbers, which are the same
+ * on all architectures.
+ */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#endif
+
+
+/* Initialize `bio'; it's set up on first use. */
+void batch_io_init(batch_io_t *bio)
+{
+    memset(bio, 0, sizeof(batch_io_t));
+#ifdef BATCH_IO_URING
+    bio->ring_fd = -1;
+#endif
+}
+
+
+#ifdef _WIN32
+
+/* Microsoft Windows has no use for batched reads yet (see "buffer_pool.c"), so
+ * reads are issued one at a time.
+ */
+void batch_io_read(batch_io_t *bio, HANDLE fd, batch_read_t *reads,
+        size_t num_reads)
+{
+    OVERLAPPED ov;
+    DWORD n;
+    size_t i;
+
+    UNREFERENCED_PARAMETER(bio);
+
+    for(i = 0; i < num_reads; i++)
+    {
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = LODWORD(reads[i].pos);
+        ov.OffsetHigh = HIDWORD(reads[i].pos);
+
+        if(ReadFile(fd, reads[i].buf, (DWORD)reads[i].size, &n, &ov))
+            reads[i].result = n;
+        else
+            reads[i].result = GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+}
+
+
+void batch_io_fini(batch_io_t *bio)
+{
+    UNREFERENCED_PARAMETER(bio);
+}
+
+#else
+
+/* Read `read->size' bytes at `read->pos' from `fd', stopping at the end of the
+ * file, and set `read->result'.
+ */
+static void batch_read_one(int fd, batch_read_t *read)
+{
+    ssize_t n;
+    size_t done = 0;
+
+    while(done < read->size)
+    {
+        n = pread(fd, read->buf + done, read->size - done,
+            (off_t)(read->pos + done));
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n < 0)
+        {
+            read->result = -1;
+            return;
+        }
+
+        if(n == 0)
+            break;
+        done += n;
+    }
+
+    read->result = (ssize_t)done;
+}
+
+
+/* Body of the worker threads of `bio'. */
+static void *batch_io_worker(void *arg)
+{
+    batch_io_t *bio = arg;
+    batch_read_t *read;
+
+    pthread_mutex_lock(&bio->mutex);
+
+    for(;;)
+    {
+        while(bio->stop == 0 && bio->next >= bio->num_reads)
+            pthread_cond_wait(&bio->work, &bio->mutex);
+
+        if(bio->stop)
+            break;
+
+        read = &bio->reads[bio->next++];
+
+        pthread_mutex_unlock(&bio->mutex);
+        batch_read_one(bio->fd, read);
+        pthread_mutex_lock(&bio->mutex);
+
+        if(--bio->pending == 0)
+            pthread_cond_signal(&bio->done);
+    }
+
+    pthread_mutex_unlock(&bio->mutex);
+    return NULL;
+}
+
+
+/* Start the worker threads of `bio'. Reads are issued by the calling thread if
+ * none can be started.
+ */
+static void batch_io_start_threads(batch_io_t *bio)
+{
+    size_t i;
+
+    if(pthread_mutex_init(&bio->mutex, NULL) != 0)
+        goto _err1;
+
+    if(pthread_cond_init(&bio->work, NULL) != 0)
+        goto _err2;
+
+    if(pthread_cond_init(&bio->done, NULL) != 0)
+        goto _err3;
+
+    for(i = 0; i < BATCH_IO_THREADS; i++)
+    {
+        if(pthread_create(&bio->threads[i], NULL, batch_io_worker, bio) != 0)
+            break;
+        bio->num_threads += 1;
+    }
+
+    if(bio->num_threads == 0)
+        goto _err4;
+
+    return;
+
+_err4:
+    pthread_cond_destroy(&bio->done);
+
+_err3:
+    pthread_cond_destroy(&bio->work);
+
+_err2:
+    pthread_mutex_destroy(&bio->mutex);
+
+_err1:
+    return;
+}
+
+
+/* Read the `num_reads' entries of `reads' from `fd' with the worker threads of
+ * `bio', or one at a time if there are none.
+ */
+static void batch_io_read_threads(batch_io_t *bio, int fd, batch_read_t *reads,
+        size_t num_reads)
+{
+    size_t i;
+
+    if(bio->num_threads == 0)
+    {
+        for(i = 0; i < num_reads; i++)
+            batch_read_one(fd, &reads[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&bio->mutex);
+
+    bio->fd = fd;
+    bio->reads = reads;
+    bio->num_reads = num_reads;
+    bio->next = 0;
+    bio->pending = num_reads;
+    pthread_cond_broadcast(&bio->work);
+
+    while(bio->pending > 0)
+        pthread_cond_wait(&bio->done, &bio->mutex);
+
+    bio->reads = NULL;
+    bio->num_reads = 0;
+    bio->next = 0;
+
+    pthread_mutex_unlock(&bio->mutex);
+}
+
+
+#ifdef BATCH_IO_URING
+
+/* Fields of the rings of `bio', at offset `off' of their mapping. */
+#define SQ_FIELD(bio, off) ((unsigned int *)((char *)(bio)->sq_ring + (off)))
+#define CQ_FIELD(bio, off) ((unsigned int *)((char *)(bio)->cq_ring + (off)))
+
+
+/* Tear down the ring of `bio'. */
+static void batch_io_close_ring(batch_io_t *bio)
+{
+    munmap(bio->sqes, bio->sqes_size);
+    if(bio->cq_ring_size > 0)
+        munmap(bio->cq_ring, bio->cq_ring_size);
+    munmap(bio->sq_ring, bio->sq_ring_size);
+    close(bio->ring_fd);
+    bio->ring_fd = -1;
+}
+
+
+/* Set up an `io_uring' ring of `BATCH_IO_DEPTH' entries for `bio'. Leaves
+ * `bio->ring_fd' set to -1 if the kernel doesn't support it, or if it's been
+ * disabled (e.g. by a seccomp filter or `kernel.io_uring_disabled'), or if
+ * `BATCH_IO_NO_URING' is set in the environment, which tests use to exercise
+ * the pool of threads.
+ */
+static void batch_io_open_ring(batch_io_t *bio)
+{
+    struct io_uring_params *p = &bio->params;
+    int fd;
+
+    memset(p, 0, sizeof(struct io_uring_params));
+
+    if(getenv(BATCH_IO_NO_URING) != NULL)
+        goto _err1;
+
+    if((fd = (int)syscall(__NR_io_uring_setup, BATCH_IO_DEPTH, p)) < 0)
+        goto _err1;
+
+    bio->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    bio->cq_ring_size = p->cq_off.cqes +
+        p->cq_entries * sizeof(struct io_uring_cqe);
+    bio->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Since Linux 5.4 both rings live in a single mapping. */
+    if(p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(bio->cq_ring_size > bio->sq_ring_size)
+            bio->sq_ring_size = bio->cq_ring_size;
+        bio->cq_ring_size = 0;
+    }
+
+    if((bio->sq_ring = mmap(NULL, bio->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        goto _err2;
+
+    bio->cq_ring = bio->sq_ring;
+    if(bio->cq_ring_size > 0 &&
+            (bio->cq_ring = mmap(NULL, bio->cq_ring_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto _err3;
+
+    if((bio->sqes = mmap(NULL, bio->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED)
+        goto _err4;
+
+    bio->ring_fd = fd;
+    return;
+
+_err4:
+    if(bio->cq_ring_size > 0)
+        munmap(bio->cq_ring, bio->cq_ring_size);
+
+_err3:
+    munmap(bio->sq_ring, bio->sq_ring_size);
+
+_err2:
+    close(fd);
+
+_err1:
+    bio->ring_fd = -1;
+}
+
+
+/* Read the rest of `read' with `pread()', after a short read. */
+static void batch_read_rest(int fd, batch_read_t *read)
+{
+    batch_read_t rest = *read;
+
+    rest.buf += read->result;
+    rest.size -= read->result;
+    rest.pos += read->result;
+
+    batch_read_one(fd, &rest);
+    read->result = rest.result < 0 ? -1 : read->result + rest.result;
+}
+
+
+/* Read the `num_reads' entries of `reads' from `fd' through the ring of `bio',
+ * keeping as many of them in flight as the ring holds. Returns -1 if the kernel
+ * doesn't support reads through `io_uring' (before Linux 5.6), or fails to take
+ * them, or to be entered at all, in which case the ring is torn down, once no
+ * reads are in flight, and the reads have to be retried.
+ */
+static int batch_io_read_ring(batch_io_t *bio, int fd, batch_read_t *reads,
+        size_t num_reads)
+{
+    struct io_uring_params *p = &bio->params;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail, mask, queued = 0;
+    size_t submitted = 0, completed = 0;
+    batch_read_t *read;
+    int failed = 0, backoff, ret;
+
+    while(completed < submitted || (failed == 0 && submitted < num_reads))
+    {
+        /* Queue reads while there's room in the ring. */
+        tail = *SQ_FIELD(bio, p->sq_off.tail);
+        mask = *SQ_FIELD(bio, p->sq_off.ring_mask);
+
+        while(failed == 0 && submitted < num_reads &&
+                submitted - completed < p->sq_entries)
+        {
+            read = &reads[submitted];
+            sqe = &((struct io_uring_sqe *)bio->sqes)[tail & mask];
+
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)read->buf;
+            sqe->len = (unsigned int)read->size;
+            sqe->off = read->pos;
+            sqe->user_data = submitted;
+
+            SQ_FIELD(bio, p->sq_off.array)[tail & mask] = tail & mask;
+            tail += 1;
+            submitted += 1;
+            queued += 1;
+        }
+
+        __atomic_store_n(SQ_FIELD(bio, p->sq_off.tail), tail, __ATOMIC_RELEASE);
+
+        /* Submit them and wait for at least one to complete. */
+        do
+            ret = (int)syscall(__NR_io_uring_enter, bio->ring_fd, queued, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        while(ret < 0 && errno == EINTR);
+
+        backoff = 0;
+
+        if(ret >= 0)
+            queued -= (unsigned int)ret < queued ? (unsigned int)ret : queued;
+
+        /* The kernel is short of memory, or of room for completions, until
+         * some are reaped below. Back off if there are none yet.
+         */
+        else if(errno == EAGAIN || errno == EBUSY)
+            backoff = 1;
+
+        /* Shouldn't happen, but if the kernel refuses reads, take back those
+         * it hasn't consumed, and wait for the rest, which complete whether
+         * or not the ring is entered, before tearing it down, as they still
+         * write to the buffers of `reads'.
+         */
+        else
+        {
+            if(queued > 0)
+            {
+                head = __atomic_load_n(SQ_FIELD(bio, p->sq_off.head),
+                    __ATOMIC_ACQUIRE);
+                __atomic_store_n(SQ_FIELD(bio, p->sq_off.tail), head,
+                    __ATOMIC_RELEASE);
+                submitted -= queued;
+                queued = 0;
+            }
+            failed = 1;
+            backoff = 1;
+        }
+
+        /* Reap completions. */
+        head = *CQ_FIELD(bio, p->cq_off.head);
+        mask = *CQ_FIELD(bio, p->cq_off.ring_mask);
+
+        if(backoff && head == __atomic_load_n(CQ_FIELD(bio, p->cq_off.tail),
+                __ATOMIC_ACQUIRE))
+            usleep(BATCH_IO_BACKOFF);
+
+        while(head != __atomic_load_n(CQ_FIELD(bio, p->cq_off.tail),
+                __ATOMIC_ACQUIRE))
+        {
+            cqe = &((struct io_uring_cqe *)((char *)bio->cq_ring +
+                p->cq_off.cqes))[head & mask];
+
+            read = &reads[cqe->user_data];
+            read->result = cqe->res < 0 ? -1 : cqe->res;
+            if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                failed = 1;
+
+            head += 1;
+            completed += 1;
+        }
+
+        __atomic_store_n(CQ_FIELD(bio, p->cq_off.head), head, __ATOMIC_RELEASE);
+    }
+
+    if(failed)
+    {
+        batch_io_close_ring(bio);
+        return -1;
+    }
+
+    /* Reads are short at the end of the file, but may be elsewhere too. */
+    for(read = reads; read < reads + num_reads; read++)
+        if(read->result > 0 && (size_t)read->result < read->size)
+            batch_read_rest(fd, read);
+
+    return 0;
+}
+
+#endif /* BATCH_IO_URING */
+
+
+/* Read the `num_reads' entries of `reads' from file `fd' concurrently, and wait
+ * for all of them. Called with the GIL released.
+ */
+void batch_io_read(batch_io_t *bio, int fd, batch_read_t *reads,
+        size_t num_reads)
+{
+    if(bio->initialized == 0)
+    {
+        bio->initialized = 1;
+#ifdef BATCH_IO_URING
+        batch_io_open_ring(bio);
+        if(bio->ring_fd < 0)
+#endif
+        batch_io_start_threads(bio);
+    }
+
+#ifdef BATCH_IO_URING
+    if(bio->ring_fd >= 0)
+    {
+        if(batch_io_read_ring(bio, fd, reads, num_reads) == 0)
+            return;
+        batch_io_start_threads(bio);
+    }
+#endif
+
+    batch_io_read_threads(bio, fd, reads, num_reads);
+}
+
+
+/* Tear down `bio', stopping its threads. */
+void batch_io_fini(batch_io_t *bio)
+{
+    size_t i;
+
+#ifdef BATCH_IO_URING
+    if(bio->ring_fd >= 0)
+        batch_io_close_ring(bio);
+#endif
+
+    if(bio->num_threads > 0)
+    {
+        pthread_mutex_lock(&bio->mutex);
+        bio->stop = 1;
+        pthread_cond_broadcast(&bio->work);
+        pthread_mutex_unlock(&bio->mutex);
+
+        for(i = 0; i < bio->num_threads; i++)
+            pthread_join(bio->threads[i], NULL);
+
+        pthread_cond_destroy(&bio->done);
+        pthread_cond_destroy(&bio->work);
+        pthread_mutex_destroy(&bio->mutex);
+        bio->num_threads = 0;
+    }
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,95 @@
+#ifndef _BATCH_IO_H_
+#define _BATCH_IO_H_
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/* Reads are submitted to the kernel with `io_uring' on Linux, if the headers
+ * know of `IORING_OP_READ', which came along with `IORING_FEAT_RW_CUR_POS'.
+ */
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS
+#define BATCH_IO_URING
+#endif
+#endif
+#endif
+
+
+/* Environment variable that, if set, has the pool of threads issue reads, even
+ * where `io_uring' is available.
+ */
+#define BATCH_IO_NO_URING "PYRSISTENCE_NO_IO_URING"
+
+/* Number of reads kept in flight with `io_uring'. */
+#define BATCH_IO_DEPTH 32
+
+/* Microseconds to wait before entering the ring again, when the kernel can't
+ * take more reads for the time being.
+ */
+#define BATCH_IO_BACKOFF 1000
+
+/* Number of threads issuing reads where `io_uring' is unavailable. */
+#define BATCH_IO_THREADS 16
+
+
+/* A read of `size' bytes at position `pos' in `buf'. `result' receives the
+ * number of bytes read or -1 on error.
+ */
+typedef struct batch_read
+{
+    char *buf;                /* Buffer to read in */
+    size_t size;              /* Number of bytes to read */
+    size_t pos;               /* Position in the file */
+    ssize_t result;           /* Bytes read, -1 on error */
+} batch_read_t;
+
+
+/* Submits many reads of a file at once and waits for all of them. Set up on
+ * first use, with `io_uring' on Linux, or else a pool of threads each issuing
+ * one read at a time.
+ */
+typedef struct batch_io
+{
+    char initialized;         /* Non-zero once set up on first use */
+#ifdef BATCH_IO_URING
+    int ring_fd;              /* Ring descriptor, -1 if `io_uring' is unavailable */
+    struct io_uring_params params;  /* Layout of the rings */
+    void *sq_ring;            /* Mapping of the submission queue ring */
+    void *cq_ring;            /* Mapping of the completion queue ring */
+    void *sqes;               /* Mapping of the submission queue entries */
+    size_t sq_ring_size;      /* Size of `sq_ring' */
+    size_t cq_ring_size;      /* Size of `cq_ring', 0 if shared with `sq_ring' */
+    size_t sqes_size;         /* Size of `sqes' */
+#endif
+#ifndef _WIN32
+    size_t num_threads;       /* Number of worker threads started */
+    pthread_t threads[BATCH_IO_THREADS];
+    pthread_mutex_t mutex;    /* Protects the fields below */
+    pthread_cond_t work;      /* Signaled when reads are submitted */
+    pthread_cond_t done;      /* Signaled when the last read completes */
+    int fd;                   /* File the current batch reads */
+    batch_read_t *reads;      /* Reads of the current batch */
+    size_t num_reads;         /* Number of entries in `reads' */
+    size_t next;              /* Next read to be picked up by a worker */
+    size_t pending;           /* Reads not completed yet */
+    char stop;                /* Set to ask the workers to exit */
+#endif
+} batch_io_t;
+
+
+void batch_io_init(batch_io_t *);
+#ifdef _WIN32
+void batch_io_read(batch_io_t *, HANDLE, batch_read_t *, size_t);
+#else
+void batch_io_read(batch_io_t *, int, batch_read_t *, size_t);
+#endif
+void batch_io_fini(batch_io_t *);
+
+#endif /* _BATCH_IO_H_ */
@@ -0,0 +1,784 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * buffer_pool.c - Buffered access to files with `pread()' and `pwrite()'.
+ *
+ * Memory mapped files leave caching entirely to the operating system. Every
+ * access to a page that's not resident is a synchronous page fault, memory use
+ * can't be bounded, and I/O errors are reported by delivering `SIGBUS'. For
+ * data structures many times larger than the available memory, files may
+ * instead be accessed through a buffer pool of fixed size, which reads and
+ * writes them in blocks of `BUFFER_BLOCK_SIZE' bytes using plain file I/O, with
+ * the GIL released, and reports I/O errors as such.
+ *
+ * A pool may be shared by several files, e.g. the segments of a segmented file,
+ * so that they're cached together within a single bound.
+ *
+ * Files may also be opened for direct I/O, bypassing the page cache, in which
+ * case the buffer pool is the only cache and memory use is bounded precisely.
+ * Direct I/O requires aligned buffers, file positions and sizes, so the block
+ * at the end of the file is written in full and the file truncated back.
+ */
+#ifndef _WIN32
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "buffer_pool.h"
+
+
+#ifdef _WIN32
+
+/* Allocate `size' bytes of memory aligned to `BUFFER_ALIGN'. */
+static void *buffer_alloc(size_t size)
+{
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+
+static void buffer_free(void *memory)
+{
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+
+/* Read or write, depending on `write', `size' bytes at position `pos'. Reads
+ * stop at the end of the file. Returns the number of bytes transferred or -1 on
+ * error.
+ */
+static ssize_t buffer_io(HANDLE fd, char *buf, size_t size, size_t pos,
+        int write)
+{
+    OVERLAPPED ov;
+    DWORD n;
+    size_t done = 0;
+
+    while(done < size)
+    {
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = LODWORD(pos + done);
+        ov.OffsetHigh = HIDWORD(pos + done);
+
+        n = size - done > 0x40000000 ? 0x40000000 : (DWORD)(size - done);
+        if(write)
+        {
+            if(WriteFile(fd, buf + done, n, &n, &ov) == FALSE)
+                return -1;
+        }
+        else if(ReadFile(fd, buf + done, n, &n, &ov) == FALSE)
+        {
+            if(GetLastError() != ERROR_HANDLE_EOF)
+                return -1;
+            n = 0;
+        }
+
+        if(n == 0)
+            break;
+        done += n;
+    }
+
+    return (ssize_t)done;
+}
+
+
+/* Truncate file `fd' at `size' bytes. */
+static int buffer_truncate_file(HANDLE fd, size_t size)
+{
+    LARGE_INTEGER lsize;
+
+    lsize.QuadPart = size;
+    return SetFilePointerEx(fd, lsize, NULL, FILE_BEGIN) &&
+        SetEndOfFile(fd) ? 0 : -1;
+}
+
+
+/* Raise an exception for the last I/O error. */
+static void buffer_error(void)
+{
+    PyErr_SetFromWindowsErr(0);
+}
+
+#else
+
+/* Allocate `size' bytes of memory aligned to `BUFFER_ALIGN'. */
+static void *buffer_alloc(size_t size)
+{
+    void *memory;
+
+    if(posix_memalign(&memory, BUFFER_ALIGN, size) != 0)
+        memory = NULL;
+    return memory;
+}
+
+
+static void buffer_free(void *memory)
+{
+    free(memory);
+}
+
+
+/* Read or write, depending on `write', `size' bytes at position `pos'. Reads
+ * stop at the end of the file. Returns the number of bytes transferred or -1 on
+ * error.
+ */
+static ssize_t buffer_io(int fd, char *buf, size_t size, size_t pos, int write)
+{
+    ssize_t n;
+    size_t done = 0;
+
+    while(done < size)
+    {
+        if(write)
+            n = pwrite(fd, buf + done, size - done, (off_t)(pos + done));
+        else
+            n = pread(fd, buf + done, size - done, (off_t)(pos + done));
+
+        if(n < 0)
+            return -1;
+        if(n == 0)
+            break;
+        done += n;
+    }
+
+    return (ssize_t)done;
+}
+
+
+/* Truncate file `fd' at `size' bytes. */
+static int buffer_truncate_file(int fd, size_t size)
+{
+    return ftruncate(fd, (off_t)size);
+}
+
+
+/* Raise an exception for the last I/O error. */
+static void buffer_error(void)
+{
+    if(errno == 0)
+        errno = EIO;
+    PyErr_SetFromErrno(PyExc_IOError);
+}
+
+#endif /* _WIN32 */
+
+
+/* Return the number of bytes of block `block' within the first `file_size'
+ * bytes of a file of `pool', and set `*aligned_sizep' to that rounded up as
+ * needed for direct I/O.
+ */
+static size_t buffer_pool_extent(buffer_pool_t *pool, size_t block,
+        size_t file_size, size_t *aligned_sizep)
+{
+    size_t pos, size;
+
+    pos = block * BUFFER_BLOCK_SIZE;
+    size = pos < file_size ? file_size - pos : 0;
+    if(size > BUFFER_BLOCK_SIZE)
+        size = BUFFER_BLOCK_SIZE;
+
+    *aligned_sizep = size;
+    if(pool->direct)
+        *aligned_sizep = (size + BUFFER_ALIGN - 1) & ~(size_t)(BUFFER_ALIGN - 1);
+
+    return size;
+}
+
+
+/* Read in or write back, depending on `write', the block held in frame `frame'
+ * of `pool'. Only the part of the block within its file is transferred, rounded
+ * up for direct I/O. The rest of a block read in is zeroed. Called with the GIL
+ * released.
+ */
+static int buffer_pool_block_io(buffer_pool_t *pool, buffer_frame_t *frame,
+        int write)
+{
+    buffer_file_t *file = &pool->files[frame->file];
+    size_t pos, size, aligned_size;
+    ssize_t n;
+
+    int ret = -1;
+
+    pos = frame->block * BUFFER_BLOCK_SIZE;
+    size = buffer_pool_extent(pool, frame->block, file->size, &aligned_size);
+
+    if((n = buffer_io(file->fd, frame->data, aligned_size, pos, write)) < 0)
+        goto _err;
+
+    if(write)
+    {
+        /* Short writes are reported as `EIO' by `buffer_error()'. */
+        if((size_t)n != aligned_size)
+        {
+#ifndef _WIN32
+            errno = 0;
+#endif
+            goto _err;
+        }
+
+        /* Direct writes past the end of the file have to be undone. */
+        if(aligned_size > size &&
+                buffer_truncate_file(file->fd, file->size) != 0)
+            goto _err;
+    }
+    else if((size_t)n < BUFFER_BLOCK_SIZE)
+        memset(frame->data + n, 0, BUFFER_BLOCK_SIZE - n);
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Return the hash bucket of `pool' for block `block' of file `file'. Blocks of
+ * different files are spread apart, as their numbers overlap.
+ */
+static size_t *buffer_pool_bucket(buffer_pool_t *pool, size_t file,
+        size_t block)
+{
+    return &pool->buckets[(block + file * 0x9e3779b1) & pool->mask];
+}
+
+
+/* Return the index of the frame of `pool' holding block `block' of file `file',
+ * or `BUFFER_NONE' if it's not in the pool.
+ */
+static size_t buffer_pool_lookup(buffer_pool_t *pool, size_t file,
+        size_t block)
+{
+    size_t i = *buffer_pool_bucket(pool, file, block);
+
+    while(i != BUFFER_NONE &&
+            (pool->frames[i].block != block || pool->frames[i].file != file))
+        i = pool->frames[i].next;
+    return i;
+}
+
+
+/* Remove frame `i' of `pool' from its hash bucket and mark it free. */
+static void buffer_pool_unlink(buffer_pool_t *pool, size_t i)
+{
+    buffer_frame_t *frame = &pool->frames[i];
+    size_t *p = buffer_pool_bucket(pool, frame->file, frame->block);
+
+    while(*p != i)
+        p = &pool->frames[*p].next;
+    *p = frame->next;
+
+    frame->block = BUFFER_NONE;
+    frame->dirty = 0;
+    pool->used -= 1;
+}
+
+
+/* Make frame `i' of `pool' hold block `block' of file `file' and add it to its
+ * hash bucket.
+ */
+static void buffer_pool_link(buffer_pool_t *pool, size_t i, size_t file,
+        size_t block)
+{
+    buffer_frame_t *frame = &pool->frames[i];
+    size_t *bucket = buffer_pool_bucket(pool, file, block);
+
+    frame->file = file;
+    frame->block = block;
+    frame->next = *bucket;
+    *bucket = i;
+    frame->referenced = 1;
+    pool->used += 1;
+}
+
+
+/* Return the index of the frame of `pool' to replace next. The clock hand is
+ * advanced, giving frames accessed since it last passed a second chance, until
+ * a free or unreferenced frame is found. Frames being read in are skipped.
+ */
+static size_t buffer_pool_victim(buffer_pool_t *pool)
+{
+    buffer_frame_t *frame;
+    size_t i;
+
+    for(;;)
+    {
+        i = pool->hand;
+        pool->hand = (i + 1) % pool->num_frames;
+        frame = &pool->frames[i];
+
+        if(frame->reading == 0 &&
+                (frame->block == BUFFER_NONE || frame->referenced == 0))
+            break;
+        frame->referenced = 0;
+    }
+
+    return i;
+}
+
+
+/* Return the frame of `pool' holding block `block' of file `file', replacing
+ * another block if it's not in the pool. If `fill' is zero the block is about
+ * to be overwritten in full, so it's not read in. Raises `IOError' and returns
+ * `NULL' on I/O error. Called with the pool's lock held.
+ */
+static buffer_frame_t *buffer_pool_get(buffer_pool_t *pool, size_t file,
+        size_t block, int fill)
+{
+    buffer_frame_t *frame;
+    size_t i;
+    int ret = 0;
+
+    if((i = buffer_pool_lookup(pool, file, block)) != BUFFER_NONE)
+    {
+        frame = &pool->frames[i];
+        frame->referenced = 1;
+        goto _ok;
+    }
+
+    i = buffer_pool_victim(pool);
+    frame = &pool->frames[i];
+
+    Py_BEGIN_ALLOW_THREADS
+    if(frame->block != BUFFER_NONE && frame->dirty)
+        ret = buffer_pool_block_io(pool, frame, 1);
+    Py_END_ALLOW_THREADS
+
+    if(ret != 0)
+        goto _err;
+
+    if(frame->block != BUFFER_NONE)
+        buffer_pool_unlink(pool, i);
+
+    frame->file = file;
+    frame->block = block;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(fill)
+        ret = buffer_pool_block_io(pool, frame, 0);
+    Py_END_ALLOW_THREADS
+
+    if(ret != 0)
+    {
+        frame->block = BUFFER_NONE;
+        goto _err;
+    }
+
+    buffer_pool_link(pool, i, file, block);
+
+_ok:
+    return frame;
+
+_err:
+    buffer_error();
+    return NULL;
+}
+
+
+/* Operations of `buffer_pool_access()'. */
+#define BUFFER_READ  0
+#define BUFFER_WRITE 1
+#define BUFFER_SET   2
+
+/* Read, write or set to `c', depending on `op', `size' bytes at position `pos'
+ * of file `file' of `pool'.
+ */
+static int buffer_pool_access(buffer_pool_t *pool, size_t file, char *buf,
+        int c, size_t size, size_t pos, int op)
+{
+    buffer_frame_t *frame;
+    size_t offset, n;
+    int ret = -1;
+
+    lock_acquire(&pool->lock);
+
+    while(size > 0)
+    {
+        offset = pos % BUFFER_BLOCK_SIZE;
+        n = BUFFER_BLOCK_SIZE - offset;
+        if(n > size)
+            n = size;
+
+        if((frame = buffer_pool_get(pool, file, pos / BUFFER_BLOCK_SIZE,
+                op == BUFFER_READ || n < BUFFER_BLOCK_SIZE)) == NULL)
+            goto _err;
+
+        if(op == BUFFER_READ)
+            memcpy(buf, frame->data + offset, n);
+        else
+        {
+            if(op == BUFFER_WRITE)
+                memcpy(frame->data + offset, buf, n);
+            else
+                memset(frame->data + offset, c, n);
+            frame->dirty = 1;
+        }
+
+        if(buf != NULL)
+            buf += n;
+        size -= n;
+        pos += n;
+    }
+
+    ret = 0;
+
+_err:
+    lock_release(&pool->lock);
+    return ret;
+}
+
+
+/* Create a buffer pool of about `size' bytes. If `direct' is non-zero, files
+ * added to it are opened for direct I/O.
+ */
+buffer_pool_t *buffer_pool_new(size_t size, int direct)
+{
+    buffer_pool_t *pool;
+    size_t i, num_frames, num_buckets;
+
+    if((pool = PyMem_MALLOC(sizeof(buffer_pool_t))) == NULL)
+        goto _err1;
+
+    memset(pool, 0, sizeof(buffer_pool_t));
+
+    num_frames = size / BUFFER_BLOCK_SIZE;
+    if(num_frames == 0)
+        num_frames = 1;
+
+    for(num_buckets = 1; num_buckets < num_frames; num_buckets <<= 1)
+        ;
+
+    if(num_frames > SSIZE_MAX / BUFFER_BLOCK_SIZE)
+        goto _err2;
+
+    if((pool->frames = PyMem_NEW(buffer_frame_t, num_frames)) == NULL)
+        goto _err2;
+
+    if((pool->buckets = PyMem_NEW(size_t, num_buckets)) == NULL)
+        goto _err3;
+
+    if((pool->order = PyMem_NEW(buffer_frame_t *, num_frames)) == NULL)
+        goto _err4;
+
+    if((pool->reads = PyMem_NEW(batch_read_t, num_frames)) == NULL)
+        goto _err5;
+
+    if((pool->memory = buffer_alloc(num_frames * BUFFER_BLOCK_SIZE)) == NULL)
+        goto _err6;
+
+    if(lock_init(&pool->lock) != 0)
+        goto _err7;
+
+    for(i = 0; i < num_frames; i++)
+    {
+        pool->frames[i].file = 0;
+        pool->frames[i].block = BUFFER_NONE;
+        pool->frames[i].next = BUFFER_NONE;
+        pool->frames[i].data = pool->memory + i * BUFFER_BLOCK_SIZE;
+        pool->frames[i].dirty = 0;
+        pool->frames[i].referenced = 0;
+        pool->frames[i].reading = 0;
+    }
+
+    for(i = 0; i < num_buckets; i++)
+        pool->buckets[i] = BUFFER_NONE;
+
+    pool->direct = (char)direct;
+    pool->num_frames = num_frames;
+    pool->mask = num_buckets - 1;
+    batch_io_init(&pool->bio);
+    return pool;
+
+_err7:
+    buffer_free(pool->memory);
+
+_err6:
+    PyMem_FREE(pool->reads);
+
+_err5:
+    PyMem_FREE(pool->order);
+
+_err4:
+    PyMem_FREE(pool->buckets);
+
+_err3:
+    PyMem_FREE(pool->frames);
+
+_err2:
+    PyMem_FREE(pool);
+
+_err1:
+    PyErr_NoMemory();
+    return NULL;
+}
+
+
+/* Access file `fd' of `size' bytes through buffer pool `pool'. Returns the
+ * file's number in the pool, or -1 on error.
+ */
+#ifdef _WIN32
+ssize_t buffer_pool_add_file(buffer_pool_t *pool, HANDLE fd, size_t size)
+#else
+ssize_t buffer_pool_add_file(buffer_pool_t *pool, int fd, size_t size)
+#endif
+{
+    buffer_file_t *files;
+
+    ssize_t ret = -1;
+
+    lock_acquire(&pool->lock);
+
+    if((files = PyMem_REALLOC(pool->files,
+            (pool->num_files + 1) * sizeof(buffer_file_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    files[pool->num_files].fd = fd;
+    files[pool->num_files].size = size;
+    pool->files = files;
+
+    ret = (ssize_t)pool->num_files++;
+
+_err:
+    lock_release(&pool->lock);
+    return ret;
+}
+
+
+/* Equivalent to `pread()' on file `file' through buffer pool `pool'. */
+ssize_t buffer_pool_pread(buffer_pool_t *pool, size_t file, void *buf,
+        size_t size, size_t pos)
+{
+    if(buffer_pool_access(pool, file, buf, 0, size, pos, BUFFER_READ) != 0)
+        return -1;
+    return (ssize_t)size;
+}
+
+
+/* Equivalent to `pwrite()' on file `file' through buffer pool `pool'. Data is
+ * written back when evicted or flushed.
+ */
+ssize_t buffer_pool_pwrite(buffer_pool_t *pool, size_t file, const void *buf,
+        size_t size, size_t pos)
+{
+    if(buffer_pool_access(pool, file, (char *)buf, 0, size, pos,
+            BUFFER_WRITE) != 0)
+        return -1;
+    return (ssize_t)size;
+}
+
+
+/* Set `size' bytes at position `pos' of file `file' to `c' through buffer pool
+ * `pool'.
+ */
+int buffer_pool_memset(buffer_pool_t *pool, size_t file, int c, size_t size,
+        size_t pos)
+{
+    return buffer_pool_access(pool, file, NULL, c, size, pos, BUFFER_SET);
+}
+
+
+/* Frames are sorted by block when written back; they all belong to the same
+ * file.
+ */
+static int buffer_frame_cmp(const void *a, const void *b)
+{
+    const buffer_frame_t *fa = *(buffer_frame_t *const *)a;
+    const buffer_frame_t *fb = *(buffer_frame_t *const *)b;
+    int ret = 0;
+
+    if(fa->block < fb->block)
+        ret = -1;
+    if(fa->block > fb->block)
+        ret = 1;
+    return ret;
+}
+
+
+/* Write back the modified blocks of `pool' overlapping with the `size' bytes
+ * at position `pos' of file `file', in file order. Raises `IOError' on failure.
+ */
+int buffer_pool_flush(buffer_pool_t *pool, size_t file, size_t pos,
+        size_t size)
+{
+    buffer_frame_t *frame, **order = pool->order;
+    size_t i, block, first, last, num_dirty = 0;
+    int ret = 0;
+
+    if(size == 0)
+        goto _ret;
+
+    first = pos / BUFFER_BLOCK_SIZE;
+    last = (pos + size - 1) / BUFFER_BLOCK_SIZE;
+
+    lock_acquire(&pool->lock);
+
+    /* Look up the blocks in the range one by one, unless there are more of them
+     * than frames in the pool.
+     */
+    if(last - first < pool->num_frames)
+    {
+        for(block = first; block <= last; block++)
+            if((i = buffer_pool_lookup(pool, file, block)) != BUFFER_NONE &&
+                    pool->frames[i].dirty)
+                order[num_dirty++] = &pool->frames[i];
+    }
+    else
+    {
+        for(i = 0; i < pool->num_frames; i++)
+        {
+            frame = &pool->frames[i];
+            if(frame->block != BUFFER_NONE && frame->dirty &&
+                    frame->file == file && frame->block >= first &&
+                    frame->block <= last)
+                order[num_dirty++] = frame;
+        }
+
+        qsort(order, num_dirty, sizeof(buffer_frame_t *), buffer_frame_cmp);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for(i = 0; ret == 0 && i < num_dirty; i++)
+    {
+        if((ret = buffer_pool_block_io(pool, order[i], 1)) == 0)
+            order[i]->dirty = 0;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(ret != 0)
+        buffer_error();
+
+    lock_release(&pool->lock);
+
+_ret:
+    return ret;
+}
+
+
+/* Read in the blocks in `blocks', `num_blocks' of them in ascending order, of
+ * file `file', that aren't in `pool' yet, all at once, rather than one at a
+ * time as they're accessed. At most half of the frames of the pool are
+ * replaced, so that blocks read in don't replace each other before they're
+ * accessed. This is merely a hint; blocks that can't be read in are read again
+ * when accessed, and errors are reported then.
+ */
+void buffer_pool_prefetch(buffer_pool_t *pool, size_t file,
+        const size_t *blocks, size_t num_blocks)
+{
+    buffer_frame_t *frame, **order = pool->order;
+    batch_read_t *reads = pool->reads;
+    size_t i, j, size, aligned_size, max, file_size, n = 0;
+    int ret = 0;
+
+    lock_acquire(&pool->lock);
+
+    max = pool->num_frames / 2;
+    file_size = pool->files[file].size;
+
+    for(i = 0; i < num_blocks && n < max; i++)
+    {
+        if(blocks[i] * BUFFER_BLOCK_SIZE >= file_size ||
+                buffer_pool_lookup(pool, file, blocks[i]) != BUFFER_NONE)
+            continue;
+
+        j = buffer_pool_victim(pool);
+        frame = &pool->frames[j];
+
+        Py_BEGIN_ALLOW_THREADS
+        if(frame->block != BUFFER_NONE && frame->dirty)
+            ret = buffer_pool_block_io(pool, frame, 1);
+        Py_END_ALLOW_THREADS
+
+        if(ret != 0)
+            break;
+
+        if(frame->block != BUFFER_NONE)
+            buffer_pool_unlink(pool, j);
+
+        /* Frames are added to the pool right away, as the pool stays locked
+         * until they've been read in.
+         */
+        buffer_pool_link(pool, j, file, blocks[i]);
+        frame->reading = 1;
+
+        buffer_pool_extent(pool, blocks[i], file_size, &aligned_size);
+        reads[n].buf = frame->data;
+        reads[n].size = aligned_size;
+        reads[n].pos = blocks[i] * BUFFER_BLOCK_SIZE;
+        order[n] = frame;
+        n += 1;
+    }
+
+    if(n > 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        batch_io_read(&pool->bio, pool->files[file].fd, reads, n);
+        Py_END_ALLOW_THREADS
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        frame = order[i];
+        frame->reading = 0;
+
+        size = buffer_pool_extent(pool, frame->block, file_size, &aligned_size);
+        if(reads[i].result < 0 || (size_t)reads[i].result < size)
+            buffer_pool_unlink(pool, frame - pool->frames);
+        else if(size < BUFFER_BLOCK_SIZE)
+            memset(frame->data + size, 0, BUFFER_BLOCK_SIZE - size);
+    }
+
+    lock_release(&pool->lock);
+}
+
+
+/* Forget the blocks of `pool' past the first `size' bytes of file `file', which
+ * has been resized. The block the file now ends in is zeroed past its end, as
+ * that's what the file reads if it grows again.
+ */
+void buffer_pool_truncate(buffer_pool_t *pool, size_t file, size_t size)
+{
+    buffer_frame_t *frame;
+    size_t i, end;
+
+    lock_acquire(&pool->lock);
+
+    pool->files[file].size = size;
+
+    for(i = 0; i < pool->num_frames; i++)
+    {
+        frame = &pool->frames[i];
+        if(frame->block == BUFFER_NONE || frame->file != file)
+            continue;
+
+        end = (frame->block + 1) * BUFFER_BLOCK_SIZE;
+        if(frame->block * BUFFER_BLOCK_SIZE >= size)
+            buffer_pool_unlink(pool, i);
+        else if(end > size)
+            memset(frame->data + size % BUFFER_BLOCK_SIZE, 0, end - size);
+    }
+
+    lock_release(&pool->lock);
+}
+
+
+/* Return the number of bytes held in `pool'. */
+size_t buffer_pool_resident(buffer_pool_t *pool)
+{
+    return pool->used * BUFFER_BLOCK_SIZE;
+}
+
+
+/* Free buffer pool `pool', dropping modified blocks not written back. */
+void buffer_pool_free(buffer_pool_t *pool)
+{
+    batch_io_fini(&pool->bio);
+    lock_fini(&pool->lock);
+    buffer_free(pool->memory);
+    PyMem_FREE(pool->files);
+    PyMem_FREE(pool->reads);
+    PyMem_FREE(pool->order);
+    PyMem_FREE(pool->buckets);
+    PyMem_FREE(pool->frames);
+    PyMem_FREE(pool);
+}
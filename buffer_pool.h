@@ -0,0 +1,87 @@
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include "common.h"
+#include "lock.h"
+#include "batch_io.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+
+/* Unit of caching and I/O. Must be a multiple of `BUFFER_ALIGN'. */
+#define BUFFER_BLOCK_SIZE (1 << 16)
+
+/* Alignment of buffers, file positions and sizes of direct I/O. */
+#define BUFFER_ALIGN 4096
+
+/* Marks free frames and empty hash buckets. */
+#define BUFFER_NONE ((size_t)-1)
+
+
+/* A file accessed through a buffer pool. */
+typedef struct buffer_file
+{
+#ifdef _WIN32
+    HANDLE fd;                /* Handle of the file */
+#else
+    int fd;                   /* Descriptor of the file */
+#endif
+    size_t size;              /* Size of the file */
+} buffer_file_t;
+
+
+/* A frame of the pool, holding a copy of one block of one of its files. */
+typedef struct buffer_frame
+{
+    size_t file;              /* File the block belongs to */
+    size_t block;             /* Block held, `BUFFER_NONE' if free */
+    size_t next;              /* Next frame in the same hash bucket */
+    char *data;               /* `BUFFER_BLOCK_SIZE' bytes of data */
+    char dirty;               /* Non-zero if modified since read in or written */
+    char referenced;          /* Non-zero if accessed since the clock hand passed */
+    char reading;             /* Non-zero while read in by `buffer_pool_prefetch()' */
+} buffer_frame_t;
+
+
+/* A fixed number of frames caching blocks of one or more files, which are
+ * accessed with `pread()' and `pwrite()' rather than being mapped in memory.
+ * Frames are replaced using the clock algorithm, regardless of the file they
+ * belong to.
+ */
+typedef struct buffer_pool
+{
+    buffer_file_t *files;     /* Files accessed through the pool */
+    size_t num_files;         /* Number of entries in `files' */
+    char direct;              /* Non-zero if the files are opened for direct I/O */
+    size_t num_frames;        /* Number of frames */
+    buffer_frame_t *frames;   /* Array of `num_frames' frames */
+    char *memory;             /* Data of all frames, aligned to `BUFFER_ALIGN' */
+    size_t *buckets;          /* Hash table of frames by block */
+    buffer_frame_t **order;   /* Scratch space for sorting frames */
+    batch_read_t *reads;      /* Scratch space for reading in frames */
+    batch_io_t bio;           /* Reads frames in batches */
+    size_t mask;              /* Number of hash buckets minus one */
+    size_t hand;              /* Next frame considered for replacement */
+    size_t used;              /* Number of frames holding a block */
+    lock_t lock;              /* Serializes access to the pool */
+} buffer_pool_t;
+
+
+buffer_pool_t *buffer_pool_new(size_t, int);
+#ifdef _WIN32
+ssize_t buffer_pool_add_file(buffer_pool_t *, HANDLE, size_t);
+#else
+ssize_t buffer_pool_add_file(buffer_pool_t *, int, size_t);
+#endif
+ssize_t buffer_pool_pread(buffer_pool_t *, size_t, void *, size_t, size_t);
+ssize_t buffer_pool_pwrite(buffer_pool_t *, size_t, const void *, size_t, size_t);
+int buffer_pool_memset(buffer_pool_t *, size_t, int, size_t, size_t);
+int buffer_pool_flush(buffer_pool_t *, size_t, size_t, size_t);
+void buffer_pool_prefetch(buffer_pool_t *, size_t, const size_t *, size_t);
+void buffer_pool_truncate(buffer_pool_t *, size_t, size_t);
+size_t buffer_pool_resident(buffer_pool_t *);
+void buffer_pool_free(buffer_pool_t *);
+
+#endif /* _BUFFER_POOL_H_ */
@@ -0,0 +1,690 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * class_table.c - Persistent class tables shared by all stored objects.
+ *
+ * When pickling an object, its class is referred to by its fully qualified name
+ * (e.g. "networkx.classes.digraph\0DiGraph"), which is repeated in each and
+ * every stored object and has to be imported back on each unpickling. Instead,
+ * we keep a per data structure table of classes in "classes.bin" and make the
+ * pickler emit a class ID (a persistent ID in pickle's terms) for each class.
+ * IDs are resolved back to class objects, which are cached, by the unpickler.
+ *
+ * Entries are only ever appended to the table, so IDs are stable for the whole
+ * lifetime of the data structure.
+ */
+#include "util.h"
+#include "class_table.h"
+
+
+static PyObject *pickler_type;
+static PyObject *unpickler_type;
+static PyObject *bytesio_type;
+
+
+/* Look up the pickler, unpickler and `io.BytesIO' types. Called once, when the
+ * extension is loaded.
+ */
+int class_table_init(void)
+{
+    PyObject *module;
+
+    int ret = -1;
+
+    if(pickler_type != NULL)
+        goto _ok;
+
+#if PY_MAJOR_VERSION >= 3
+    if((module = PyImport_ImportModule("_pickle")) == NULL)
+        goto _err;
+#else
+    if((module = PyImport_ImportModule("cPickle")) == NULL)
+        goto _err;
+#endif
+
+    pickler_type = PyObject_GetAttrString(module, "Pickler");
+    unpickler_type = PyObject_GetAttrString(module, "Unpickler");
+    Py_DECREF(module);
+
+    if((module = PyImport_ImportModule("io")) == NULL)
+        goto _err;
+
+    bytesio_type = PyObject_GetAttrString(module, "BytesIO");
+    Py_DECREF(module);
+
+    if(pickler_type == NULL || unpickler_type == NULL || bytesio_type == NULL)
+    {
+        Py_CLEAR(pickler_type);
+        Py_CLEAR(unpickler_type);
+        Py_CLEAR(bytesio_type);
+        goto _err;
+    }
+
+_ok:
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Import module `module' and look up the, possibly dotted, name `qualname' in
+ * it. Returns a new reference to the object found.
+ */
+static PyObject *class_table_lookup(PyObject *module, PyObject *qualname)
+{
+    PyObject *obj, *attr, *parts;
+    Py_ssize_t i;
+
+    if((obj = PyImport_Import(module)) == NULL)
+        goto _err1;
+
+    if((parts = PyObject_CallMethod(qualname, "split", "s", ".")) == NULL)
+        goto _err2;
+
+    for(i = 0; i < PyList_GET_SIZE(parts); i++)
+    {
+        if((attr = PyObject_GetAttr(obj, PyList_GET_ITEM(parts, i))) == NULL)
+            goto _err3;
+        Py_DECREF(obj);
+        obj = attr;
+    }
+
+    Py_DECREF(parts);
+    return obj;
+
+_err3:
+    Py_DECREF(parts);
+
+_err2:
+    Py_DECREF(obj);
+
+_err1:
+    return NULL;
+}
+
+
+/* Record class name `(module, qualname)' as class ID `id' in memory. */
+static int class_table_insert(class_table_t *table, PyObject *name,
+        PyObject *id, PyObject *cls)
+{
+    int ret = -1;
+
+    if(PyList_Append(table->names, name) != 0)
+        goto _err;
+
+    if(PyList_Append(table->classes, cls) != 0)
+        goto _err;
+
+    if(PyDict_SetItem(table->by_name, name, id) != 0)
+        goto _err;
+
+    if(cls != Py_None && PyDict_SetItem(table->ids, cls, id) != 0)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Append class `cls' in the class table and return its new ID. If `cls' can't
+ * be found by name, `None' is returned and pickling of `cls' is left to the
+ * pickler.
+ */
+static PyObject *class_table_add(class_table_t *table, PyObject *cls)
+{
+    class_table_hdr_t *hdr;
+    PyObject *module = NULL, *qualname = NULL, *name = NULL, *obj, *id = NULL;
+    const char *module_s, *qualname_s;
+    Py_ssize_t module_size, qualname_size;
+    uint32_t size;
+    mapped_file_t *mf = table->mf;
+    char nul = 0;
+
+    if((module = PyObject_GetAttrString(cls, "__module__")) == NULL)
+        goto _none;
+
+    if((qualname = PyObject_GetAttrString(cls, "__qualname__")) == NULL)
+    {
+        PyErr_Clear();
+        if((qualname = PyObject_GetAttrString(cls, "__name__")) == NULL)
+            goto _none;
+    }
+
+    if((name = PyTuple_Pack(2, module, qualname)) == NULL)
+        goto _err;
+
+    /* The class may already be in the table, but not resolved yet. */
+    if((id = PyDict_GetItem(table->by_name, name)) != NULL)
+    {
+        Py_INCREF(id);
+        if(PyDict_SetItem(table->ids, cls, id) != 0)
+        {
+            Py_CLEAR(id);
+            goto _err;
+        }
+
+        /* `PyList_SetItem()' steals the reference, even on failure. */
+        Py_INCREF(cls);
+        if(PyList_SetItem(table->classes, PyLong_AsSsize_t(id), cls) != 0)
+            Py_CLEAR(id);
+        goto _err;
+    }
+
+    /* Make sure the class can be found by name, like the pickler does. */
+    if((obj = class_table_lookup(module, qualname)) == NULL)
+        goto _none;
+
+    Py_DECREF(obj);
+    if(obj != cls)
+        goto _none;
+
+#if PY_MAJOR_VERSION >= 3
+    if((module_s = PyUnicode_AsUTF8AndSize(module, &module_size)) == NULL ||
+            (qualname_s = PyUnicode_AsUTF8AndSize(qualname, &qualname_size)) == NULL)
+        goto _none;
+#else
+    if(PyString_AsStringAndSize(module, (char **)&module_s, &module_size) != 0 ||
+            PyString_AsStringAndSize(qualname, (char **)&qualname_s, &qualname_size) != 0)
+        goto _none;
+#endif
+
+    size = (uint32_t)(module_size + 1 + qualname_size);
+
+    if(mapped_file_seek(mf, mapped_file_get_eof(mf), SEEK_SET) != 0 ||
+            mapped_file_write(mf, &size, sizeof(uint32_t)) != sizeof(uint32_t) ||
+            mapped_file_write(mf, (void *)module_s, module_size) != module_size ||
+            mapped_file_write(mf, &nul, 1) != 1 ||
+            mapped_file_write(mf, (void *)qualname_s, qualname_size) != qualname_size)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot write class table entry");
+        goto _err;
+    }
+
+    /* Update the count last; the mapping may have moved while writing. */
+    hdr = mf->address;
+
+    if((id = PyLong_FromSize_t(hdr->count)) == NULL)
+        goto _err;
+
+    if(class_table_insert(table, name, id, cls) != 0)
+    {
+        Py_CLEAR(id);
+        goto _err;
+    }
+
+    hdr->count += 1;
+    goto _err;
+
+_none:
+    PyErr_Clear();
+    Py_INCREF(Py_None);
+    id = Py_None;
+
+_err:
+    Py_XDECREF(name);
+    Py_XDECREF(qualname);
+    Py_XDECREF(module);
+    return id;
+}
+
+
+/* Pickler's `persistent_id()'; returns the ID of class objects. */
+static PyObject *class_table_persistent_id(PyObject *self, PyObject *obj)
+{
+    class_table_t *table;
+    PyObject *id;
+
+    if(PyType_Check(obj) == 0)
+        Py_RETURN_NONE;
+
+    table = PyCapsule_GetPointer(self, NULL);
+
+    if((id = PyDict_GetItem(table->ids, obj)) != NULL)
+    {
+        Py_INCREF(id);
+        return id;
+    }
+
+    return class_table_add(table, obj);
+}
+
+
+/* Unpickler's `persistent_load()'; resolves class IDs to class objects. */
+static PyObject *class_table_persistent_load(PyObject *self, PyObject *pid)
+{
+    class_table_t *table;
+    PyObject *name, *cls = NULL;
+    Py_ssize_t i;
+
+    table = PyCapsule_GetPointer(self, NULL);
+
+    if((i = PyNumber_AsSsize_t(pid, NULL)) == -1 && PyErr_Occurred())
+        goto _err;
+
+    if(i < 0 || i >= PyList_GET_SIZE(table->classes))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Invalid class ID");
+        goto _err;
+    }
+
+    cls = PyList_GET_ITEM(table->classes, i);
+
+    if(cls == Py_None)
+    {
+        name = PyList_GET_ITEM(table->names, i);
+
+        if((cls = class_table_lookup(PyTuple_GET_ITEM(name, 0),
+                PyTuple_GET_ITEM(name, 1))) == NULL)
+            goto _err;
+
+        if(PyDict_SetItem(table->ids, cls, pid) != 0)
+        {
+            Py_DECREF(cls);
+            cls = NULL;
+            goto _err;
+        }
+
+        Py_INCREF(cls);
+        PyList_SetItem(table->classes, i, cls);
+    }
+    else
+        Py_INCREF(cls);
+
+_err:
+    return cls;
+}
+
+
+static PyMethodDef persistent_id_def =
+{
+    "persistent_id", (PyCFunction)class_table_persistent_id, METH_O, NULL
+};
+
+static PyMethodDef persistent_load_def =
+{
+    "persistent_load", (PyCFunction)class_table_persistent_load, METH_O, NULL
+};
+
+
+/* Return a pickler or unpickler factory, based on `base', using `func' as its
+ * `persistent_id()' or `persistent_load()' method, named `name'. Python 3.13
+ * no longer allows setting these on instances, but all Python 3 versions look
+ * them up when the instance is initialized, so a subclass is used instead. On
+ * Python 2, the attribute is set on each instance.
+ */
+static PyObject *class_table_subclass(PyObject *base, const char *name,
+        PyObject *func)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyObject_CallFunction((PyObject *)&PyType_Type, "s(O){sO}",
+        ((PyTypeObject *)base)->tp_name, base, name, func);
+#else
+    Py_INCREF(base);
+    return base;
+#endif
+}
+
+
+/* Create a new pickler writing in a new `io.BytesIO' object. */
+static PyObject *class_table_new_pickler(class_table_t *table,
+        PyObject **bufferp)
+{
+    PyObject *buffer, *proto, *pickler = NULL;
+
+    if((buffer = PyObject_CallObject(bytesio_type, NULL)) == NULL)
+        goto _err1;
+
+    /* A negative protocol version selects the highest protocol. */
+    if((proto = PyLong_FromLong(-1)) == NULL)
+        goto _err2;
+
+    pickler = PyObject_CallFunctionObjArgs(table->pickler_class, buffer, proto,
+        NULL);
+    Py_DECREF(proto);
+
+    if(pickler == NULL)
+        goto _err2;
+
+#if PY_MAJOR_VERSION < 3
+    if(PyObject_SetAttrString(pickler, "persistent_id", table->persistent_id) != 0)
+    {
+        Py_CLEAR(pickler);
+        goto _err2;
+    }
+#endif
+
+    *bufferp = buffer;
+    return pickler;
+
+_err2:
+    Py_DECREF(buffer);
+
+_err1:
+    return pickler;
+}
+
+
+/* Load the entries of "classes.bin" not already in memory. */
+static int class_table_load(class_table_t *table)
+{
+    class_table_hdr_t *hdr;
+    PyObject *module, *qualname, *name, *id;
+    mapped_file_t *mf = table->mf;
+    size_t pos, i, known;
+    uint32_t size;
+    char *entry, *sep;
+
+    int ret = -1;
+
+    hdr = mf->address;
+    if(mf->size < sizeof(class_table_hdr_t) || hdr->magic != MAGIC)
+        goto _err;
+
+    pos = sizeof(class_table_hdr_t);
+    known = (size_t)PyList_GET_SIZE(table->names);
+
+    for(i = 0; i < hdr->count; i++)
+    {
+        if(mapped_file_pread(mf, &size, sizeof(uint32_t), pos) != sizeof(uint32_t) ||
+                pos + sizeof(uint32_t) + size > mf->size)
+            goto _err;
+
+        if(i < known)
+        {
+            pos += sizeof(uint32_t) + size;
+            continue;
+        }
+
+        entry = (char *)mf->address + pos + sizeof(uint32_t);
+        if((sep = memchr(entry, 0, size)) == NULL)
+            goto _err;
+
+#if PY_MAJOR_VERSION >= 3
+        module = PyUnicode_DecodeUTF8(entry, sep - entry, NULL);
+        qualname = PyUnicode_DecodeUTF8(sep + 1, entry + size - sep - 1, NULL);
+#else
+        module = PyString_FromStringAndSize(entry, sep - entry);
+        qualname = PyString_FromStringAndSize(sep + 1, entry + size - sep - 1);
+#endif
+        name = NULL;
+        if(module != NULL && qualname != NULL)
+            name = PyTuple_Pack(2, module, qualname);
+
+        Py_XDECREF(module);
+        Py_XDECREF(qualname);
+
+        if(name == NULL)
+            goto _err;
+
+        if((id = PyLong_FromSize_t(i)) == NULL)
+        {
+            Py_DECREF(name);
+            goto _err;
+        }
+
+        ret = class_table_insert(table, name, id, Py_None);
+        Py_DECREF(name);
+        Py_DECREF(id);
+
+        if(ret != 0)
+            goto _err;
+
+        ret = -1;
+        pos += sizeof(uint32_t) + size;
+    }
+
+    /* Drop anything past the last entry; new entries are appended at EOF. */
+    if(mf->readonly == 0 && mapped_file_truncate(mf, pos) != 0)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Open the class table in directory `dirname'. If "classes.bin" doesn't exist,
+ * it's created only if `create' is non-zero. If `readonly' is non-zero, it's
+ * only read, and may be refreshed with `class_table_refresh()' while another
+ * process appends to it. Returns `NULL' either on error, in which case an
+ * exception is set, or if there's no class table.
+ */
+class_table_t *class_table_open(const char *dirname, int create, int readonly)
+{
+    class_table_t *table;
+    class_table_hdr_t hdr;
+    PyObject *capsule;
+    char *filename;
+    int exists;
+
+    filename = path_combine(dirname, "classes.bin");
+    exists = access(filename, F_OK) == 0;
+
+    if(exists == 0 && (create == 0 || readonly))
+        goto _err1;
+
+    if((table = PyMem_MALLOC(sizeof(class_table_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err1;
+    }
+
+    memset(table, 0, sizeof(class_table_t));
+
+    if((table->ids = PyDict_New()) == NULL ||
+            (table->by_name = PyDict_New()) == NULL ||
+            (table->names = PyList_New(0)) == NULL ||
+            (table->classes = PyList_New(0)) == NULL)
+        goto _err2;
+
+    if((capsule = PyCapsule_New(table, NULL, NULL)) == NULL)
+        goto _err2;
+
+    table->persistent_id = PyCFunction_New(&persistent_id_def, capsule);
+    table->persistent_load = PyCFunction_New(&persistent_load_def, capsule);
+    Py_DECREF(capsule);
+
+    if(table->persistent_id == NULL || table->persistent_load == NULL)
+        goto _err2;
+
+    if((table->pickler_class = class_table_subclass(pickler_type,
+            "persistent_id", table->persistent_id)) == NULL)
+        goto _err2;
+
+    if((table->unpickler_class = class_table_subclass(unpickler_type,
+            "persistent_load", table->persistent_load)) == NULL)
+        goto _err2;
+
+    if((table->pickler = class_table_new_pickler(table, &table->buffer)) == NULL)
+        goto _err2;
+
+    if(exists)
+    {
+        if((table->mf = mapped_file_open(filename, readonly, 0)) == NULL)
+            goto _err3;
+
+        if(class_table_load(table) != 0)
+            goto _err4;
+    }
+    else
+    {
+        if((table->mf = mapped_file_create(filename, 4096, 0)) == NULL)
+            goto _err3;
+
+        hdr.magic = MAGIC;
+        hdr.count = 0;
+        if(mapped_file_write(table->mf, &hdr, sizeof(hdr)) != sizeof(hdr))
+            goto _err4;
+    }
+
+    return table;
+
+_err4:
+    mapped_file_close(table->mf);
+    table->mf = NULL;
+
+_err3:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open class table");
+
+_err2:
+    class_table_close(table);
+
+_err1:
+    return NULL;
+}
+
+
+/* Load entries appended to read-only class table `table' by another process. */
+int class_table_refresh(class_table_t *table)
+{
+    int ret = -1;
+
+    if(mapped_file_remap(table->mf) != 0 || class_table_load(table) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot refresh class table");
+        goto _err;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Marshal object `obj' using class IDs instead of class names. */
+PyObject *class_table_marshal(class_table_t *table, PyObject *obj)
+{
+    PyObject *buffer, *pickler, *r;
+
+    /* The pickler may be re-entered (e.g. by a `__reduce__()' storing objects
+     * in the same data structure); use a temporary one in that case.
+     */
+    if(table->busy)
+    {
+        if((pickler = class_table_new_pickler(table, &buffer)) == NULL)
+            return NULL;
+    }
+    else
+    {
+        buffer = table->buffer;
+        pickler = table->pickler;
+        Py_INCREF(buffer);
+        Py_INCREF(pickler);
+        table->busy = 1;
+    }
+
+    r = NULL;
+
+    if((r = PyObject_CallMethod(buffer, "seek", "i", 0)) == NULL)
+        goto _err;
+    Py_DECREF(r);
+
+    if((r = PyObject_CallMethod(buffer, "truncate", NULL)) == NULL)
+        goto _err;
+    Py_DECREF(r);
+
+    if((r = PyObject_CallMethod(pickler, "clear_memo", NULL)) == NULL)
+        goto _err;
+    Py_DECREF(r);
+
+    if((r = PyObject_CallMethod(pickler, "dump", "(O)", obj)) == NULL)
+        goto _err;
+    Py_DECREF(r);
+
+    r = PyObject_CallMethod(buffer, "getvalue", NULL);
+
+_err:
+    if(pickler == table->pickler)
+        table->busy = 0;
+    Py_DECREF(pickler);
+    Py_DECREF(buffer);
+    return r;
+}
+
+
+/* Unmarshal object from string object `str', resolving class IDs. */
+PyObject *class_table_unmarshal(class_table_t *table, PyObject *str)
+{
+    PyObject *buffer, *unpickler, *r = NULL;
+
+    if((buffer = PyObject_CallFunctionObjArgs(bytesio_type, str, NULL)) == NULL)
+        goto _err1;
+
+    if((unpickler = PyObject_CallFunctionObjArgs(table->unpickler_class, buffer,
+            NULL)) == NULL)
+        goto _err2;
+
+#if PY_MAJOR_VERSION < 3
+    if(PyObject_SetAttrString(unpickler, "persistent_load", table->persistent_load) == 0)
+        r = PyObject_CallMethod(unpickler, "load", NULL);
+#else
+    r = PyObject_CallMethod(unpickler, "load", NULL);
+#endif
+
+    Py_DECREF(unpickler);
+
+_err2:
+    Py_DECREF(buffer);
+
+_err1:
+    return r;
+}
+
+
+/* Make sure all entries of the class table are on disk. Cheap if no entries
+ * were added since the last call.
+ */
+int class_table_sync(class_table_t *table)
+{
+    mapped_file_t *mf = table->mf;
+    size_t eof = mapped_file_get_eof(mf);
+
+    int ret = -1;
+
+    if(eof != table->synced)
+    {
+        if(mapped_file_sync(mf, 0, eof) != 0)
+            goto _err;
+        table->synced = eof;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Synchronize and close class table `table'. */
+void class_table_close(class_table_t *table)
+{
+    mapped_file_t *mf = table->mf;
+
+    if(mf != NULL)
+    {
+        if(mf->readonly == 0)
+        {
+            mapped_file_sync(mf, 0, mf->size);
+            mapped_file_truncate(mf, mapped_file_get_eof(mf));
+        }
+        mapped_file_close(mf);
+    }
+
+    Py_XDECREF(table->pickler);
+    Py_XDECREF(table->buffer);
+    Py_XDECREF(table->unpickler_class);
+    Py_XDECREF(table->pickler_class);
+    Py_XDECREF(table->persistent_load);
+    Py_XDECREF(table->persistent_id);
+    Py_XDECREF(table->classes);
+    Py_XDECREF(table->names);
+    Py_XDECREF(table->by_name);
+    Py_XDECREF(table->ids);
+    PyMem_FREE(table);
+}
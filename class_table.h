@@ -0,0 +1,45 @@
+#ifndef _CLASS_TABLE_H_
+#define _CLASS_TABLE_H_
+
+#include "common.h"
+#include "mapped_file.h"
+
+
+/* In-file header; "classes.bin" begins with this structure. Each entry that
+ * follows is a `uint32_t' length followed by "module\0qualname".
+ */
+typedef struct class_table_hdr
+{
+    uint64_t magic;           /* Memory mapped file magic */
+    size_t count;             /* Number of entries */
+} class_table_hdr_t;
+
+
+/* A persistent table of classes referred to by stored objects. */
+typedef struct class_table
+{
+    mapped_file_t *mf;        /* Memory mapped file for class names */
+    PyObject *ids;            /* Maps class objects to class IDs */
+    PyObject *by_name;        /* Maps `(module, qualname)' tuples to class IDs */
+    PyObject *names;          /* List of `(module, qualname)' tuples */
+    PyObject *classes;        /* List of class objects, `None' if unresolved */
+    PyObject *persistent_id;  /* `persistent_id()' implementation */
+    PyObject *persistent_load;/* `persistent_load()' implementation */
+    PyObject *pickler_class;  /* Pickler factory using `persistent_id' */
+    PyObject *unpickler_class;/* Unpickler factory using `persistent_load' */
+    PyObject *buffer;         /* `io.BytesIO' object used by `pickler' */
+    PyObject *pickler;        /* `Pickler' object emitting class IDs */
+    char busy;                /* Non-zero while `pickler' is in use */
+    size_t synced;            /* End of entries known to be on disk */
+} class_table_t;
+
+
+int class_table_init(void);
+class_table_t *class_table_open(const char *, int, int);
+int class_table_refresh(class_table_t *);
+int class_table_sync(class_table_t *);
+PyObject *class_table_marshal(class_table_t *, PyObject *);
+PyObject *class_table_unmarshal(class_table_t *, PyObject *);
+void class_table_close(class_table_t *);
+
+#endif /* _CLASS_TABLE_H_ */
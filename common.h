@@ -3,15 +3,61 @@
 
 #include <Python.h>
 
-/* Magic number common to all files is "EMD\0HDR\0". */
-#define MAGIC 0x0052444800444d45
+/* Magic number common to all files is "EMD\0HDR\0". Index files keep a format
+ * version in the last byte instead, as their header has been extended over
+ * time (see "em_dict.h" and "em_list.h").
+ */
+#define MAGIC         0x0052444800444d45
+#define INDEX_VERSION 5
+#define INDEX_MAGIC   (MAGIC | ((uint64_t)INDEX_VERSION << 56))
+#define IS_MAGIC(x)   (((x) & 0x00ffffffffffffffULL) == MAGIC)
+#define VERSION_OF(x) ((unsigned int)((x) >> 56))
+
+/* Writers upgrade index files of earlier versions when they're opened (see
+ * `em_dict_upgrade()' and `em_list_upgrade()'). Version 0 headers, which begin
+ * with plain `MAGIC', hold the used and total number of entries only. Version 1
+ * added the generation counter and version 2 the sequence counter. Version 3
+ * added the number of deleted slots to dictionaries, whose entries may be
+ * marked as deleted since. Version 4 split "values.bin" in segments, whose
+ * positions hold a segment number, which is 0 for positions in files of earlier
+ * versions (see `mapped_file_open_segmented()'), and kept the header as it was.
+ * Version 5 added the flags below, which are clear in files of earlier
+ * versions. Entries are laid out the same in all versions, unless flags say
+ * otherwise, right past the header, whose size is given by
+ * `EM_DICT_INDEX_HDR_SIZE()' and `EM_LIST_INDEX_HDR_SIZE()'.
+ */
+
+/* Flags in index headers, recording optional features of the file format. */
+#define INDEX_COMPACT        1 /* Entries hold 32-bit positions, see `COMPACT_POS()' */
+#define INDEX_COMPACT_CHUNKS 2 /* Data files have `MF_COMPACT_CHUNKS' set */
+#define INDEX_INLINE         4 /* Small values are kept in entries, see `IS_INLINE()' */
+#define INDEX_RECORDS        8 /* Keys are kept along with values (see "em_dict.h") */
+#define INDEX_FLAGS          (INDEX_COMPACT | INDEX_COMPACT_CHUNKS | INDEX_INLINE | \
+    INDEX_RECORDS) /* Flags known to this version */
 
-/* Define two macros used for laying out readable `PyMethodDef[]' definitions.
- * Document strings are set to `NULL'.
+/* With `INDEX_INLINE', values marshalled in up to `INLINE_SIZE_MAX()' bytes are
+ * packed in the value position of their index entry, with bit 0 set, which is
+ * clear in chunk positions (see `marshal_inline()'). Compact indices then keep
+ * other value positions in units of half the chunk alignment, which covers
+ * files of up to 16GB.
  */
-#define M_NOARGS(x, y)  {x, ((PyCFunction)(y)), METH_NOARGS, NULL}
-#define M_VARARGS(x, y) {x, ((PyCFunction)(y)), METH_VARARGS, NULL}
-#define M_KWARGS(x, y)  {x, ((PyCFunctionWithKeywords)(y)), METH_VARARGS | METH_KEYWORDS, NULL}
+#define IS_INLINE(x)             ((x) & 1)
+#define INLINE_SIZE_MAX(compact) ((compact) ? sizeof(uint32_t) - 1 : sizeof(size_t) - 1)
+#define COMPACT_VALUE_POS(x) \
+    ((uint32_t)(IS_INLINE(x) ? (x) : (x) / (sizeof(size_t) / 2)))
+#define EXPAND_VALUE_POS(x) \
+    (IS_INLINE(x) ? (size_t)(x) : (size_t)(x) * (sizeof(size_t) / 2))
+#define COMPACT_VALUE_POS_MAX ((size_t)UINT32_MAX * (sizeof(size_t) / 2))
+
+/* Define three macros used for laying out readable `PyMethodDef[]' definitions.
+ * Document strings are set to `NULL'. Methods are cast through `void (*)(void)',
+ * as their actual types, `PyCFunctionWithKeywords' in particular, differ from
+ * `PyCFunction', which GCC warns about with `-Wcast-function-type'.
+ */
+#define M_CAST(y) ((PyCFunction)(void (*)(void))(y))
+#define M_NOARGS(x, y)  {x, M_CAST(y), METH_NOARGS, NULL}
+#define M_VARARGS(x, y) {x, M_CAST(y), METH_VARARGS, NULL}
+#define M_KWARGS(x, y)  {x, M_CAST(y), METH_VARARGS | METH_KEYWORDS, NULL}
 
 /* Define `M_NULL' to avoid using `{NULL}' in `PyMethodDef[]' definitions. Fixes
  * several compiler warnings about missing initializers thrown on my Mac OS X
@@ -19,6 +65,34 @@
  */
 #define M_NULL {NULL, NULL, 0, NULL}
 
+/* Python 2.7 lacks `Py_UNUSED()'. */
+#ifndef Py_UNUSED
+#define Py_UNUSED(name) _unused_ ## name
+#endif
+
+/* Storage class specifier for per-thread variables. */
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Compression modes for `em_common_t'. */
+#define COMPRESSION_NONE     0
+#define COMPRESSION_LZ4      1
+#define COMPRESSION_LZ4_DICT 2
+
+/* Durability modes of write-ahead logs (see "wal.h"). */
+#define DURABILITY_NONE  0
+#define DURABILITY_ASYNC 1
+#define DURABILITY_BATCH 2
+#define DURABILITY_OP    3
+
+/* Files read in when an EM object is opened. */
+#define PREFAULT_NONE  0
+#define PREFAULT_INDEX 1
+#define PREFAULT_ALL   2
+
 
 #ifdef _WIN32
 #include <BaseTsd.h>
@@ -40,14 +114,20 @@ typedef SIZE_T size_t;
 #endif
 
 
+struct lz4_dict;
+struct class_table;
+
 /* Common fields in all types implemented by this extension. */
 typedef struct em_common
 {
     PyObject_HEAD
-    PyObject *pickler;   /* `pickle.Pickler' object or `NULL' */
-    PyObject *pickle;    /* Pickle method (`pickler.dump()' or `_pickle.dumps()') */
-    PyObject *unpickler; /* `pickle.Unpickler' object or `NULL' */
-    PyObject *unpickle;  /* Unpickle method (`pickler.load()' or `_pickle.loads()') */
+    PyObject *pickler;     /* `pickle.Pickler' object or `NULL' */
+    PyObject *pickle;      /* Pickle method (`pickler.dump()' or `_pickle.dumps()') */
+    PyObject *unpickler;   /* `pickle.Unpickler' object or `NULL' */
+    PyObject *unpickle;    /* Unpickle method (`pickler.load()' or `_pickle.loads()') */
+    int compression;       /* Compression mode, `COMPRESSION_XXX' constants */
+    struct lz4_dict *dict; /* Shared compression dictionary or `NULL' */
+    struct class_table *classes; /* Persistent class table or `NULL' */
 } em_common_t;
 
 #define EM_COMMON(x) ((em_common_t *)((x)))
@@ -0,0 +1,185 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * compression.c - Shared compression dictionaries.
+ *
+ * Small objects rarely compress well on their own, as there's not enough
+ * redundancy within each one of them. However, objects stored in the same EM
+ * data structure tend to share a lot (e.g. module and class names in pickles).
+ * A dictionary is trained once, from chunks already present in the data
+ * structure's files, and is stored in "dict.bin". Chunks compressed with it are
+ * flagged with `CHUNK_DICT'. As such chunks can't be decompressed without the
+ * dictionary, the latter is never modified once trained.
+ */
+#include "util.h"
+#include "compression.h"
+
+
+/* Load "dict.bin" from directory `dirname', if present, in `em_obj'. */
+int compression_load_dict(em_common_t *em_obj, const char *dirname)
+{
+    compression_dict_hdr_t *hdr;
+    mapped_file_t *mf;
+    lz4_dict_t *dict;
+    char *filename;
+
+    int ret = -1;
+
+    filename = path_combine(dirname, "dict.bin");
+    if(access(filename, F_OK) != 0)
+        goto _ok;
+
+    if((mf = mapped_file_open(filename, 1, 0)) == NULL)
+        goto _err1;
+
+    hdr = mf->address;
+    if(mf->size < sizeof(compression_dict_hdr_t) || hdr->magic != MAGIC ||
+            hdr->size > LZ4_MAX_DICT_SIZE ||
+            hdr->size > mf->size - sizeof(compression_dict_hdr_t))
+        goto _err2;
+
+    if((dict = PyMem_MALLOC(sizeof(lz4_dict_t))) == NULL)
+        goto _err2;
+
+    lz4_dict_init(dict, (char *)(hdr + 1), hdr->size);
+    mapped_file_close(mf);
+
+    em_obj->dict = dict;
+
+_ok:
+    return 0;
+
+_err2:
+    mapped_file_close(mf);
+
+_err1:
+    PyErr_SetString(PyExc_RuntimeError, "Cannot load compression dictionary");
+    return ret;
+}
+
+
+/* Write dictionary `data' of size `size' in "dict.bin" in directory `dirname'. */
+static int compression_save_dict(const char *dirname, const char *data,
+        size_t size)
+{
+    compression_dict_hdr_t hdr;
+    mapped_file_t *mf;
+    char *filename;
+
+    int ret = -1;
+
+    filename = path_combine(dirname, "dict.bin");
+    if((mf = mapped_file_create(filename, sizeof(hdr) + size, 0)) == NULL)
+        goto _err;
+
+    hdr.magic = MAGIC;
+    hdr.size = size;
+
+    if(mapped_file_write(mf, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+            mapped_file_write(mf, (void *)data, size) == (ssize_t)size &&
+            mapped_file_sync(mf, 0, mf->size) == 0)
+        ret = 0;
+    else
+        mapped_file_unlink(mf);
+
+    mapped_file_close(mf);
+
+_err:
+    return ret;
+}
+
+
+/* Write the compression dictionary of `em_obj', if any, in "dict.bin" in
+ * directory `dirname'.
+ */
+int compression_copy_dict(em_common_t *em_obj, const char *dirname)
+{
+    lz4_dict_t *dict = em_obj->dict;
+
+    int ret = 0;
+
+    if(dict != NULL)
+        ret = compression_save_dict(dirname, dict->data, dict->size);
+    return ret;
+}
+
+
+/* Train a compression dictionary from the chunks in the `num_mfs' mapped files
+ * in `mfs', whose chunks begin at position `pos', and store it in "dict.bin" in
+ * directory `dirname'. Returns 0 on success, 1 if there's not enough data in
+ * the mapped files and -1 on error.
+ */
+int compression_train_dict(em_common_t *em_obj, const char *dirname,
+        mapped_file_t **mfs, size_t num_mfs, size_t pos)
+{
+    char *samples, data[DICT_SIZE];
+    lz4_dict_t *dict;
+    size_t samples_size = 0, size, i;
+    ssize_t r;
+
+    int ret = -1;
+
+    if(em_obj->dict != NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Compression dictionary already trained");
+        goto _err1;
+    }
+
+    if((samples = PyMem_MALLOC(DICT_SAMPLES_SIZE)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err1;
+    }
+
+    /* Give each mapped file an equal share of the sample buffer. */
+    for(i = 0; i < num_mfs; i++)
+    {
+        size = (DICT_SAMPLES_SIZE - samples_size) / (num_mfs - i);
+        if((r = mapped_file_sample_chunks(em_obj, mfs[i], pos,
+                samples + samples_size, size)) < 0)
+            goto _err2;
+        samples_size += r;
+    }
+
+    if(samples_size < DICT_MIN_SAMPLES_SIZE ||
+            (size = lz4_dict_train(samples, samples_size, data, DICT_SIZE)) == 0)
+    {
+        ret = 1;
+        goto _err2;
+    }
+
+    if((dict = PyMem_MALLOC(sizeof(lz4_dict_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err2;
+    }
+
+    if(compression_save_dict(dirname, data, size) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot save compression dictionary");
+        PyMem_FREE(dict);
+        goto _err2;
+    }
+
+    lz4_dict_init(dict, data, size);
+    em_obj->dict = dict;
+
+    ret = 0;
+
+_err2:
+    PyMem_FREE(samples);
+
+_err1:
+    return ret;
+}
+
+
+/* Release the compression dictionary of `em_obj', if any. */
+void compression_free_dict(em_common_t *em_obj)
+{
+    if(em_obj->dict != NULL)
+    {
+        PyMem_FREE(em_obj->dict);
+        em_obj->dict = NULL;
+    }
+}
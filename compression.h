@@ -0,0 +1,31 @@
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include "common.h"
+#include "mapped_file.h"
+#include "lz4.h"
+
+/* Size of trained dictionaries and amount of sample data used for training. A
+ * dictionary is only trained if at least `DICT_MIN_SAMPLES_SIZE' bytes of
+ * sample data are available.
+ */
+#define DICT_SIZE             LZ4_MAX_DICT_SIZE
+#define DICT_SAMPLES_SIZE     (1 << 20)
+#define DICT_MIN_SAMPLES_SIZE (1 << 16)
+
+
+/* In-file header; "dict.bin" begins with this structure. */
+typedef struct compression_dict_hdr
+{
+    uint64_t magic;           /* Memory mapped file magic */
+    size_t size;              /* Size of dictionary following the header */
+} compression_dict_hdr_t;
+
+
+int compression_load_dict(em_common_t *, const char *);
+int compression_train_dict(em_common_t *, const char *, mapped_file_t **,
+    size_t, size_t);
+int compression_copy_dict(em_common_t *, const char *);
+void compression_free_dict(em_common_t *);
+
+#endif /* _COMPRESSION_H_ */
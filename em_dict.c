@@ -8,30 +8,93 @@
 
 #include "util.h"
 #include "common.h"
+#include "marshaller.h"
 #include "mapped_file.h"
+#include "compression.h"
+#include "class_table.h"
 #include "em_dict.h"
 
 
-#define EM_DICT_E2S(x) \
-    (sizeof(em_dict_index_hdr_t) + (x) * sizeof(em_dict_index_ent_t))
+/* Size of entries in "index.bin", compact or not. */
+#define EM_DICT_ENT_SIZE(compact) \
+    ((compact) ? sizeof(em_dict_compact_ent_t) : sizeof(em_dict_index_ent_t))
 
-#define EM_DICT_S2E(x) \
-    (((x) - sizeof(em_dict_index_hdr_t)) / sizeof(em_dict_index_ent_t))
+/* Entries of "index.bin" follow its header, whose size depends on the format
+ * version (see `EM_DICT_INDEX_HDR_SIZE()').
+ */
+#define EM_DICT_E2S(self, x) \
+    ((self)->index_hdr_size + (x) * EM_DICT_ENT_SIZE((self)->compact))
 
+#define EM_DICT_S2E(self, x) \
+    (((x) - (self)->index_hdr_size) / EM_DICT_ENT_SIZE((self)->compact))
 
-/* Gets the "index.bin" entry at index `i'. */
-static int em_dict_get_entry(mapped_file_t *mf, em_dict_index_ent_t *ent,
-        size_t i)
+/* File holding the keys of `self', "values.bin" if keys are kept in records. */
+#define EM_DICT_KEYS(self) ((self)->records ? (self)->values : (self)->keys)
+
+
+/* Decode the "index.bin" entry at `data', compact if `compact' is non-zero, in
+ * `*ent'. If `inline_values' is non-zero, values may be inline. Compact
+ * entries can't hold `EM_DICT_DELETED', which isn't a multiple of the chunk
+ * alignment, so deleted slots keep a value position of 1 instead.
+ */
+static void em_dict_decode_entry(const void *data, int compact,
+        int inline_values, em_dict_index_ent_t *ent)
 {
-    size_t size = sizeof(em_dict_index_ent_t);
-    int ret = -1;
+    const em_dict_compact_ent_t *compact_ent = data;
 
-    if(mapped_file_seek(mf, EM_DICT_E2S(i), SEEK_SET) != 0)
-        goto _err;
+    if(compact)
+    {
+        ent->hash = (Py_ssize_t)compact_ent->hash;
+        ent->key_pos = EXPAND_POS(compact_ent->key_pos);
+        if(compact_ent->key_pos == 0 && compact_ent->value_pos == 1)
+            ent->value_pos = EM_DICT_DELETED;
+        else if(inline_values)
+            ent->value_pos = EXPAND_VALUE_POS(compact_ent->value_pos);
+        else
+            ent->value_pos = EXPAND_POS(compact_ent->value_pos);
+    }
+    else
+        memcpy(ent, data, sizeof(em_dict_index_ent_t));
+}
+
+
+/* Encode `*ent' as an "index.bin" entry at `data'. See above for `compact' and
+ * `inline_values'.
+ */
+static void em_dict_encode_entry(void *data, int compact, int inline_values,
+        const em_dict_index_ent_t *ent)
+{
+    em_dict_compact_ent_t *compact_ent = data;
+
+    if(compact)
+    {
+        compact_ent->hash = (uint32_t)ent->hash;
+        compact_ent->key_pos = COMPACT_POS(ent->key_pos);
+        if(ent->key_pos == 0 && ent->value_pos == EM_DICT_DELETED)
+            compact_ent->value_pos = 1;
+        else if(inline_values)
+            compact_ent->value_pos = COMPACT_VALUE_POS(ent->value_pos);
+        else
+            compact_ent->value_pos = COMPACT_POS(ent->value_pos);
+    }
+    else
+        memcpy(data, ent, sizeof(em_dict_index_ent_t));
+}
+
+
+/* Reads the "index.bin" entry at index `i' in `*ent'. Returns -1 if it's out
+ * of bounds.
+ */
+static int em_dict_get_entry(em_dict_t *self, size_t i, em_dict_index_ent_t *ent)
+{
+    void *data;
+    int ret = -1;
 
-    if(mapped_file_read(mf, ent, size) != (ssize_t)size)
+    if((data = mapped_file_ptr(self->index, EM_DICT_E2S(self, i),
+            EM_DICT_ENT_SIZE(self->compact))) == NULL)
         goto _err;
 
+    em_dict_decode_entry(data, self->compact, self->inline_values, ent);
     ret = 0;
 
 _err:
@@ -40,16 +103,17 @@ _err:
 
 
 /* Sets the "index.bin" entry at index `i'. */
-static int em_dict_set_entry(mapped_file_t *mf, em_dict_index_ent_t *ent,
+static int em_dict_set_entry(em_dict_t *self, em_dict_index_ent_t *ent,
         size_t i)
 {
-    size_t size = sizeof(em_dict_index_ent_t);
+    em_dict_index_ent_t data;
+    size_t size = EM_DICT_ENT_SIZE(self->compact);
     int ret = -1;
 
-    if(mapped_file_seek(mf, EM_DICT_E2S(i), SEEK_SET) != 0)
-        goto _err;
+    em_dict_encode_entry(&data, self->compact, self->inline_values, ent);
 
-    if(mapped_file_write(mf, ent, size) != (ssize_t)size)
+    if(mapped_file_pwrite(self->index, &data, size, EM_DICT_E2S(self, i)) !=
+            (ssize_t)size)
         goto _err;
 
     ret = 0;
@@ -59,674 +123,2741 @@ _err:
 }
 
 
-/* Check if `ent' represents a free slot. */
-static int em_dict_entry_is_free(em_dict_index_ent_t *ent)
-{
-    return (ent->hash == 0 && ent->key_pos == 0 && ent->value_pos == 0);
-}
-
-
-
-/* External memory dictionary iterator object definitions begin here. Normal
- * Python dictionaries have three kinds of iterators, one for items, one for
- * keys and one for values. The iteration logic is common to all three kinds of
- * iterators, what differs, is only the returned object type. In the original
- * Python sources, a common object named `_PyDictViewObject' is used as a basis
- * for implementing all iterators. We try to follow this design here as well.
- *
- * We define an object called `_EMDictIter', which implements the code common to
- * all iterators (notice that this object is private and thus not exported to
- * the end user). When an `_EMDictIter' object is instantiated, the object's
- * `type' member is set to the appropriate iterator type. The iterator's
- * implementation of `next()' decides the type of object to return based on the
- * value of `type'.
+/* Marshal the record made of marshalled key `key_str' and marshalled value
+ * `value_str', which may be `NULL' if the value is inline, in "values.bin".
+ * Returns the position of the record, or -1 on error.
  */
-
-/* Iterator's `__iter__()' method. */
-static PyObject *em_dict_iter_iter(em_dict_iter_t *self)
+static ssize_t em_dict_marshal_record(em_dict_t *self, PyObject *key_str,
+        PyObject *value_str)
 {
-    return (PyObject *)self;
-}
+    em_dict_record_hdr_t rec_hdr;
+    char *key, *value = NULL, *data;
+    Py_ssize_t key_size, value_size = 0;
+    PyObject *rec_str;
+    ssize_t ret = -1;
 
+#if PY_MAJOR_VERSION >= 3
+    if(PyBytes_AsStringAndSize(key_str, &key, &key_size) == -1)
+        goto _err;
 
-/* Iterator's `next()' method. */
-static PyObject *em_dict_iter_iternext(em_dict_iter_t *self)
-{
-    em_dict_index_ent_t ent;
-    char type;
-    size_t max_pos = self->max_pos;
-    size_t pos = self->pos;
-    em_dict_t *em_dict = self->em_dict;
-    PyObject *key = NULL, *value = NULL, *r = NULL;
+    if(value_str != NULL &&
+            PyBytes_AsStringAndSize(value_str, &value, &value_size) == -1)
+        goto _err;
+#else
+    if(PyString_AsStringAndSize(key_str, &key, &key_size) == -1)
+        goto _err;
 
-    /* If we haven't finished iterating the elements of the external memory
-     * dictionary, lookup the next non-free slot.
-     */
-    if(pos < max_pos)
-    {
-        do
-        {
-            if(em_dict_get_entry(em_dict->index, &ent, pos) != 0)
-                goto _err;
-            pos += 1;
-        }
-        while(em_dict_entry_is_free(&ent) && pos < max_pos);
-        self->pos = pos;
-    }
+    if(value_str != NULL &&
+            PyString_AsStringAndSize(value_str, &value, &value_size) == -1)
+        goto _err;
+#endif
 
-    /* Have we found a non-free slot? If yes read key and value. */
-    if(pos < max_pos)
+    if((size_t)key_size > UINT32_MAX)
     {
-        type = self->type;
-
-        if(type == EM_DICT_ITER_ITEMS || type == EM_DICT_ITER_KEYS)
-            key = mapped_file_unmarshal_object(EM_COMMON(em_dict), em_dict->keys, ent.key_pos);
-
-        if(type == EM_DICT_ITER_ITEMS || type == EM_DICT_ITER_VALUES)
-            value = mapped_file_unmarshal_object(EM_COMMON(em_dict), em_dict->values, ent.value_pos);
-
-        /* Return the appropriate object type based on the iterator's type. */
-        if(type == EM_DICT_ITER_ITEMS)
-        {
-            if((r = Py_BuildValue("(NN)", key, value)) == NULL)
-            {
-                Py_DECREF(key);
-                Py_DECREF(value);
-            }
-        }
-        else if(type == EM_DICT_ITER_KEYS)
-            r = key;
-        else if(type == EM_DICT_ITER_VALUES)
-            r = value;
+        PyErr_SetString(PyExc_ValueError, "Object too large");
+        goto _err;
     }
-    else
-        PyErr_SetNone(PyExc_StopIteration);
-
-_err:
-    return r;
-}
 
+#if PY_MAJOR_VERSION >= 3
+    rec_str = PyBytes_FromStringAndSize(NULL,
+        sizeof(rec_hdr) + key_size + value_size);
+#else
+    rec_str = PyString_FromStringAndSize(NULL,
+        sizeof(rec_hdr) + key_size + value_size);
+#endif
+    if(rec_str == NULL)
+        goto _err;
 
-static void em_dict_iter_dealloc(em_dict_iter_t *self)
-{
-    Py_DECREF(self->em_dict);
-}
-
-static PyTypeObject em_dict_iter_type =
-{
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pyrsistence._EMDictIter",
-    .tp_basicsize = sizeof(em_dict_iter_t),
-    .tp_dealloc = (destructor)em_dict_iter_dealloc,
 #if PY_MAJOR_VERSION >= 3
-    .tp_flags = Py_TPFLAGS_DEFAULT,
+    data = PyBytes_AS_STRING(rec_str);
 #else
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
+    data = PyString_AS_STRING(rec_str);
 #endif
-    .tp_doc = "Internal EMDict iterator object.",
-    .tp_iter = (getiterfunc)em_dict_iter_iter,
-    .tp_iternext = (iternextfunc)em_dict_iter_iternext
-};
 
+    rec_hdr.key_size = (uint32_t)key_size;
+    memcpy(data, &rec_hdr, sizeof(rec_hdr));
+    memcpy(data + sizeof(rec_hdr), key, key_size);
+    if(value_size > 0)
+        memcpy(data + sizeof(rec_hdr) + key_size, value, value_size);
 
+    ret = mapped_file_marshal_string_object(EM_COMMON(self), self->values,
+        rec_str);
 
-/* Main external memory dictionary implementation begins here. */
+    Py_DECREF(rec_str);
 
-/* Lookup `key' in external memory dictionary. If the key is found, 0 is
- * returned and `*pi' holds the index of the entry in "index.bin". If a free
- * slot is detected where the key should be, the return value is > 0 and `*pi'
- * holds the index of the free slot. Otherwise a value < 0 is returned and `*pi'
- * is unaffected.
+_err:
+    return ret;
+}
+
+
+/* Unmarshal the key, if `keyp' is not `NULL', and the value, if `valuep' is
+ * not `NULL', of the record at position `pos' in "values.bin".
  */
-static int em_dict_lookup(em_dict_t *self, PyObject *key, size_t *pi)
+static int em_dict_unmarshal_record(em_dict_t *self, size_t pos,
+        PyObject **keyp, PyObject **valuep)
 {
-    em_dict_index_hdr_t *index_hdr;
-    em_dict_index_ent_t ent;
-    Py_ssize_t hash;
-    PyObject *r;
-    size_t mask, i, perturb;
-    int eq;
-    mapped_file_t *keys = self->keys;
+    em_dict_record_hdr_t rec_hdr;
+    char *data;
+    Py_ssize_t size;
+    PyObject *rec_str, *str, *key = NULL;
     int ret = -1;
 
-    if((hash = PyObject_Hash(key)) == -1)
-        goto _err;
-
-    index_hdr = self->index->address;
-    mask = index_hdr->mask;
+    if((rec_str = mapped_file_get_chunk_data(EM_COMMON(self), self->values,
+            pos)) == NULL)
+        goto _err1;
 
-    i = (size_t)hash & mask;
+#if PY_MAJOR_VERSION >= 3
+    data = PyBytes_AS_STRING(rec_str);
+    size = PyBytes_GET_SIZE(rec_str);
+#else
+    data = PyString_AS_STRING(rec_str);
+    size = PyString_GET_SIZE(rec_str);
+#endif
 
-    if(em_dict_get_entry(self->index, &ent, i) != 0)
-        goto _err;
+    if((size_t)size >= sizeof(rec_hdr))
+        memcpy(&rec_hdr, data, sizeof(rec_hdr));
 
-    /* Hash value returned by `PyObject_Hash()' may be 0, so check if the entry
-     * is free first.
-     */
-    if(em_dict_entry_is_free(&ent))
+    if((size_t)size < sizeof(rec_hdr) ||
+            rec_hdr.key_size > (size_t)size - sizeof(rec_hdr))
     {
-        *pi = i;
-        ret = 1;
-        goto _err;
+        PyErr_SetString(PyExc_RuntimeError, "Corrupted record");
+        goto _err2;
     }
 
-    /* Now check if the hashes match. */
-    else if(ent.hash == hash)
+    data += sizeof(rec_hdr);
+    size -= sizeof(rec_hdr);
+
+    if(keyp != NULL)
     {
-        if((r = mapped_file_unmarshal_object(EM_COMMON(self), keys, ent.key_pos)) != NULL)
-        {
-            eq = equal_objects(key, r);
-            Py_DECREF(r);
+#if PY_MAJOR_VERSION >= 3
+        str = PyBytes_FromStringAndSize(data, rec_hdr.key_size);
+#else
+        str = PyString_FromStringAndSize(data, rec_hdr.key_size);
+#endif
+        if(str == NULL)
+            goto _err2;
 
-            if(eq)
-            {
-                *pi = i;
-                ret = 0;
-                goto _err;
-            }
-        }
+        key = unmarshal(EM_COMMON(self), str);
+        Py_DECREF(str);
+
+        if(key == NULL)
+            goto _err2;
     }
 
-    /* If the dictionary becomes full, this loop will never terminate. However,
-     * guaranteeing that the resize invariant is always obeyed, also guarantees
-     * termination of this loop.
+    /* The value takes the rest of the record, along with any padding, which
+     * unpicklers ignore.
      */
-    for(perturb = hash; ; perturb >>= PERTURB_SHIFT)
+    if(valuep != NULL)
     {
-        i = ((i << 2) + i + perturb + 1) & mask;
+#if PY_MAJOR_VERSION >= 3
+        str = PyBytes_FromStringAndSize(data + rec_hdr.key_size,
+            size - rec_hdr.key_size);
+#else
+        str = PyString_FromStringAndSize(data + rec_hdr.key_size,
+            size - rec_hdr.key_size);
+#endif
+        if(str == NULL)
+            goto _err3;
 
-        if(em_dict_get_entry(self->index, &ent, i) != 0)
-            goto _err;
+        *valuep = unmarshal(EM_COMMON(self), str);
+        Py_DECREF(str);
 
-        if(em_dict_entry_is_free(&ent))
-        {
-            *pi = i;
-            ret = 1;
-            goto _err;
-        }
+        if(*valuep == NULL)
+            goto _err3;
+    }
 
-        else if(ent.hash == hash)
-        {
-            if((r = mapped_file_unmarshal_object(EM_COMMON(self), keys, ent.key_pos)) != NULL)
-            {
-                eq = equal_objects(key, r);
-                Py_DECREF(r);
+    if(keyp != NULL)
+        *keyp = key;
+    key = NULL;
+    ret = 0;
 
-                if(eq)
-                {
-                    *pi = i;
-                    ret = 0;
-                    goto _err;
-                }
-            }
-        }
-    }
+_err3:
+    Py_XDECREF(key);
 
-_err:
+_err2:
+    Py_DECREF(rec_str);
+
+_err1:
     return ret;
 }
 
 
-/* Resize external memory dictionary. */
-static int em_dict_resize(em_dict_t *self)
+/* Unmarshal the key, if `keyp' is not `NULL', and the value, if `valuep' is
+ * not `NULL', of index entry `ent'. With records, both are read at once.
+ */
+static int em_dict_unmarshal_entry(em_dict_t *self, em_dict_index_ent_t *ent,
+        PyObject **keyp, PyObject **valuep)
 {
-    em_dict_index_hdr_t *index_hdr, *new_index_hdr;
-    em_dict_index_ent_t ent, new_ent;
-    size_t mask, new_mask, num_ents, new_num_ents, size, new_size, i, j, perturb;
-    mapped_file_t *mf;
-    char *filename;
+    PyObject *key = NULL, *value = NULL;
+    int stored = valuep != NULL && !IS_INLINE(ent->value_pos);
     int ret = -1;
 
-    /* Store current values for later use. */
-    index_hdr = self->index->address;
-    mask = index_hdr->mask;
-    num_ents = mask + 1;
-    size = self->index->size;
-
-    /* Compute new values and do some sanity checking. */
-    new_num_ents = num_ents << 1;
-    new_size = EM_DICT_E2S(new_num_ents);
-    if(new_num_ents < num_ents || new_size < size)
-        goto _err;
-
-    msgf("EMDict: Resizing");
-
-    filename = path_combine(self->dirname, "index.bin.1");
-    if((mf = mapped_file_create(filename, new_size)) == NULL)
+    /* Inline values are read along with the index. */
+    if(valuep != NULL && !stored &&
+            (value = unmarshal_inline(EM_COMMON(self), ent->value_pos)) == NULL)
         goto _err;
 
-    new_mask = new_num_ents - 1;
-    new_index_hdr = mf->address;
-    new_index_hdr->magic = MAGIC;
-    new_index_hdr->used = 0;
-    new_index_hdr->mask = new_mask;
-
-    msgf("EMDict: Rehashing");
-
-    /* Rehash all dictionary entries in the new index file. */
-    for(i = 0; i < num_ents; i++)
+    if(self->records)
     {
-        em_dict_get_entry(self->index, &ent, i);
-
-        if(!em_dict_entry_is_free(&ent))
-        {
-            /* Locate empty slot in new index file. */
-            j = ent.hash & new_mask;
-            em_dict_get_entry(mf, &new_ent, j);
-
-            perturb = ent.hash;
-            while(em_dict_entry_is_free(&new_ent) == 0)
-            {
-                j = ((j << 2) + j + perturb + 1) & new_mask;
-                perturb >>= PERTURB_SHIFT;
-                em_dict_get_entry(mf, &new_ent, j);
-            }
-
-            /* Key and value offsets in "keys.bin" and "values.bin" are the same.
-             * We just rehash the index entry in a (possibly) different position
-             * in the new "index.bin".
-             */
-            em_dict_set_entry(mf, &ent, j);
-            new_index_hdr->used += 1;
-        }
+        if((keyp != NULL || stored) && em_dict_unmarshal_record(self,
+                ent->key_pos, keyp != NULL ? &key : NULL,
+                stored ? &value : NULL) != 0)
+            goto _err;
     }
+    else
+    {
+        if(keyp != NULL && (key = mapped_file_unmarshal_object(EM_COMMON(self),
+                self->keys, ent->key_pos)) == NULL)
+            goto _err;
 
-    msgf("EMDict: Resize successful");
-
-    /* Move the new mapped file over the old one. When the file is closed below,
-     * the kernel will remove it from our filesystem because the link count will
-     * reach 0. This works on Microsoft Windows too, but with a slightly
-     * different technique (see `mapped_file_unlink()' for more information).
-     */
-    filename = path_combine(self->dirname, "index.bin.0");
-    if(mapped_file_rename(self->index, filename) != 0)
-        goto _err;
-
-    filename = path_combine(self->dirname, "index.bin");
-    if(mapped_file_rename(mf, filename) != 0)
-        goto _err;
-
-    mapped_file_unlink(self->index);
-    mapped_file_close(self->index);
-
-    self->index = mf;
+        if(stored && (value = mapped_file_unmarshal_object(EM_COMMON(self),
+                self->values, ent->value_pos)) == NULL)
+            goto _err;
+    }
 
+    if(keyp != NULL)
+        *keyp = key;
+    if(valuep != NULL)
+        *valuep = value;
     ret = 0;
 
 _err:
+    if(ret != 0)
+    {
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+    }
     return ret;
 }
 
 
+/* Hash `key' the way hash values are kept in the index of `self'. */
+static Py_ssize_t em_dict_hash(em_dict_t *self, PyObject *key)
+{
+    Py_ssize_t hash;
 
-/* Sequence protocol implementation. */
+    if((hash = PyObject_Hash(key)) != -1 && self->compact)
+        hash = (Py_ssize_t)(uint32_t)hash;
+    return hash;
+}
 
-/* Callback for Python's `in' operator. */
-static int em_dict_contains(em_dict_t *self, PyObject *key)
+
+/* Make sure positions `key_pos' and `value_pos' fit in the index of `self'. */
+static int em_dict_check_pos(em_dict_t *self, size_t key_pos, size_t value_pos)
 {
-    size_t i;
-    return em_dict_lookup(self, key, &i) != 0 ? 0 : 1;
+    size_t value_pos_max = self->inline_values ? COMPACT_VALUE_POS_MAX : COMPACT_POS_MAX;
+    int ret = 0;
+
+    if(self->compact && (key_pos > COMPACT_POS_MAX ||
+            (!IS_INLINE(value_pos) && value_pos > value_pos_max)))
+    {
+        PyErr_SetString(PyExc_OverflowError, "EMDict too large for compact index");
+        ret = -1;
+    }
+    return ret;
 }
 
 
+/* Check if `ent' represents a free slot. */
+static int em_dict_entry_is_free(em_dict_index_ent_t *ent)
+{
+    return (ent->hash == 0 && ent->key_pos == 0 && ent->value_pos == 0);
+}
 
-/* Mapping protocol implementation. */
 
-/* Callback for Python's `len()'. */
-static Py_ssize_t em_dict_len(em_dict_t *self)
+/* Check if `ent' represents a deleted slot. Deleted slots have no key, like
+ * free ones, but lookups probe past them, so that keys inserted after a key
+ * that collided with them can still be found (see `em_dict_lookup()').
+ */
+static int em_dict_entry_is_deleted(em_dict_index_ent_t *ent)
 {
-    return ((em_dict_index_hdr_t *)(self->index->address))->used;
+    return (ent->key_pos == 0 && ent->value_pos == EM_DICT_DELETED);
 }
 
 
-/* Retrieve item from external memory dictionary. */
-static PyObject *em_dict_getitem(em_dict_t *self, PyObject *key)
+/* Check if `ent' holds an item, i.e. it's neither free nor deleted. */
+static int em_dict_entry_is_used(em_dict_index_ent_t *ent)
+{
+    return ent->key_pos != 0;
+}
+
+
+/* Multiple processes may open an `EMDict'; a single writer and any number of
+ * readers. The writer holds an exclusive lock on "keys.bin", which is never
+ * replaced, while readers map all files read-only. Whenever the writer grows
+ * a file, or replaces "index.bin" while resizing, it bumps the generation
+ * counter in the index header, so that readers know they have to re-open or
+ * re-map their files before accessing them again.
+ */
+
+/* Sum of the sizes of the files of `self'. Files only grow while the writer is
+ * active, so readers need to refresh whenever the sum changes.
+ */
+static size_t em_dict_layout(em_dict_t *self)
+{
+    size_t layout = self->index->size + self->keys->size + self->values->size;
+
+    if(self->classes != NULL)
+        layout += mapped_file_get_eof(self->classes->mf);
+    return layout;
+}
+
+
+/* Let readers know that the files of `self' have changed. */
+static void em_dict_bump_generation(em_dict_t *self)
+{
+    ((em_dict_index_hdr_t *)self->index->address)->generation += 1;
+}
+
+
+/* Re-open "index.bin", which may have been replaced by a resize, and re-map
+ * the rest of the files, after the writer has modified them. Must be called
+ * with the lock of reader `self' held exclusively.
+ */
+static int em_dict_refresh(em_dict_t *self)
+{
+    em_dict_index_hdr_t *index_hdr;
+    mapped_file_t *mf;
+    char *filename;
+    int ret = -1;
+
+    index_hdr = self->index->address;
+    if(index_hdr->generation == self->generation)
+        goto _ok;
+
+    filename = path_combine(self->dirname, "index.bin");
+    if((mf = mapped_file_open(filename, 1, self->index->options)) == NULL)
+        goto _err;
+
+    index_hdr = mf->address;
+    if(mf->size < sizeof(em_dict_index_hdr_t) || index_hdr->magic != INDEX_MAGIC)
+    {
+        mapped_file_close(mf);
+        goto _err;
+    }
+
+    mapped_file_close(self->index);
+    self->index = mf;
+
+    /* Files may grow again meanwhile; a later bump will be noticed. */
+    self->generation = index_hdr->generation;
+
+    if(mapped_file_remap(self->keys) != 0 || mapped_file_remap(self->values) != 0)
+        goto _err;
+
+    /* The writer may have trained a compression dictionary or created a class
+     * table in the meantime.
+     */
+    if(self->dict == NULL &&
+            compression_load_dict(EM_COMMON(self), self->dirname) != 0)
+        goto _err;
+
+    if(self->classes != NULL)
+    {
+        if(class_table_refresh(self->classes) != 0)
+            goto _err;
+    }
+    else if((self->classes = class_table_open(self->dirname, 0, 1)) == NULL &&
+            PyErr_Occurred() != NULL)
+        goto _err;
+
+_ok:
+    ret = 0;
+
+_err:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot refresh EMDict");
+    return ret;
+}
+
+
+/* Acquire the lock of `self', in shared mode if `shared' is non-zero, and make
+ * sure it's open. Readers may only take it in shared mode, and have their files
+ * refreshed first, if the writer has modified them.
+ */
+static int em_dict_lock(em_dict_t *self, int shared)
+{
+    int ret = -1;
+
+    for(;;)
+    {
+        if(shared)
+            lock_acquire_shared(&self->lock);
+        else
+            lock_acquire(&self->lock);
+
+        if(self->is_open == 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "EMDict not open");
+            goto _unlock;
+        }
+
+        if(self->reader == 0 && self->readonly == 0)
+            break;
+
+        if(shared == 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, self->readonly ?
+                "EMDict is open in read-only mode" : "EMDict is open in reader mode");
+            goto _unlock;
+        }
+
+        /* Nothing changes under a read-only `EMDict'. */
+        if(self->readonly ||
+                ((em_dict_index_hdr_t *)self->index->address)->generation ==
+                self->generation)
+            break;
+
+        /* Files are re-mapped, so upgrade to an exclusive lock and retry. */
+        lock_release_shared(&self->lock);
+        lock_acquire(&self->lock);
+        ret = self->is_open ? em_dict_refresh(self) : 0;
+        lock_release(&self->lock);
+
+        if(ret != 0)
+            goto _err;
+    }
+
+    ret = 0;
+    goto _err;
+
+_unlock:
+    if(shared)
+        lock_release_shared(&self->lock);
+    else
+        lock_release(&self->lock);
+
+_err:
+    return ret;
+}
+
+
+
+/* Start reading from `self'. See `em_dict_read_retry()'. */
+static size_t em_dict_read_begin(em_dict_t *self)
+{
+    /* Read-only opens may be looking at an index of an earlier version, which
+     * has no sequence counter.
+     */
+    if(self->reader == 0)
+        return 0;
+
+    return seq_read_begin(&((em_dict_index_hdr_t *)self->index->address)->seq);
+}
+
+
+/* Check if a reader has to read again, because the writer has modified the
+ * index, or the files, since `em_dict_read_begin()' returned `seq'. Lookups in
+ * other modes are serialized with modifications by the object's lock.
+ */
+static int em_dict_read_retry(em_dict_t *self, size_t seq)
+{
+    em_dict_index_hdr_t *index_hdr = self->index->address;
+
+    return self->reader && (seq_read_retry(&index_hdr->seq, seq) ||
+        index_hdr->generation != self->generation);
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform on slots
+ * [`start', `end') of the index of `self', and on the parts of "keys.bin" and
+ * "values.bin" holding their keys, if `keys' is non-zero, and their values, if
+ * `values' is non-zero. These parts span from the first to the last key or
+ * value and are skipped if longer than `max_span' bytes, unless it's 0. Called
+ * with the dictionary's lock held.
+ */
+static int em_dict_advise_slots(em_dict_t *self, size_t start, size_t end,
+        int advice, int keys, int values, size_t max_span)
 {
     em_dict_index_ent_t ent;
-    size_t i;
+    size_t i, key_min = SIZE_MAX, key_max = 0, value_min = SIZE_MAX, value_max = 0;
+    int ret = 0;
+
+    if(mapped_file_advise(self->index, EM_DICT_E2S(self, start),
+            EM_DICT_E2S(self, end) - EM_DICT_E2S(self, start), advice) != 0)
+        ret = -1;
+
+    for(i = start; i < end && (keys || values); i++)
+    {
+        if(em_dict_get_entry(self, i, &ent) != 0)
+            break;
+
+        if(em_dict_entry_is_used(&ent) == 0)
+            continue;
+
+        if(ent.key_pos < key_min)
+            key_min = ent.key_pos;
+        if(ent.key_pos > key_max)
+            key_max = ent.key_pos;
+        if(IS_INLINE(ent.value_pos))
+            continue;
+        if(ent.value_pos < value_min)
+            value_min = ent.value_pos;
+        if(ent.value_pos > value_max)
+            value_max = ent.value_pos;
+    }
+
+    if(keys && key_min <= key_max &&
+            (max_span == 0 || key_max - key_min <= max_span) &&
+            mapped_file_advise(EM_DICT_KEYS(self), key_min,
+                key_max - key_min + 1, advice) != 0)
+        ret = -1;
+
+    if(values && value_min <= value_max &&
+            (max_span == 0 || value_max - value_min <= max_span) &&
+            mapped_file_advise(self->values, value_min,
+                value_max - value_min + 1, advice) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+
+/* External memory dictionary iterator object definitions begin here. Normal
+ * Python dictionaries have three kinds of iterators, one for items, one for
+ * keys and one for values. The iteration logic is common to all three kinds of
+ * iterators, what differs, is only the returned object type. In the original
+ * Python sources, a common object named `_PyDictViewObject' is used as a basis
+ * for implementing all iterators. We try to follow this design here as well.
+ *
+ * We define an object called `_EMDictIter', which implements the code common to
+ * all iterators (notice that this object is private and thus not exported to
+ * the end user). When an `_EMDictIter' object is instantiated, the object's
+ * `type' member is set to the appropriate iterator type. The iterator's
+ * implementation of `next()' decides the type of object to return based on the
+ * value of `type'.
+ */
+
+/* Iterator's `__iter__()' method. */
+static PyObject *em_dict_iter_iter(em_dict_iter_t *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+
+/* Read the item at slot `pos' for iterator `self'. Sets `*foundp' to zero if
+ * the slot is free, in which case `NULL' is returned without an exception.
+ * Called with the dictionary's lock held.
+ */
+static PyObject *em_dict_iter_read_slot(em_dict_iter_t *self, size_t pos,
+        int *foundp)
+{
+    em_dict_index_ent_t ent;
+    char type = self->type;
+    em_dict_t *em_dict = self->em_dict;
+    PyObject *key = NULL, *value = NULL, *r = NULL;
+
+    *foundp = 0;
+
+    if(em_dict_get_entry(em_dict, pos, &ent) != 0)
+        goto _err;
+
+    if(em_dict_entry_is_used(&ent) == 0)
+        goto _err;
+
+    *foundp = 1;
+
+    if(em_dict_unmarshal_entry(em_dict, &ent,
+            type != EM_DICT_ITER_VALUES ? &key : NULL,
+            type != EM_DICT_ITER_KEYS ? &value : NULL) != 0)
+        goto _err;
+
+    /* Return the appropriate object type based on the iterator's type. */
+    if(type == EM_DICT_ITER_ITEMS)
+    {
+        if((r = Py_BuildValue("(NN)", key, value)) == NULL)
+        {
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+    }
+    else if(type == EM_DICT_ITER_KEYS)
+        r = key;
+    else if(type == EM_DICT_ITER_VALUES)
+        r = value;
+
+_err:
+    return r;
+}
+
+
+/* Collect the used slots from `*posp' up to `end' in the batch of iterator
+ * `self', `self->prefetch' of them at most, and start reading in the keys and
+ * values they point to, as needed by the iterator's type. The batch is left
+ * sorted by position of value, or of key for key iterators. `*posp' is updated
+ * to point past the last slot examined. Called with the dictionary's lock held.
+ */
+static void em_dict_iter_prefetch(em_dict_iter_t *self, size_t *posp,
+        size_t end)
+{
+    em_dict_index_ent_t ent;
+    char type = self->type;
+    size_t i, n = 0, pos = *posp;
+    em_dict_t *em_dict = self->em_dict;
+    chunk_ref_t *batch = self->batch;
+
+    for(; pos < end && n < self->prefetch; pos++)
+    {
+        if(em_dict_get_entry(em_dict, pos, &ent) != 0)
+        {
+            pos = end;
+            break;
+        }
+
+        if(em_dict_entry_is_used(&ent))
+        {
+            batch[n].pos = ent.key_pos;
+            batch[n].index = pos;
+            n += 1;
+        }
+    }
+
+    if(type != EM_DICT_ITER_VALUES)
+        mapped_file_prefetch_chunks(EM_DICT_KEYS(em_dict), batch, n);
+
+    /* Records hold values along with keys, unless these are inline. */
+    if(type != EM_DICT_ITER_KEYS &&
+            (em_dict->records == 0 || type == EM_DICT_ITER_VALUES))
+    {
+        for(i = 0; i < n; i++)
+        {
+            /* Inline values are read along with the index. */
+            em_dict_get_entry(em_dict, batch[i].index, &ent);
+            batch[i].pos = IS_INLINE(ent.value_pos) ? 0 : ent.value_pos;
+        }
+        mapped_file_prefetch_chunks(em_dict->values, batch, n);
+    }
+
+    self->batch_len = n;
+    *posp = pos;
+}
+
+
+/* Read the next item of iterator `self', starting from slot `*posp', which is
+ * updated to point past the slot read. Called with the dictionary's lock held.
+ */
+static PyObject *em_dict_iter_read(em_dict_iter_t *self, size_t *posp)
+{
+    size_t start, max_pos = self->max_pos;
+    size_t pos = *posp;
+    int found = 0;
+    PyObject *r = NULL;
+
+    /* Keep the chunks of the next `prefetch' used slots being read in. */
+    if(self->prefetch > 0 && pos + self->prefetch / 2 >= self->prefetched)
+    {
+        start = pos > self->prefetched ? pos : self->prefetched;
+        em_dict_iter_prefetch(self, &start, max_pos);
+        self->prefetched = start;
+    }
+
+    /* If we haven't finished iterating the elements of the external memory
+     * dictionary, lookup the next non-free slot.
+     */
+    while(pos < max_pos && found == 0)
+    {
+        r = em_dict_iter_read_slot(self, pos, &found);
+        pos += 1;
+    }
+
+    *posp = pos;
+
+    if(found == 0)
+        PyErr_SetNone(PyExc_StopIteration);
+
+    return r;
+}
+
+
+/* Read the next item of iterator `self' in reordering mode. Used slots are
+ * taken in batches, each returned in the order their values, or keys, appear
+ * on disk. `*batch_posp' is the entry of the current batch to return next and
+ * is updated accordingly. Collecting a new batch updates the iterator's state
+ * directly; a batch is a mere hint, as each slot is read again when its turn
+ * comes. Called with the dictionary's lock held.
+ */
+static PyObject *em_dict_iter_read_batch(em_dict_iter_t *self,
+        size_t *batch_posp)
+{
+    size_t batch_pos = *batch_posp;
+    int found = 0;
+    PyObject *r = NULL;
+
+    while(found == 0)
+    {
+        if(batch_pos == self->batch_len)
+        {
+            if(self->pos >= self->max_pos)
+            {
+                PyErr_SetNone(PyExc_StopIteration);
+                break;
+            }
+
+            em_dict_iter_prefetch(self, &self->pos, self->max_pos);
+            self->batch_pos = batch_pos = 0;
+            continue;
+        }
+
+        /* Slots deleted since the batch was collected are skipped. */
+        r = em_dict_iter_read_slot(self, self->batch[batch_pos].index, &found);
+        batch_pos += 1;
+    }
+
+    *batch_posp = batch_pos;
+    return r;
+}
+
+
+/* Keep at least half a window of slots read ahead of the position of iterator
+ * `self', so that full scans don't wait for the disk at every page. Called with
+ * the dictionary's lock held.
+ */
+static void em_dict_iter_readahead(em_dict_iter_t *self)
+{
+    size_t start = self->readahead, end;
+    char type = self->type;
+
+    if(start >= self->max_pos || self->pos + EM_DICT_READAHEAD / 2 < start)
+        return;
+
+    end = start + EM_DICT_READAHEAD;
+    if(end > self->max_pos)
+        end = self->max_pos;
+
+    em_dict_advise_slots(self->em_dict, start, end, MF_ACCESS_WILLNEED,
+        type != EM_DICT_ITER_VALUES, type != EM_DICT_ITER_KEYS,
+        READAHEAD_MAX_SPAN);
+
+    self->readahead = end;
+}
+
+
+/* Iterator's `next()' method. */
+static PyObject *em_dict_iter_iternext(em_dict_iter_t *self)
+{
+    size_t pos, batch_pos, seq;
+    em_dict_t *em_dict = self->em_dict;
     PyObject *r = NULL;
 
-    if(em_dict_lookup(self, key, &i) == 0)
+    if(em_dict_lock(em_dict, 1) != 0)
+        goto _err;
+
+    /* Readers retry if the writer modified the index meanwhile. */
+    for(;;)
+    {
+        seq = em_dict_read_begin(em_dict);
+        pos = self->pos;
+        batch_pos = self->batch_pos;
+
+        if(self->reorder)
+            r = em_dict_iter_read_batch(self, &batch_pos);
+        else
+            r = em_dict_iter_read(self, &pos);
+
+        if(em_dict_read_retry(em_dict, seq) == 0)
+            break;
+
+        Py_CLEAR(r);
+        PyErr_Clear();
+        lock_release_shared(&em_dict->lock);
+
+        if(em_dict_lock(em_dict, 1) != 0)
+            goto _err;
+    }
+
+    if(self->reorder)
+        self->batch_pos = batch_pos;
+    else
+        self->pos = pos;
+
+    em_dict_iter_readahead(self);
+    lock_release_shared(&em_dict->lock);
+
+_err:
+    return r;
+}
+
+
+static void em_dict_iter_dealloc(em_dict_iter_t *self)
+{
+    PyMem_FREE(self->batch);
+    Py_DECREF(self->em_dict);
+    PyObject_Del(self);
+}
+
+static PyTypeObject em_dict_iter_type =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pyrsistence._EMDictIter",
+    .tp_basicsize = sizeof(em_dict_iter_t),
+    .tp_dealloc = (destructor)em_dict_iter_dealloc,
+#if PY_MAJOR_VERSION >= 3
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+#else
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
+#endif
+    .tp_doc = "Internal EMDict iterator object.",
+    .tp_iter = (getiterfunc)em_dict_iter_iter,
+    .tp_iternext = (iternextfunc)em_dict_iter_iternext
+};
+
+
+
+/* Main external memory dictionary implementation begins here. */
+
+/* Check if index entry `ent' holds `key'. If so, and `valuep' is not `NULL',
+ * `*valuep' receives a new reference to the value. With records, the value is
+ * read along with the key, so that the record isn't read a second time.
+ */
+static int em_dict_match_entry(em_dict_t *self, PyObject *key,
+        em_dict_index_ent_t *ent, PyObject **valuep)
+{
+    PyObject *r, *value = NULL;
+    int ret = -1;
+
+    if(em_dict_unmarshal_entry(self, ent, &r,
+            valuep != NULL && self->records ? &value : NULL) != 0)
+        goto _err;
+
+    ret = equal_objects(key, r);
+    Py_DECREF(r);
+
+    if(ret && valuep != NULL)
+    {
+        if(value == NULL && em_dict_unmarshal_entry(self, ent, NULL, &value) != 0)
+        {
+            ret = -1;
+            goto _err;
+        }
+        *valuep = value;
+        value = NULL;
+    }
+
+_err:
+    Py_XDECREF(value);
+    return ret;
+}
+
+
+/* Lookup `key' in external memory dictionary. If the key is found, 0 is
+ * returned, `*pi' holds the index of the entry in "index.bin" and, if `valuep'
+ * is not `NULL', `*valuep' holds a new reference to the value. If a free slot
+ * is detected where the key should be, the return value is > 0 and `*pi' holds
+ * the index of the first deleted slot probed, which can be reused, or of the
+ * free slot if none was. Otherwise a value < 0 is returned, with an exception
+ * set, and `*pi' is unaffected.
+ */
+static int em_dict_lookup(em_dict_t *self, PyObject *key, size_t *pi,
+        PyObject **valuep)
+{
+    em_dict_index_hdr_t *index_hdr;
+    em_dict_index_ent_t ent;
+    Py_ssize_t hash;
+    size_t mask, i, perturb, deleted = SIZE_MAX;
+    int eq;
+    int ret = -1;
+
+    if((hash = em_dict_hash(self, key)) == -1)
+        goto _err;
+
+    index_hdr = self->index->address;
+    mask = index_hdr->mask;
+
+    i = (size_t)hash & mask;
+
+    if(em_dict_get_entry(self, i, &ent) != 0)
+        goto _err;
+
+    /* Hash value returned by `PyObject_Hash()' may be 0, so check if the entry
+     * is free first.
+     */
+    if(em_dict_entry_is_free(&ent))
+    {
+        *pi = i;
+        ret = 1;
+        goto _err;
+    }
+
+    /* Deleted slots have no key to compare with, but the probe goes on. */
+    else if(em_dict_entry_is_deleted(&ent))
+        deleted = i;
+
+    /* Now check if the hashes match. */
+    else if(ent.hash == hash)
+    {
+        if((eq = em_dict_match_entry(self, key, &ent, valuep)) < 0)
+            goto _err;
+
+        if(eq)
+        {
+            *pi = i;
+            ret = 0;
+            goto _err;
+        }
+    }
+
+    /* If the dictionary becomes full, this loop will never terminate. However,
+     * guaranteeing that the resize invariant is always obeyed, also guarantees
+     * termination of this loop.
+     */
+    for(perturb = hash; ; perturb >>= PERTURB_SHIFT)
+    {
+        i = ((i << 2) + i + perturb + 1) & mask;
+
+        if(em_dict_get_entry(self, i, &ent) != 0)
+            goto _err;
+
+        if(em_dict_entry_is_free(&ent))
+        {
+            *pi = deleted != SIZE_MAX ? deleted : i;
+            ret = 1;
+            goto _err;
+        }
+
+        else if(em_dict_entry_is_deleted(&ent))
+        {
+            if(deleted == SIZE_MAX)
+                deleted = i;
+        }
+
+        else if(ent.hash == hash)
+        {
+            if((eq = em_dict_match_entry(self, key, &ent, valuep)) < 0)
+                goto _err;
+
+            if(eq)
+            {
+                *pi = i;
+                ret = 0;
+                goto _err;
+            }
+        }
+    }
+
+_err:
+    if(ret < 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Corrupted EMDict index");
+    return ret;
+}
+
+
+/* Lookup the `num_keys' keys in `keys' and store new references to their
+ * values in `values', using `ents' and `batch', arrays of `num_keys' elements,
+ * as scratch space. The chunks of the keys in the slots probed first, and then
+ * those of the values found, are read in as a batch, so that the disk serves
+ * many reads at once instead of one per lookup. Returns 0 on success, or -1,
+ * with an exception set, if a key is missing. Called with the dictionary's lock
+ * held.
+ */
+static int em_dict_lookup_many(em_dict_t *self, PyObject **keys,
+        size_t num_keys, em_dict_index_ent_t *ents, chunk_ref_t *batch,
+        PyObject **values)
+{
+    em_dict_index_hdr_t *index_hdr = self->index->address;
+    Py_ssize_t hash;
+    size_t i, j, n = 0;
+    int ret = -1;
+
+    for(i = 0; i < num_keys; i++)
+    {
+        if((hash = em_dict_hash(self, keys[i])) == -1)
+            goto _err;
+
+        if(em_dict_get_entry(self, (size_t)hash & index_hdr->mask, &ents[i]) == 0 &&
+                em_dict_entry_is_used(&ents[i]))
+        {
+            batch[n].pos = ents[i].key_pos;
+            batch[n].index = i;
+            n += 1;
+        }
+    }
+
+    mapped_file_prefetch_chunks(EM_DICT_KEYS(self), batch, n);
+
+    /* Records hold values along with keys, so they are read by the lookup. */
+    for(i = 0, n = 0; i < num_keys; i++)
+    {
+        if((ret = em_dict_lookup(self, keys[i], &j,
+                self->records ? &values[i] : NULL)) > 0)
+            PyErr_SetString(PyExc_KeyError, "No such key");
+
+        if(ret != 0)
+        {
+            ret = -1;
+            goto _err;
+        }
+
+        if(self->records == 0)
+        {
+            if(em_dict_get_entry(self, j, &ents[i]) != 0)
+            {
+                ret = -1;
+                goto _err;
+            }
+
+            batch[n].pos = IS_INLINE(ents[i].value_pos) ? 0 : ents[i].value_pos;
+            batch[n].index = i;
+            n += 1;
+        }
+    }
+
+    mapped_file_prefetch_chunks(self->values, batch, n);
+
+    /* Unmarshal the values in the order they appear on disk. */
+    for(i = 0; i < n; i++)
+    {
+        j = batch[i].index;
+        if(em_dict_unmarshal_entry(self, &ents[j], NULL, &values[j]) != 0)
+        {
+            ret = -1;
+            goto _err;
+        }
+    }
+
+    ret = 0;
+
+_err:
+    if(ret < 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Corrupted EMDict index");
+    return ret;
+}
+
+
+/* Rehash the `num_ents' entries in `ents' into `new_ents', a zeroed array of
+ * `new_mask + 1' entries, formatted as `compact' and `inline_values' say (see
+ * `em_dict_decode_entry()'), dropping deleted entries. Returns the number of
+ * entries rehashed. Doesn't touch any Python objects, so it's called with the
+ * GIL released.
+ */
+static size_t em_dict_rehash(const char *ents, size_t num_ents,
+        char *new_ents, size_t new_mask, int compact, int inline_values)
+{
+    em_dict_index_ent_t ent, new_ent;
+    size_t i, j, perturb, used = 0, size = EM_DICT_ENT_SIZE(compact);
+
+    for(i = 0; i < num_ents; i++)
+    {
+        em_dict_decode_entry(&ents[i * size], compact, inline_values, &ent);
+
+        if(em_dict_entry_is_used(&ent))
+        {
+            /* Locate empty slot in new index file. */
+            j = ent.hash & new_mask;
+
+            perturb = ent.hash;
+            for(;;)
+            {
+                em_dict_decode_entry(&new_ents[j * size], compact,
+                    inline_values, &new_ent);
+                if(em_dict_entry_is_free(&new_ent))
+                    break;
+
+                j = ((j << 2) + j + perturb + 1) & new_mask;
+                perturb >>= PERTURB_SHIFT;
+            }
+
+            /* Key and value offsets in "keys.bin" and "values.bin" are the same.
+             * We just rehash the index entry in a (possibly) different position
+             * in the new "index.bin".
+             */
+            memcpy(&new_ents[j * size], &ents[i * size], size);
+            used += 1;
+        }
+    }
+
+    return used;
+}
+
+
+/* Resize external memory dictionary. */
+static int em_dict_resize(em_dict_t *self)
+{
+    em_dict_index_hdr_t *index_hdr, *new_index_hdr;
+    char *ents, *new_ents;
+    size_t mask, new_mask, num_ents, new_num_ents, size, new_size, used;
+    mapped_file_t *mf;
+    char *filename;
+    int ret = -1;
+
+    /* Store current values for later use. */
+    index_hdr = self->index->address;
+    mask = index_hdr->mask;
+    num_ents = mask + 1;
+    size = self->index->size;
+
+    /* Compute new values and do some sanity checking. If deleted slots make up
+     * most of the load, dropping them is enough and the size is kept.
+     */
+    new_num_ents = index_hdr->used * 3 >= num_ents ? num_ents << 1 : num_ents;
+    new_size = EM_DICT_E2S(self, new_num_ents);
+    if(new_num_ents < num_ents || new_size < size)
+        goto _err;
+
+    msgf("EMDict: Resizing");
+
+    /* The new index is mapped like the old one, e.g. it's locked in memory if
+     * the old one was. It's about to be written in full, so it's not prefaulted.
+     */
+    filename = path_combine(self->dirname, "index.bin.1");
+    if((mf = mapped_file_create(filename, new_size,
+            self->index->options & ~MF_PREFAULT)) == NULL)
+        goto _err;
+
+    new_mask = new_num_ents - 1;
+    new_index_hdr = mf->address;
+    new_index_hdr->magic = INDEX_MAGIC;
+    new_index_hdr->used = 0;
+    new_index_hdr->mask = new_mask;
+    new_index_hdr->generation = index_hdr->generation + 1;
+    new_index_hdr->flags = index_hdr->flags;
+
+    msgf("EMDict: Rehashing");
+
+    /* Rehash all dictionary entries in the new index file. The object's lock
+     * is held, so other threads can safely run meanwhile.
+     */
+    ents = (char *)index_hdr + EM_DICT_E2S(self, 0);
+    new_ents = (char *)new_index_hdr + EM_DICT_E2S(self, 0);
+
+    Py_BEGIN_ALLOW_THREADS
+    used = em_dict_rehash(ents, num_ents, new_ents, new_mask, self->compact,
+        self->inline_values);
+    Py_END_ALLOW_THREADS
+
+    new_index_hdr->used = used;
+
+    /* The new index was written directly in the mapped buffer. */
+    mapped_file_mark_dirty(mf, 0, new_size);
+
+    msgf("EMDict: Resize successful");
+
+    /* Move the new mapped file over the old one. When the file is closed below,
+     * the kernel will remove it from our filesystem because the link count will
+     * reach 0. This works on Microsoft Windows too, but with a slightly
+     * different technique (see `mapped_file_unlink()' for more information).
+     */
+    filename = path_combine(self->dirname, "index.bin.0");
+    if(mapped_file_rename(self->index, filename) != 0)
+        goto _err;
+
+    filename = path_combine(self->dirname, "index.bin");
+    if(mapped_file_rename(mf, filename) != 0)
+        goto _err;
+
+    /* Readers still mapping the old "index.bin" will re-open the new one. */
+    index_hdr->generation += 1;
+
+    mapped_file_unlink(self->index);
+    mapped_file_close(self->index);
+
+    self->index = mf;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Replace "index.bin" of format version `version' with one in the current
+ * format, in the same way `em_dict_resize()' does. Entries are laid out the
+ * same, past the longer header.
+ */
+static int em_dict_upgrade(em_dict_t *self, unsigned int version)
+{
+    em_dict_index_hdr_t *index_hdr, *new_index_hdr;
+    em_dict_index_ent_t *new_ents;
+    size_t i, num_ents, new_size, used = 0, deleted = 0;
+    size_t hdr_size = EM_DICT_INDEX_HDR_SIZE(version);
+    mapped_file_t *mf;
+    char *filename;
+    int ret = -1;
+
+    index_hdr = self->index->address;
+
+    if(self->index->size < hdr_size)
+        goto _err;
+
+    num_ents = index_hdr->mask + 1;
+    if(num_ents == 0 || (self->index->size - hdr_size) /
+            sizeof(em_dict_index_ent_t) < num_ents)
+        goto _err;
+
+    msgf("EMDict: Upgrading");
+
+    new_size = sizeof(em_dict_index_hdr_t) + num_ents * sizeof(em_dict_index_ent_t);
+
+    filename = path_combine(self->dirname, "index.bin.1");
+    if((mf = mapped_file_create(filename, new_size,
+            self->index->options & ~MF_PREFAULT)) == NULL)
+        goto _err;
+
+    new_index_hdr = mf->address;
+    new_index_hdr->magic = INDEX_MAGIC;
+    new_index_hdr->mask = index_hdr->mask;
+    new_index_hdr->generation = 0;
+    new_index_hdr->seq = 0;
+    new_index_hdr->flags = 0;
+
+    new_ents = (em_dict_index_ent_t *)((char *)new_index_hdr +
+        sizeof(em_dict_index_hdr_t));
+
+    /* Earlier versions freed the slots of deleted items without updating the
+     * number of used slots, so count them again, along with deleted slots left
+     * by versions that mark them.
+     */
+    Py_BEGIN_ALLOW_THREADS
+    memcpy(new_ents, (char *)index_hdr + hdr_size,
+        num_ents * sizeof(em_dict_index_ent_t));
+    for(i = 0; i < num_ents; i++)
+    {
+        used += em_dict_entry_is_used(&new_ents[i]);
+        deleted += em_dict_entry_is_deleted(&new_ents[i]);
+    }
+    Py_END_ALLOW_THREADS
+
+    new_index_hdr->used = used;
+    new_index_hdr->deleted = deleted;
+
+    /* Make sure the new index is on disk before the old one is replaced. */
+    if(mapped_file_sync(mf, 0, new_size) != 0)
+        goto _err2;
+
+    filename = path_combine(self->dirname, "index.bin.0");
+    if(mapped_file_rename(self->index, filename) != 0)
+        goto _err2;
+
+    filename = path_combine(self->dirname, "index.bin");
+    if(mapped_file_rename(mf, filename) != 0)
+        goto _err2;
+
+    mapped_file_unlink(self->index);
+    mapped_file_close(self->index);
+
+    self->index = mf;
+
+    msgf("EMDict: Upgrade successful");
+
+    ret = 0;
+    goto _err;
+
+_err2:
+    mapped_file_unlink(mf);
+    mapped_file_close(mf);
+
+_err:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot upgrade EMDict");
+    return ret;
+}
+
+
+
+/* Sequence protocol implementation. */
+
+/* Callback for Python's `in' operator. */
+static int em_dict_contains(em_dict_t *self, PyObject *key)
+{
+    size_t i, seq;
+    int ret = -1;
+
+    if(em_dict_lock(self, 1) != 0)
+        goto _err;
+
+    /* Readers retry if the writer modified the index meanwhile. */
+    for(;;)
+    {
+        seq = em_dict_read_begin(self);
+        if((ret = em_dict_lookup(self, key, &i, NULL)) >= 0)
+            ret = ret == 0;
+
+        if(em_dict_read_retry(self, seq) == 0)
+            break;
+
+        PyErr_Clear();
+        lock_release_shared(&self->lock);
+
+        if(em_dict_lock(self, 1) != 0)
+        {
+            ret = -1;
+            goto _err;
+        }
+    }
+
+    lock_release_shared(&self->lock);
+
+_err:
+    return ret;
+}
+
+
+
+/* Mapping protocol implementation. */
+
+/* Callback for Python's `len()'. */
+static Py_ssize_t em_dict_len(em_dict_t *self)
+{
+    Py_ssize_t ret = -1;
+
+    if(em_dict_lock(self, 1) != 0)
+        goto _err;
+
+    ret = ((em_dict_index_hdr_t *)(self->index->address))->used;
+    lock_release_shared(&self->lock);
+
+_err:
+    return ret;
+}
+
+
+/* Retrieve item from external memory dictionary. */
+static PyObject *em_dict_getitem(em_dict_t *self, PyObject *key)
+{
+    size_t i, seq;
+    int found;
+    PyObject *r = NULL;
+
+    if(em_dict_lock(self, 1) != 0)
+        goto _err;
+
+    /* Readers retry if the writer modified the index meanwhile. */
+    for(;;)
+    {
+        seq = em_dict_read_begin(self);
+
+        if((found = em_dict_lookup(self, key, &i, &r)) > 0)
+            PyErr_SetString(PyExc_KeyError, "No such key");
+
+        if(em_dict_read_retry(self, seq) == 0)
+            break;
+
+        Py_CLEAR(r);
+        PyErr_Clear();
+        lock_release_shared(&self->lock);
+
+        if(em_dict_lock(self, 1) != 0)
+            goto _err;
+    }
+
+    lock_release_shared(&self->lock);
+
+_err:
+    return r;
+}
+
+
+/* Write back the parts of the files of `self' modified since they were last
+ * synchronized to disk, or just schedule write back if `async' is non-zero.
+ * The index header is updated in place by every operation, so it's always
+ * written back.
+ */
+static int em_dict_sync(em_dict_t *self, int async)
+{
+    int ret = 0;
+
+    mapped_file_mark_dirty(self->index, 0, sizeof(em_dict_index_hdr_t));
+
+    if(mapped_file_flush(self->index, async) != 0 ||
+            mapped_file_flush(self->keys, async) != 0 ||
+            mapped_file_flush(self->values, async) != 0 ||
+            (async == 0 && self->classes != NULL &&
+                class_table_sync(self->classes) != 0))
+        ret = -1;
+    return ret;
+}
+
+
+/* Synchronize the files of `self' to disk, save a copy of "index.bin" in
+ * "index.ckpt", which recovery starts from (see "wal.c"), and empty its write-
+ * ahead log. Chunks freed since the previous checkpoint may be reused then.
+ */
+static int em_dict_checkpoint(em_dict_t *self)
+{
+    int ret = -1;
+
+    msgf("EMDict: Checkpoint");
+
+    if(em_dict_sync(self, 0) != 0 || mapped_file_save(self->index,
+            path_combine(self->dirname, "index.ckpt")) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMDict");
+        goto _err;
+    }
+
+    if(wal_reset(&self->wal) != 0)
+        goto _err;
+
+    mapped_file_release_chunks(self->keys);
+    mapped_file_release_chunks(self->values);
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Remove "index.ckpt" of `self', once its files have been synchronized to disk
+ * and "index.bin" can be relied upon on its own, and empty its write-ahead log.
+ */
+static int em_dict_drop_checkpoint(em_dict_t *self)
+{
+    int ret = -1;
+
+    rm_file(path_combine(self->dirname, "index.ckpt"));
+
+    if(sync_file(self->dirname) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMDict");
+        goto _err;
+    }
+
+    ret = wal_reset(&self->wal);
+
+_err:
+    return ret;
+}
+
+
+/* If the last writer of `self' didn't close it, "index.bin" may be in any state
+ * between the last checkpoint and the crash; replace it with "index.ckpt", on
+ * top of which the write-ahead log is replayed. Readers still mapping the old
+ * "index.bin" are told to re-open it. Called with the writer's lock held.
+ */
+static int em_dict_restore_index(em_dict_t *self)
+{
+    mapped_file_t *mf;
+    em_dict_index_hdr_t *index_hdr;
+
+    int ret = -1;
+
+    if(file_exists(path_combine(self->dirname, "index.ckpt")) == 0)
+        goto _ok;
+
+    msgf("EMDict: Restoring checkpoint");
+
+    if(file_exists(path_combine(self->dirname, "index.bin")) &&
+            (mf = mapped_file_open(path_combine(self->dirname, "index.bin"),
+                0, 0)) != NULL)
+    {
+        index_hdr = mf->address;
+        if(mf->size >= sizeof(em_dict_index_hdr_t))
+            index_hdr->generation += 1;
+        mapped_file_close(mf);
+    }
+
+    if((mf = mapped_file_open(path_combine(self->dirname, "index.ckpt"),
+            1, 0)) == NULL)
+        goto _err;
+
+    ret = mapped_file_save(mf, path_combine(self->dirname, "index.bin"));
+    mapped_file_close(mf);
+
+    if(ret != 0)
+        goto _err;
+
+_ok:
+    ret = 0;
+
+_err:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot restore EMDict checkpoint");
+    return ret;
+}
+
+
+/* Evict pages of "values.bin" until the resident size of `self' is within its
+ * memory budget. "index.bin" and "keys.bin", needed by every lookup, are left
+ * alone. Called with the object's lock held.
+ */
+static void em_dict_enforce_budget(em_dict_t *self)
+{
+    size_t resident;
+
+    resident = mapped_file_resident(self->index) +
+        mapped_file_resident(self->keys) + mapped_file_resident(self->values);
+
+    if(resident > self->memory_budget)
+        mapped_file_evict(self->values, resident - self->memory_budget,
+            &self->evict_hand);
+}
+
+
+/* Called periodically by the background flusher of `self' to start write back
+ * of the pages modified since its last run, and to enforce its memory budget.
+ * Skips a run if `self' is busy, rather than stalling the thread modifying it.
+ */
+static int em_dict_flusher(void *arg)
+{
+    em_dict_t *self = arg;
+    int ret = 0;
+
+    if(lock_try_acquire(&self->lock) == 0)
+    {
+        if(self->is_open && self->write_back)
+            ret = em_dict_sync(self, 1);
+        if(self->is_open && self->memory_budget > 0)
+            em_dict_enforce_budget(self);
+        lock_release(&self->lock);
+    }
+    return ret;
+}
+
+
+/* Insert item in external memory dictionary. */
+static int em_dict_setitem(em_dict_t *self, PyObject *key, PyObject *value)
+{
+    em_dict_index_hdr_t *index_hdr;
+    em_dict_index_ent_t ent;
+    Py_ssize_t hash;
+    ssize_t key_pos, value_pos, old_key_pos, old_value_pos, lsn = 0;
+    size_t i, layout;
+    mapped_file_t *index, *keys, *values;
+    PyObject *key_str = NULL, *value_str = NULL;
+    int logged, reused = 0, resized = 0, inlined = 0, ret = -1;
+
+    if(em_dict_lock(self, 0) != 0)
+        goto _err;
+
+    layout = em_dict_layout(self);
+
+    index = self->index;
+    keys = self->keys;
+    values = self->values;
+
+    logged = self->wal.durability != DURABILITY_NONE;
+
+    ret = em_dict_lookup(self, key, &i, NULL);
+
+    /* Python dictionaries raise `KeyError' when deleting missing keys. */
+    if(ret > 0 && value == NULL)
+    {
+        PyErr_SetObject(PyExc_KeyError, key);
+        goto _fail;
+    }
+
+    /* If `ret > 0' a free or deleted slot was found where `key' and `value' can
+     * be placed. If `ret == 0', `key' was already present in the dictionary and
+     * its slot was returned.
+     */
+    if(ret >= 0)
+    {
+        if((hash = em_dict_hash(self, key)) == -1)
+            goto _fail;
+
+        if(em_dict_get_entry(self, i, &ent) != 0)
+            goto _fail;
+
+        /* If the key was already present in the dictionary, re-use the key
+         * object. The old value object is freed once the new one is in place,
+         * and so is the key object if it's deleted.
+         */
+        key_pos = value_pos = old_key_pos = old_value_pos = 0;
+        if(ret == 0)
+        {
+            key_pos = old_key_pos = ent.key_pos;
+            old_value_pos = ent.value_pos;
+        }
+        else
+            reused = em_dict_entry_is_deleted(&ent);
+
+        /* Marshal key object only if it's not already in the dictionary, or if
+         * the operation has to be logged. With records, the key is written
+         * again along with each new value.
+         */
+        if(((value != NULL && (key_pos == 0 || self->records)) || logged) &&
+                (key_str = marshal(EM_COMMON(self), key)) == NULL)
+            goto _fail;
+
+        if(value != NULL && (value_str = marshal(EM_COMMON(self), value)) == NULL)
+            goto _fail;
+
+        /* Log the operation before applying it. */
+        if((lsn = wal_append(&self->wal, EM_COMMON(self),
+                value != NULL ? WAL_OP_SET : WAL_OP_DEL, key_str, value_str)) < 0)
+            goto _fail;
+
+        /* Now clear the index entry (indicates a free element). */
+        memset(&ent, 0, sizeof(ent));
+
+        /* If value object is not `NULL' populate the index entry accordingly.
+         * Otherwise, a `del' statement was used and the indicated element must
+         * be marked as deleted, rather than free, so as not to cut short the
+         * probes of other keys going through it.
+         */
+        if(value == NULL)
+            ent.value_pos = EM_DICT_DELETED;
+        else
+        {
+            if(self->records == 0 && key_pos == 0 &&
+                    (key_pos = mapped_file_marshal_string_object(
+                        EM_COMMON(self), keys, key_str)) < 0)
+                goto _fail;
+
+            /* Marshal new value object, in the index entry if it's small
+             * enough, in "values.bin" otherwise.
+             */
+            if(self->inline_values && (inlined = marshal_inline(EM_COMMON(self),
+                    value_str, INLINE_SIZE_MAX(self->compact), &ent.value_pos)) < 0)
+                goto _fail;
+
+            /* Records are written anew, unless both the old value and the new
+             * one are inline, in which case the record holds the key only.
+             */
+            if(self->records)
+            {
+                if((key_pos == 0 || inlined == 0 || !IS_INLINE(old_value_pos)) &&
+                        (key_pos = em_dict_marshal_record(self, key_str,
+                            inlined ? NULL : value_str)) < 0)
+                    goto _fail;
+
+                if(inlined == 0)
+                    ent.value_pos = (size_t)key_pos;
+            }
+            else if(inlined == 0)
+            {
+                if((value_pos = mapped_file_marshal_string_object(EM_COMMON(self),
+                        values, value_str)) < 0)
+                    goto _fail;
+                ent.value_pos = (size_t)value_pos;
+            }
+
+            /* Chunks that don't fit in a compact index are given back. */
+            if(em_dict_check_pos(self, key_pos, ent.value_pos) != 0)
+            {
+                if(self->records)
+                {
+                    if(key_pos != old_key_pos)
+                        mapped_file_free_chunk(values, key_pos);
+                }
+                else
+                {
+                    if(inlined == 0)
+                        mapped_file_free_chunk(values, ent.value_pos);
+                    if(ret > 0)
+                        mapped_file_free_chunk(keys, key_pos);
+                }
+                goto _fail;
+            }
+
+            /* Populate new index entry. */
+            ent.hash = hash;
+            ent.key_pos = key_pos;
+        }
+
+        /* Let readers re-map grown files before they see the new entry. */
+        if(em_dict_layout(self) != layout)
+            em_dict_bump_generation(self);
+
+        /* Readers in other processes may be reading the old value object, so
+         * only free it while they are told to retry.
+         */
+        index_hdr = index->address;
+        seq_write_begin(&index_hdr->seq);
+
+        /* Records hold the key too, so they're freed when deleted as well. */
+        if(self->records)
+        {
+            if(old_key_pos != 0 && (size_t)old_key_pos != ent.key_pos)
+                mapped_file_free_chunk(values, old_key_pos);
+        }
+        else
+        {
+            if(old_value_pos != 0 && !IS_INLINE(old_value_pos))
+                mapped_file_free_chunk(values, old_value_pos);
+
+            if(value == NULL)
+                mapped_file_free_chunk(keys, key_pos);
+        }
+
+        /* Write updated index entry. */
+        em_dict_set_entry(self, &ent, i);
+
+        /* Increase `used' only if a free or deleted slot was used. */
+        if(value == NULL)
+        {
+            index_hdr->used -= 1;
+            index_hdr->deleted += 1;
+        }
+        else if(ret > 0)
+        {
+            index_hdr->used += 1;
+            index_hdr->deleted -= reused;
+        }
+
+        seq_write_end(&index_hdr->seq);
+
+        /* Check if we should resize. Deleted slots count as well, as lookups
+         * only end at free ones.
+         */
+        if((index_hdr->used + index_hdr->deleted) * 3 >= (index_hdr->mask + 1) * 2)
+        {
+            if(em_dict_resize(self) != 0)
+                goto _fail;
+            resized = 1;
+        }
+
+        /* The new "index.bin" has never been synchronized to disk, and a long
+         * log takes long to replay, so sync everything now and then.
+         */
+        if(logged && (resized || self->wal.pos >= WAL_CHECKPOINT_SIZE))
+        {
+            if(em_dict_checkpoint(self) != 0)
+                goto _fail;
+            lsn = 0;
+        }
+
+        ret = 0;
+    }
+
+    goto _unlock;
+
+_fail:
+    ret = -1;
+
+_unlock:
+    lock_release(&self->lock);
+
+    Py_XDECREF(value_str);
+    Py_XDECREF(key_str);
+
+    /* Wait for the log to reach the disk without holding the lock. */
+    if(ret == 0 && lsn > 0)
+        ret = wal_complete(&self->wal, (size_t)lsn);
+
+_err:
+    return ret;
+}
+
+
+/* Re-apply an operation read back from the write-ahead log of `self'. */
+static int em_dict_apply(void *arg, int op, PyObject *key, PyObject *value)
+{
+    em_dict_t *self = arg;
+
+    int ret = -1;
+
+    if(op == WAL_OP_SET && value != NULL)
+        ret = em_dict_setitem(self, key, value);
+    else if(op == WAL_OP_DEL && (ret = em_dict_contains(self, key)) > 0)
+        ret = em_dict_setitem(self, key, NULL);
+    else if(ret != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Invalid write-ahead log record");
+    return ret;
+}
+
+
+
+/* Train a shared compression dictionary from the chunks in "keys.bin" and
+ * "values.bin". See `compression_train_dict()' for the return value.
+ */
+static int em_dict_train_dict(em_dict_t *self)
+{
+    mapped_file_t *mfs[2];
+
+    /* Values usually outweigh keys, so sample them first. */
+    mfs[0] = self->values;
+    mfs[1] = self->keys;
+
+    return compression_train_dict(EM_COMMON(self), self->dirname, mfs, 2,
+        sizeof(em_dict_values_hdr_t));
+}
+
+
+
+/* Standard interface to `open()' and `close()'. */
+
+/* Create a new external memory dictionary. "index.bin" is mapped with options
+ * `options', `MF_XXX' constants.
+ */
+static int em_dict_create(em_dict_t *self, int classes, int options)
+{
+    mapped_file_t *mf;
+    em_dict_index_hdr_t index_hdr;
+    em_dict_keys_hdr_t keys_hdr;
+    int data_options = 0;
+    char *filename;
+    const char *dirname = self->dirname;
+
+    /* Create directory to hold external memory dictionary files. */
+    if(mk_dir(dirname) != 0)
+        goto _err1;
+
+    self->index_hdr_size = sizeof(em_dict_index_hdr_t);
+
+    /* Create "index.bin" and write file header (initial size 65k entries). */
+    filename = path_combine(dirname, "index.bin");
+    if((mf = mapped_file_create(filename, EM_DICT_E2S(self, 65536), options)) == NULL)
+        goto _err2;
+
+    index_hdr.magic = INDEX_MAGIC;
+    index_hdr.used = 0;
+    index_hdr.mask = 65536 - 1;
+    index_hdr.generation = 0;
+    index_hdr.seq = 0;
+    index_hdr.deleted = 0;
+    index_hdr.flags = self->compact ? INDEX_COMPACT : 0;
+    if(self->inline_values)
+        index_hdr.flags |= INDEX_INLINE;
+    if(self->records)
+        index_hdr.flags |= INDEX_RECORDS;
+    if(self->compact_chunks)
+    {
+        index_hdr.flags |= INDEX_COMPACT_CHUNKS;
+        data_options = MF_COMPACT_CHUNKS;
+    }
+    mapped_file_write(mf, &index_hdr, sizeof(em_dict_index_hdr_t));
+
+    self->index = mf;
+
+    /* Create "keys.bin" and write file header (initial size 65k). */
+    filename = path_combine(dirname, "keys.bin");
+    if((mf = mapped_file_create(filename, 65536, data_options)) == NULL)
+        goto _err3;
+
+    keys_hdr.magic = MAGIC;
+    mapped_file_write(mf, &keys_hdr, sizeof(em_dict_keys_hdr_t));
+
+    self->keys = mf;
+
+    if(mapped_file_lock(mf, 1) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMDict is in use by another process");
+        goto _err4;
+    }
+
+    /* Create "values.bin", the first of its segments. */
+    filename = path_combine(dirname, "values.bin");
+    if((mf = mapped_file_create(filename, 0, data_options | MF_SEGMENTED)) == NULL)
+        goto _err4;
+
+    self->values = mf;
+
+    /* Create "classes.bin" if a class table was requested. */
+    if(classes && (self->classes = class_table_open(dirname, 1, 0)) == NULL)
+        goto _err5;
+
+    return 0;
+
+_err5:
+    mapped_file_unlink(self->values);
+    mapped_file_close(self->values);
+
+_err4:
+    mapped_file_unlink(self->keys);
+    mapped_file_close(self->keys);
+
+_err3:
+    mapped_file_unlink(self->index);
+    mapped_file_close(self->index);
+
+_err2:
+    rm_dir(dirname);
+
+_err1:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMDict");
+    return -1;
+}
+
+
+/* Open existing external memory dictionary. "index.bin" is mapped with options
+ * `index_options', "keys.bin" and "values.bin" with `data_options'.
+ */
+static int em_dict_open_existing(em_dict_t *self, int classes,
+        int index_options, int data_options)
+{
+    mapped_file_t *mf;
+    em_dict_index_hdr_t *index_hdr;
+    em_dict_keys_hdr_t *keys_hdr;
+    size_t pos, flags;
+    int readonly = self->reader || self->readonly;
+    const char *dirname = self->dirname;
+    char *filename;
+
+    /* Open and verify "keys.bin" first; it's where the writer's lock is held. */
+    filename = path_combine(dirname, "keys.bin");
+    if((mf = mapped_file_open(filename, readonly, data_options)) == NULL)
+        goto _err1;
+
+    self->keys = mf;
+    keys_hdr = mf->address;
+
+    pos = mapped_file_get_eof(mf);
+    if(keys_hdr->magic != MAGIC || mapped_file_seek(mf, pos, SEEK_SET) != 0)
+        goto _err2;
+
+    /* Read-only opens share the lock, so they exclude writers and vice versa. */
+    if(self->reader == 0 && mapped_file_lock(mf, self->readonly == 0) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMDict is in use by another process");
+        goto _err2;
+    }
+
+    if(readonly == 0 && em_dict_restore_index(self) != 0)
+        goto _err2;
+
+    /* Open and verify "index.bin". */
+    filename = path_combine(dirname, "index.bin");
+    if((mf = mapped_file_open(filename, readonly, index_options)) == NULL)
+        goto _err2;
+
+    self->index = mf;
+    index_hdr = mf->address;
+
+    /* Read-only opens take indices of earlier versions as they are, writers
+     * upgrade them first.
+     */
+    self->index_hdr_size = sizeof(em_dict_index_hdr_t);
+
+    if(mf->size >= sizeof(uint64_t) && IS_MAGIC(index_hdr->magic) &&
+            VERSION_OF(index_hdr->magic) < INDEX_VERSION)
+    {
+        if(self->reader)
+        {
+            PyErr_SetString(PyExc_RuntimeError,
+                "EMDict was created by an earlier version, open it for writing first");
+            goto _err3;
+        }
+
+        if(self->readonly)
+            self->index_hdr_size =
+                EM_DICT_INDEX_HDR_SIZE(VERSION_OF(index_hdr->magic));
+        else if(em_dict_upgrade(self, VERSION_OF(index_hdr->magic)) != 0)
+            goto _err3;
+
+        index_hdr = self->index->address;
+    }
+
+    if(self->index->size < self->index_hdr_size || IS_MAGIC(index_hdr->magic) == 0 ||
+            VERSION_OF(index_hdr->magic) > INDEX_VERSION)
+    {
+        if(IS_MAGIC(index_hdr->magic))
+            PyErr_SetString(PyExc_RuntimeError, "EMDict was created by a newer version");
+        goto _err3;
+    }
+
+    /* Indices of versions without flags use none of the features they record. */
+    flags = VERSION_OF(index_hdr->magic) >= 5 ? index_hdr->flags : 0;
+
+    if(flags & ~(size_t)INDEX_FLAGS)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMDict uses features unsupported by this version");
+        goto _err3;
+    }
+
+    self->compact = (flags & INDEX_COMPACT) != 0;
+    self->inline_values = (flags & INDEX_INLINE) != 0;
+    self->records = (flags & INDEX_RECORDS) != 0;
+
+    /* "keys.bin" was opened before its format was known. */
+    if(flags & INDEX_COMPACT_CHUNKS)
+    {
+        self->compact_chunks = 1;
+        mapped_file_set_compact_chunks(self->keys);
+        data_options |= MF_COMPACT_CHUNKS;
+    }
+
+    /* Only readers look at the generation counter. */
+    if(self->reader)
+        self->generation = index_hdr->generation;
+
+    /* Open "values.bin" and its segments, which are verified as they're opened. */
+    filename = path_combine(dirname, "values.bin");
+    if((mf = mapped_file_open(filename, readonly,
+            data_options | MF_SEGMENTED)) == NULL)
+        goto _err3;
+
+    self->values = mf;
+
+    /* Load the shared compression dictionary, or try to train one if it's
+     * missing and the compression mode requires it.
+     */
+    if(compression_load_dict(EM_COMMON(self), dirname) != 0)
+        goto _err4;
+
+    if(readonly == 0 && self->compression == COMPRESSION_LZ4_DICT &&
+            self->dict == NULL && em_dict_train_dict(self) < 0)
+        goto _err4;
+
+    /* Open "classes.bin" if present, or create it if a class table was
+     * requested.
+     */
+    if((self->classes = class_table_open(dirname, classes, readonly)) == NULL &&
+            PyErr_Occurred() != NULL)
+        goto _err4;
+
+    return 0;
+
+_err4:
+    compression_free_dict(EM_COMMON(self));
+    mapped_file_close(self->values);
+
+_err3:
+    mapped_file_close(self->index);
+
+_err2:
+    mapped_file_close(self->keys);
+
+_err1:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMDict");
+    return -1;
+}
+
+
+static PyObject *em_dict_close(em_dict_t *, PyObject *);
+
+
+/* Replay the write-ahead log of `self', if any, and keep it open for logging
+ * further operations, unless `durability' is `DURABILITY_NONE'.
+ */
+static int em_dict_open_wal(em_dict_t *self, int durability)
+{
+    int count;
+
+    if(durability == DURABILITY_NONE &&
+            file_exists(path_combine(self->dirname, "wal.bin")) == 0 &&
+            file_exists(path_combine(self->dirname, "index.ckpt")) == 0)
+        goto _ok;
+
+    /* Replayed operations are not logged again. */
+    if(wal_open(&self->wal, self->dirname, DURABILITY_NONE) != 0)
+        goto _err1;
+
+    /* Chunks referred to by "index.ckpt" may be freed while replaying, but
+     * replaying may have to start over from it.
+     */
+    if(mapped_file_defer_frees(self->keys, 1) != 0 ||
+            mapped_file_defer_frees(self->values, 1) != 0)
+        goto _err2;
+
+    if((count = wal_replay(&self->wal, EM_COMMON(self), em_dict_apply, self)) < 0)
+        goto _err2;
+
+    msgf("EMDict: Replayed %d operations", count);
+
+    /* Without a log, "index.bin" is all there is to recover from. */
+    if(durability == DURABILITY_NONE)
+    {
+        if(em_dict_sync(self, 0) != 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMDict");
+            goto _err2;
+        }
+
+        if(em_dict_drop_checkpoint(self) != 0)
+            goto _err2;
+
+        mapped_file_defer_frees(self->keys, 0);
+        mapped_file_defer_frees(self->values, 0);
+        wal_close(&self->wal);
+    }
+    else
+    {
+        if(em_dict_checkpoint(self) != 0)
+            goto _err2;
+
+        self->wal.durability = durability;
+    }
+
+_ok:
+    return 0;
+
+_err2:
+    mapped_file_defer_frees(self->keys, 0);
+    mapped_file_defer_frees(self->values, 0);
+    wal_close(&self->wal);
+
+_err1:
+    return -1;
+}
+
+
+/* Called by `em_dict_open()' and `em_dict_init()'. */
+static int em_dict_open_common(em_dict_t *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *pickler = NULL, *unpickler = NULL;
+    char *compression = NULL, *durability = NULL, *prefault = NULL;
+    int classes = 0, reader = 0, readonly = 0, durability_mode;
+    int hugepages = 0, lock_index = 0, prefault_mode, index_options;
+    int data_options, direct_io = 0, compact_index = 0, compact_chunks = 0;
+    int inline_values = 0, records = 0;
+    double flush_interval = 0;
+    Py_ssize_t memory_budget = 0, buffer_pool = 0;
+
+    char *dirname, *kwarr[] = {
+        "dirname",
+        "pickler",
+        "unpickler",
+        "compression",
+        "class_table",
+        "reader",
+        "readonly",
+        "durability",
+        "flush_interval",
+        "hugepages",
+        "prefault",
+        "memory_budget",
+        "lock_index",
+        "buffer_pool",
+        "direct_io",
+        "compact_index",
+        "compact_chunks",
+        "inline_values",
+        "records",
+        NULL
+    };
+
+    int ret = -1;
+
+    if(kwargs)
+    {
+        if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|OOziiizdizniniiiii", kwarr,
+                &dirname, &pickler, &unpickler, &compression, &classes, &reader,
+                &readonly, &durability, &flush_interval, &hugepages,
+                &prefault, &memory_budget, &lock_index, &buffer_pool,
+                &direct_io, &compact_index, &compact_chunks,
+                &inline_values, &records) == 0)
+            goto _err;
+    }
+    else
+    {
+        if(PyArg_ParseTuple(args, "s", &dirname) == 0)
+            goto _err;
+    }
+
+    if(valid_compression(compression, &self->compression) != 0)
+        goto _err;
+
+    if(valid_durability(durability, &durability_mode) != 0)
+        goto _err;
+
+    if(valid_prefault(prefault, &prefault_mode) != 0)
+        goto _err;
+
+    if(flush_interval < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid flush interval");
+        goto _err;
+    }
+
+    if(memory_budget < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid memory budget");
+        goto _err;
+    }
+
+    /* A buffer pool would keep serving data the writer has since changed. */
+    if(buffer_pool < 0 || (buffer_pool > 0 && reader))
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid buffer pool size");
+        goto _err;
+    }
+
+    if(direct_io && buffer_pool == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Direct I/O requires a buffer pool");
+        goto _err;
+    }
+
+    if((self->dirname = PyMem_MALLOC(strlen(dirname) + 1)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    strcpy(self->dirname, dirname);
+
+    if(pickler && valid_pickler(pickler, &self->pickle) == 0)
+        self->pickler = pickler;
+
+    if(unpickler && valid_unpickler(unpickler, &self->unpickle) == 0)
+        self->unpickler = unpickler;
+
+    self->reader = reader != 0;
+    self->readonly = readonly != 0;
+    self->write_back = reader == 0 && readonly == 0 && flush_interval > 0;
+    self->memory_budget = (size_t)memory_budget;
+    self->evict_hand = 0;
+    self->compact = compact_index != 0;
+    self->compact_chunks = compact_chunks != 0;
+    self->inline_values = inline_values != 0;
+    self->records = records != 0;
+
+    index_options = hugepages ? MF_HUGEPAGES : 0;
+    if(prefault_mode != PREFAULT_NONE)
+        index_options |= MF_PREFAULT;
+    if(lock_index)
+        index_options |= MF_LOCKED;
+    data_options = prefault_mode == PREFAULT_ALL ? MF_PREFAULT : 0;
+
+    /* XXX: There's an obvious race condition here, should we care? */
+    if(access(self->dirname, F_OK) == 0)
+        ret = em_dict_open_existing(self, classes, index_options, data_options);
+    else if(reader == 0 && readonly == 0)
+        ret = em_dict_create(self, classes, index_options);
+    else
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMDict");
+
+    if(ret >= 0)
+    {
+        self->is_open = 1;
+
+        /* Data files are accessed through buffer pools, if requested, once
+         * their headers have been verified.
+         */
+        if(buffer_pool > 0 &&
+                ((ret = mapped_file_set_buffered(self->keys, buffer_pool,
+                    direct_io)) != 0 ||
+                (ret = mapped_file_set_buffered(self->values, buffer_pool,
+                    direct_io)) != 0))
+            em_dict_close(self, NULL);
+
+        /* Only writers log operations. */
+        else if(reader == 0 && readonly == 0 &&
+                (ret = em_dict_open_wal(self, durability_mode)) != 0)
+            em_dict_close(self, NULL);
+
+        /* Started last, as it has to be stopped before closing on failure.
+         * Readers may have a memory budget too.
+         */
+        else if((self->write_back || memory_budget > 0) &&
+                (ret = flusher_start(&self->flusher, self->write_back ?
+                    flush_interval : BUDGET_INTERVAL, em_dict_flusher,
+                    self)) != 0)
+            em_dict_close(self, NULL);
+    }
+
+_err:
+    return ret;
+}
+
+
+/* Open external memory dictionary. */
+static PyObject *em_dict_open(em_dict_t *self, PyObject *args)
+{
+    PyObject *r = NULL;
+
+    lock_acquire(&self->lock);
+
+    if(self->is_open)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMDict already open");
+        goto _err;
+    }
+
+    if(em_dict_open_common(self, args, NULL) != 0)
+        goto _err;
+
+    Py_INCREF(Py_True);
+    r = Py_True;
+
+_err:
+    lock_release(&self->lock);
+    return r;
+}
+
+
+/* Synchronize and close an external memory dictionary. */
+static PyObject *em_dict_close(em_dict_t *self, PyObject *Py_UNUSED(args))
+{
+    mapped_file_t *index, *keys, *values;
+
+    /* The flusher takes the lock too; stop it before taking it. */
+    flusher_stop(&self->flusher);
+
+    lock_acquire(&self->lock);
+
+    if(self->is_open)
+    {
+        index = self->index;
+        keys = self->keys;
+        values = self->values;
+
+        /* Files opened read-only are neither synchronized nor truncated. */
+        if(self->reader == 0 && self->readonly == 0)
+        {
+            /* Readers have to re-map the files truncated below. */
+            em_dict_bump_generation(self);
+
+            /* Sync all files; the checkpoint and the write-ahead log are no
+             * longer needed once they're on disk.
+             */
+            if(em_dict_sync(self, 0) == 0 && wal_is_open(&self->wal) &&
+                    em_dict_drop_checkpoint(self) != 0)
+                PyErr_Clear();
+
+            wal_close(&self->wal);
+
+            /* Truncate "keys.bin" and "values.bin". */
+            mapped_file_truncate(keys, mapped_file_get_eof(keys));
+            mapped_file_truncate(values, mapped_file_get_eof(values));
+        }
+
+        mapped_file_close(index);
+        mapped_file_close(keys);
+        mapped_file_close(values);
+
+        compression_free_dict(EM_COMMON(self));
+
+        if(self->classes != NULL)
+        {
+            class_table_close(self->classes);
+            self->classes = NULL;
+        }
+
+        PyMem_FREE(self->dirname);
+        self->is_open = 0;
+    }
+
+    lock_release(&self->lock);
+
+    Py_RETURN_NONE;
+};
+
+
+
+/* Train a shared compression dictionary from the objects stored so far. Objects
+ * stored afterwards are compressed with it if compression mode "lz4-dict" is in
+ * use.
+ */
+static PyObject *em_dict_train_dictionary(em_dict_t *self,
+        PyObject *Py_UNUSED(args))
+{
+    int ret;
+    PyObject *r = NULL;
+
+    if(em_dict_lock(self, 0) != 0)
+        goto _err;
+
+    if((ret = em_dict_train_dict(self)) < 0)
+        goto _unlock;
+
+    if(ret > 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Not enough data to train a compression dictionary");
+        goto _unlock;
+    }
+
+    /* Readers load the new dictionary when they refresh. */
+    em_dict_bump_generation(self);
+
+    r = PyLong_FromSize_t(self->dict->size);
+
+_unlock:
+    lock_release(&self->lock);
+
+_err:
+    return r;
+}
+
+
+
+/* Make sure all operations on `self' so far survive a crash. Without a write-
+ * ahead log, all files are synchronized to disk.
+ */
+static PyObject *em_dict_commit(em_dict_t *self, PyObject *Py_UNUSED(args))
+{
+    size_t lsn = 0;
+    int ret = 0;
+    PyObject *r = NULL;
+
+    if(em_dict_lock(self, 0) != 0)
+        goto _err;
+
+    if(wal_is_open(&self->wal))
+        lsn = self->wal.pos;
+    else if((ret = em_dict_sync(self, 0)) != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMDict");
+
+    lock_release(&self->lock);
+
+    if(ret == 0 && lsn > 0)
+        ret = wal_commit(&self->wal, lsn);
+
+    if(ret == 0)
+    {
+        Py_INCREF(Py_None);
+        r = Py_None;
+    }
+
+_err:
+    return r;
+}
+
+
+
+/* Write back the parts of the files of `self' modified so far. If `async_' is
+ * true, write back is only scheduled and this returns immediately. Otherwise,
+ * the write-ahead log, if any, is emptied too, as all logged operations are on
+ * disk afterwards.
+ */
+static PyObject *em_dict_flush(em_dict_t *self, PyObject *args, PyObject *kwargs)
+{
+    int async = 0, ret;
+    char *kwarr[] = {"async_", NULL};
+    PyObject *r = NULL;
+
+    if(PyArg_ParseTupleAndKeywords(args, kwargs, "|i", kwarr, &async) == 0)
+        goto _err;
+
+    if(em_dict_lock(self, 0) != 0)
+        goto _err;
+
+    if(async == 0 && wal_is_open(&self->wal))
+        ret = em_dict_checkpoint(self);
+    else if((ret = em_dict_sync(self, async)) != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMDict");
+
+    lock_release(&self->lock);
+
+    if(ret == 0)
+    {
+        Py_INCREF(Py_None);
+        r = Py_None;
+    }
+
+_err:
+    return r;
+}
+
+
+
+/* Give kernel a hint about how `self' is going to be accessed. The hint applies
+ * to slots `start' up to `end' in iteration order, or to all files of `self'
+ * if no range is given.
+ */
+static PyObject *em_dict_advise(em_dict_t *self, PyObject *args,
+        PyObject *kwargs)
+{
+    char *hint;
+    Py_ssize_t start = 0, end = PY_SSIZE_T_MAX;
+    size_t num_slots;
+    int advice, ret;
+    char *kwarr[] = {"hint", "start", "end", NULL};
+    PyObject *end_obj = Py_None, *r = NULL;
+
+    if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|nO", kwarr, &hint, &start,
+            &end_obj) == 0)
+        goto _err;
+
+    /* A missing `end', or `None', stands for the end of the data structure. */
+    if(end_obj != Py_None &&
+            (end = PyNumber_AsSsize_t(end_obj, PyExc_OverflowError)) == -1 &&
+            PyErr_Occurred())
+        goto _err;
+
+    if(valid_access(hint, &advice) != 0)
+        goto _err;
+
+    if(start < 0 || end < start)
     {
-        memset(&ent, 0, sizeof(em_dict_index_ent_t));
-        em_dict_get_entry(self->index, &ent, i);
-        r = mapped_file_unmarshal_object(EM_COMMON(self), self->values, ent.value_pos);
+        PyErr_SetString(PyExc_ValueError, "Invalid range");
+        goto _err;
     }
-    else
-        PyErr_SetString(PyExc_KeyError, "No such key");
 
-    return r;
-}
+    if(em_dict_lock(self, 1) != 0)
+        goto _err;
 
+    num_slots = ((em_dict_index_hdr_t *)self->index->address)->mask + 1;
 
-/* Insert item in external memory dictionary. */
-static int em_dict_setitem(em_dict_t *self, PyObject *key, PyObject *value)
-{
-    em_dict_index_hdr_t *index_hdr;
-    em_dict_index_ent_t ent;
-    Py_ssize_t hash;
-    ssize_t key_pos, value_pos;
-    size_t i;
-    mapped_file_t *index = self->index;
-    mapped_file_t *keys = self->keys;
-    mapped_file_t *values = self->values;
-    int ret = -1;
+    if(start == 0 && (size_t)end >= num_slots)
+        ret = mapped_file_set_access(self->index, advice) != 0 ||
+            mapped_file_set_access(self->keys, advice) != 0 ||
+            mapped_file_set_access(self->values, advice) != 0 ? -1 : 0;
+    else if((size_t)start < num_slots)
+        ret = em_dict_advise_slots(self, start,
+            (size_t)end < num_slots ? (size_t)end : num_slots, advice, 1, 1, 0);
+    else
+        ret = 0;
 
-    ret = em_dict_lookup(self, key, &i);
+    lock_release_shared(&self->lock);
 
-    /* If `ret > 0' a free slot was found where `key' and `value' can be placed.
-     * If `ret == 0', `key' was already present in the dictionary and its slot
-     * was returned.
-     */
-    if(ret >= 0)
+    if(ret != 0)
     {
-        if((hash = PyObject_Hash(key)) == -1)
-            goto _err;
+        PyErr_SetString(PyExc_RuntimeError, "Cannot advise kernel on EMDict access");
+        goto _err;
+    }
 
-        /* If the key was already present in the dictionary, lookup the index
-         * entry, free the old value object and re-use the key object.
-         */
-        key_pos = value_pos = 0;
-        if(ret == 0)
-        {
-            em_dict_get_entry(index, &ent, i);
-            key_pos = ent.key_pos;
-            value_pos = ent.value_pos;
-            mapped_file_free_chunk(values, value_pos);
-        }
+    Py_INCREF(Py_None);
+    r = Py_None;
 
-        /* Now clear the index entry (indicates a free element). */
-        memset(&ent, 0, sizeof(ent));
+_err:
+    return r;
+}
 
-        /* If value object is not `NULL' populate the index entry accordingly.
-         * Otherwise, a `del' statement was used and the indicated element must
-         * be marked as free.
-         */
-        if(value != NULL)
-        {
-            /* Marshal key object only if it's not already in the dictionary. */
-            if(key_pos == 0 &&
-                    (key_pos = mapped_file_marshal_object(EM_COMMON(self), keys, key)) < 0)
-                goto _err;
 
-            /* Marshal new value object. */
-            if((value_pos = mapped_file_marshal_object(EM_COMMON(self), values, value)) < 0)
-                goto _err;
 
-            /* Populate new index entry. */
-            ent.hash = hash;
-            ent.key_pos = key_pos;
-            ent.value_pos = value_pos;
-        }
+/* Retrieve the values of the keys in sequence `keys', as a list. Keys are
+ * looked up `EM_DICT_BATCH' at a time, with the chunks of each batch read in
+ * at once (see `em_dict_lookup_many()'). Raises `KeyError' if any key is
+ * missing.
+ */
+static PyObject *em_dict_get_many(em_dict_t *self, PyObject *args)
+{
+    em_dict_index_ent_t *ents = NULL;
+    chunk_ref_t *batch = NULL;
+    size_t i, j, n, num_keys, seq;
+    int ret;
+    PyObject *keys, *keys_seq = NULL, **items, *r = NULL;
 
-        /* Write updated index entry. */
-        em_dict_set_entry(index, &ent, i);
+    if(PyArg_ParseTuple(args, "O", &keys) == 0)
+        goto _err;
 
-        index_hdr = index->address;
+    if((keys_seq = PySequence_Fast(keys, "Keys must be iterable")) == NULL)
+        goto _err;
 
-        /* Increase `used' only if a free slot was used. */
-        if(ret > 0)
-            index_hdr->used += 1;
+    num_keys = (size_t)PySequence_Fast_GET_SIZE(keys_seq);
 
-        /* Check if we should resize. */
-        if(index_hdr->used * 3 >= (index_hdr->mask + 1) * 2)
-        {
-            if(em_dict_resize(self) != 0)
-                goto _err;
-        }
+    if((r = PyList_New((Py_ssize_t)num_keys)) == NULL)
+        goto _err;
 
-        ret = 0;
+    if((ents = PyMem_MALLOC(EM_DICT_BATCH * sizeof(em_dict_index_ent_t))) == NULL ||
+            (batch = PyMem_MALLOC(EM_DICT_BATCH * sizeof(chunk_ref_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _fail;
     }
 
-_err:
-    return ret;
-}
-
+    items = PySequence_Fast_ITEMS(r);
 
+    /* Writers get a chance to take the lock between batches. */
+    for(i = 0; i < num_keys; i += n)
+    {
+        n = num_keys - i < EM_DICT_BATCH ? num_keys - i : EM_DICT_BATCH;
 
-/* Standard interface to `open()' and `close()'. */
+        if(em_dict_lock(self, 1) != 0)
+            goto _fail;
 
-/* Create a new external memory dictionary. */
-static int em_dict_create(em_dict_t *self)
-{
-    mapped_file_t *mf;
-    em_dict_index_hdr_t index_hdr;
-    em_dict_keys_hdr_t keys_hdr;
-    em_dict_values_hdr_t values_hdr;
-    char *filename;
-    const char *dirname = self->dirname;
+        /* Readers retry if the writer modified the index meanwhile. */
+        for(;;)
+        {
+            seq = em_dict_read_begin(self);
+            ret = em_dict_lookup_many(self, &PySequence_Fast_ITEMS(keys_seq)[i],
+                n, ents, batch, &items[i]);
 
-    /* Create directory to hold external memory dictionary files. */
-    if(mk_dir(dirname) != 0)
-        goto _err1;
+            if(em_dict_read_retry(self, seq) == 0)
+                break;
 
-    /* Create "index.bin" and write file header (initial size 65k entries). */
-    filename = path_combine(dirname, "index.bin");
-    if((mf = mapped_file_create(filename, EM_DICT_E2S(65536))) == NULL)
-        goto _err2;
+            for(j = i; j < i + n; j++)
+                Py_CLEAR(items[j]);
 
-    index_hdr.magic = MAGIC;
-    index_hdr.used = 0;
-    index_hdr.mask = 65536 - 1;
-    mapped_file_write(mf, &index_hdr, sizeof(em_dict_index_hdr_t));
+            PyErr_Clear();
+            lock_release_shared(&self->lock);
 
-    self->index = mf;
+            if(em_dict_lock(self, 1) != 0)
+                goto _fail;
+        }
 
-    /* Create "keys.bin" and write file header (initial size 65k). */
-    filename = path_combine(dirname, "keys.bin");
-    if((mf = mapped_file_create(filename, 65536)) == NULL)
-        goto _err3;
+        lock_release_shared(&self->lock);
 
-    keys_hdr.magic = MAGIC;
-    mapped_file_write(mf, &keys_hdr, sizeof(em_dict_keys_hdr_t));
+        if(ret != 0)
+            goto _fail;
+    }
 
-    self->keys = mf;
+    goto _err;
 
-    /* Create "values.bin" and write file header (initial size 65k). */
-    filename = path_combine(dirname, "values.bin");
-    if((mf = mapped_file_create(filename, 65536)) == NULL)
-        goto _err4;
+_fail:
+    Py_CLEAR(r);
 
-    values_hdr.magic = MAGIC;
-    mapped_file_write(mf, &values_hdr, sizeof(em_dict_values_hdr_t));
+_err:
+    PyMem_FREE(batch);
+    PyMem_FREE(ents);
+    Py_XDECREF(keys_seq);
+    return r;
+}
 
-    self->values = mf;
-    return 0;
 
-_err4:
-    mapped_file_unlink(self->keys);
-    mapped_file_close(self->keys);
 
-_err3:
-    mapped_file_unlink(self->index);
-    mapped_file_close(self->index);
+/* Remove the files copied in directory `dirname' by `em_dict_clone()'. */
+static void em_dict_remove_clone(const char *dirname)
+{
+    const char *filenames[] = {"index.bin", "classes.bin", "dict.bin"};
+    size_t i;
 
-_err2:
+    for(i = 0; i < sizeof(filenames) / sizeof(filenames[0]); i++)
+        rm_file(path_combine(dirname, filenames[i]));
     rm_dir(dirname);
-
-_err1:
-    PyErr_SetString(PyExc_RuntimeError, "Cannot open EMDict");
-    return -1;
 }
 
 
-/* Open existing external memory dictionary. */
-static int em_dict_open_existing(em_dict_t *self)
+/* Copy the files of `self' in new directory `dirname', except for "keys.bin"
+ * and "values.bin", which are frozen and added to the `*num_copiesp' copies at
+ * `*copiesp', to be copied once the lock of `self' is released (see
+ * `mapped_file_freeze()').
+ */
+static int em_dict_clone(em_dict_t *self, const char *dirname,
+        file_copy_t **copiesp, size_t *num_copiesp)
 {
-    mapped_file_t *mf;
-    em_dict_index_hdr_t *index_hdr;
-    em_dict_keys_hdr_t *keys_hdr;
-    em_dict_values_hdr_t *values_hdr;
-    size_t pos;
-    const char *dirname = self->dirname;
-    char *filename;
+    const char *filenames[] = {"index.bin", "classes.bin"};
+    mapped_file_t *mfs[] = {self->index, NULL};
+    size_t i, num_mfs = sizeof(mfs) / sizeof(mfs[0]);
 
-    /* Open and verify "index.bin". */
-    filename = path_combine(dirname, "index.bin");
-    if((mf = mapped_file_open(filename)) == NULL)
+    if(mk_dir(dirname) != 0)
         goto _err1;
 
-    self->index = mf;
-    index_hdr = mf->address;
+    if(self->classes != NULL)
+        mfs[num_mfs - 1] = self->classes->mf;
 
-    if(index_hdr->magic != MAGIC)
-        goto _err2;
+    for(i = 0; i < num_mfs; i++)
+    {
+        if(mfs[i] != NULL &&
+                mapped_file_clone(mfs[i], path_combine(dirname, filenames[i])) != 0)
+            goto _err2;
+    }
 
-    /* Open and verify "keys.bin". */
-    filename = path_combine(dirname, "keys.bin");
-    if((mf = mapped_file_open(filename)) == NULL)
+    if(compression_copy_dict(EM_COMMON(self), dirname) != 0)
         goto _err2;
 
-    self->keys = mf;
-    keys_hdr = mf->address;
-
-    pos = mapped_file_get_eof(mf);
-    if(keys_hdr->magic != MAGIC || mapped_file_seek(mf, pos, SEEK_SET) != 0)
-        goto _err3;
+    if(mapped_file_freeze(self->keys, path_combine(dirname, "keys.bin"),
+            copiesp, num_copiesp) != 0)
+        goto _err2;
 
-    /* Open and verify "values.bin". */
-    filename = path_combine(dirname, "values.bin");
-    if((mf = mapped_file_open(filename)) == NULL)
+    if(mapped_file_freeze(self->values, path_combine(dirname, "values.bin"),
+            copiesp, num_copiesp) != 0)
         goto _err3;
 
-    self->values = mf;
-    values_hdr = mf->address;
-
-    pos = mapped_file_get_eof(mf);
-    if(values_hdr->magic != MAGIC || mapped_file_seek(mf, pos, SEEK_SET) != 0)
-        goto _err4;
-
     return 0;
 
-_err4:
-    mapped_file_close(self->values);
-
 _err3:
-    mapped_file_close(self->keys);
+    mapped_file_thaw(self->keys);
 
 _err2:
-    mapped_file_close(self->index);
+    em_dict_remove_clone(dirname);
 
 _err1:
-    PyErr_SetString(PyExc_RuntimeError, "Cannot open EMDict");
     return -1;
 }
 
 
-/* Called by `em_dict_open()' and `em_dict_init()'. */
-static int em_dict_open_common(em_dict_t *self, PyObject *args, PyObject *kwargs)
+/* Copy the files of `self' in directory `dirname' and open the copy read-only.
+ * The copy is consistent, as modifications are blocked while "index.bin" is
+ * copied, and the rest of the files are frozen until copied, so that they keep
+ * holding whatever the copy of "index.bin" refers to. Copying is cheap on file
+ * systems that support sharing blocks between files.
+ */
+static PyObject *em_dict_snapshot(em_dict_t *self, PyObject *args)
 {
-    PyObject *pickler = NULL, *unpickler = NULL;
+    char *dirname;
+    file_copy_t *copies = NULL;
+    size_t num_copies = 0;
+    int shared, ret;
+    PyObject *snapshot_args, *snapshot_kwargs, *r = NULL;
 
-    char *dirname, *kwarr[] = {
-        "dirname",
-        "pickler",
-        "unpickler",
-        NULL
-    };
+    if(PyArg_ParseTuple(args, "s", &dirname) == 0)
+        goto _err1;
 
-    int ret = -1;
+    /* Nothing changes under read-only objects, so they're copied under a shared
+     * lock. Readers can't stop the writer from modifying the files.
+     */
+    shared = self->readonly || self->reader;
+    if(em_dict_lock(self, shared) != 0)
+        goto _err1;
 
-    if(kwargs)
+    if(self->reader)
     {
-        if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO", kwarr, &dirname,
-                &pickler, &unpickler) == 0)
-            goto _err;
+        PyErr_SetString(PyExc_RuntimeError, "EMDict is open in reader mode");
+        lock_release_shared(&self->lock);
+        goto _err1;
     }
+
+    ret = em_dict_clone(self, dirname, &copies, &num_copies);
+
+    if(shared)
+        lock_release_shared(&self->lock);
     else
-    {
-        if(PyArg_ParseTuple(args, "s", &dirname) == 0)
-            goto _err;
-    }
+        lock_release(&self->lock);
 
-    if((self->dirname = PyMem_MALLOC(strlen(dirname) + 1)) == NULL)
+    if(ret == 0)
     {
-        PyErr_NoMemory();
-        goto _err;
-    }
+        ret = mapped_file_copy_frozen(copies, num_copies);
 
-    strcpy(self->dirname, dirname);
+        /* Chunks freed meanwhile may now be reused, unless `self' was closed. */
+        lock_acquire(&self->lock);
+        if(self->is_open)
+        {
+            mapped_file_thaw(self->keys);
+            mapped_file_thaw(self->values);
+        }
+        lock_release(&self->lock);
 
-    if(pickler && valid_pickler(pickler, &self->pickle) == 0)
-        self->pickler = pickler;
+        if(ret != 0)
+            em_dict_remove_clone(dirname);
+    }
 
-    if(unpickler && valid_unpickler(unpickler, &self->unpickle) == 0)
-        self->unpickler = unpickler;
+    mapped_file_free_copies(copies, num_copies);
 
-    /* XXX: There's an obvious race condition here, should we care? */
-    if(access(self->dirname, F_OK) == 0)
-        ret = em_dict_open_existing(self);
-    else
-        ret = em_dict_create(self);
+    if(ret != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot create snapshot");
+        goto _err1;
+    }
 
-    if(ret >= 0)
-        self->is_open = 1;
+    if((snapshot_args = Py_BuildValue("(s)", dirname)) == NULL)
+        goto _err1;
 
-_err:
-    return ret;
-}
+    if((snapshot_kwargs = Py_BuildValue("{s:O}", "readonly", Py_True)) == NULL)
+        goto _err2;
 
+    if(self->pickler != NULL &&
+            PyDict_SetItemString(snapshot_kwargs, "pickler", self->pickler) != 0)
+        goto _err3;
 
-/* Open external memory dictionary. */
-static PyObject *em_dict_open(em_dict_t *self, PyObject *args)
-{
-    PyObject *r = NULL;
+    if(self->unpickler != NULL &&
+            PyDict_SetItemString(snapshot_kwargs, "unpickler", self->unpickler) != 0)
+        goto _err3;
 
-    if(self->is_open)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "EMDict already open");
-        goto _err;
-    }
+    r = PyObject_Call((PyObject *)Py_TYPE(self), snapshot_args, snapshot_kwargs);
 
-    if(em_dict_open_common(self, args, NULL) != 0)
-        goto _err;
+_err3:
+    Py_DECREF(snapshot_kwargs);
 
-    Py_INCREF(Py_True);
-    r = Py_True;
+_err2:
+    Py_DECREF(snapshot_args);
 
-_err:
+_err1:
     return r;
 }
 
 
-/* Synchronize and close an external memory dictionary. */
-static PyObject *em_dict_close(em_dict_t *self, PyObject *Py_UNUSED(args))
-{
-    mapped_file_t *index = self->index;
-    mapped_file_t *keys = self->keys;
-    mapped_file_t *values = self->values;
-
-    if(self->is_open)
-    {
-        /* Sync and close "index.bin". */
-        mapped_file_sync(index, 0, index->size);
-        mapped_file_close(index);
 
-        /* Sync, truncate and close "keys.bin". */
-        mapped_file_sync(keys, 0, keys->size);
-        mapped_file_truncate(keys, mapped_file_get_eof(keys));
-        mapped_file_close(keys);
+/* Standard interface to `items()', `keys()' and `values()'. */
 
-        /* Sync, truncate and close "values.bin". */
-        mapped_file_sync(values, 0, values->size);
-        mapped_file_truncate(values, mapped_file_get_eof(values));
-        mapped_file_close(values);
+/* Initialize and return an `EMDict' iterator of type `type'. Keyword argument
+ * `prefetch' sets the number of used slots whose keys and values are read in
+ * ahead of time, and `reorder' makes the iterator return each such batch in
+ * the order the values, or keys, appear on disk. If `args' is `NULL', default
+ * values are used.
+ */
+static PyObject *em_dict_iterator_new(em_dict_t *self, char type,
+        PyObject *args, PyObject *kwargs)
+{
+    Py_ssize_t prefetch = 0;
+    int reorder = 0;
+    char *kwarr[] = {"prefetch", "reorder", NULL};
+    chunk_ref_t *batch = NULL;
+    em_dict_iter_t *iter = NULL;
+
+    if(args != NULL && PyArg_ParseTupleAndKeywords(args, kwargs, "|ni", kwarr,
+            &prefetch, &reorder) == 0)
+        goto _err;
 
-        PyMem_FREE(self->dirname);
-        self->is_open = 0;
+    if(prefetch < 0 || (reorder && prefetch == 0))
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefetch window");
+        goto _err;
     }
 
-    Py_RETURN_NONE;
-};
-
-
-
-/* Standard interface to `items()', `keys()' and `values()'. */
+    if(prefetch > 0 && (batch = PyMem_NEW(chunk_ref_t, prefetch)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
 
-/* Initialize and return an `EMDict' iterator of type `type'. */
-static PyObject *em_dict_iterator_new(em_dict_t *self, char type)
-{
-    em_dict_iter_t *iter;
+    if(em_dict_lock(self, 1) != 0)
+        goto _err;
 
     if((iter = PyObject_New(em_dict_iter_t, &em_dict_iter_type)) != NULL)
     {
@@ -736,37 +2867,49 @@ static PyObject *em_dict_iterator_new(em_dict_t *self, char type)
         /* XXX: Maybe initialize `max_pos' to index file's `used' member? */
         iter->em_dict = self;
         iter->pos = 0;
-        iter->max_pos = ((em_dict_index_hdr_t *)self->index)->mask + 1;
+        iter->max_pos = ((em_dict_index_hdr_t *)self->index->address)->mask + 1;
+        iter->readahead = 0;
+        iter->prefetch = (size_t)prefetch;
+        iter->prefetched = 0;
+        iter->batch = batch;
+        iter->batch_len = 0;
+        iter->batch_pos = 0;
+        iter->reorder = reorder != 0;
         iter->type = type;
+        batch = NULL;
     }
     else
         PyErr_SetString(PyExc_RuntimeError, "Failed to initialize iterator");
 
+    lock_release_shared(&self->lock);
+
+_err:
+    PyMem_FREE(batch);
     return (PyObject *)iter;
 }
 
 /* Get an iterator for key-value tuples. */
-static PyObject *em_dict_items(em_dict_t *self, PyObject *Py_UNUSED(args))
+static PyObject *em_dict_items(em_dict_t *self, PyObject *args, PyObject *kwargs)
 {
-    return em_dict_iterator_new(self, EM_DICT_ITER_ITEMS);
+    return em_dict_iterator_new(self, EM_DICT_ITER_ITEMS, args, kwargs);
 }
 
 /* Get an iterator for keys. */
-static PyObject *em_dict_keys(em_dict_t *self, PyObject *Py_UNUSED(args))
+static PyObject *em_dict_keys(em_dict_t *self, PyObject *args, PyObject *kwargs)
 {
-    return em_dict_iterator_new(self, EM_DICT_ITER_KEYS);
+    return em_dict_iterator_new(self, EM_DICT_ITER_KEYS, args, kwargs);
 }
 
 /* Get an iterator for values. */
-static PyObject *em_dict_values(em_dict_t *self, PyObject *Py_UNUSED(args))
+static PyObject *em_dict_values(em_dict_t *self, PyObject *args, PyObject *kwargs)
 {
-    return em_dict_iterator_new(self, EM_DICT_ITER_VALUES);
+    return em_dict_iterator_new(self, EM_DICT_ITER_VALUES, args, kwargs);
 }
 
 /* Get default iterator for `__iter__()'. */
 static PyObject *em_dict_iter(em_dict_t *self)
 {
-    return em_dict_iterator_new(self, EM_DICT_ITER_KEYS);
+    return em_dict_iterator_new(self, EM_DICT_ITER_KEYS, NULL, NULL);
 }
 
 
@@ -775,6 +2918,8 @@ static int em_dict_init(em_dict_t *self, PyObject *args, PyObject *kwargs)
 {
     int ret = -1;
 
+    lock_acquire(&self->lock);
+
     if(self->is_open)
     {
         PyErr_SetString(PyExc_RuntimeError, "EMDict already open");
@@ -787,14 +2932,42 @@ static int em_dict_init(em_dict_t *self, PyObject *args, PyObject *kwargs)
     ret = 0;
 
 _err:
+    lock_release(&self->lock);
     return ret;
 }
 
 
+/* Called via `tp_new()'. */
+static PyObject *em_dict_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwargs)
+{
+    em_dict_t *self;
+
+    if((self = (em_dict_t *)PyType_GenericNew(type, args, kwargs)) == NULL)
+        goto _err;
+
+    flusher_init(&self->flusher);
+
+    if(lock_init(&self->lock) != 0 || wal_init(&self->wal) != 0)
+    {
+        Py_DECREF(self);
+        self = NULL;
+    }
+
+_err:
+    return (PyObject *)self;
+}
+
+
 /* Called via `tp_dealloc()'. */
 static void em_dict_dealloc(em_dict_t *self)
 {
-    em_dict_close(self, NULL);
+    if(self->lock.initialized)
+    {
+        em_dict_close(self, NULL);
+        lock_fini(&self->lock);
+    }
+    wal_fini(&self->wal);
     PyObject_Del(self);
 }
 
@@ -823,9 +2996,15 @@ static PyMappingMethods em_dict_mapping_proto =
 static PyMethodDef em_dict_methods[] =
 {
     M_VARARGS("open", em_dict_open),
-    M_NOARGS("items", em_dict_items),
-    M_NOARGS("keys", em_dict_keys),
-    M_NOARGS("values", em_dict_values),
+    M_KWARGS("items", em_dict_items),
+    M_KWARGS("keys", em_dict_keys),
+    M_KWARGS("values", em_dict_values),
+    M_NOARGS("train_dictionary", em_dict_train_dictionary),
+    M_NOARGS("commit", em_dict_commit),
+    M_KWARGS("flush", em_dict_flush),
+    M_KWARGS("advise", em_dict_advise),
+    M_VARARGS("get_many", em_dict_get_many),
+    M_VARARGS("snapshot", em_dict_snapshot),
     M_NOARGS("close", em_dict_close),
     M_NULL
 };
@@ -850,7 +3029,7 @@ static PyTypeObject em_dict_type =
     .tp_iter = (getiterfunc)em_dict_iter,
     .tp_iternext = (iternextfunc)em_dict_iter_iternext,
     .tp_init = (initproc)em_dict_init,
-    .tp_new = PyType_GenericNew
+    .tp_new = em_dict_new
 };
 
 
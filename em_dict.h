@@ -4,6 +4,9 @@
 #include <Python.h>
 
 #include "mapped_file.h"
+#include "lock.h"
+#include "wal.h"
+#include "flusher.h"
 
 #define PERTURB_SHIFT 5
 
@@ -11,6 +14,12 @@
 #define EM_DICT_ITER_KEYS   1
 #define EM_DICT_ITER_VALUES 2
 
+/* Number of slots iterators read ahead of their position at a time. */
+#define EM_DICT_READAHEAD (1 << 14)
+
+/* Number of keys `get_many()' looks up at a time. */
+#define EM_DICT_BATCH 256
+
 
 /* In-file header; "index.bin" begins with this structure. */
 typedef struct em_dict_index_hdr
@@ -18,16 +27,52 @@ typedef struct em_dict_index_hdr
     uint64_t magic;           /* Memory mapped file magic */
     size_t used;              /* Number of used hash slots */
     size_t mask;              /* Hash table size mask */
+    size_t generation;        /* Bumped when files are resized or replaced */
+    size_t seq;               /* Odd while the writer modifies the index */
+    size_t deleted;           /* Number of deleted hash slots */
+    size_t flags;             /* Format of the index, `INDEX_XXX' constants */
 } em_dict_index_hdr_t;
 
+/* Size of the header above in format version `v' (see "common.h"). */
+#define EM_DICT_INDEX_HDR_SIZE(v) \
+    (sizeof(uint64_t) + (2 + ((v) < 3 ? (v) : 3) + ((v) >= 5)) * sizeof(size_t))
+
 /* In-file header; each entry in "index.bin" has the following format. */
 typedef struct em_dict_index_ent
 {
     Py_ssize_t hash;          /* Hash value of index entry */
     size_t key_pos;           /* Offset of key object in "keys.bin" */
-    size_t value_pos;         /* Offset of value object in "values.bin" */
+    size_t value_pos;         /* Offset of value object in "values.bin", or
+                                 inline value, see `IS_INLINE()' */
 } em_dict_index_ent_t;
 
+/* Value position of deleted entries, which have no key. It's never a chunk
+ * position, and only entries with keys hold inline values.
+ */
+#define EM_DICT_DELETED 1
+
+/* Format of entries in "index.bin" if `INDEX_COMPACT' is set. Only the low 32
+ * bits of hash values are kept, and lookups compare and probe with those.
+ */
+typedef struct em_dict_compact_ent
+{
+    uint32_t hash;            /* Low bits of hash value of index entry */
+    uint32_t key_pos;         /* `COMPACT_POS()' of key object offset */
+    uint32_t value_pos;       /* `COMPACT_POS()' of value object offset, or
+                                 `COMPACT_VALUE_POS()' with `INDEX_INLINE' */
+} em_dict_compact_ent_t;
+
+/* If `INDEX_RECORDS' is set, each key is kept in "values.bin" along with its
+ * value, in a single chunk, so that looking up a key takes a single access to
+ * "values.bin" rather than one to "keys.bin" and another to "values.bin".
+ * Entries' `key_pos' is then the offset of the record, and `value_pos' is the
+ * same offset, or an inline value, in which case the record holds the key only.
+ */
+typedef struct em_dict_record_hdr
+{
+    uint32_t key_size;        /* Size of marshalled key following this header */
+} em_dict_record_hdr_t;
+
 
 /* In-file header; "keys.bin" begins with this structure. */
 typedef struct em_dict_keys_hdr
@@ -36,7 +81,7 @@ typedef struct em_dict_keys_hdr
 } em_dict_keys_hdr_t;
 
 
-/* In-file header; "values.bin" begins with this structure. */
+/* In-file header; each segment of "values.bin" begins with this structure. */
 typedef struct em_dict_values_hdr
 {
     uint64_t magic;           /* Memory mapped file magic */
@@ -53,11 +98,28 @@ typedef struct em_dict
     PyObject *pickle;
     PyObject *unpickler;
     PyObject *unpickle;
+    int compression;
+    struct lz4_dict *dict;
+    struct class_table *classes;
     char *dirname;            /* Directory holding memory mapped files */
     mapped_file_t *index;     /* Memory mapped file for indeces */
+    size_t index_hdr_size;    /* Size of the header of "index.bin" */
     mapped_file_t *keys;      /* Memory mapped file for keys */
     mapped_file_t *values;    /* Memory mapped file for values */
     char is_open;             /* Non-zero if `EMDict' is open */
+    char readonly;            /* Non-zero if opened in read-only mode */
+    char reader;              /* Non-zero if opened in reader mode */
+    char compact;             /* Non-zero if "index.bin" has compact entries */
+    char compact_chunks;      /* Non-zero if data files have compact chunks */
+    char inline_values;       /* Non-zero if small values are kept in "index.bin" */
+    char records;             /* Non-zero if keys are kept in records, see above */
+    size_t generation;        /* Generation of "index.bin" last seen by reader */
+    lock_t lock;              /* Serializes access to the object */
+    wal_t wal;                /* Write-ahead log, unless durability is "none" */
+    flusher_t flusher;        /* Background thread, if enabled */
+    char write_back;          /* Non-zero if the flusher starts write back */
+    size_t memory_budget;     /* Bytes allowed to stay resident, 0 if unlimited */
+    size_t evict_hand;        /* Next block of "values.bin" to evict */
 } em_dict_t;
 
 
@@ -68,6 +130,13 @@ typedef struct em_dict_iter
     em_dict_t *em_dict;       /* `EMDict' object this iterator refers to */
     size_t pos;               /* Current iterator position */
     size_t max_pos;           /* Maximum iterator position */
+    size_t readahead;         /* Slots up to this position have been read ahead */
+    size_t prefetch;          /* Number of used slots to prefetch, 0 if disabled */
+    size_t prefetched;        /* Slots up to this position have been prefetched */
+    chunk_ref_t *batch;       /* Used slots prefetched, ordered by chunk position */
+    size_t batch_len;         /* Number of slots in `batch' */
+    size_t batch_pos;         /* Next slot in `batch' to return when reordering */
+    char reorder;             /* Non-zero if batches are returned in disk order */
     char type;                /* Iterator type, `EM_DIC_ITER_XXX' constants */
 } em_dict_iter_t;
 
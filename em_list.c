@@ -8,32 +8,48 @@
 
 #include "util.h"
 #include "common.h"
+#include "marshaller.h"
 #include "mapped_file.h"
+#include "compression.h"
+#include "class_table.h"
 #include "em_list.h"
 
 
-#define EM_LIST_E2S(x) \
-    (sizeof(em_list_index_hdr_t) + (x) * sizeof(em_list_index_ent_t))
+/* Size of entries in "index.bin", compact or not. */
+#define EM_LIST_ENT_SIZE(compact) \
+    ((compact) ? sizeof(em_list_compact_ent_t) : sizeof(em_list_index_ent_t))
 
-#define EM_LIST_S2E(x) \
-    (((x) - sizeof(em_list_index_hdr_t)) / sizeof(em_list_index_ent_t))
+/* Entries of "index.bin" follow its header, whose size depends on the format
+ * version (see `EM_LIST_INDEX_HDR_SIZE()').
+ */
+#define EM_LIST_E2S(self, x) \
+    ((self)->index_hdr_size + (x) * EM_LIST_ENT_SIZE((self)->compact))
+
+#define EM_LIST_S2E(self, x) \
+    (((x) - (self)->index_hdr_size) / EM_LIST_ENT_SIZE((self)->compact))
 
 
 
 /* Functions for handling index entries in "index.bin". */
 
-/* Gets the "index.bin" entry at index `i'. */
-static int em_list_get_entry(mapped_file_t *mf, em_list_index_ent_t *ent,
-        size_t i)
+/* Reads the "index.bin" entry at index `i' in `*ent'. Returns -1 if it's out
+ * of bounds.
+ */
+static int em_list_get_entry(em_list_t *self, size_t i, em_list_index_ent_t *ent)
 {
-    size_t size = sizeof(em_list_index_ent_t);
+    void *data;
     int ret = -1;
 
-    if(mapped_file_seek(mf, EM_LIST_E2S(i), SEEK_SET) != 0)
+    if((data = mapped_file_ptr(self->index, EM_LIST_E2S(self, i),
+            EM_LIST_ENT_SIZE(self->compact))) == NULL)
         goto _err;
 
-    if(mapped_file_read(mf, ent, size) != (ssize_t)size)
-        goto _err;
+    if(self->compact && self->inline_values)
+        ent->value_pos = EXPAND_VALUE_POS(((em_list_compact_ent_t *)data)->value_pos);
+    else if(self->compact)
+        ent->value_pos = EXPAND_POS(((em_list_compact_ent_t *)data)->value_pos);
+    else
+        memcpy(ent, data, sizeof(em_list_index_ent_t));
 
     ret = 0;
 
@@ -43,19 +59,168 @@ _err:
 
 
 /* Sets the "index.bin" entry at index `i'. */
-static int em_list_set_entry(mapped_file_t *mf, em_list_index_ent_t *ent,
+static int em_list_set_entry(em_list_t *self, em_list_index_ent_t *ent,
         size_t i)
 {
-    size_t size = sizeof(em_list_index_ent_t);
+    em_list_compact_ent_t compact_ent;
+    size_t size = EM_LIST_ENT_SIZE(self->compact);
+    void *data = ent;
+    int ret = -1;
+
+    if(self->compact)
+    {
+        if(self->inline_values)
+            compact_ent.value_pos = COMPACT_VALUE_POS(ent->value_pos);
+        else
+            compact_ent.value_pos = COMPACT_POS(ent->value_pos);
+        data = &compact_ent;
+    }
+
+    if(mapped_file_pwrite(self->index, data, size, EM_LIST_E2S(self, i)) !=
+            (ssize_t)size)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+
+/* Readers and the writer of an `EMList' in different processes coordinate the
+ * same way as those of an `EMDict'; see "em_dict.c". The writer's lock is held
+ * on "values.bin".
+ */
+
+/* Sum of the sizes of the files of `self'. */
+static size_t em_list_layout(em_list_t *self)
+{
+    size_t layout = self->index->size + self->values->size;
+
+    if(self->classes != NULL)
+        layout += mapped_file_get_eof(self->classes->mf);
+    return layout;
+}
+
+
+/* Let readers know that the files of `self' have changed. */
+static void em_list_bump_generation(em_list_t *self)
+{
+    ((em_list_index_hdr_t *)self->index->address)->generation += 1;
+}
+
+
+/* Re-open "index.bin" and re-map the rest of the files of reader `self', after
+ * the writer has modified them. Must be called with the lock held exclusively.
+ */
+static int em_list_refresh(em_list_t *self)
+{
+    em_list_index_hdr_t *index_hdr;
+    mapped_file_t *mf;
+    char *filename;
     int ret = -1;
 
-    if(mapped_file_seek(mf, EM_LIST_E2S(i), SEEK_SET) != 0)
+    index_hdr = self->index->address;
+    if(index_hdr->generation == self->generation)
+        goto _ok;
+
+    filename = path_combine(self->dirname, "index.bin");
+    if((mf = mapped_file_open(filename, 1, self->index->options)) == NULL)
+        goto _err;
+
+    index_hdr = mf->address;
+    if(mf->size < sizeof(em_list_index_hdr_t) || index_hdr->magic != INDEX_MAGIC)
+    {
+        mapped_file_close(mf);
+        goto _err;
+    }
+
+    mapped_file_close(self->index);
+    self->index = mf;
+    self->generation = index_hdr->generation;
+
+    if(mapped_file_remap(self->values) != 0)
+        goto _err;
+
+    if(self->dict == NULL &&
+            compression_load_dict(EM_COMMON(self), self->dirname) != 0)
         goto _err;
 
-    if(mapped_file_write(mf, ent, size) != (ssize_t)size)
+    if(self->classes != NULL)
+    {
+        if(class_table_refresh(self->classes) != 0)
+            goto _err;
+    }
+    else if((self->classes = class_table_open(self->dirname, 0, 1)) == NULL &&
+            PyErr_Occurred() != NULL)
         goto _err;
 
+_ok:
+    ret = 0;
+
+_err:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot refresh EMList");
+    return ret;
+}
+
+
+/* Acquire the lock of `self', in shared mode if `shared' is non-zero, and make
+ * sure it's open. Readers may only take it in shared mode, and have their files
+ * refreshed first, if the writer has modified them.
+ */
+static int em_list_lock(em_list_t *self, int shared)
+{
+    int ret = -1;
+
+    for(;;)
+    {
+        if(shared)
+            lock_acquire_shared(&self->lock);
+        else
+            lock_acquire(&self->lock);
+
+        if(self->is_open == 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "EMList not open");
+            goto _unlock;
+        }
+
+        if(self->reader == 0 && self->readonly == 0)
+            break;
+
+        if(shared == 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, self->readonly ?
+                "EMList is open in read-only mode" : "EMList is open in reader mode");
+            goto _unlock;
+        }
+
+        /* Nothing changes under a read-only `EMList'. */
+        if(self->readonly ||
+                ((em_list_index_hdr_t *)self->index->address)->generation ==
+                self->generation)
+            break;
+
+        /* Files are re-mapped, so upgrade to an exclusive lock and retry. */
+        lock_release_shared(&self->lock);
+        lock_acquire(&self->lock);
+        ret = self->is_open ? em_list_refresh(self) : 0;
+        lock_release(&self->lock);
+
+        if(ret != 0)
+            goto _err;
+    }
+
     ret = 0;
+    goto _err;
+
+_unlock:
+    if(shared)
+        lock_release_shared(&self->lock);
+    else
+        lock_release(&self->lock);
 
 _err:
     return ret;
@@ -63,12 +228,89 @@ _err:
 
 
 
+/* Start reading from `self'. See `em_list_read_retry()'. */
+static size_t em_list_read_begin(em_list_t *self)
+{
+    /* Read-only opens may be looking at an index of an earlier version, which
+     * has no sequence counter.
+     */
+    if(self->reader == 0)
+        return 0;
+
+    return seq_read_begin(&((em_list_index_hdr_t *)self->index->address)->seq);
+}
+
+
+/* Check if a reader has to read again, because the writer has modified the
+ * index, or the files, since `em_list_read_begin()' returned `seq'.
+ */
+static int em_list_read_retry(em_list_t *self, size_t seq)
+{
+    em_list_index_hdr_t *index_hdr = self->index->address;
+
+    return self->reader && (seq_read_retry(&index_hdr->seq, seq) ||
+        index_hdr->generation != self->generation);
+}
+
+
+
+/* Give kernel a hint about the type of access we are going to perform on items
+ * [`start', `end') of `self'; on their index entries, and on the part of
+ * "values.bin" from their first to their last value. The latter is skipped if
+ * longer than `max_span' bytes, unless it's 0. Called with the list's lock
+ * held.
+ */
+static int em_list_advise_items(em_list_t *self, size_t start, size_t end,
+        int advice, size_t max_span)
+{
+    em_list_index_ent_t ent;
+    size_t i, value_min = SIZE_MAX, value_max = 0;
+    int ret = 0;
+
+    if(mapped_file_advise(self->index, EM_LIST_E2S(self, start),
+            EM_LIST_E2S(self, end) - EM_LIST_E2S(self, start), advice) != 0)
+        ret = -1;
+
+    for(i = start; i < end; i++)
+    {
+        if(em_list_get_entry(self, i, &ent) != 0)
+            break;
+
+        if(ent.value_pos == 0 || IS_INLINE(ent.value_pos))
+            continue;
+
+        if(ent.value_pos < value_min)
+            value_min = ent.value_pos;
+        if(ent.value_pos > value_max)
+            value_max = ent.value_pos;
+    }
+
+    if(value_min <= value_max &&
+            (max_span == 0 || value_max - value_min <= max_span) &&
+            mapped_file_advise(self->values, value_min,
+                value_max - value_min + 1, advice) != 0)
+        ret = -1;
+
+    return ret;
+}
+
+
+
 /* Mapping protocol implementation. */
 
 /* Callback for Python's `len()'. */
 static Py_ssize_t em_list_len(em_list_t *self)
 {
-    return ((em_list_index_hdr_t *)(self->index->address))->used;
+    Py_ssize_t ret = -1;
+
+    if(em_list_lock(self, 1) != 0)
+        goto _err;
+
+    ret = ((em_list_index_hdr_t *)(self->index->address))->used;
+    lock_release_shared(&self->lock);
+
+_err:
+    return ret;
 }
 
 
@@ -86,14 +328,19 @@ static PyObject *em_list_getitem_internal(em_list_t *self, Py_ssize_t index)
         goto _err;
     }
 
-    if(em_list_get_entry(self->index, &ent, (size_t)index) != 0)
+    if(em_list_get_entry(self, (size_t)index, &ent) != 0)
     {
         PyErr_SetString(PyExc_RuntimeError, "Failed to read index entry");
         goto _err;
     }
 
     value_pos = ent.value_pos;
-    if(value_pos != 0)
+    if(IS_INLINE(value_pos))
+    {
+        if((r = unmarshal_inline(EM_COMMON(self), value_pos)) == NULL)
+            PyErr_SetString(PyExc_RuntimeError, "Failed to unmarshal value object");
+    }
+    else if(value_pos != 0)
     {
         if((r = mapped_file_unmarshal_object(EM_COMMON(self), self->values, value_pos)) == NULL)
             PyErr_SetString(PyExc_RuntimeError, "Failed to unmarshal value object");
@@ -109,232 +356,1717 @@ _err:
 }
 
 
-/* Retrieve item from external memory list.
- *
- * XXX: Support slice objects and negative indices?
- */
-static PyObject *em_list_getitem(em_list_t *self, PyObject *key)
+/* Convert `key' to an index in `*indexp'. */
+static int em_list_key_to_index(PyObject *key, Py_ssize_t *indexp)
 {
     Py_ssize_t index;
-    PyObject *r = NULL;
+    int ret = -1;
 
     /* Python 3 supports only long integers. */
 #if PY_MAJOR_VERSION < 3
     if(PyInt_CheckExact(key))
-    {
         index = PyInt_AsSsize_t(key);
-        r = em_list_getitem_internal(self, index);
-    }
     else if(PyLong_CheckExact(key))
 #else
     if(PyLong_CheckExact(key))
 #endif
-    {
         index = PyLong_AsSsize_t(key);
-        r = em_list_getitem_internal(self, index);
-    }
     else
+    {
         PyErr_SetString(PyExc_TypeError, "Invalid key object type");
+        goto _err;
+    }
 
-    return r;
+    if(index == -1 && PyErr_Occurred())
+        goto _err;
+
+    *indexp = index;
+    ret = 0;
+
+_err:
+    return ret;
 }
 
 
-/* Does the hard work of actually inserting an item in the external memory list. */
-static int em_list_setitem_internal(em_list_t *self, Py_ssize_t index,
-        PyObject *value)
+/* Read the `num_items' items at `indices' and store new references to them in
+ * `items', using `batch', an array of `num_items' elements, as scratch space.
+ * The chunks of their values are read in as a batch, so that the disk serves
+ * many reads at once instead of one per item. Called with the list's lock
+ * held.
+ */
+static int em_list_getitem_many(em_list_t *self, Py_ssize_t *indices,
+        size_t num_items, chunk_ref_t *batch, PyObject **items)
 {
+    em_list_index_hdr_t *index_hdr = self->index->address;
     em_list_index_ent_t ent;
-    ssize_t value_pos;
+    size_t i, j;
     int ret = -1;
 
-    if(em_list_get_entry(self->index, &ent, (size_t)index) != 0)
+    for(i = 0; i < num_items; i++)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to read index entry");
-        goto _err;
+        if(indices[i] < 0 || (size_t)indices[i] >= index_hdr->used)
+        {
+            PyErr_SetString(PyExc_IndexError, "Invalid index");
+            goto _err;
+        }
+
+        /* Inline values are read along with the index. */
+        if(em_list_get_entry(self, (size_t)indices[i], &ent) != 0 ||
+                IS_INLINE(ent.value_pos))
+            ent.value_pos = 0;
+
+        batch[i].pos = ent.value_pos;
+        batch[i].index = i;
     }
 
-    if(ent.value_pos != 0)
-        mapped_file_free_chunk(self->values, ent.value_pos);
+    mapped_file_prefetch_chunks(self->values, batch, num_items);
 
-    if((value_pos = mapped_file_marshal_object(EM_COMMON(self), self->values, value)) < 0)
+    /* Unmarshal the values in the order they appear on disk. */
+    for(i = 0; i < num_items; i++)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to marshal value object");
-        goto _err;
+        j = batch[i].index;
+        if((items[j] = em_list_getitem_internal(self, indices[j])) == NULL)
+            goto _err;
     }
 
-    ent.value_pos = (size_t)value_pos;
-    if(em_list_set_entry(self->index, &ent, (size_t)index) != 0)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to write index entry");
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Retrieve item from external memory list.
+ *
+ * XXX: Support slice objects and negative indices?
+ */
+static PyObject *em_list_getitem(em_list_t *self, PyObject *key)
+{
+    Py_ssize_t index;
+    size_t seq;
+    PyObject *r = NULL;
+
+    if(em_list_key_to_index(key, &index) != 0)
         goto _err;
+
+    if(em_list_lock(self, 1) != 0)
+        goto _err;
+
+    /* Readers retry if the writer modified the index meanwhile. */
+    for(;;)
+    {
+        seq = em_list_read_begin(self);
+        r = em_list_getitem_internal(self, index);
+
+        if(em_list_read_retry(self, seq) == 0)
+            break;
+
+        Py_CLEAR(r);
+        PyErr_Clear();
+        lock_release_shared(&self->lock);
+
+        if(em_list_lock(self, 1) != 0)
+            goto _err;
     }
 
-    ret = 0;
+    lock_release_shared(&self->lock);
 
 _err:
+    return r;
+}
+
+
+/* Write back the parts of the files of `self' modified since they were last
+ * synchronized to disk, or just schedule write back if `async' is non-zero.
+ * The index header is updated in place by every operation, so it's always
+ * written back.
+ */
+static int em_list_sync(em_list_t *self, int async)
+{
+    int ret = 0;
+
+    mapped_file_mark_dirty(self->index, 0, sizeof(em_list_index_hdr_t));
+
+    if(mapped_file_flush(self->index, async) != 0 ||
+            mapped_file_flush(self->values, async) != 0 ||
+            (async == 0 && self->classes != NULL &&
+                class_table_sync(self->classes) != 0))
+        ret = -1;
     return ret;
 }
 
 
-/* Sanitize index and insert item in external memory list. */
-static int em_list_setitem_safe(em_list_t *self, Py_ssize_t index, PyObject *value)
+/* Synchronize the files of `self' to disk, save a copy of "index.bin" in
+ * "index.ckpt", which recovery starts from (see "wal.c"), and empty its write-
+ * ahead log. Chunks freed since the previous checkpoint may be reused then.
+ */
+static int em_list_checkpoint(em_list_t *self)
 {
-    em_list_index_hdr_t *index_hdr;
     int ret = -1;
 
-    index_hdr = self->index->address;
-    if(index < 0)
-        index += index_hdr->used;
+    msgf("EMList: Checkpoint");
 
-    if(index < 0 || (size_t)index >= index_hdr->used)
+    if(em_list_sync(self, 0) != 0 || mapped_file_save(self->index,
+            path_combine(self->dirname, "index.ckpt")) != 0)
     {
-        PyErr_SetString(PyExc_IndexError, "List index out of range");
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMList");
         goto _err;
     }
 
-    ret = em_list_setitem_internal(self, index, value);
+    if(wal_reset(&self->wal) != 0)
+        goto _err;
+
+    mapped_file_release_chunks(self->values);
+
+    ret = 0;
 
 _err:
     return ret;
 }
 
 
-/* Insert item in external memory list.
- *
- * XXX: Support slice objects and negative indices?
+/* Remove "index.ckpt" of `self', once its files have been synchronized to disk
+ * and "index.bin" can be relied upon on its own, and empty its write-ahead log.
  */
-static int em_list_setitem(em_list_t *self, PyObject *key, PyObject *value)
+static int em_list_drop_checkpoint(em_list_t *self)
 {
-    Py_ssize_t index;
     int ret = -1;
 
-    /* Python 3 supports only long integers. */
-#if PY_MAJOR_VERSION < 3
-    if(PyInt_CheckExact(key))
-    {
-        index = PyInt_AsSsize_t(key);
-        ret = em_list_setitem_safe(self, index, value);
-    }
-    else if(PyLong_CheckExact(key))
-#else
-    if(PyLong_CheckExact(key))
-#endif
+    rm_file(path_combine(self->dirname, "index.ckpt"));
+
+    if(sync_file(self->dirname) != 0)
     {
-        index = PyLong_AsSsize_t(key);
-        ret = em_list_setitem_safe(self, index, value);
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMList");
+        goto _err;
     }
-    else
-        PyErr_SetString(PyExc_TypeError, "Invalid index type");
 
+    ret = wal_reset(&self->wal);
+
+_err:
     return ret;
 }
 
 
-
-static int em_list_resize(em_list_t *self)
+/* If the last writer of `self' didn't close it, "index.bin" may be in any state
+ * between the last checkpoint and the crash; replace it with "index.ckpt", on
+ * top of which the write-ahead log is replayed. Readers still mapping the old
+ * "index.bin" are told to re-open it. Called with the writer's lock held.
+ */
+static int em_list_restore_index(em_list_t *self)
 {
-    size_t capacity, new_capacity, new_size;
-    char *filename;
     mapped_file_t *mf;
-    em_list_index_hdr_t *index_hdr, *new_index_hdr;
+    em_list_index_hdr_t *index_hdr;
 
-    /* Get a reference to the current index file header. */
-    index_hdr = (em_list_index_hdr_t *)self->index->address;
+    int ret = -1;
 
-    /* Compute new capacity and size in bytes and check for overflows. */
-    capacity = index_hdr->capacity;
+    if(file_exists(path_combine(self->dirname, "index.ckpt")) == 0)
+        goto _ok;
 
-    if(capacity == 0)
-        new_capacity = 1;
-    else
-        new_capacity = capacity << 1;
-    new_size = EM_LIST_E2S(new_capacity);
+    msgf("EMList: Restoring checkpoint");
 
-    if(new_capacity < capacity || new_size < new_capacity)
+    if(file_exists(path_combine(self->dirname, "index.bin")) &&
+            (mf = mapped_file_open(path_combine(self->dirname, "index.bin"),
+                0, 0)) != NULL)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Integer overflow while resizing EMList");
-        goto _err1;
+        index_hdr = mf->address;
+        if(mf->size >= sizeof(em_list_index_hdr_t))
+            index_hdr->generation += 1;
+        mapped_file_close(mf);
     }
 
-    msgf("EMList: Resizing");
+    if((mf = mapped_file_open(path_combine(self->dirname, "index.ckpt"),
+            1, 0)) == NULL)
+        goto _err;
 
-    filename = path_combine(self->dirname, "index.bin.1");
-    if((mf = mapped_file_create(filename, new_size)) == NULL)
-        goto _err1;
+    ret = mapped_file_save(mf, path_combine(self->dirname, "index.bin"));
+    mapped_file_close(mf);
 
-    /* Copy old entries to the new external memory list. */
-    memcpy(mf->address, self->index->address, EM_LIST_E2S(capacity));
+    if(ret != 0)
+        goto _err;
 
-    msgf("EMList: Resize successful");
+_ok:
+    ret = 0;
 
-    filename = path_combine(self->dirname, "index.bin.0");
-    if(mapped_file_rename(self->index, filename) != 0)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Cannot rename old EMList index file");
-        goto _err2;
-    }
+_err:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot restore EMList checkpoint");
+    return ret;
+}
 
-    filename = path_combine(self->dirname, "index.bin");
-    if(mapped_file_rename(mf, filename) != 0)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Cannot rename new EMList index file");
-        goto _err2;
-    }
 
-    /* Populate new index file header. */
-    new_index_hdr = (em_list_index_hdr_t *)mf->address;
-    new_index_hdr->magic = MAGIC;
+/* Evict pages of "values.bin" until the resident size of `self' is within its
+ * memory budget. "index.bin", needed by every lookup, is left alone. Called with
+ * the object's lock held.
+ */
+static void em_list_enforce_budget(em_list_t *self)
+{
+    size_t resident;
+
+    resident = mapped_file_resident(self->index) +
+        mapped_file_resident(self->values);
+
+    if(resident > self->memory_budget)
+        mapped_file_evict(self->values, resident - self->memory_budget,
+            &self->evict_hand);
+}
+
+
+/* Called periodically by the background flusher of `self' to start write back
+ * of the pages modified since its last run, and to enforce its memory budget.
+ * Skips a run if `self' is busy, rather than stalling the thread modifying it.
+ */
+static int em_list_flusher(void *arg)
+{
+    em_list_t *self = arg;
+    int ret = 0;
+
+    if(lock_try_acquire(&self->lock) == 0)
+    {
+        if(self->is_open && self->write_back)
+            ret = em_list_sync(self, 1);
+        if(self->is_open && self->memory_budget > 0)
+            em_list_enforce_budget(self);
+        lock_release(&self->lock);
+    }
+    return ret;
+}
+
+
+/* Checkpoint `self' if "index.bin" was replaced by a resize, as it was never
+ * synchronized to disk, or if the write-ahead log has grown too long. Clears
+ * `*lsnp', which no longer needs to be committed, in that case.
+ */
+static int em_list_maybe_checkpoint(em_list_t *self, int resized, ssize_t *lsnp)
+{
+    int ret = 0;
+
+    if(self->wal.durability != DURABILITY_NONE &&
+            (resized || self->wal.pos >= WAL_CHECKPOINT_SIZE) &&
+            (ret = em_list_checkpoint(self)) == 0)
+        *lsnp = 0;
+    return ret;
+}
+
+
+/* Log the operation of storing marshalled value `value_str' at index `index' of
+ * `self'. See `wal_append()' for the return value.
+ */
+static ssize_t em_list_log(em_list_t *self, Py_ssize_t index,
+        PyObject *value_str)
+{
+    PyObject *index_obj, *key_str;
+
+    ssize_t ret = -1;
+
+    if(self->wal.durability == DURABILITY_NONE)
+    {
+        ret = 0;
+        goto _err1;
+    }
+
+    if((index_obj = PyLong_FromSsize_t(index)) == NULL)
+        goto _err1;
+
+    if((key_str = marshal(EM_COMMON(self), index_obj)) == NULL)
+        goto _err2;
+
+    ret = wal_append(&self->wal, EM_COMMON(self), WAL_OP_SET, key_str, value_str);
+    Py_DECREF(key_str);
+
+_err2:
+    Py_DECREF(index_obj);
+
+_err1:
+    return ret;
+}
+
+
+/* Does the hard work of actually inserting an item in the external memory list.
+ * The position of the record logged for the operation, if any, is stored in
+ * `*lsnp'.
+ */
+static int em_list_setitem_internal(em_list_t *self, Py_ssize_t index,
+        PyObject *value, ssize_t *lsnp)
+{
+    em_list_index_hdr_t *index_hdr;
+    em_list_index_ent_t ent;
+    ssize_t value_pos;
+    size_t old_value_pos, value_pos_max, layout = em_list_layout(self);
+    PyObject *value_str;
+    int inlined = 0, ret = -1;
+
+    if((value_str = marshal(EM_COMMON(self), value)) == NULL)
+        goto _err1;
+
+    /* Log the operation before applying it. */
+    if((*lsnp = em_list_log(self, index, value_str)) < 0)
+        goto _err2;
+
+    if(em_list_get_entry(self, (size_t)index, &ent) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to read index entry");
+        goto _err2;
+    }
+
+    old_value_pos = ent.value_pos;
+
+    /* Marshal the value in the index entry if it's small enough, in "values.bin"
+     * otherwise.
+     */
+    if(self->inline_values && (inlined = marshal_inline(EM_COMMON(self),
+            value_str, INLINE_SIZE_MAX(self->compact), &ent.value_pos)) < 0)
+        goto _err2;
+
+    if(inlined == 0)
+    {
+        if((value_pos = mapped_file_marshal_string_object(EM_COMMON(self),
+                self->values, value_str)) < 0)
+        {
+            if(PyErr_Occurred() == NULL)
+                PyErr_SetString(PyExc_RuntimeError, "Failed to marshal value object");
+            goto _err2;
+        }
+
+        /* Chunks that don't fit in a compact index are given back. */
+        value_pos_max = self->inline_values ? COMPACT_VALUE_POS_MAX : COMPACT_POS_MAX;
+        if(self->compact && (size_t)value_pos > value_pos_max)
+        {
+            mapped_file_free_chunk(self->values, (size_t)value_pos);
+            PyErr_SetString(PyExc_OverflowError, "EMList too large for compact index");
+            goto _err2;
+        }
+
+        ent.value_pos = (size_t)value_pos;
+    }
+
+    /* Let readers re-map grown files before they see the new entry. */
+    if(em_list_layout(self) != layout)
+        em_list_bump_generation(self);
+
+    /* Readers in other processes may be reading the old value object, so only
+     * free it while they are told to retry.
+     */
+    index_hdr = self->index->address;
+    seq_write_begin(&index_hdr->seq);
+
+    if(old_value_pos != 0 && !IS_INLINE(old_value_pos))
+        mapped_file_free_chunk(self->values, old_value_pos);
+
+    ret = em_list_set_entry(self, &ent, (size_t)index);
+
+    seq_write_end(&index_hdr->seq);
+
+    if(ret != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Failed to write index entry");
+
+_err2:
+    Py_DECREF(value_str);
+
+_err1:
+    return ret;
+}
+
+
+/* Sanitize index and insert item in external memory list. */
+static int em_list_setitem_safe(em_list_t *self, Py_ssize_t index,
+        PyObject *value, ssize_t *lsnp)
+{
+    em_list_index_hdr_t *index_hdr;
+    int ret = -1;
+
+    index_hdr = self->index->address;
+    if(index < 0)
+        index += index_hdr->used;
+
+    if(index < 0 || (size_t)index >= index_hdr->used)
+    {
+        PyErr_SetString(PyExc_IndexError, "List index out of range");
+        goto _err;
+    }
+
+    ret = em_list_setitem_internal(self, index, value, lsnp);
+
+_err:
+    return ret;
+}
+
+
+/* Insert item in external memory list.
+ *
+ * XXX: Support slice objects and negative indices?
+ */
+static int em_list_setitem(em_list_t *self, PyObject *key, PyObject *value)
+{
+    Py_ssize_t index;
+    ssize_t lsn = 0;
+    int ret = -1;
+
+    if(em_list_lock(self, 0) != 0)
+        goto _err;
+
+    /* Python 3 supports only long integers. */
+#if PY_MAJOR_VERSION < 3
+    if(PyInt_CheckExact(key))
+    {
+        index = PyInt_AsSsize_t(key);
+        ret = em_list_setitem_safe(self, index, value, &lsn);
+    }
+    else if(PyLong_CheckExact(key))
+#else
+    if(PyLong_CheckExact(key))
+#endif
+    {
+        index = PyLong_AsSsize_t(key);
+        ret = em_list_setitem_safe(self, index, value, &lsn);
+    }
+    else
+        PyErr_SetString(PyExc_TypeError, "Invalid index type");
+
+    if(ret == 0)
+        ret = em_list_maybe_checkpoint(self, 0, &lsn);
+
+    lock_release(&self->lock);
+
+    /* Wait for the log to reach the disk without holding the lock. */
+    if(ret == 0 && lsn > 0)
+        ret = wal_complete(&self->wal, (size_t)lsn);
+
+_err:
+    return ret;
+}
+
+
+
+static int em_list_resize(em_list_t *self)
+{
+    size_t capacity, new_capacity, new_size;
+    char *filename;
+    mapped_file_t *mf;
+    em_list_index_hdr_t *index_hdr, *new_index_hdr;
+
+    /* Get a reference to the current index file header. */
+    index_hdr = (em_list_index_hdr_t *)self->index->address;
+
+    /* Compute new capacity and size in bytes and check for overflows. */
+    capacity = index_hdr->capacity;
+
+    if(capacity == 0)
+        new_capacity = 1;
+    else
+        new_capacity = capacity << 1;
+    new_size = EM_LIST_E2S(self, new_capacity);
+
+    if(new_capacity < capacity || new_size < new_capacity)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Integer overflow while resizing EMList");
+        goto _err1;
+    }
+
+    msgf("EMList: Resizing");
+
+    /* The new index is mapped like the old one, e.g. it's locked in memory if
+     * the old one was. It's about to be written in full, so it's not prefaulted.
+     */
+    filename = path_combine(self->dirname, "index.bin.1");
+    if((mf = mapped_file_create(filename, new_size,
+            self->index->options & ~MF_PREFAULT)) == NULL)
+        goto _err1;
+
+    /* Copy old entries to the new external memory list. The object's lock is
+     * held, so other threads can safely run meanwhile.
+     */
+    Py_BEGIN_ALLOW_THREADS
+    memcpy(mf->address, self->index->address, EM_LIST_E2S(self, capacity));
+    Py_END_ALLOW_THREADS
+
+    msgf("EMList: Resize successful");
+
+    filename = path_combine(self->dirname, "index.bin.0");
+    if(mapped_file_rename(self->index, filename) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot rename old EMList index file");
+        goto _err2;
+    }
+
+    filename = path_combine(self->dirname, "index.bin");
+    if(mapped_file_rename(mf, filename) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot rename new EMList index file");
+        goto _err2;
+    }
+
+    /* Populate new index file header. */
+    new_index_hdr = (em_list_index_hdr_t *)mf->address;
+    new_index_hdr->magic = INDEX_MAGIC;
     new_index_hdr->used = index_hdr->used;
     new_index_hdr->capacity = new_capacity;
+    new_index_hdr->generation = index_hdr->generation + 1;
+
+    /* The new index was written directly in the mapped buffer. */
+    mapped_file_mark_dirty(mf, 0, new_size);
+
+    /* Readers still mapping the old "index.bin" will re-open the new one. */
+    index_hdr->generation += 1;
+
+    mapped_file_unlink(self->index);
+    mapped_file_close(self->index);
+
+    self->index = mf;
+    return 0;
+
+_err2:
+    mapped_file_unlink(mf);
+    mapped_file_close(mf);
+
+_err1:
+    return -1;
+}
+
+/* Replace "index.bin" of format version `version' with one in the current
+ * format, in the same way `em_list_resize()' does. Entries are laid out the
+ * same, past the longer header.
+ */
+static int em_list_upgrade(em_list_t *self, unsigned int version)
+{
+    size_t capacity, new_size, hdr_size = EM_LIST_INDEX_HDR_SIZE(version);
+    char *filename;
+    mapped_file_t *mf;
+    em_list_index_hdr_t *index_hdr, *new_index_hdr;
+
+    index_hdr = (em_list_index_hdr_t *)self->index->address;
+
+    if(self->index->size < hdr_size)
+        goto _err1;
+
+    capacity = index_hdr->capacity;
+    if((self->index->size - hdr_size) /
+            sizeof(em_list_index_ent_t) < capacity || index_hdr->used > capacity)
+        goto _err1;
+
+    msgf("EMList: Upgrading");
+
+    new_size = sizeof(em_list_index_hdr_t) + capacity * sizeof(em_list_index_ent_t);
+
+    filename = path_combine(self->dirname, "index.bin.1");
+    if((mf = mapped_file_create(filename, new_size,
+            self->index->options & ~MF_PREFAULT)) == NULL)
+        goto _err1;
+
+    new_index_hdr = (em_list_index_hdr_t *)mf->address;
+    new_index_hdr->magic = INDEX_MAGIC;
+    new_index_hdr->used = index_hdr->used;
+    new_index_hdr->capacity = capacity;
+    new_index_hdr->generation = 0;
+    new_index_hdr->seq = 0;
+    new_index_hdr->flags = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    memcpy((char *)new_index_hdr + sizeof(em_list_index_hdr_t),
+        (char *)index_hdr + hdr_size,
+        capacity * sizeof(em_list_index_ent_t));
+    Py_END_ALLOW_THREADS
+
+    /* Make sure the new index is on disk before the old one is replaced. */
+    if(mapped_file_sync(mf, 0, new_size) != 0)
+        goto _err2;
+
+    filename = path_combine(self->dirname, "index.bin.0");
+    if(mapped_file_rename(self->index, filename) != 0)
+        goto _err2;
+
+    filename = path_combine(self->dirname, "index.bin");
+    if(mapped_file_rename(mf, filename) != 0)
+        goto _err2;
 
     mapped_file_unlink(self->index);
     mapped_file_close(self->index);
 
     self->index = mf;
+
+    msgf("EMList: Upgrade successful");
     return 0;
 
-_err2:
-    mapped_file_unlink(mf);
-    mapped_file_close(mf);
+_err2:
+    mapped_file_unlink(mf);
+    mapped_file_close(mf);
+
+_err1:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot upgrade EMList");
+    return -1;
+}
+
+
+
+/* Append item in external memory list. Sets `*resizedp' if "index.bin" had to
+ * be resized.
+ */
+static int em_list_append_internal(em_list_t *self, PyObject *value,
+        ssize_t *lsnp, int *resizedp)
+{
+    em_list_index_hdr_t *index;
+    size_t used;
+    int ret = -1;
+
+    index = self->index->address;
+    used = index->used;
+
+    /* Resize memory mapped index if needed. */
+    if(used >= index->capacity)
+    {
+        if(em_list_resize(self) != 0)
+            goto _err;
+
+        /* Pointer to memory mapped index file has probably been modified. */
+        index = self->index->address;
+        *resizedp = 1;
+    }
+
+    /* Add item in external memory list, but don't increase reference count! */
+    if(em_list_setitem_internal(self, used, value, lsnp) != 0)
+        goto _err;
+
+    /* Pointer may have been modified again by a re-entrant `append()'. */
+    index = self->index->address;
+
+    used += 1;
+    index->used = used;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Append item in external memory list. */
+static PyObject *em_list_append(em_list_t *self, PyObject *args)
+{
+    ssize_t lsn = 0;
+    int resized = 0, ret;
+    PyObject *value, *r = NULL;
+
+    if(PyArg_ParseTuple(args, "O", &value) == 0)
+        goto _err;
+
+    if(em_list_lock(self, 0) != 0)
+        goto _err;
+
+    if((ret = em_list_append_internal(self, value, &lsn, &resized)) == 0)
+        ret = em_list_maybe_checkpoint(self, resized, &lsn);
+
+    lock_release(&self->lock);
+
+    /* Wait for the log to reach the disk without holding the lock. */
+    if(ret == 0 && lsn > 0)
+        ret = wal_complete(&self->wal, (size_t)lsn);
+
+    if(ret == 0)
+    {
+        r = Py_None;
+        Py_INCREF(r);
+    }
+
+_err:
+    return r;
+}
+
+
+/* Re-apply an operation read back from the write-ahead log of `self'. Appended
+ * items were logged with the index they were stored at.
+ */
+static int em_list_apply(void *arg, int op, PyObject *key, PyObject *value)
+{
+    em_list_t *self = arg;
+    em_list_index_hdr_t *index_hdr = self->index->address;
+    Py_ssize_t index;
+    ssize_t lsn;
+    int resized;
+
+    int ret = -1;
+
+    if(op != WAL_OP_SET || value == NULL || PyIndex_Check(key) == 0 ||
+            (index = PyNumber_AsSsize_t(key, NULL)) < 0 ||
+            (size_t)index > index_hdr->used)
+    {
+        if(PyErr_Occurred() == NULL)
+            PyErr_SetString(PyExc_RuntimeError, "Invalid write-ahead log record");
+        goto _err;
+    }
+
+    if((size_t)index < index_hdr->used)
+        ret = em_list_setitem_internal(self, index, value, &lsn);
+    else
+        ret = em_list_append_internal(self, value, &lsn, &resized);
+
+_err:
+    return ret;
+}
+
+
+
+/* External memory list iterator interface. */
+
+/* Iterator's `__iter__()' method. */
+static PyObject *em_list_iter_iter(em_list_iter_t *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+
+/* Keep at least half a window of items read ahead of the position of iterator
+ * `self', so that full scans don't wait for the disk at every page. Called with
+ * the list's lock held.
+ */
+static void em_list_iter_readahead(em_list_iter_t *self)
+{
+    size_t start = self->readahead, end;
+
+    if(start >= self->maxpos || self->pos + EM_LIST_READAHEAD / 2 < start)
+        return;
+
+    end = start + EM_LIST_READAHEAD;
+    if(end > self->maxpos)
+        end = self->maxpos;
+
+    em_list_advise_items(self->em_list, start, end, MF_ACCESS_WILLNEED,
+        READAHEAD_MAX_SPAN);
+
+    self->readahead = end;
+}
+
+
+/* Collect the items from `*posp' up to `end' in the batch of iterator `self',
+ * `self->prefetch' of them at most, and start reading in their values. The
+ * batch is left sorted by position of value. `*posp' is updated to point past
+ * the last item collected. Called with the list's lock held.
+ */
+static void em_list_iter_prefetch(em_list_iter_t *self, size_t *posp,
+        size_t end)
+{
+    em_list_index_ent_t ent;
+    size_t n = 0, pos = *posp;
+    em_list_t *em_list = self->em_list;
+    chunk_ref_t *batch = self->batch;
+
+    for(; pos < end && n < self->prefetch; pos++)
+    {
+        if(em_list_get_entry(em_list, pos, &ent) != 0)
+        {
+            pos = end;
+            break;
+        }
+
+        /* Inline values are read along with the index. */
+        batch[n].pos = IS_INLINE(ent.value_pos) ? 0 : ent.value_pos;
+        batch[n].index = pos;
+        n += 1;
+    }
+
+    mapped_file_prefetch_chunks(em_list->values, batch, n);
+
+    self->batch_len = n;
+    *posp = pos;
+}
+
+
+/* Read the item of iterator `self' at position `*posp', which is updated to
+ * point past it. Called with the list's lock held.
+ */
+static PyObject *em_list_iter_read(em_list_iter_t *self, size_t *posp)
+{
+    size_t start, pos = *posp;
+    PyObject *r = NULL;
+
+    if(pos >= self->maxpos)
+    {
+        PyErr_SetNone(PyExc_StopIteration);
+        goto _err;
+    }
+
+    /* Keep the values of the next `prefetch' items being read in. */
+    if(self->prefetch > 0 && pos + self->prefetch / 2 >= self->prefetched)
+    {
+        start = pos > self->prefetched ? pos : self->prefetched;
+        em_list_iter_prefetch(self, &start, self->maxpos);
+        self->prefetched = start;
+    }
+
+    r = em_list_getitem_internal(self->em_list, pos);
+    *posp = pos + 1;
+
+_err:
+    return r;
+}
+
+
+/* Read the next item of iterator `self' in reordering mode. Items are taken in
+ * batches, each returned in the order their values appear on disk. `*batch_posp'
+ * is the entry of the current batch to return next and is updated accordingly.
+ * Collecting a new batch updates the iterator's state directly. Called with the
+ * list's lock held.
+ */
+static PyObject *em_list_iter_read_batch(em_list_iter_t *self,
+        size_t *batch_posp)
+{
+    size_t batch_pos = *batch_posp;
+    PyObject *r = NULL;
+
+    while(batch_pos == self->batch_len)
+    {
+        if(self->pos >= self->maxpos)
+        {
+            PyErr_SetNone(PyExc_StopIteration);
+            goto _err;
+        }
+
+        em_list_iter_prefetch(self, &self->pos, self->maxpos);
+        self->batch_pos = batch_pos = 0;
+    }
+
+    r = em_list_getitem_internal(self->em_list, self->batch[batch_pos].index);
+    *batch_posp = batch_pos + 1;
+
+_err:
+    return r;
+}
+
+
+/* Iterator's `next()' method. */
+static PyObject *em_list_iter_iternext(em_list_iter_t *self)
+{
+    em_list_t *em_list = self->em_list;
+    size_t pos, batch_pos, seq;
+    PyObject *r = NULL;
+
+    if(em_list_lock(em_list, 1) != 0)
+        goto _err;
+
+    /* Readers retry if the writer modified the index meanwhile. */
+    for(;;)
+    {
+        seq = em_list_read_begin(em_list);
+        pos = self->pos;
+        batch_pos = self->batch_pos;
+
+        if(self->reorder)
+            r = em_list_iter_read_batch(self, &batch_pos);
+        else
+            r = em_list_iter_read(self, &pos);
+
+        if(em_list_read_retry(em_list, seq) == 0)
+            break;
+
+        Py_CLEAR(r);
+        PyErr_Clear();
+        lock_release_shared(&em_list->lock);
+
+        if(em_list_lock(em_list, 1) != 0)
+            goto _err;
+    }
+
+    if(self->reorder)
+        self->batch_pos = batch_pos;
+    else
+        self->pos = pos;
+
+    em_list_iter_readahead(self);
+    lock_release_shared(&em_list->lock);
+
+_err:
+    return r;
+}
+
+static void em_list_iter_dealloc(em_list_iter_t *self)
+{
+    PyMem_FREE(self->batch);
+    Py_DECREF(self->em_list);
+    PyObject_Del(self);
+}
+
+static PyTypeObject em_list_iter_type =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pyrsistence._EMListIter",
+    .tp_basicsize = sizeof(em_list_iter_t),
+    .tp_dealloc = (destructor)em_list_iter_dealloc,
+#if PY_MAJOR_VERSION >= 3
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+#else
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
+#endif
+    .tp_doc = "Internal EMList iterator object.",
+    .tp_iter = (getiterfunc)em_list_iter_iter,
+    .tp_iternext = (iternextfunc)em_list_iter_iternext,
+};
+
+
+/* This is the `tp_iter()' method of `EMList' object. */
+/* Create an iterator over list `self'. Keyword arguments `prefetch' and
+ * `reorder' are passed from `scan()'; see the README.
+ */
+static PyObject *em_list_iterator_new(em_list_t *self, PyObject *args,
+        PyObject *kwargs)
+{
+    Py_ssize_t prefetch = 0;
+    int reorder = 0;
+    char *kwarr[] = {"prefetch", "reorder", NULL};
+    chunk_ref_t *batch = NULL;
+    em_list_iter_t *iter = NULL;
+    em_list_index_hdr_t *index;
+
+    if(args != NULL && PyArg_ParseTupleAndKeywords(args, kwargs, "|ni", kwarr,
+            &prefetch, &reorder) == 0)
+        goto _err;
+
+    if(prefetch < 0 || (reorder && prefetch == 0))
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid prefetch window");
+        goto _err;
+    }
+
+    if(prefetch > 0 && (batch = PyMem_NEW(chunk_ref_t, prefetch)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    if(em_list_lock(self, 1) != 0)
+        goto _err;
+
+    index = self->index->address;
+
+    if((iter = PyObject_New(em_list_iter_t, &em_list_iter_type)) != NULL)
+    {
+        PyObject_Init((PyObject *)iter, &em_list_iter_type);
+        Py_INCREF(self);
+
+        iter->em_list = self;
+        iter->pos = 0;
+        iter->maxpos = index->used;
+        iter->readahead = 0;
+        iter->prefetch = (size_t)prefetch;
+        iter->prefetched = 0;
+        iter->batch = batch;
+        iter->batch_len = 0;
+        iter->batch_pos = 0;
+        iter->reorder = reorder != 0;
+        batch = NULL;
+    }
+    else
+        PyErr_SetString(PyExc_RuntimeError, "Failed to initialize iterator");
+
+    lock_release_shared(&self->lock);
+
+_err:
+    PyMem_FREE(batch);
+    return (PyObject *)iter;
+}
+
+
+static PyObject *em_list_iter(em_list_t *self)
+{
+    return em_list_iterator_new(self, NULL, NULL);
+}
+
+
+/* Iterate over the list, optionally prefetching and reordering values. */
+static PyObject *em_list_scan(em_list_t *self, PyObject *args,
+        PyObject *kwargs)
+{
+    return em_list_iterator_new(self, args, kwargs);
+}
+
+
+
+/* Train a shared compression dictionary from the chunks in "values.bin". See
+ * `compression_train_dict()' for the return value.
+ */
+static int em_list_train_dict(em_list_t *self)
+{
+    return compression_train_dict(EM_COMMON(self), self->dirname,
+        &self->values, 1, sizeof(em_list_values_hdr_t));
+}
+
+
+
+/* Standard interface to `open()' and `close()'. */
+
+/* Create a new external memory list. "index.bin" is mapped with options
+ * `options', `MF_XXX' constants.
+ */
+static int em_list_create(em_list_t *self, int classes, int options)
+{
+    mapped_file_t *mf;
+    em_list_index_hdr_t index_hdr;
+    size_t size;
+    int data_options = 0;
+    char *filename;
+    const char *dirname = self->dirname;
+
+    /* Compute initial external memory list index size. */
+    self->index_hdr_size = sizeof(em_list_index_hdr_t);
+    size = EM_LIST_E2S(self, 0);
+
+    /* Create directory to hold external memory list files. */
+    if(mk_dir(dirname) != 0)
+        goto _err1;
+
+    /* Create "index.bin" and write file header. */
+    filename = path_combine(dirname, "index.bin");
+    if((mf = mapped_file_create(filename, size, options)) == NULL)
+        goto _err2;
+
+    index_hdr.magic = INDEX_MAGIC;
+    index_hdr.used = 0;
+    index_hdr.capacity = 0;
+    index_hdr.generation = 0;
+    index_hdr.seq = 0;
+    index_hdr.flags = self->compact ? INDEX_COMPACT : 0;
+    if(self->compact_chunks)
+    {
+        index_hdr.flags |= INDEX_COMPACT_CHUNKS;
+        data_options = MF_COMPACT_CHUNKS;
+    }
+    if(self->inline_values)
+        index_hdr.flags |= INDEX_INLINE;
+    mapped_file_write(mf, &index_hdr, sizeof(em_list_index_hdr_t));
+
+    self->index = mf;
+
+    /* Create "values.bin", the first of its segments. */
+    filename = path_combine(dirname, "values.bin");
+    if((mf = mapped_file_create(filename, 0, data_options | MF_SEGMENTED)) == NULL)
+        goto _err3;
+
+    self->values = mf;
+
+    if(mapped_file_lock(mf, 1) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMList is in use by another process");
+        goto _err4;
+    }
+
+    /* Create "classes.bin" if a class table was requested. */
+    if(classes && (self->classes = class_table_open(dirname, 1, 0)) == NULL)
+        goto _err4;
+
+    return 0;
+
+_err4:
+    mapped_file_unlink(self->values);
+    mapped_file_close(self->values);
+
+_err3:
+    mapped_file_unlink(self->index);
+    mapped_file_close(self->index);
+
+_err2:
+    rm_dir(dirname);
+
+_err1:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMList");
+    return -1;
+}
+
+
+/* Open existing external memory list. "index.bin" is mapped with options
+ * `index_options' and "values.bin" with `data_options'.
+ */
+static int em_list_open_existing(em_list_t *self, int classes,
+        int index_options, int data_options)
+{
+    mapped_file_t *mf;
+    em_list_index_hdr_t *index_hdr;
+    size_t flags;
+    int readonly = self->reader || self->readonly;
+    char *filename;
+    const char *dirname = self->dirname;
+
+    /* Open "values.bin" and its segments first; the writer's lock is held on
+     * the first segment. Segments are verified as they're opened.
+     */
+    filename = path_combine(dirname, "values.bin");
+    if((mf = mapped_file_open(filename, readonly,
+            data_options | MF_SEGMENTED)) == NULL)
+        goto _err1;
+
+    self->values = mf;
+
+    /* Read-only opens share the lock, so they exclude writers and vice versa. */
+    if(self->reader == 0 && mapped_file_lock(mf, self->readonly == 0) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMList is in use by another process");
+        goto _err2;
+    }
+
+    if(readonly == 0 && em_list_restore_index(self) != 0)
+        goto _err2;
+
+    /* Open and verify "index.bin". */
+    filename = path_combine(dirname, "index.bin");
+    if((mf = mapped_file_open(filename, readonly, index_options)) == NULL)
+        goto _err2;
+
+    self->index = mf;
+    index_hdr = mf->address;
+
+    /* Read-only opens take indices of earlier versions as they are, writers
+     * upgrade them first.
+     */
+    self->index_hdr_size = sizeof(em_list_index_hdr_t);
+
+    if(mf->size >= sizeof(uint64_t) && IS_MAGIC(index_hdr->magic) &&
+            VERSION_OF(index_hdr->magic) < INDEX_VERSION)
+    {
+        if(self->reader)
+        {
+            PyErr_SetString(PyExc_RuntimeError,
+                "EMList was created by an earlier version, open it for writing first");
+            goto _err3;
+        }
+
+        if(self->readonly)
+            self->index_hdr_size =
+                EM_LIST_INDEX_HDR_SIZE(VERSION_OF(index_hdr->magic));
+        else if(em_list_upgrade(self, VERSION_OF(index_hdr->magic)) != 0)
+            goto _err3;
+
+        index_hdr = self->index->address;
+    }
+
+    if(self->index->size < self->index_hdr_size || IS_MAGIC(index_hdr->magic) == 0 ||
+            VERSION_OF(index_hdr->magic) > INDEX_VERSION)
+    {
+        if(IS_MAGIC(index_hdr->magic))
+            PyErr_SetString(PyExc_RuntimeError, "EMList was created by a newer version");
+        goto _err3;
+    }
+
+    /* Indices of versions without flags use none of the features they record. */
+    flags = VERSION_OF(index_hdr->magic) >= 5 ? index_hdr->flags : 0;
+
+    if(flags & ~(size_t)INDEX_FLAGS)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMList uses features unsupported by this version");
+        goto _err3;
+    }
+
+    self->compact = (flags & INDEX_COMPACT) != 0;
+    self->inline_values = (flags & INDEX_INLINE) != 0;
+
+    /* "values.bin" was opened before its format was known. */
+    if(flags & INDEX_COMPACT_CHUNKS)
+    {
+        self->compact_chunks = 1;
+        mapped_file_set_compact_chunks(self->values);
+    }
+
+    /* Only readers look at the generation counter. */
+    if(self->reader)
+        self->generation = index_hdr->generation;
+
+    /* Load the shared compression dictionary, or try to train one if it's
+     * missing and the compression mode requires it.
+     */
+    if(compression_load_dict(EM_COMMON(self), dirname) != 0)
+        goto _err3;
+
+    if(readonly == 0 && self->compression == COMPRESSION_LZ4_DICT &&
+            self->dict == NULL && em_list_train_dict(self) < 0)
+        goto _err4;
+
+    /* Open "classes.bin" if present, or create it if a class table was
+     * requested.
+     */
+    if((self->classes = class_table_open(dirname, classes, readonly)) == NULL &&
+            PyErr_Occurred() != NULL)
+        goto _err4;
+
+    return 0;
+
+_err4:
+    compression_free_dict(EM_COMMON(self));
+
+_err3:
+    mapped_file_close(self->index);
+
+_err2:
+    mapped_file_close(self->values);
+
+_err1:
+    if(PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMList");
+    return -1;
+}
+
+
+static PyObject *em_list_close(em_list_t *, PyObject *);
+
+
+/* Replay the write-ahead log of `self', if any, and keep it open for logging
+ * further operations, unless `durability' is `DURABILITY_NONE'.
+ */
+static int em_list_open_wal(em_list_t *self, int durability)
+{
+    int count;
+
+    if(durability == DURABILITY_NONE &&
+            file_exists(path_combine(self->dirname, "wal.bin")) == 0 &&
+            file_exists(path_combine(self->dirname, "index.ckpt")) == 0)
+        goto _ok;
+
+    /* Replayed operations are not logged again. */
+    if(wal_open(&self->wal, self->dirname, DURABILITY_NONE) != 0)
+        goto _err1;
+
+    /* Chunks referred to by "index.ckpt" may be freed while replaying, but
+     * replaying may have to start over from it.
+     */
+    if(mapped_file_defer_frees(self->values, 1) != 0)
+        goto _err2;
+
+    if((count = wal_replay(&self->wal, EM_COMMON(self), em_list_apply, self)) < 0)
+        goto _err2;
+
+    msgf("EMList: Replayed %d operations", count);
+
+    /* Without a log, "index.bin" is all there is to recover from. */
+    if(durability == DURABILITY_NONE)
+    {
+        if(em_list_sync(self, 0) != 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMList");
+            goto _err2;
+        }
+
+        if(em_list_drop_checkpoint(self) != 0)
+            goto _err2;
+
+        mapped_file_defer_frees(self->values, 0);
+        wal_close(&self->wal);
+    }
+    else
+    {
+        if(em_list_checkpoint(self) != 0)
+            goto _err2;
+
+        self->wal.durability = durability;
+    }
+
+_ok:
+    return 0;
+
+_err2:
+    mapped_file_defer_frees(self->values, 0);
+    wal_close(&self->wal);
+
+_err1:
+    return -1;
+}
+
+
+/* Called by `em_list_open()' and `em_list_init()'. */
+static int em_list_open_common(em_list_t *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *pickler = NULL, *unpickler = NULL;
+    char *compression = NULL, *durability = NULL, *prefault = NULL;
+    int classes = 0, reader = 0, readonly = 0, durability_mode;
+    int hugepages = 0, lock_index = 0, prefault_mode, index_options;
+    int data_options, direct_io = 0, compact_index = 0, compact_chunks = 0;
+    int inline_values = 0;
+    double flush_interval = 0;
+    Py_ssize_t memory_budget = 0, buffer_pool = 0;
+
+    char *dirname, *kwarr[] = {
+        "dirname",
+        "pickler",
+        "unpickler",
+        "compression",
+        "class_table",
+        "reader",
+        "readonly",
+        "durability",
+        "flush_interval",
+        "hugepages",
+        "prefault",
+        "memory_budget",
+        "lock_index",
+        "buffer_pool",
+        "direct_io",
+        "compact_index",
+        "compact_chunks",
+        "inline_values",
+        NULL
+    };
+
+    int ret = -1;
+
+    if(kwargs)
+    {
+        if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|OOziiizdizniniiii", kwarr,
+                &dirname, &pickler, &unpickler, &compression, &classes, &reader,
+                &readonly, &durability, &flush_interval, &hugepages,
+                &prefault, &memory_budget, &lock_index, &buffer_pool,
+                &direct_io, &compact_index, &compact_chunks,
+                &inline_values) == 0)
+            goto _err;
+    }
+    else
+    {
+        if(PyArg_ParseTuple(args, "s", &dirname) == 0)
+            goto _err;
+    }
+
+    if(valid_compression(compression, &self->compression) != 0)
+        goto _err;
+
+    if(valid_durability(durability, &durability_mode) != 0)
+        goto _err;
+
+    if(valid_prefault(prefault, &prefault_mode) != 0)
+        goto _err;
+
+    if(flush_interval < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid flush interval");
+        goto _err;
+    }
+
+    if(memory_budget < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid memory budget");
+        goto _err;
+    }
+
+    /* A buffer pool would keep serving data the writer has since changed. */
+    if(buffer_pool < 0 || (buffer_pool > 0 && reader))
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid buffer pool size");
+        goto _err;
+    }
+
+    if(direct_io && buffer_pool == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Direct I/O requires a buffer pool");
+        goto _err;
+    }
+
+    if((self->dirname = PyMem_MALLOC(strlen(dirname) + 1)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    strcpy(self->dirname, dirname);
+
+    if(pickler && valid_pickler(pickler, &self->pickle) == 0)
+        self->pickler = pickler;
+
+    if(unpickler && valid_unpickler(unpickler, &self->unpickle) == 0)
+        self->unpickler = unpickler;
+
+    self->reader = reader != 0;
+    self->readonly = readonly != 0;
+    self->write_back = reader == 0 && readonly == 0 && flush_interval > 0;
+    self->memory_budget = (size_t)memory_budget;
+    self->evict_hand = 0;
+    self->compact = compact_index != 0;
+    self->compact_chunks = compact_chunks != 0;
+    self->inline_values = inline_values != 0;
+
+    index_options = hugepages ? MF_HUGEPAGES : 0;
+    if(prefault_mode != PREFAULT_NONE)
+        index_options |= MF_PREFAULT;
+    if(lock_index)
+        index_options |= MF_LOCKED;
+    data_options = prefault_mode == PREFAULT_ALL ? MF_PREFAULT : 0;
+
+    /* XXX: There's an obvious race condition here, should we care? */
+    if(access(self->dirname, F_OK) == 0)
+        ret = em_list_open_existing(self, classes, index_options, data_options);
+    else if(reader == 0 && readonly == 0)
+        ret = em_list_create(self, classes, index_options);
+    else
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open EMList");
+
+    if(ret >= 0)
+    {
+        self->is_open = 1;
+
+        /* Data files are accessed through buffer pools, if requested, once
+         * their headers have been verified.
+         */
+        if(buffer_pool > 0 &&
+                (ret = mapped_file_set_buffered(self->values, buffer_pool,
+                    direct_io)) != 0)
+            em_list_close(self, NULL);
+
+        /* Only writers log operations. */
+        else if(reader == 0 && readonly == 0 &&
+                (ret = em_list_open_wal(self, durability_mode)) != 0)
+            em_list_close(self, NULL);
+
+        /* Started last, as it has to be stopped before closing on failure.
+         * Readers may have a memory budget too.
+         */
+        else if((self->write_back || memory_budget > 0) &&
+                (ret = flusher_start(&self->flusher, self->write_back ?
+                    flush_interval : BUDGET_INTERVAL, em_list_flusher,
+                    self)) != 0)
+            em_list_close(self, NULL);
+    }
+
+_err:
+    return ret;
+}
+
+
+/* Open external memory list. */
+static PyObject *em_list_open(em_list_t *self, PyObject *args)
+{
+    PyObject *r = NULL;
+
+    lock_acquire(&self->lock);
+
+    if(self->is_open)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "EMList already open");
+        goto _err;
+    }
+
+    if(em_list_open_common(self, args, NULL) != 0)
+        goto _err;
+
+    Py_INCREF(Py_True);
+    r = Py_True;
+
+_err:
+    lock_release(&self->lock);
+    return r;
+}
+
+
+/* Synchronize and close an external memory list. */
+static PyObject *em_list_close(em_list_t *self, PyObject *Py_UNUSED(args))
+{
+    mapped_file_t *index, *values;
+
+    /* The flusher takes the lock too; stop it before taking it. */
+    flusher_stop(&self->flusher);
+
+    lock_acquire(&self->lock);
+
+    if(self->is_open)
+    {
+        index = self->index;
+        values = self->values;
+
+        /* Files opened read-only are neither synchronized nor truncated. */
+        if(self->reader == 0 && self->readonly == 0)
+        {
+            /* Readers have to re-map the files truncated below. */
+            em_list_bump_generation(self);
+
+            /* Sync all files; the checkpoint and the write-ahead log are no
+             * longer needed once they're on disk.
+             */
+            if(em_list_sync(self, 0) == 0 && wal_is_open(&self->wal) &&
+                    em_list_drop_checkpoint(self) != 0)
+                PyErr_Clear();
+
+            wal_close(&self->wal);
+
+            /* Truncate "values.bin". */
+            mapped_file_truncate(values, mapped_file_get_eof(values));
+        }
+
+        mapped_file_close(index);
+        mapped_file_close(values);
+
+        compression_free_dict(EM_COMMON(self));
+
+        if(self->classes != NULL)
+        {
+            class_table_close(self->classes);
+            self->classes = NULL;
+        }
+
+        PyMem_FREE(self->dirname);
+        self->is_open = 0;
+    }
+
+    lock_release(&self->lock);
+
+    Py_RETURN_NONE;
+};
+
+
+
+/* Train a shared compression dictionary from the objects stored so far. Objects
+ * stored afterwards are compressed with it if compression mode "lz4-dict" is in
+ * use.
+ */
+static PyObject *em_list_train_dictionary(em_list_t *self,
+        PyObject *Py_UNUSED(args))
+{
+    int ret;
+    PyObject *r = NULL;
+
+    if(em_list_lock(self, 0) != 0)
+        goto _err;
+
+    if((ret = em_list_train_dict(self)) < 0)
+        goto _unlock;
+
+    if(ret > 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Not enough data to train a compression dictionary");
+        goto _unlock;
+    }
+
+    /* Readers load the new dictionary when they refresh. */
+    em_list_bump_generation(self);
+
+    r = PyLong_FromSize_t(self->dict->size);
+
+_unlock:
+    lock_release(&self->lock);
+
+_err:
+    return r;
+}
+
+
+
+/* Make sure all operations on `self' so far survive a crash. Without a write-
+ * ahead log, all files are synchronized to disk.
+ */
+static PyObject *em_list_commit(em_list_t *self, PyObject *Py_UNUSED(args))
+{
+    size_t lsn = 0;
+    int ret = 0;
+    PyObject *r = NULL;
+
+    if(em_list_lock(self, 0) != 0)
+        goto _err;
+
+    if(wal_is_open(&self->wal))
+        lsn = self->wal.pos;
+    else if((ret = em_list_sync(self, 0)) != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMList");
+
+    lock_release(&self->lock);
+
+    if(ret == 0 && lsn > 0)
+        ret = wal_commit(&self->wal, lsn);
+
+    if(ret == 0)
+    {
+        Py_INCREF(Py_None);
+        r = Py_None;
+    }
+
+_err:
+    return r;
+}
+
+
+
+/* Write back the parts of the files of `self' modified so far. If `async_' is
+ * true, write back is only scheduled and this returns immediately. Otherwise,
+ * the write-ahead log, if any, is emptied too, as all logged operations are on
+ * disk afterwards.
+ */
+static PyObject *em_list_flush(em_list_t *self, PyObject *args, PyObject *kwargs)
+{
+    int async = 0, ret;
+    char *kwarr[] = {"async_", NULL};
+    PyObject *r = NULL;
+
+    if(PyArg_ParseTupleAndKeywords(args, kwargs, "|i", kwarr, &async) == 0)
+        goto _err;
+
+    if(em_list_lock(self, 0) != 0)
+        goto _err;
+
+    if(async == 0 && wal_is_open(&self->wal))
+        ret = em_list_checkpoint(self);
+    else if((ret = em_list_sync(self, async)) != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize EMList");
+
+    lock_release(&self->lock);
 
-_err1:
-    return -1;
+    if(ret == 0)
+    {
+        Py_INCREF(Py_None);
+        r = Py_None;
+    }
+
+_err:
+    return r;
 }
 
 
-/* Append item in external memory list. */
-static PyObject *em_list_append(em_list_t *self, PyObject *args)
+
+/* Give kernel a hint about how `self' is going to be accessed. The hint applies
+ * to items `start' up to `end', or to all files of `self' if no range is given.
+ */
+static PyObject *em_list_advise(em_list_t *self, PyObject *args,
+        PyObject *kwargs)
 {
-    em_list_index_hdr_t *index;
+    char *hint;
+    Py_ssize_t start = 0, end = PY_SSIZE_T_MAX;
     size_t used;
-    PyObject *value, *r = NULL;
+    int advice, ret;
+    char *kwarr[] = {"hint", "start", "end", NULL};
+    PyObject *end_obj = Py_None, *r = NULL;
 
-    if(PyArg_ParseTuple(args, "O", &value) == 0)
+    if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|nO", kwarr, &hint, &start,
+            &end_obj) == 0)
         goto _err;
 
-    index = self->index->address;
-    used = index->used;
+    /* A missing `end', or `None', stands for the end of the data structure. */
+    if(end_obj != Py_None &&
+            (end = PyNumber_AsSsize_t(end_obj, PyExc_OverflowError)) == -1 &&
+            PyErr_Occurred())
+        goto _err;
 
-    /* Resize memory mapped index if needed. */
-    if(used >= index->capacity)
-    {
-        if(em_list_resize(self) != 0)
-            goto _err;
+    if(valid_access(hint, &advice) != 0)
+        goto _err;
 
-        /* Pointer to memory mapped index file has probably been modified. */
-        index = self->index->address;
+    if(start < 0 || end < start)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid range");
+        goto _err;
     }
 
-    /* Add item in external memory list, but don't increase reference count! */
-    if(em_list_setitem_internal(self, used, value) != 0)
+    if(em_list_lock(self, 1) != 0)
         goto _err;
 
-    used += 1;
-    index->used = used;
+    used = ((em_list_index_hdr_t *)self->index->address)->used;
+
+    if(start == 0 && (size_t)end >= used)
+        ret = mapped_file_set_access(self->index, advice) != 0 ||
+            mapped_file_set_access(self->values, advice) != 0 ? -1 : 0;
+    else if((size_t)start < used)
+        ret = em_list_advise_items(self, start,
+            (size_t)end < used ? (size_t)end : used, advice, 0);
+    else
+        ret = 0;
+
+    lock_release_shared(&self->lock);
+
+    if(ret != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot advise kernel on EMList access");
+        goto _err;
+    }
 
+    Py_INCREF(Py_None);
     r = Py_None;
-    Py_INCREF(r);
 
 _err:
     return r;
@@ -342,280 +2074,231 @@ _err:
 
 
 
-/* External memory list iterator interface. */
-
-/* Iterator's `__iter__()' method. */
-static PyObject *em_list_iter_iter(em_list_iter_t *self)
+/* Retrieve the items at the indices in sequence `indices', as a list. Items
+ * are read `EM_LIST_BATCH' at a time, with the chunks of each batch read in at
+ * once (see `em_list_getitem_many()'). Raises `IndexError' if any index is out
+ * of bounds.
+ */
+static PyObject *em_list_get_many(em_list_t *self, PyObject *args)
 {
-    return (PyObject *)self;
-}
-
+    Py_ssize_t *indices = NULL;
+    chunk_ref_t *batch = NULL;
+    size_t i, j, n, num_items, seq;
+    int ret;
+    PyObject *keys, *keys_seq = NULL, **items, *r = NULL;
 
-/* Iterator's `next()' method. */
-static PyObject *em_list_iter_iternext(em_list_iter_t *self)
-{
-    em_list_t *em_list = self->em_list;
-    size_t pos = self->pos;
-    PyObject *r = NULL;
+    if(PyArg_ParseTuple(args, "O", &keys) == 0)
+        goto _err;
 
-    if(pos < self->maxpos)
-    {
-        r = em_list_getitem_internal(em_list, pos);
-        pos += 1;
-        self->pos = pos;
-    }
-    else
-        PyErr_SetNone(PyExc_StopIteration);
+    if((keys_seq = PySequence_Fast(keys, "Indices must be iterable")) == NULL)
+        goto _err;
 
-    return r;
-}
+    num_items = (size_t)PySequence_Fast_GET_SIZE(keys_seq);
 
-static void em_list_iter_dealloc(em_list_iter_t *self)
-{
-    Py_DECREF(self->em_list);
-}
+    if((r = PyList_New((Py_ssize_t)num_items)) == NULL)
+        goto _err;
 
-static PyTypeObject em_list_iter_type =
-{
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pyrsistence._EMListIter",
-    .tp_basicsize = sizeof(em_list_iter_t),
-    .tp_dealloc = (destructor)em_list_iter_dealloc,
-#if PY_MAJOR_VERSION >= 3
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-#else
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER,
-#endif
-    .tp_doc = "Internal EMList iterator object.",
-    .tp_iter = (getiterfunc)em_list_iter_iter,
-    .tp_iternext = (iternextfunc)em_list_iter_iternext,
-};
+    if((indices = PyMem_MALLOC(num_items * sizeof(Py_ssize_t))) == NULL ||
+            (batch = PyMem_MALLOC(EM_LIST_BATCH * sizeof(chunk_ref_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _fail;
+    }
 
+    for(i = 0; i < num_items; i++)
+    {
+        if(em_list_key_to_index(PySequence_Fast_GET_ITEM(keys_seq, i),
+                &indices[i]) != 0)
+            goto _fail;
+    }
 
-/* This is the `tp_iter()' method of `EMList' object. */
-static PyObject *em_list_iter(em_list_t *self)
-{
-    em_list_iter_t *iter;
-    em_list_index_hdr_t *index = self->index->address;
+    items = PySequence_Fast_ITEMS(r);
 
-    if((iter = PyObject_New(em_list_iter_t, &em_list_iter_type)) != NULL)
+    /* Writers get a chance to take the lock between batches. */
+    for(i = 0; i < num_items; i += n)
     {
-        PyObject_Init((PyObject *)iter, &em_list_iter_type);
-        Py_INCREF(self);
-
-        iter->em_list = self;
-        iter->pos = 0;
-        iter->maxpos = index->used;
-    }
-    else
-        PyErr_SetString(PyExc_RuntimeError, "Failed to initialize iterator");
+        n = num_items - i < EM_LIST_BATCH ? num_items - i : EM_LIST_BATCH;
 
-    return (PyObject *)iter;
-}
+        if(em_list_lock(self, 1) != 0)
+            goto _fail;
 
+        /* Readers retry if the writer modified the index meanwhile. */
+        for(;;)
+        {
+            seq = em_list_read_begin(self);
+            ret = em_list_getitem_many(self, &indices[i], n, batch, &items[i]);
 
+            if(em_list_read_retry(self, seq) == 0)
+                break;
 
-/* Standard interface to `open()' and `close()'. */
+            for(j = i; j < i + n; j++)
+                Py_CLEAR(items[j]);
 
-/* Create a new external memory list. */
-static int em_list_create(em_list_t *self)
-{
-    mapped_file_t *mf;
-    em_list_index_hdr_t index_hdr;
-    em_list_values_hdr_t values_hdr;
-    size_t size;
-    char *filename;
-    const char *dirname = self->dirname;
+            PyErr_Clear();
+            lock_release_shared(&self->lock);
 
-    /* Compute initial external memory list index size. */
-    size = EM_LIST_E2S(0);
+            if(em_list_lock(self, 1) != 0)
+                goto _fail;
+        }
 
-    /* Create directory to hold external memory list files. */
-    if(mk_dir(dirname) != 0)
-        goto _err1;
+        lock_release_shared(&self->lock);
 
-    /* Create "index.bin" and write file header. */
-    filename = path_combine(dirname, "index.bin");
-    if((mf = mapped_file_create(filename, size)) == NULL)
-        goto _err2;
+        if(ret != 0)
+            goto _fail;
+    }
 
-    index_hdr.magic = MAGIC;
-    index_hdr.used = 0;
-    index_hdr.capacity = 0;
-    mapped_file_write(mf, &index_hdr, sizeof(em_list_index_hdr_t));
+    goto _err;
 
-    self->index = mf;
+_fail:
+    Py_CLEAR(r);
 
-    /* Create "values.bin" and write file header. */
-    filename = path_combine(dirname, "values.bin");
-    if((mf = mapped_file_create(filename, size)) == NULL)
-        goto _err3;
+_err:
+    PyMem_FREE(batch);
+    PyMem_FREE(indices);
+    Py_XDECREF(keys_seq);
+    return r;
+}
 
-    values_hdr.magic = MAGIC;
-    mapped_file_write(mf, &values_hdr, sizeof(em_list_values_hdr_t));
 
-    self->values = mf;
-    return 0;
 
-_err3:
-    mapped_file_unlink(self->index);
-    mapped_file_close(self->index);
+/* Remove the files copied in directory `dirname' by `em_list_clone()'. */
+static void em_list_remove_clone(const char *dirname)
+{
+    const char *filenames[] = {"index.bin", "classes.bin", "dict.bin"};
+    size_t i;
 
-_err2:
+    for(i = 0; i < sizeof(filenames) / sizeof(filenames[0]); i++)
+        rm_file(path_combine(dirname, filenames[i]));
     rm_dir(dirname);
-
-_err1:
-    PyErr_SetString(PyExc_RuntimeError, "Cannot open EMList");
-    return -1;
 }
 
 
-/* Open existing external memory list. */
-static int em_list_open_existing(em_list_t *self)
+/* Copy the files of `self' in new directory `dirname', except for "values.bin",
+ * which is frozen and added to the `*num_copiesp' copies at `*copiesp', to be
+ * copied once the lock of `self' is released (see `mapped_file_freeze()').
+ */
+static int em_list_clone(em_list_t *self, const char *dirname,
+        file_copy_t **copiesp, size_t *num_copiesp)
 {
-    mapped_file_t *mf;
-    em_list_index_hdr_t *index_hdr;
-    em_list_values_hdr_t *values_hdr;
-    size_t pos;
-    char *filename;
-    const char *dirname = self->dirname;
+    const char *filenames[] = {"index.bin", "classes.bin"};
+    mapped_file_t *mfs[] = {self->index, NULL};
+    size_t i, num_mfs = sizeof(mfs) / sizeof(mfs[0]);
 
-    /* Open and verify "index.bin". */
-    filename = path_combine(dirname, "index.bin");
-    if((mf = mapped_file_open(filename)) == NULL)
+    if(mk_dir(dirname) != 0)
         goto _err1;
 
-    self->index = mf;
-    index_hdr = mf->address;
+    if(self->classes != NULL)
+        mfs[num_mfs - 1] = self->classes->mf;
 
-    if(index_hdr->magic != MAGIC)
-        goto _err2;
+    for(i = 0; i < num_mfs; i++)
+    {
+        if(mfs[i] != NULL &&
+                mapped_file_clone(mfs[i], path_combine(dirname, filenames[i])) != 0)
+            goto _err2;
+    }
 
-    /* Open and verify "values.bin". */
-    filename = path_combine(dirname, "values.bin");
-    if((mf = mapped_file_open(filename)) == NULL)
+    if(compression_copy_dict(EM_COMMON(self), dirname) != 0)
         goto _err2;
 
-    self->values = mf;
-    values_hdr = mf->address;
-
-    pos = mapped_file_get_eof(mf);
-    if(values_hdr->magic != MAGIC || mapped_file_seek(mf, pos, SEEK_SET) != 0)
-        goto _err3;
+    if(mapped_file_freeze(self->values, path_combine(dirname, "values.bin"),
+            copiesp, num_copiesp) != 0)
+        goto _err2;
 
     return 0;
 
-_err3:
-    mapped_file_close(self->values);
-
 _err2:
-    mapped_file_close(self->index);
+    em_list_remove_clone(dirname);
 
 _err1:
-    PyErr_SetString(PyExc_RuntimeError, "Cannot open EMList");
     return -1;
 }
 
 
-/* Called by `em_list_open()' and `em_list_init()'. */
-static int em_list_open_common(em_list_t *self, PyObject *args, PyObject *kwargs)
+/* Copy the files of `self' in directory `dirname' and open the copy read-only.
+ * The copy is consistent, as modifications are blocked while "index.bin" is
+ * copied, and the rest of the files are frozen until copied, so that they keep
+ * holding whatever the copy of "index.bin" refers to. Copying is cheap on file
+ * systems that support sharing blocks between files.
+ */
+static PyObject *em_list_snapshot(em_list_t *self, PyObject *args)
 {
-    PyObject *pickler = NULL, *unpickler = NULL;
-
-    char *dirname, *kwarr[] = {
-        "dirname",
-        "pickler",
-        "unpickler",
-        NULL
-    };
+    char *dirname;
+    file_copy_t *copies = NULL;
+    size_t num_copies = 0;
+    int shared, ret;
+    PyObject *snapshot_args, *snapshot_kwargs, *r = NULL;
 
-    int ret = -1;
+    if(PyArg_ParseTuple(args, "s", &dirname) == 0)
+        goto _err1;
 
-    if(kwargs)
-    {
-        if(PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO", kwarr, &dirname,
-                &pickler, &unpickler) == 0)
-            goto _err;
-    }
-    else
-    {
-        if(PyArg_ParseTuple(args, "s", &dirname) == 0)
-            goto _err;
-    }
+    /* Nothing changes under read-only objects, so they're copied under a shared
+     * lock. Readers can't stop the writer from modifying the files.
+     */
+    shared = self->readonly || self->reader;
+    if(em_list_lock(self, shared) != 0)
+        goto _err1;
 
-    if((self->dirname = PyMem_MALLOC(strlen(dirname) + 1)) == NULL)
+    if(self->reader)
     {
-        PyErr_NoMemory();
-        goto _err;
+        PyErr_SetString(PyExc_RuntimeError, "EMList is open in reader mode");
+        lock_release_shared(&self->lock);
+        goto _err1;
     }
 
-    strcpy(self->dirname, dirname);
-
-    if(pickler && valid_pickler(pickler, &self->pickle) == 0)
-        self->pickler = pickler;
-
-    if(unpickler && valid_unpickler(unpickler, &self->unpickle) == 0)
-        self->unpickler = unpickler;
+    ret = em_list_clone(self, dirname, &copies, &num_copies);
 
-    /* XXX: There's an obvious race condition here, should we care? */
-    if(access(self->dirname, F_OK) == 0)
-        ret = em_list_open_existing(self);
+    if(shared)
+        lock_release_shared(&self->lock);
     else
-        ret = em_list_create(self);
+        lock_release(&self->lock);
 
-    if(ret >= 0)
-        self->is_open = 1;
+    if(ret == 0)
+    {
+        ret = mapped_file_copy_frozen(copies, num_copies);
 
-_err:
-    return ret;
-}
+        /* Chunks freed meanwhile may now be reused, unless `self' was closed. */
+        lock_acquire(&self->lock);
+        if(self->is_open)
+            mapped_file_thaw(self->values);
+        lock_release(&self->lock);
 
+        if(ret != 0)
+            em_list_remove_clone(dirname);
+    }
 
-/* Open external memory list. */
-static PyObject *em_list_open(em_list_t *self, PyObject *args)
-{
-    PyObject *r = NULL;
+    mapped_file_free_copies(copies, num_copies);
 
-    if(self->is_open)
+    if(ret != 0)
     {
-        PyErr_SetString(PyExc_RuntimeError, "EMList already open");
-        goto _err;
+        PyErr_SetString(PyExc_RuntimeError, "Cannot create snapshot");
+        goto _err1;
     }
 
-    if(em_list_open_common(self, args, NULL) != 0)
-        goto _err;
-
-    Py_INCREF(Py_True);
-    r = Py_True;
+    if((snapshot_args = Py_BuildValue("(s)", dirname)) == NULL)
+        goto _err1;
 
-_err:
-    return r;
-}
+    if((snapshot_kwargs = Py_BuildValue("{s:O}", "readonly", Py_True)) == NULL)
+        goto _err2;
 
+    if(self->pickler != NULL &&
+            PyDict_SetItemString(snapshot_kwargs, "pickler", self->pickler) != 0)
+        goto _err3;
 
-/* Synchronize and close an external memory list. */
-static PyObject *em_list_close(em_list_t *self, PyObject *Py_UNUSED(args))
-{
-    mapped_file_t *index = self->index;
-    mapped_file_t *values = self->values;
+    if(self->unpickler != NULL &&
+            PyDict_SetItemString(snapshot_kwargs, "unpickler", self->unpickler) != 0)
+        goto _err3;
 
-    if(self->is_open)
-    {
-        /* Sync and close "index.bin". */
-        mapped_file_sync(index, 0, index->size);
-        mapped_file_close(index);
+    r = PyObject_Call((PyObject *)Py_TYPE(self), snapshot_args, snapshot_kwargs);
 
-        /* Sync and close "values.bin". */
-        mapped_file_sync(values, 0, values->size);
-        mapped_file_truncate(values, mapped_file_get_eof(values));
-        mapped_file_close(values);
+_err3:
+    Py_DECREF(snapshot_kwargs);
 
-        PyMem_FREE(self->dirname);
-        self->is_open = 0;
-    }
+_err2:
+    Py_DECREF(snapshot_args);
 
-    Py_RETURN_NONE;
-};
+_err1:
+    return r;
+}
 
 
 
@@ -624,6 +2307,8 @@ static int em_list_init(em_list_t *self, PyObject *args, PyObject *kwargs)
 {
     int ret = -1;
 
+    lock_acquire(&self->lock);
+
     if(self->is_open)
     {
         PyErr_SetString(PyExc_RuntimeError, "EMList already open");
@@ -636,14 +2321,42 @@ static int em_list_init(em_list_t *self, PyObject *args, PyObject *kwargs)
     ret = 0;
 
 _err:
+    lock_release(&self->lock);
     return ret;
 }
 
 
+/* Called via `tp_new()'. */
+static PyObject *em_list_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwargs)
+{
+    em_list_t *self;
+
+    if((self = (em_list_t *)PyType_GenericNew(type, args, kwargs)) == NULL)
+        goto _err;
+
+    flusher_init(&self->flusher);
+
+    if(lock_init(&self->lock) != 0 || wal_init(&self->wal) != 0)
+    {
+        Py_DECREF(self);
+        self = NULL;
+    }
+
+_err:
+    return (PyObject *)self;
+}
+
+
 /* Called via `tp_dealloc()'. */
 static void em_list_dealloc(em_list_t *self)
 {
-    em_list_close(self, NULL);
+    if(self->lock.initialized)
+    {
+        em_list_close(self, NULL);
+        lock_fini(&self->lock);
+    }
+    wal_fini(&self->wal);
     PyObject_Del(self);
 }
 
@@ -660,6 +2373,13 @@ static PyMethodDef methods[] =
 {
     M_VARARGS("open", em_list_open),
     M_VARARGS("append", em_list_append),
+    M_NOARGS("train_dictionary", em_list_train_dictionary),
+    M_NOARGS("commit", em_list_commit),
+    M_KWARGS("flush", em_list_flush),
+    M_KWARGS("advise", em_list_advise),
+    M_VARARGS("get_many", em_list_get_many),
+    M_KWARGS("scan", em_list_scan),
+    M_VARARGS("snapshot", em_list_snapshot),
     M_NOARGS("close", em_list_close),
     M_NULL
 };
@@ -682,7 +2402,7 @@ static PyTypeObject em_list_type =
     .tp_methods = methods,
     .tp_members = members,
     .tp_init = (initproc)em_list_init,
-    .tp_new = PyType_GenericNew
+    .tp_new = em_list_new
 };
 
 
@@ -4,6 +4,16 @@
 #include <Python.h>
 
 #include "mapped_file.h"
+#include "lock.h"
+#include "wal.h"
+#include "flusher.h"
+
+
+/* Number of items iterators read ahead of their position at a time. */
+#define EM_LIST_READAHEAD (1 << 14)
+
+/* Number of items `get_many()' reads at a time. */
+#define EM_LIST_BATCH 256
 
 
 /* In-file header; "index.bin" begins with this structure. */
@@ -12,16 +22,31 @@ typedef struct em_list_index_hdr
     uint64_t magic;             /* Memory mapped file magic */
     size_t used;                /* Number of used elements */
     size_t capacity;            /* Total number of elements */
+    size_t generation;          /* Bumped when files are resized or replaced */
+    size_t seq;                 /* Odd while the writer modifies the index */
+    size_t flags;               /* Format of the index, `INDEX_XXX' constants */
 } em_list_index_hdr_t;
 
+/* Size of the header above in format version `v' (see "common.h"). */
+#define EM_LIST_INDEX_HDR_SIZE(v) \
+    (sizeof(uint64_t) + (2 + ((v) < 2 ? (v) : 2) + ((v) >= 5)) * sizeof(size_t))
+
 /* In-file header; each entry in "index.bin" has the following format. */
 typedef struct em_list_index_ent
 {
-    size_t value_pos;           /* File offset of value in "values.bin" */
+    size_t value_pos;           /* File offset of value in "values.bin", or
+                                   inline value, see `IS_INLINE()' */
 } em_list_index_ent_t;
 
+/* Format of entries in "index.bin" if `INDEX_COMPACT' is set. */
+typedef struct em_list_compact_ent
+{
+    uint32_t value_pos;         /* `COMPACT_POS()' of value offset, or
+                                   `COMPACT_VALUE_POS()' with `INDEX_INLINE' */
+} em_list_compact_ent_t;
+
 
-/* In-file header; "values.bin" begins with this structure. */
+/* In-file header; each segment of "values.bin" begins with this structure. */
 typedef struct em_list_values_hdr
 {
     uint64_t magic;             /* Memory mapped file magic */
@@ -37,10 +62,26 @@ typedef struct em_list
     PyObject *pickle;
     PyObject *unpickler;
     PyObject *unpickle;
+    int compression;
+    struct lz4_dict *dict;
+    struct class_table *classes;
     char *dirname;              /* Directory holding memory mapped files */
     mapped_file_t *index;       /* Memory mapped file for indeces */
+    size_t index_hdr_size;      /* Size of the header of "index.bin" */
     mapped_file_t *values;      /* Memory mapped file for values */
     char is_open;               /* Non-zero if list is open */
+    char readonly;              /* Non-zero if opened in read-only mode */
+    char reader;                /* Non-zero if opened in reader mode */
+    char compact;               /* Non-zero if "index.bin" has compact entries */
+    char compact_chunks;        /* Non-zero if "values.bin" has compact chunks */
+    char inline_values;         /* Non-zero if small values are kept in "index.bin" */
+    size_t generation;          /* Generation of "index.bin" last seen by reader */
+    lock_t lock;                /* Serializes access to the object */
+    wal_t wal;                  /* Write-ahead log, unless durability is "none" */
+    flusher_t flusher;          /* Background thread, if enabled */
+    char write_back;            /* Non-zero if the flusher starts write back */
+    size_t memory_budget;       /* Bytes allowed to stay resident, 0 if unlimited */
+    size_t evict_hand;          /* Next block of "values.bin" to evict */
 } em_list_t;
 
 
@@ -51,6 +92,13 @@ typedef struct em_list_iter
     em_list_t *em_list;         /* `EMList' object this iterator refers to */
     size_t pos;                 /* Current iterator position */
     size_t maxpos;              /* Maximum iterator position */
+    size_t readahead;           /* Items up to this position have been read ahead */
+    size_t prefetch;            /* Number of items whose values are prefetched */
+    size_t prefetched;          /* Values up to this position have been prefetched */
+    chunk_ref_t *batch;         /* Items collected for prefetching */
+    size_t batch_len;           /* Number of items in `batch' */
+    size_t batch_pos;           /* Next item of `batch' to return */
+    char reorder;               /* Return items of `batch' in order of value */
 } em_list_iter_t;
 
 
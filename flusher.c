@@ -0,0 +1,232 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * flusher.c - Background write back of memory mapped files.
+ *
+ * Left alone, the operating system writes back modified pages of memory mapped
+ * files in bursts, once too many of them have accumulated, stalling processes
+ * that keep modifying them meanwhile. When a flush interval is given, EM
+ * objects start a thread that wakes up every so often and starts write back of
+ * the pages modified since its last run, without waiting for it to complete.
+ * This keeps the number of modified pages bounded and spreads writes evenly.
+ * The same thread keeps the resident size of objects opened with a memory budget
+ * within it.
+ *
+ * The thread takes the GIL and the lock of the EM object on each run, much like
+ * any other Python thread, but holds them only briefly; write back is started
+ * with the GIL released.
+ */
+#ifndef _WIN32
+#include <sys/time.h>
+#include <errno.h>
+#endif
+
+#include "flusher.h"
+
+
+/* Initialize flusher `flusher'. */
+void flusher_init(flusher_t *flusher)
+{
+    memset(flusher, 0, sizeof(flusher_t));
+}
+
+
+#ifdef _WIN32
+
+/* Sleep for the flush interval of `flusher'. Returns non-zero if it has been
+ * asked to exit meanwhile.
+ */
+static int flusher_wait(flusher_t *flusher)
+{
+    return WaitForSingleObject(flusher->event,
+        (DWORD)(flusher->interval * 1000)) == WAIT_OBJECT_0;
+}
+
+#else
+
+/* Sleep for the flush interval of `flusher'. Returns non-zero if it has been
+ * asked to exit meanwhile.
+ */
+static int flusher_wait(flusher_t *flusher)
+{
+    struct timeval now;
+    struct timespec deadline;
+    double secs;
+    int stop;
+
+    gettimeofday(&now, NULL);
+    secs = now.tv_sec + now.tv_usec / 1e6 + flusher->interval;
+    deadline.tv_sec = (time_t)secs;
+    deadline.tv_nsec = (long)((secs - deadline.tv_sec) * 1e9);
+
+    pthread_mutex_lock(&flusher->mutex);
+    while(flusher->stop == 0 &&
+            pthread_cond_timedwait(&flusher->cond, &flusher->mutex,
+                &deadline) != ETIMEDOUT)
+        ;
+    stop = flusher->stop;
+    pthread_mutex_unlock(&flusher->mutex);
+
+    return stop;
+}
+
+#endif /* _WIN32 */
+
+
+/* Body of the thread of `flusher'. */
+static void flusher_run(flusher_t *flusher)
+{
+    PyGILState_STATE state;
+
+    while(flusher_wait(flusher) == 0)
+    {
+        state = PyGILState_Ensure();
+        flusher->fn(flusher->arg);
+        PyGILState_Release(state);
+    }
+}
+
+
+#ifdef _WIN32
+
+static DWORD WINAPI flusher_main(LPVOID arg)
+{
+    flusher_run(arg);
+    return 0;
+}
+
+
+/* Start the thread of `flusher', calling `fn(arg)' every `interval' seconds.
+ * Raises `RuntimeError' on failure.
+ */
+int flusher_start(flusher_t *flusher, double interval, flusher_fn_t fn,
+        void *arg)
+{
+    int ret = -1;
+
+    flusher->fn = fn;
+    flusher->arg = arg;
+    flusher->interval = interval;
+    flusher->stop = 0;
+
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+
+    if((flusher->event = CreateEventA(NULL, TRUE, FALSE, NULL)) == NULL)
+        goto _err1;
+
+    if((flusher->thread = CreateThread(NULL, 0, flusher_main, flusher, 0,
+            NULL)) == NULL)
+        goto _err2;
+
+    flusher->running = 1;
+
+    ret = 0;
+    goto _err1;
+
+_err2:
+    CloseHandle(flusher->event);
+
+_err1:
+    if(ret != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot start flusher thread");
+    return ret;
+}
+
+
+/* Ask the thread of `flusher' to exit and wait for it. Must be called with the
+ * GIL held, and without holding the lock passed to the flusher's function.
+ */
+void flusher_stop(flusher_t *flusher)
+{
+    if(flusher->running)
+    {
+        SetEvent(flusher->event);
+
+        Py_BEGIN_ALLOW_THREADS
+        WaitForSingleObject(flusher->thread, INFINITE);
+        Py_END_ALLOW_THREADS
+
+        CloseHandle(flusher->thread);
+        CloseHandle(flusher->event);
+        flusher->running = 0;
+    }
+}
+
+#else
+
+static void *flusher_main(void *arg)
+{
+    flusher_run(arg);
+    return NULL;
+}
+
+
+/* Start the thread of `flusher', calling `fn(arg)' every `interval' seconds.
+ * Raises `RuntimeError' on failure.
+ */
+int flusher_start(flusher_t *flusher, double interval, flusher_fn_t fn,
+        void *arg)
+{
+    int ret = -1;
+
+    flusher->fn = fn;
+    flusher->arg = arg;
+    flusher->interval = interval;
+    flusher->stop = 0;
+
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+
+    if(pthread_mutex_init(&flusher->mutex, NULL) != 0)
+        goto _err1;
+
+    if(pthread_cond_init(&flusher->cond, NULL) != 0)
+        goto _err2;
+
+    if(pthread_create(&flusher->thread, NULL, flusher_main, flusher) != 0)
+        goto _err3;
+
+    flusher->running = 1;
+
+    ret = 0;
+    goto _err1;
+
+_err3:
+    pthread_cond_destroy(&flusher->cond);
+
+_err2:
+    pthread_mutex_destroy(&flusher->mutex);
+
+_err1:
+    if(ret != 0)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot start flusher thread");
+    return ret;
+}
+
+
+/* Ask the thread of `flusher' to exit and wait for it. Must be called with the
+ * GIL held, and without holding the lock passed to the flusher's function.
+ */
+void flusher_stop(flusher_t *flusher)
+{
+    if(flusher->running)
+    {
+        pthread_mutex_lock(&flusher->mutex);
+        flusher->stop = 1;
+        pthread_cond_signal(&flusher->cond);
+        pthread_mutex_unlock(&flusher->mutex);
+
+        Py_BEGIN_ALLOW_THREADS
+        pthread_join(flusher->thread, NULL);
+        Py_END_ALLOW_THREADS
+
+        pthread_cond_destroy(&flusher->cond);
+        pthread_mutex_destroy(&flusher->mutex);
+        flusher->running = 0;
+    }
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,45 @@
+#ifndef _FLUSHER_H_
+#define _FLUSHER_H_
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+
+/* Seconds between runs of a flusher started only to enforce a memory budget. */
+#define BUDGET_INTERVAL 1.0
+
+/* Called periodically by a flusher's thread, with the GIL held. */
+typedef int (*flusher_fn_t)(void *);
+
+
+/* A background thread that periodically starts write back of an EM object's
+ * modified pages and keeps its resident size within budget.
+ */
+typedef struct flusher
+{
+    flusher_fn_t fn;          /* Function called every `interval' seconds */
+    void *arg;                /* Argument passed to `fn' */
+    double interval;          /* Seconds between calls to `fn' */
+    char running;             /* Non-zero if the thread has been started */
+    char stop;                /* Set to ask the thread to exit */
+#ifdef _WIN32
+    HANDLE thread;            /* Handle of the thread */
+    HANDLE event;             /* Signaled to wake the thread up */
+#else
+    pthread_t thread;         /* Identifier of the thread */
+    pthread_mutex_t mutex;    /* Protects `stop' */
+    pthread_cond_t cond;      /* Signaled to wake the thread up */
+#endif
+} flusher_t;
+
+
+void flusher_init(flusher_t *);
+int flusher_start(flusher_t *, double, flusher_fn_t, void *);
+void flusher_stop(flusher_t *);
+
+#endif /* _FLUSHER_H_ */
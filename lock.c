@@ -0,0 +1,230 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * lock.c - Per-object reader-writer locks and sequence counters.
+ *
+ * Memory mapped files are resized, re-mapped and synchronized to disk with the
+ * GIL released, so that other Python threads keep running meanwhile. Neither
+ * does the GIL exist at all on free-threaded builds of Python. EM objects thus
+ * have their own locks, held for the duration of every operation on them.
+ *
+ * Lookups never modify a memory mapped file, so they take the lock in shared
+ * mode and scale across cores. Modifications take it in exclusive mode, which
+ * is recursive, as operations may re-enter the same object through Python code
+ * (e.g. a `__reduce__()' method storing objects in it). A thread holding the
+ * lock exclusively may also take it in shared mode. The opposite, modifying an
+ * object from within a lookup on it, deadlocks.
+ */
+#include "lock.h"
+
+
+/* The owner is only ever set by the thread holding the lock exclusively, but
+ * it's read by all threads trying to acquire it.
+ */
+#ifdef Py_GIL_DISABLED
+#define LOAD_OWNER(l)     _Py_atomic_load_ulong_relaxed(&(l)->owner)
+#define STORE_OWNER(l, v) _Py_atomic_store_ulong_relaxed(&(l)->owner, (v))
+#else
+#define LOAD_OWNER(l)     ((l)->owner)
+#define STORE_OWNER(l, v) ((l)->owner = (v))
+#endif
+
+
+#ifdef _WIN32
+
+#define RWLOCK_INIT(l)          (InitializeSRWLock(l), 0)
+#define RWLOCK_FINI(l)
+#define RWLOCK_TRYWRLOCK(l)     (TryAcquireSRWLockExclusive(l) ? 0 : -1)
+#define RWLOCK_TRYRDLOCK(l)     (TryAcquireSRWLockShared(l) ? 0 : -1)
+#define RWLOCK_WRLOCK(l)        AcquireSRWLockExclusive(l)
+#define RWLOCK_RDLOCK(l)        AcquireSRWLockShared(l)
+#define RWLOCK_WRUNLOCK(l)      ReleaseSRWLockExclusive(l)
+#define RWLOCK_RDUNLOCK(l)      ReleaseSRWLockShared(l)
+
+#else
+
+#define RWLOCK_INIT(l)          pthread_rwlock_init(l, NULL)
+#define RWLOCK_FINI(l)          pthread_rwlock_destroy(l)
+#define RWLOCK_TRYWRLOCK(l)     pthread_rwlock_trywrlock(l)
+#define RWLOCK_TRYRDLOCK(l)     pthread_rwlock_tryrdlock(l)
+#define RWLOCK_WRLOCK(l)        pthread_rwlock_wrlock(l)
+#define RWLOCK_RDLOCK(l)        pthread_rwlock_rdlock(l)
+#define RWLOCK_WRUNLOCK(l)      pthread_rwlock_unlock(l)
+#define RWLOCK_RDUNLOCK(l)      pthread_rwlock_unlock(l)
+
+#endif /* _WIN32 */
+
+
+#ifdef _WIN32
+#define MEMORY_BARRIER() MemoryBarrier()
+#else
+#define MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+
+/* Start reading data protected by sequence counter `seq'. */
+size_t seq_read_begin(volatile size_t *seq)
+{
+    size_t ret = *seq;
+
+    MEMORY_BARRIER();
+    return ret;
+}
+
+
+/* Check if data read since `seq_read_begin()' returned `start' may have been
+ * modified meanwhile, in which case it has to be read again.
+ */
+int seq_read_retry(volatile size_t *seq, size_t start)
+{
+    MEMORY_BARRIER();
+    return (start & 1) != 0 || *seq != start;
+}
+
+
+/* Start modifying data protected by sequence counter `seq'. */
+void seq_write_begin(volatile size_t *seq)
+{
+    *seq += 1;
+    MEMORY_BARRIER();
+}
+
+
+/* Finish modifying data protected by sequence counter `seq'. */
+void seq_write_end(volatile size_t *seq)
+{
+    MEMORY_BARRIER();
+    *seq += 1;
+}
+
+
+/* Initialize lock `lock'. Raises `MemoryError' on failure. */
+int lock_init(lock_t *lock)
+{
+    int ret = -1;
+
+    if(RWLOCK_INIT(&lock->rwlock) != 0)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    lock->owner = 0;
+    lock->depth = 0;
+    lock->initialized = 1;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Check if the calling thread holds lock `lock' exclusively. */
+static int lock_is_owned(lock_t *lock, unsigned long owner)
+{
+    return LOAD_OWNER(lock) == owner;
+}
+
+
+/* Acquire lock `lock' exclusively. */
+void lock_acquire(lock_t *lock)
+{
+    unsigned long owner = (unsigned long)PyThread_get_thread_ident();
+
+    if(lock_is_owned(lock, owner))
+    {
+        lock->depth += 1;
+        return;
+    }
+
+    /* Don't bother releasing the GIL if the lock is free. */
+    if(RWLOCK_TRYWRLOCK(&lock->rwlock) != 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        RWLOCK_WRLOCK(&lock->rwlock);
+        Py_END_ALLOW_THREADS
+    }
+
+    STORE_OWNER(lock, owner);
+    lock->depth = 1;
+}
+
+
+/* Acquire lock `lock' exclusively, unless it's held by another thread. Returns
+ * -1 without waiting in that case.
+ */
+int lock_try_acquire(lock_t *lock)
+{
+    unsigned long owner = (unsigned long)PyThread_get_thread_ident();
+
+    if(lock_is_owned(lock, owner))
+    {
+        lock->depth += 1;
+        return 0;
+    }
+
+    if(RWLOCK_TRYWRLOCK(&lock->rwlock) != 0)
+        return -1;
+
+    STORE_OWNER(lock, owner);
+    lock->depth = 1;
+    return 0;
+}
+
+
+/* Acquire lock `lock' in shared mode. */
+void lock_acquire_shared(lock_t *lock)
+{
+    unsigned long owner = (unsigned long)PyThread_get_thread_ident();
+
+    /* Already held exclusively by the calling thread; just nest. */
+    if(lock_is_owned(lock, owner))
+    {
+        lock->depth += 1;
+        return;
+    }
+
+    if(RWLOCK_TRYRDLOCK(&lock->rwlock) != 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        RWLOCK_RDLOCK(&lock->rwlock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+
+/* Release exclusively held lock `lock'. */
+void lock_release(lock_t *lock)
+{
+    lock->depth -= 1;
+
+    if(lock->depth == 0)
+    {
+        STORE_OWNER(lock, 0);
+        RWLOCK_WRUNLOCK(&lock->rwlock);
+    }
+}
+
+
+/* Release lock `lock' held in shared mode. */
+void lock_release_shared(lock_t *lock)
+{
+    unsigned long owner = (unsigned long)PyThread_get_thread_ident();
+
+    if(lock_is_owned(lock, owner))
+        lock_release(lock);
+    else
+        RWLOCK_RDUNLOCK(&lock->rwlock);
+}
+
+
+/* Free resources held by lock `lock'. */
+void lock_fini(lock_t *lock)
+{
+    if(lock->initialized)
+    {
+        RWLOCK_FINI(&lock->rwlock);
+        lock->initialized = 0;
+    }
+}
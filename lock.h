@@ -0,0 +1,50 @@
+#ifndef _LOCK_H_
+#define _LOCK_H_
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+
+/* A reader-writer lock serializing access to an EM object. Lookups take it in
+ * shared mode and may run concurrently; everything else takes it in exclusive
+ * mode, which is recursive. It may be held while the GIL is released (e.g.
+ * while resizing or synchronizing memory mapped files). Waiting for it always
+ * releases the GIL, so that its holders can make progress.
+ */
+typedef struct lock
+{
+#ifdef _WIN32
+    SRWLOCK rwlock;           /* Underlying non-recursive reader-writer lock */
+#else
+    pthread_rwlock_t rwlock;  /* Underlying non-recursive reader-writer lock */
+#endif
+    unsigned long owner;      /* Identifier of the thread holding it exclusively */
+    size_t depth;             /* Number of times `owner' acquired the lock */
+    char initialized;         /* Non-zero if `rwlock' has been initialized */
+} lock_t;
+
+
+/* Sequence counters in memory mapped files are used as seqlocks, protecting
+ * readers in other processes from seeing data modified while being read. The
+ * writer keeps the counter odd while modifying data. Readers never wait; they
+ * retry instead, if the counter was odd or changed while they were reading.
+ */
+size_t seq_read_begin(volatile size_t *);
+int seq_read_retry(volatile size_t *, size_t);
+void seq_write_begin(volatile size_t *);
+void seq_write_end(volatile size_t *);
+
+int lock_init(lock_t *);
+void lock_acquire(lock_t *);
+int lock_try_acquire(lock_t *);
+void lock_acquire_shared(lock_t *);
+void lock_release(lock_t *);
+void lock_release_shared(lock_t *);
+void lock_fini(lock_t *);
+
+#endif /* _LOCK_H_ */
@@ -0,0 +1,454 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * lz4.c - Minimal, self-contained implementation of the LZ4 block format.
+ *
+ * Only raw blocks are supported; there's no support for the LZ4 frame format,
+ * as the chunk headers in "mapped_file.c" already record everything we need to
+ * know about a compressed chunk. The compressor is a simple greedy one, using a
+ * single hash table of 4 byte sequences, much like the reference fast mode.
+ *
+ * Each block is a series of sequences. Each sequence begins with a token, whose
+ * high nibble holds the number of literals and whose low nibble holds the match
+ * length minus `MIN_MATCH'. A nibble value of 15 means that the length goes on
+ * in the following bytes (each byte of value 255 means "add 255 and continue").
+ * Literals follow, then a 2 byte little endian match offset. The last sequence
+ * of a block is literals only.
+ *
+ * An optional dictionary may be given to both the compressor and decompressor;
+ * it's treated as if it immediately preceded the data, so match offsets may
+ * point back into it. This is what makes compressing small records worthwhile,
+ * as they rarely contain enough redundancy on their own.
+ */
+#include "lz4.h"
+
+
+#define HASH_LOG      LZ4_HASH_LOG
+#define HASH_SIZE     LZ4_HASH_SIZE
+#define MIN_MATCH     4
+#define LAST_LITERALS 5
+#define MF_LIMIT      12
+#define MAX_DISTANCE  65535
+#define SKIP_TRIGGER  6
+
+/* Parameters used when training dictionaries; see `lz4_dict_train()'. */
+#define TRAIN_DMER     6
+#define TRAIN_SEGMENT  48
+#define TRAIN_HASH_LOG 20
+
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+
+static unsigned int hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+
+/* Write the continuation bytes of a literal or match length. */
+static unsigned char *write_length(unsigned char *op, size_t len)
+{
+    while(len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+
+/* Write a sequence of `lit' literals starting at `anchor', optionally followed
+ * by a match of length `len' at distance `off'. A `len' of 0 denotes the last,
+ * literals only, sequence of a block. Returns `NULL' if `dst' is too small.
+ */
+static unsigned char *write_sequence(unsigned char *op, unsigned char *oend,
+        const unsigned char *anchor, size_t lit, size_t off, size_t len)
+{
+    unsigned char *token;
+
+    if((size_t)(oend - op) < 1 + lit + lit / 255 + 1 + 2 + len / 255 + 1)
+        return NULL;
+
+    token = op++;
+
+    if(lit >= 15)
+    {
+        *token = 15 << 4;
+        op = write_length(op, lit - 15);
+    }
+    else
+        *token = (unsigned char)(lit << 4);
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if(len != 0)
+    {
+        *op++ = (unsigned char)(off & 0xff);
+        *op++ = (unsigned char)(off >> 8);
+
+        len -= MIN_MATCH;
+        if(len >= 15)
+        {
+            *token |= 15;
+            op = write_length(op, len - 15);
+        }
+        else
+            *token |= (unsigned char)len;
+    }
+
+    return op;
+}
+
+
+/* Compress `src_size' bytes at `src' into `dst', optionally using dictionary
+ * `dict'. Returns the size of the compressed block, or -1 if it doesn't fit in
+ * `dst_size' bytes.
+ */
+ssize_t lz4_compress(const char *src, size_t src_size, char *dst,
+        size_t dst_size, const lz4_dict_t *dict)
+{
+    uint32_t table[HASH_SIZE];
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *ref;
+    const unsigned char *iend = base + src_size;
+    const unsigned char *mflimit, *matchlimit;
+    const unsigned char *dbase = NULL;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_size;
+    unsigned int h, searches;
+    size_t len, off, dpos, dsize = 0;
+
+    ssize_t ret = -1;
+
+    if(src_size > LZ4_MAX_INPUT_SIZE)
+        goto _err;
+
+    if(dict != NULL)
+    {
+        dbase = (const unsigned char *)dict->data;
+        dsize = dict->size;
+    }
+
+    /* Inputs shorter than this are stored as a single run of literals. */
+    if(src_size > MF_LIMIT)
+    {
+        mflimit = iend - MF_LIMIT;
+        matchlimit = iend - LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        searches = 1 << SKIP_TRIGGER;
+
+        while(ip < mflimit)
+        {
+            h = hash32(read32(ip));
+            ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            len = 0;
+
+            if(ref < ip && ip - ref <= MAX_DISTANCE && read32(ref) == read32(ip))
+            {
+                while(ip > anchor && ref > base && ip[-1] == ref[-1])
+                {
+                    ip -= 1;
+                    ref -= 1;
+                }
+
+                len = MIN_MATCH;
+                while(ip + len < matchlimit && ip[len] == ref[len])
+                    len += 1;
+
+                off = ip - ref;
+            }
+
+            /* No match in the data seen so far; look in the dictionary. Matches
+             * in the dictionary don't extend past its end.
+             */
+            else if(dsize != 0)
+            {
+                dpos = dict->table[h];
+                off = (ip - base) + (dsize - dpos);
+
+                if(dpos + MIN_MATCH <= dsize && off <= MAX_DISTANCE &&
+                        read32(dbase + dpos) == read32(ip))
+                {
+                    len = MIN_MATCH;
+                    while(ip + len < matchlimit && dpos + len < dsize &&
+                            ip[len] == dbase[dpos + len])
+                        len += 1;
+                }
+            }
+
+            if(len == 0)
+            {
+                /* Move faster over incompressible data. */
+                ip += searches++ >> SKIP_TRIGGER;
+                continue;
+            }
+
+            if((op = write_sequence(op, oend, anchor, ip - anchor, off,
+                    len)) == NULL)
+                goto _err;
+
+            ip += len;
+            anchor = ip;
+            searches = 1 << SKIP_TRIGGER;
+
+            if(ip < mflimit)
+                table[hash32(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    if((op = write_sequence(op, oend, anchor, iend - anchor, 0, 0)) == NULL)
+        goto _err;
+
+    ret = (ssize_t)(op - (unsigned char *)dst);
+
+_err:
+    return ret;
+}
+
+
+/* Decompress block `src' into `dst', stopping once `dst_size' bytes have been
+ * produced. Trailing bytes in `src' (e.g. padding) are ignored. The block must
+ * have been compressed using the same dictionary `dict', if any. Returns the
+ * number of bytes written to `dst' or -1 if the block is malformed.
+ */
+ssize_t lz4_decompress(const char *src, size_t src_size, char *dst,
+        size_t dst_size, const lz4_dict_t *dict)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_size;
+    const unsigned char *ref;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_size;
+    unsigned char token, b;
+    size_t lit, len, off, produced, n;
+
+    ssize_t ret = -1;
+
+    while(ip < iend)
+    {
+        token = *ip++;
+
+        lit = token >> 4;
+        if(lit == 15)
+        {
+            do
+            {
+                if(ip >= iend)
+                    goto _err;
+                b = *ip++;
+                lit += b;
+            }
+            while(b == 255);
+        }
+
+        if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+            goto _err;
+
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        /* The last sequence carries no match. */
+        if(op == oend || ip >= iend)
+            break;
+
+        if(iend - ip < 2)
+            goto _err;
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        produced = (size_t)(op - (unsigned char *)dst);
+        if(off == 0 || (off > produced &&
+                (dict == NULL || off - produced > dict->size)))
+            goto _err;
+
+        len = token & 15;
+        if(len == 15)
+        {
+            do
+            {
+                if(ip >= iend)
+                    goto _err;
+                b = *ip++;
+                len += b;
+            }
+            while(b == 255);
+        }
+        len += MIN_MATCH;
+
+        if((size_t)(oend - op) < len)
+            goto _err;
+
+        /* Matches beginning in the dictionary may continue at the beginning of
+         * the output.
+         */
+        if(off > produced)
+        {
+            n = off - produced;
+            if(n > len)
+                n = len;
+
+            memcpy(op, dict->data + dict->size - (off - produced), n);
+            op += n;
+            len -= n;
+            off = produced + n;
+        }
+
+        /* Matches may overlap with the bytes they produce. */
+        ref = op - off;
+        if(off >= len)
+        {
+            memcpy(op, ref, len);
+            op += len;
+        }
+        else
+        {
+            while(len--)
+                *op++ = *ref++;
+        }
+    }
+
+    ret = (ssize_t)(op - (unsigned char *)dst);
+
+_err:
+    return ret;
+}
+
+
+/* Prepare dictionary `dict' with `size' bytes of contents at `data'. Only the
+ * last `LZ4_MAX_DICT_SIZE' bytes are used.
+ */
+void lz4_dict_init(lz4_dict_t *dict, const char *data, size_t size)
+{
+    size_t i;
+
+    if(size > LZ4_MAX_DICT_SIZE)
+    {
+        data += size - LZ4_MAX_DICT_SIZE;
+        size = LZ4_MAX_DICT_SIZE;
+    }
+
+    memcpy(dict->data, data, size);
+    dict->size = size;
+
+    /* Later positions overwrite earlier ones, so that the closest candidate
+     * (i.e. the one with the smallest offset) is remembered.
+     */
+    memset(dict->table, 0, sizeof(dict->table));
+    for(i = 0; i + MIN_MATCH <= size; i++)
+        dict->table[hash32(read32((unsigned char *)dict->data + i))] = (uint32_t)i;
+}
+
+
+static unsigned int hash_dmer(const unsigned char *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, TRAIN_DMER);
+    return (unsigned int)((v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_HASH_LOG));
+}
+
+
+/* Train a dictionary of at most `dict_size' bytes from `samples_size' bytes of
+ * concatenated sample data, using a simplified version of the COVER algorithm
+ * found in Zstandard. Sample data is split in as many epochs as there are
+ * segments in the dictionary; from each epoch, the segment whose d-mers occur
+ * most frequently across all samples is selected. The frequencies of selected
+ * d-mers are then reset, so that they don't contribute to subsequent picks.
+ * Segments picked first end up at the end of the dictionary, where they are
+ * cheapest to refer to. Returns the size of the dictionary, or 0 on failure.
+ */
+size_t lz4_dict_train(const char *samples, size_t samples_size, char *dict,
+        size_t dict_size)
+{
+    const unsigned char *data = (const unsigned char *)samples;
+    uint32_t *freqs;
+    size_t num_epochs, epoch_size, begin, end, best_pos, tail, i, e;
+    uint64_t score, best_score;
+
+    size_t ret = 0;
+
+    if(dict_size > LZ4_MAX_DICT_SIZE)
+        dict_size = LZ4_MAX_DICT_SIZE;
+
+    if(samples_size < 2 * TRAIN_SEGMENT || dict_size < TRAIN_SEGMENT)
+        goto _err;
+
+    if((freqs = PyMem_MALLOC(sizeof(uint32_t) << TRAIN_HASH_LOG)) == NULL)
+        goto _err;
+
+    memset(freqs, 0, sizeof(uint32_t) << TRAIN_HASH_LOG);
+
+    for(i = 0; i + TRAIN_DMER <= samples_size; i++)
+        freqs[hash_dmer(data + i)] += 1;
+
+    num_epochs = dict_size / TRAIN_SEGMENT;
+    epoch_size = samples_size / num_epochs;
+    if(epoch_size < TRAIN_SEGMENT)
+    {
+        epoch_size = TRAIN_SEGMENT;
+        num_epochs = samples_size / TRAIN_SEGMENT;
+    }
+
+    tail = dict_size;
+
+    for(e = 0; e < num_epochs && tail >= TRAIN_SEGMENT; e++)
+    {
+        begin = e * epoch_size;
+        end = begin + epoch_size;
+        if(end > samples_size)
+            end = samples_size;
+
+        if(end - begin < TRAIN_SEGMENT)
+            break;
+
+        /* Slide a window of `TRAIN_SEGMENT - TRAIN_DMER + 1' d-mers over the
+         * epoch and remember the best scoring position.
+         */
+        score = 0;
+        for(i = begin; i + TRAIN_DMER <= begin + TRAIN_SEGMENT; i++)
+            score += freqs[hash_dmer(data + i)];
+
+        best_score = score;
+        best_pos = begin;
+
+        for(i = begin + 1; i + TRAIN_SEGMENT <= end; i++)
+        {
+            score -= freqs[hash_dmer(data + i - 1)];
+            score += freqs[hash_dmer(data + i + TRAIN_SEGMENT - TRAIN_DMER)];
+            if(score > best_score)
+            {
+                best_score = score;
+                best_pos = i;
+            }
+        }
+
+        if(best_score == 0)
+            continue;
+
+        tail -= TRAIN_SEGMENT;
+        memcpy(dict + tail, data + best_pos, TRAIN_SEGMENT);
+
+        for(i = best_pos; i + TRAIN_DMER <= best_pos + TRAIN_SEGMENT; i++)
+            freqs[hash_dmer(data + i)] = 0;
+    }
+
+    PyMem_FREE(freqs);
+
+    memmove(dict, dict + tail, dict_size - tail);
+    ret = dict_size - tail;
+
+_err:
+    return ret;
+}
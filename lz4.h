@@ -0,0 +1,35 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include "common.h"
+
+/* Maximum size of the LZ4 compressed representation of `x' bytes. */
+#define LZ4_COMPRESS_BOUND(x) ((x) + ((x) / 255) + 16)
+
+/* Maximum input size accepted by `lz4_compress()'. */
+#define LZ4_MAX_INPUT_SIZE 0x7e000000
+
+/* Dictionaries are limited by the maximum match distance. */
+#define LZ4_MAX_DICT_SIZE 65535
+
+#define LZ4_HASH_LOG  12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_LOG)
+
+
+/* A prepared compression dictionary. Dictionary contents logically precede the
+ * data being compressed, so matches may refer back into the dictionary.
+ */
+typedef struct lz4_dict
+{
+    size_t size;                       /* Dictionary size */
+    uint32_t table[LZ4_HASH_SIZE];     /* Hash table of dictionary positions */
+    char data[LZ4_MAX_DICT_SIZE];      /* Dictionary contents */
+} lz4_dict_t;
+
+
+ssize_t lz4_compress(const char *, size_t, char *, size_t, const lz4_dict_t *);
+ssize_t lz4_decompress(const char *, size_t, char *, size_t, const lz4_dict_t *);
+void lz4_dict_init(lz4_dict_t *, const char *, size_t);
+size_t lz4_dict_train(const char *, size_t, char *, size_t);
+
+#endif /* _LZ4_H_ */
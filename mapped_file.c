@@ -22,14 +22,25 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 #endif
 
 #include "util.h"
+#include "lz4.h"
 #include "marshaller.h"
 #include "mapped_file.h"
 
 
+static int mapped_file_attach_pool(mapped_file_t *, buffer_pool_t *);
+
+
 /* Holes in the memory mapped buffer are ordered by size in a red-black tree. */
 static int hole_cmp(const void *a, const void *b)
 {
@@ -78,16 +89,39 @@ _err1:
 /* Deallocate a mapped file object. */
 static void mapped_file_free(mapped_file_t *mf)
 {
+    PyMem_FREE(mf->dirty);
+    PyMem_FREE(mf->unscheduled);
+    PyMem_FREE(mf->segments);
     PyMem_FREE(mf->filename);
     rbtree_free(mf->holes);
+    if(mf->pending != NULL)
+        rbtree_free(mf->pending);
     PyMem_FREE(mf);
 }
 
 
+/* Return the segment of segmented file `mf' holding position `*posp', which is
+ * made relative to the segment, or `NULL' if there's no such segment.
+ */
+static mapped_file_t *mapped_file_segment(mapped_file_t *mf, size_t *posp)
+{
+    size_t segment = SEGMENT_OF(*posp);
+
+    if(segment >= mf->num_segments)
+        return NULL;
+
+    *posp = SEGMENT_OFFSET(*posp);
+    return mf->segments[segment];
+}
+
+
 /* Make sure it's safe to access `size' bytes starting from position `pos'. */
 static int mapped_file_check_range(mapped_file_t *mf, size_t pos,
         size_t size)
 {
+    if(mf->options & MF_SEGMENTED && (mf = mapped_file_segment(mf, &pos)) == NULL)
+        return 0;
+
     return (size <= SSIZE_MAX && pos <= SSIZE_MAX && pos + size <= mf->size);
 }
 
@@ -101,7 +135,7 @@ static int mapped_file_ensure_range(mapped_file_t *mf, size_t pos,
     size_t mf_size = mf->size;
     int ret = -1;
 
-    if(size > SSIZE_MAX || pos > SSIZE_MAX)
+    if(size > SSIZE_MAX || pos > SSIZE_MAX || mf->readonly)
         goto _err;
 
     if(mf_size < pos + size)
@@ -113,6 +147,11 @@ static int mapped_file_ensure_range(mapped_file_t *mf, size_t pos,
             mf_size += mf_size >> 1;
         }
 
+        /* Segments never grow past `SEGMENT_SIZE'. */
+        if(mf->options & MF_SEGMENT && mf_size > SEGMENT_SIZE &&
+                pos + size <= SEGMENT_SIZE)
+            mf_size = SEGMENT_SIZE;
+
         if(mapped_file_truncate(mf, mf_size) != 0)
             goto _err;
     }
@@ -133,7 +172,14 @@ ssize_t mapped_file_read(mapped_file_t *mf, void *buf, size_t size)
     if(mapped_file_check_range(mf, mf_pos, size) == 0)
         goto _err;
 
-    memcpy(buf, (char *)mf->address + mf_pos, size);
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_pread(mf->pool, mf->pool_file, buf, size, mf_pos) < 0)
+            goto _err;
+    }
+    else
+        memcpy(buf, (char *)mf->address + mf_pos, size);
+
     mf->pos += size;
     ret = size;
 
@@ -142,6 +188,58 @@ _err:
 }
 
 
+/* Equivalent to `pread()' for memory mapped files. Unlike `mapped_file_read()',
+ * the file position is not used nor modified, so it's safe to call concurrently
+ * from multiple threads.
+ */
+ssize_t mapped_file_pread(mapped_file_t *mf, void *buf, size_t size,
+        size_t pos)
+{
+    ssize_t ret = -1;
+
+    if(mf->options & MF_SEGMENTED && (mf = mapped_file_segment(mf, &pos)) == NULL)
+        goto _err;
+
+    if(mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_pread(mf->pool, mf->pool_file, buf, size, pos) < 0)
+            goto _err;
+    }
+    else
+        memcpy(buf, (char *)mf->address + pos, size);
+
+    ret = size;
+
+_err:
+    return ret;
+}
+
+
+/* Return a pointer to `size' bytes starting from position `pos' in mapped file
+ * `mf', or `NULL' if they lie outside the mapped buffer or if the file is not
+ * mapped at all. The pointer is only valid until the file is resized, so it
+ * must not be held across calls that may write to `mf'.
+ */
+void *mapped_file_ptr(mapped_file_t *mf, size_t pos, size_t size)
+{
+    void *ret = NULL;
+
+    if(mf->options & MF_SEGMENTED && (mf = mapped_file_segment(mf, &pos)) == NULL)
+        goto _err;
+
+    if(mf->pool != NULL || mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    ret = (char *)mf->address + pos;
+
+_err:
+    return ret;
+}
+
+
 /* Equivalent to `write()' for memory mapped files. */
 ssize_t mapped_file_write(mapped_file_t *mf, void *buf, size_t size)
 {
@@ -151,7 +249,15 @@ ssize_t mapped_file_write(mapped_file_t *mf, void *buf, size_t size)
     if(mapped_file_ensure_range(mf, mf_pos, size) != 0)
         goto _err;
 
-    memcpy((char *)mf->address + mf_pos, buf, size);
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_pwrite(mf->pool, mf->pool_file, buf, size, mf_pos) < 0)
+            goto _err;
+    }
+    else
+        memcpy((char *)mf->address + mf_pos, buf, size);
+
+    mapped_file_mark_dirty(mf, mf_pos, size);
 
     mf_pos += size;
     if(mf_pos > mf->eof)
@@ -165,6 +271,40 @@ _err:
 }
 
 
+/* Equivalent to `pwrite()' for memory mapped files. Mapped file may be resized
+ * to fulfil the request, but the file position is left untouched.
+ */
+ssize_t mapped_file_pwrite(mapped_file_t *mf, void *buf, size_t size,
+        size_t pos)
+{
+    ssize_t ret = -1;
+
+    if(mf->options & MF_SEGMENTED && (mf = mapped_file_segment(mf, &pos)) == NULL)
+        goto _err;
+
+    if(mapped_file_ensure_range(mf, pos, size) != 0)
+        goto _err;
+
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_pwrite(mf->pool, mf->pool_file, buf, size, pos) < 0)
+            goto _err;
+    }
+    else
+        memcpy((char *)mf->address + pos, buf, size);
+
+    mapped_file_mark_dirty(mf, pos, size);
+
+    if(pos + size > mf->eof)
+        mf->eof = pos + size;
+
+    ret = size;
+
+_err:
+    return ret;
+}
+
+
 /* Safe `memset()' of a mapped file's contents. Sets `size' bytes starting from
  * position `pos'.
  */
@@ -176,7 +316,15 @@ int mapped_file_memset(mapped_file_t *mf, int c, size_t size)
     if(mapped_file_ensure_range(mf, mf_pos, size) != 0)
         goto _err;
 
-    memset((char *)mf->address + mf_pos, c, size);
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_memset(mf->pool, mf->pool_file, c, size, mf_pos) != 0)
+            goto _err;
+    }
+    else
+        memset((char *)mf->address + mf_pos, c, size);
+
+    mapped_file_mark_dirty(mf, mf_pos, size);
 
     mf_pos += size;
     if(mf_pos > mf->eof)
@@ -190,6 +338,71 @@ _err:
 }
 
 
+/* Grow block bitmap `*bitmap' from `size' to `new_size' bytes. */
+static int grow_bitmap(unsigned char **bitmap, size_t size, size_t new_size)
+{
+    unsigned char *new_bitmap;
+    int ret = -1;
+
+    if((new_bitmap = PyMem_REALLOC(*bitmap, new_size)) == NULL)
+        goto _err;
+
+    memset(&new_bitmap[size], 0, new_size - size);
+    *bitmap = new_bitmap;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Record that `size' bytes starting from position `pos' in mapped file `mf'
+ * were modified, so that `mapped_file_flush()' writes them back. Must be called
+ * by code that modifies the mapped buffer directly, rather than through the
+ * functions above. If the bitmaps can't be grown, the whole file is considered
+ * dirty instead.
+ */
+void mapped_file_mark_dirty(mapped_file_t *mf, size_t pos, size_t size)
+{
+    size_t block, last, dirty_size;
+
+    if(mf->options & MF_SEGMENTED && (mf = mapped_file_segment(mf, &pos)) == NULL)
+        goto _err;
+
+    if(size == 0 || mf->all_dirty)
+        goto _err;
+
+    block = pos / DIRTY_BLOCK_SIZE;
+    last = (pos + size - 1) / DIRTY_BLOCK_SIZE;
+
+    if(last / 8 >= mf->dirty_size)
+    {
+        dirty_size = mf->dirty_size << 1;
+        if(dirty_size <= last / 8)
+            dirty_size = last / 8 + 1;
+
+        if(grow_bitmap(&mf->dirty, mf->dirty_size, dirty_size) != 0 ||
+                grow_bitmap(&mf->unscheduled, mf->dirty_size, dirty_size) != 0)
+        {
+            mf->all_dirty = 1;
+            goto _err;
+        }
+
+        mf->dirty_size = dirty_size;
+    }
+
+    for(; block <= last; block++)
+    {
+        mf->dirty[block / 8] |= 1 << (block % 8);
+        mf->unscheduled[block / 8] |= 1 << (block % 8);
+    }
+
+_err:
+    return;
+}
+
+
 /* Equivalent to `fseek()' for memory mapped files. */
 int mapped_file_seek(mapped_file_t *mf, ssize_t off, int whence)
 {
@@ -225,407 +438,356 @@ size_t mapped_file_get_size(mapped_file_t *mf)
 }
 
 
-/* Get current EOF position of mapped file `mf'. */
+/* Get current EOF position of mapped file `mf'. For segmented files, that's
+ * the EOF position of the last segment.
+ */
 size_t mapped_file_get_eof(mapped_file_t *mf)
 {
+    mapped_file_t *last;
+
+    if(mf->options & MF_SEGMENTED)
+    {
+        last = mf->segments[mf->num_segments - 1];
+        return SEGMENT_POS(mf->num_segments - 1, last->eof);
+    }
+
     return mf->eof;
 }
 
 
-/* Return the position of a chunk of size `size' in memory mapped file `mf'.
- * It's safe to seek there and write `size' bytes. On error -1 is returned.
+/* Return the name of segment `segment' of segmented file `filename' in a newly
+ * allocated buffer.
  */
-ssize_t mapped_file_allocate_chunk(mapped_file_t *mf, size_t size)
+static char *segment_filename(const char *filename, size_t segment)
 {
-    hole_t hole;
-    rbnode_t *node;
-    size_t pos;
+    size_t size = strlen(filename) + 24;
+    char *name;
 
-    ssize_t ret = -1;
+    if((name = PyMem_MALLOC(size)) == NULL)
+        goto _err;
 
+    if(segment == 0)
+        strcpy(name, filename);
+    else
+        snprintf(name, size, "%s.%lu", filename, (unsigned long)segment);
 
-    if(size > SSIZE_MAX)
-        goto _err;
+_err:
+    return name;
+}
 
-    size = HOLE_SIZE(size);
 
-    hole.pos = 0;
-    hole.size = size;
-    node = rbtree_find_node(mf->holes, &hole);
+/* Append a new segment to segmented file `mf'. If `create' is non-zero, the
+ * segment is created, otherwise the next existing one is opened. Returns 1 if
+ * there's no next segment, or if it's not ready yet, as the writer creates the
+ * segment before writing its magic number.
+ */
+static int mapped_file_add_segment(mapped_file_t *mf, int create)
+{
+    mapped_file_t *segment, **segments;
+    uint64_t magic = MAGIC;
+    size_t num_segments = mf->num_segments;
+    int options = (mf->options & ~MF_SEGMENTED) | MF_SEGMENT;
+    char *filename;
 
-    if(node == NULL)
+    int ret = -1;
+
+    if(num_segments > (SSIZE_MAX >> SEGMENT_SHIFT))
+        goto _err1;
+
+    if((filename = segment_filename(mf->filename, num_segments)) == NULL)
+        goto _err1;
+
+    if(create == 0 && num_segments > 0 && file_exists(filename) == 0)
     {
-        pos = mf->eof;
-        if(mapped_file_seek(mf, pos, SEEK_SET) != 0)
-            goto _err;
+        ret = 1;
+        goto _err2;
+    }
 
-        if(mapped_file_write(mf, &size, sizeof(size_t)) != sizeof(size_t))
-            goto _err;
+    if((segments = PyMem_REALLOC(mf->segments,
+            (num_segments + 1) * sizeof(mapped_file_t *))) == NULL)
+        goto _err2;
 
-        size -= sizeof(size_t);
-        if(mapped_file_memset(mf, 0, size) != 0)
-            goto _err;
+    mf->segments = segments;
+
+    if(create)
+    {
+        if((segment = mapped_file_create(filename, SEGMENT_INITIAL_SIZE,
+                options)) == NULL)
+            goto _err2;
+
+        if(mapped_file_write(segment, &magic, sizeof(uint64_t)) != sizeof(uint64_t))
+            goto _err3;
     }
     else
     {
-        pos = ((hole_t *)node->data)->pos;
-        PyMem_FREE(node->data);
-        rbtree_delete_node(mf->holes, node);
+        if((segment = mapped_file_open(filename, mf->readonly, options)) == NULL)
+            goto _err2;
+
+        if(mapped_file_pread(segment, &magic, sizeof(uint64_t), 0) !=
+                sizeof(uint64_t) || magic != MAGIC)
+        {
+            if(num_segments > 0)
+                ret = 1;
+            goto _err3;
+        }
     }
 
-    ret = (ssize_t)(pos + sizeof(size_t));
+    if(mf->pool != NULL && mapped_file_attach_pool(segment, mf->pool) != 0)
+        goto _err3;
+
+    segments[num_segments] = segment;
+    mf->num_segments = num_segments + 1;
+    mf->size += segment->size;
 
-_err:
+    ret = 0;
+    goto _err2;
+
+_err3:
+    if(create)
+        mapped_file_unlink(segment);
+    mapped_file_close(segment);
+
+_err2:
+    PyMem_FREE(filename);
+
+_err1:
     return ret;
 }
 
 
-/* Mark the chunk at position `pos' in mapped file `mf' as free. Chunk must have
- * been allocated using `mapped_file_allocate_chunk()'.
+/* Open existing segmented file `filename', along with all of its segments.
+ * Files written whole by earlier versions hold plain positions, which are taken
+ * the same way in their first segment, unless they grew past `SEGMENT_SIZE', in
+ * which case they're opened whole again.
  */
-void mapped_file_free_chunk(mapped_file_t *mf, size_t pos)
+static mapped_file_t *mapped_file_open_segmented(const char *filename,
+        int readonly, int options)
 {
-    hole_t *hole;
+    mapped_file_t *mf;
     size_t size;
+    int ret;
 
-    pos -= sizeof(size_t);
-    if(mapped_file_seek(mf, pos, SEEK_SET) != 0)
-        goto _err;
+    if(file_size(filename, &size) == 0 && size > SEGMENT_SIZE)
+        return mapped_file_open(filename, readonly, options & ~MF_SEGMENTED);
 
-    if(mapped_file_read(mf, &size, sizeof(size_t)) != sizeof(size_t))
-        goto _err;
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err1;
 
-    if(mapped_file_check_range(mf, pos, size) == 0)
-        goto _err;
+    mf->readonly = (char)readonly;
+    mf->options = options;
 
-    if((hole = PyMem_MALLOC(sizeof(hole_t))) == NULL)
-        goto _err;
+    while((ret = mapped_file_add_segment(mf, 0)) == 0)
+        ;
 
-    hole->pos = pos;
-    hole->size = size;
-    rbtree_insert_node(mf->holes, hole);
+    if(ret < 0)
+        goto _err2;
 
-_err:
-    return;
+    return mf;
+
+_err2:
+    mapped_file_close(mf);
+
+_err1:
+    return NULL;
 }
 
 
-/* Allocate a chunk of appropriate size from mapped file `mf' and marshal Python
- * string object `obj' in it.
- */
-static ssize_t mapped_file_marshal_string_object(mapped_file_t *mf,
-        PyObject *obj)
+/* Create segmented file `filename', made of a single segment for now. */
+static mapped_file_t *mapped_file_create_segmented(const char *filename,
+        int options)
 {
-    Py_ssize_t size;
-    char *data;
-    ssize_t pos, ret = -1;
+    mapped_file_t *mf;
 
-#if PY_MAJOR_VERSION >= 3
-    if(PyBytes_AsStringAndSize(obj, &data, &size) == -1)
-        goto _err;
-#else
-    if(PyString_AsStringAndSize(obj, &data, &size) == -1)
-        goto _err;
-#endif
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err1;
 
-    if((pos = mapped_file_allocate_chunk(mf, (size_t)size)) < 0)
-        goto _err;
+    mf->options = options;
 
-    if((size_t)pos != mapped_file_tell(mf) &&
-            mapped_file_seek(mf, pos, SEEK_SET) != 0)
-    {
-        mapped_file_free_chunk(mf, pos);
-        goto _err;
-    }
+    if(mapped_file_add_segment(mf, 1) != 0)
+        goto _err2;
 
-    if(mapped_file_write(mf, data, size) != size)
-    {
-        mapped_file_free_chunk(mf, pos);
-        goto _err;
-    }
+    return mf;
 
-    ret = pos;
+_err2:
+    mapped_file_close(mf);
 
-_err:
-    return ret;
+_err1:
+    return NULL;
 }
 
 
-/* Allocate a chunk of appropriate size from mapped file `mf' and marshal Python
- * object `obj' in it.
+/* Truncate the segment of segmented file `mf' holding position `size' there,
+ * and the ones before it at their EOF. Later segments are left alone.
  */
-ssize_t mapped_file_marshal_object(em_common_t *em_obj, mapped_file_t *mf,
-        PyObject *obj)
+static int mapped_file_truncate_segmented(mapped_file_t *mf, size_t size)
 {
-    PyObject *str;
+    mapped_file_t *segment;
+    size_t i, segment_size;
 
-    ssize_t pos = -1;
+    int ret = 0;
 
-    if((str = marshal(em_obj, obj)) == NULL)
-        goto _err;
+    for(i = 0; i < mf->num_segments && i <= SEGMENT_OF(size); i++)
+    {
+        segment = mf->segments[i];
+        segment_size = i < SEGMENT_OF(size) ? segment->eof : SEGMENT_OFFSET(size);
 
-    pos = mapped_file_marshal_string_object(mf, str);
-    Py_DECREF(str);
+        mf->size -= segment->size;
+        if(mapped_file_truncate(segment, segment_size) != 0)
+            ret = -1;
+        mf->size += segment->size;
+    }
 
-_err:
-    return pos;
+    return ret;
 }
 
 
-/* Return the size of chunk at position `pos' in mapped file `mf'. Chunk must
- * have been allocated using `mapped_file_allocate_chunk()'.
+/* Re-map the segments of read-only segmented file `mf' and open the ones added
+ * by the writer since.
  */
-static ssize_t mapped_file_get_chunk_size(mapped_file_t *mf, size_t pos)
+static int mapped_file_remap_segmented(mapped_file_t *mf)
 {
-    size_t size;
-    ssize_t ret = -1;
+    mapped_file_t *segment;
+    size_t i;
 
-    pos -= sizeof(size_t);
-    if(pos != mapped_file_tell(mf) &&
-            mapped_file_seek(mf, (ssize_t)pos, SEEK_SET) != 0)
-        goto _err;
+    int ret = -1;
 
-    if(mapped_file_read(mf, &size, sizeof(size_t)) != sizeof(size_t))
-        goto _err;
-
-    ret = (ssize_t)(size - sizeof(size_t));
-
-_err:
-    return ret;
-}
-
-
-/* Unmarshal a Python object from position `pos' in memory mapped file `mf'. */
-PyObject *mapped_file_unmarshal_object(em_common_t *em_obj, mapped_file_t *mf,
-        size_t pos)
-{
-    ssize_t size;
-    PyObject *str, *ret = NULL;
+    for(i = 0; i < mf->num_segments; i++)
+    {
+        segment = mf->segments[i];
 
-    /* The call to `mapped_file_get_chunk_size()' will seek to the correct
-     * position in the memory mapped file.
-     */
-    if((size = mapped_file_get_chunk_size(mf, pos)) < 0)
-        goto _err;
+        mf->size -= segment->size;
+        ret = mapped_file_remap(segment);
+        mf->size += segment->size;
 
-#if PY_MAJOR_VERSION >= 3
-    if((str = PyBytes_FromStringAndSize((char *)mf->address + pos, size)) == NULL)
-        goto _err;
-#else
-    if((str = PyString_FromStringAndSize((char *)mf->address + pos, size)) == NULL)
-        goto _err;
-#endif
+        if(ret != 0)
+            goto _err;
+    }
 
-    ret = unmarshal(em_obj, str);
+    while((ret = mapped_file_add_segment(mf, 0)) == 0)
+        ;
 
-    Py_DECREF(str);
+    if(ret > 0)
+        ret = 0;
 
 _err:
     return ret;
 }
 
 
-#ifdef _WIN32
-
-/* Truncate file `fd' at `size' bytes and map it in memory. */
-static void *map_file(HANDLE fd, LARGE_INTEGER size)
+/* Copy the segments of segmented file `mf' in new files named after `filename'. */
+static int mapped_file_clone_segmented(mapped_file_t *mf, const char *filename)
 {
-    LARGE_INTEGER disk_size, cur_off;
-    HANDLE h;
-    void *address;
+    size_t i;
+    char *name;
 
+    int ret = -1;
 
-    if(size.QuadPart < 0 || size.QuadPart > SSIZE_MAX)
-        goto _err1;
-
-    GetFileSizeEx(fd, &disk_size);
+    for(i = 0; i < mf->num_segments; i++)
+    {
+        if((name = segment_filename(filename, i)) == NULL)
+            goto _err;
 
-    if(size.QuadPart == 0)
-        size = disk_size;
+        ret = mapped_file_clone(mf->segments[i], name);
+        PyMem_FREE(name);
 
-    /* Quoting the MSDN page for `SetFilePointerEx()':
-     *
-     * "If the file is extended, the contents of the file between the old end of
-     * the file and the new end of the file are not guaranteed to be zero; the
-     * behavior is defined by the file system."
-     *
-     * Looks like for NTFS, the extended part of the file is filled with zeros.
-     */
-    if(SetFilePointerEx(fd, size, &cur_off, FILE_BEGIN) == FALSE)
-    {
-        serror("map_file: SetFilePointerEx");
-        goto _err1;
+        if(ret != 0)
+            goto _err;
     }
 
-    if(SetEndOfFile(fd) == FALSE)
-    {
-        serror("map_file: SetEndOfFile");
-        goto _err2;
-    }
+    ret = 0;
+    goto _ok;
 
-    if((h = CreateFileMappingA(fd, NULL, PAGE_READWRITE, 0, 0, NULL)) == NULL)
+_err:
+    ret = -1;
+    while(i-- > 0)
     {
-        serror("map_file: CreateFileMappingA");
-        goto _err3;
+        if((name = segment_filename(filename, i)) != NULL)
+        {
+            rm_file(name);
+            PyMem_FREE(name);
+        }
     }
 
-    if((address = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, 0)) == NULL)
-        serror("map_file: MapViewOfFile");
-
-    /* We need not keep a reference to the file mapping object, we can safely
-     * close it now. Quoting the MSDN page for `CreateFileMapping()':
-     *
-     * "Mapped views of a file mapping object maintain internal references to
-     * the object, and a file mapping object does not close until all references
-     * to it are released. Therefore, to fully close a file mapping object, an
-     * application must unmap all mapped views of the file mapping object by
-     * calling UnmapViewOfFile and close the file mapping object handle by
-     * calling CloseHandle. These functions can be called in any order."
-     */
-    CloseHandle(h);
-    return address;
-
-_err3:
-    SetFilePointerEx(fd, disk_size, NULL, FILE_BEGIN);
-    SetEndOfFile(fd);
-
-_err2:
-    SetFilePointerEx(fd, cur_off, NULL, FILE_BEGIN);
-
-_err1:
-    return NULL;
+_ok:
+    return ret;
 }
 
 
-/* Open existing file `filename' and map it in memory. */
-mapped_file_t *mapped_file_open(const char *filename)
+/* Unlink all segments of segmented file `mf'. */
+static int mapped_file_unlink_segmented(mapped_file_t *mf)
 {
-    HANDLE fd;
-    LARGE_INTEGER disk_size;
-    void *address;
-    mapped_file_t *mf;
+    size_t i;
+    int ret = 0;
 
-    if((fd = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE,
-            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-            OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
+    for(i = 0; i < mf->num_segments; i++)
     {
-        serror("mapped_file_open: CreateFileA");
-        goto _err1;
+        if(mapped_file_unlink(mf->segments[i]) != 0)
+            ret = -1;
     }
 
-    GetFileSizeEx(fd, &disk_size);
-
-    if((address = map_file(fd, disk_size)) == NULL)
-        goto _err2;
-
-    if((mf = mapped_file_alloc(filename)) == NULL)
-        goto _err3;
-
-    mf->fd = fd;
-    mf->address = address;
-    mf->size = (size_t)disk_size.QuadPart;
-    mf->eof = (size_t)disk_size.QuadPart;
-    return mf;
-
-_err3:
-    UnmapViewOfFile(address);
-
-_err2:
-    CloseHandle(fd);
-
-_err1:
-    return NULL;
+    return ret;
 }
 
 
-/* Create file `filename', truncate it at `size' bytes and map it in memory. */
-mapped_file_t *mapped_file_create(const char *filename, size_t size)
+/* Close all segments of segmented file `mf', as well as their shared buffer
+ * pool, if any.
+ */
+static void mapped_file_close_segmented(mapped_file_t *mf)
 {
-    HANDLE fd;
-    LARGE_INTEGER lsize;
-    void *address;
-    mapped_file_t *mf;
-
-    if((fd = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
-        CREATE_ALWAYS, 0, NULL)) == INVALID_HANDLE_VALUE)
-    {
-        serror("mapped_file_create: CreateFileA");
-        goto _err1;
-    }
-
-    lsize.QuadPart = size;
-    if((address = map_file(fd, lsize)) == NULL)
-        goto _err2;
-
-    if((mf = mapped_file_alloc(filename)) == NULL)
-        goto _err3;
+    size_t i;
 
-    mf->fd = fd;
-    mf->address = address;
-    mf->size = size;
-    return mf;
+    for(i = 0; i < mf->num_segments; i++)
+        mapped_file_close(mf->segments[i]);
 
-_err3:
-    UnmapViewOfFile(address);
-
-_err2:
-    CloseHandle(fd);
+    if(mf->pool != NULL)
+        buffer_pool_free(mf->pool);
 
-_err1:
-    return NULL;
+    mapped_file_free(mf);
 }
 
 
-/* Synchronize memory contents to disk. */
-int mapped_file_sync(mapped_file_t *mf, size_t pos, size_t size)
+/* Read the size header of the chunk at position `pos' in mapped file `mf', as
+ * a `size_t', in `*hdrp'.
+ */
+static int mapped_file_read_chunk_header(mapped_file_t *mf, size_t pos,
+        size_t *hdrp)
 {
+    uint32_t hdr;
     int ret = -1;
 
-    if(mapped_file_check_range(mf, pos, size) == 0)
+    if(mf->options & MF_COMPACT_CHUNKS)
+    {
+        if(mapped_file_pread(mf, &hdr, sizeof(uint32_t),
+                pos - sizeof(uint32_t)) != sizeof(uint32_t))
+            goto _err;
+        *hdrp = hdr;
+    }
+    else if(mapped_file_pread(mf, hdrp, sizeof(size_t),
+            pos - sizeof(size_t)) != sizeof(size_t))
         goto _err;
 
-    ret = FlushViewOfFile((char *)mf->address + pos, size);
+    ret = 0;
 
 _err:
     return ret;
 }
 
 
-/* Give kernel a hint about the type of access we are going to perform. It's a
- * no-op for now; may be implemented in the future using `ReOpenFile()'.
- */
-int mapped_file_set_access(mapped_file_t *mf, int advice)
-{
-    UNREFERENCED_PARAMETER(mf);
-    UNREFERENCED_PARAMETER(advice);
-    return 0;
-}
-
-
-/* Equivalent to `ftruncate()' for memory mapped files. */
-int mapped_file_truncate(mapped_file_t *mf, size_t size)
+/* Write the size header of the chunk at position `pos' in mapped file `mf'. */
+static int mapped_file_write_chunk_header(mapped_file_t *mf, size_t pos,
+        size_t hdr)
 {
-    LARGE_INTEGER lsize;
-    void *address;
+    uint32_t compact_hdr = (uint32_t)hdr;
+    void *data = &hdr;
+    size_t size = CHUNK_HEADER_SIZE(mf);
     int ret = -1;
 
-    /* We need to unmap before actually re-mapping the file. Unfortunately,
-     * there's no `mremap()' equivalent on Microsoft Windows.
-     */
-    UnmapViewOfFile(mf->address);
+    if(mf->options & MF_COMPACT_CHUNKS)
+        data = &compact_hdr;
 
-    lsize.QuadPart = size;
-    if((address = map_file(mf->fd, lsize)) == NULL)
+    if(mapped_file_pwrite(mf, data, size, pos - size) != (ssize_t)size)
         goto _err;
 
-    mf->address = address;
-    mf->size = size;
-    if(mf->pos > size)
-        mf->pos = size;
-    if(mf->eof > size)
-        mf->eof = size;
-
     ret = 0;
 
 _err:
@@ -633,385 +795,2776 @@ _err:
 }
 
 
-/* Equivalent to `rename()' for memory mapped files. */
-int mapped_file_rename(mapped_file_t *mf, const char *filename)
+/* Append a chunk of `size' bytes, including its size header, at the EOF of
+ * mapped file `mf'. Returns the position past the chunk's header.
+ */
+static ssize_t mapped_file_append_chunk(mapped_file_t *mf, size_t size)
 {
-    char *filename_p;
+    size_t pos = CHUNK_START(mf, mf->eof), header_size = CHUNK_HEADER_SIZE(mf);
 
-    int ret = -1;
+    ssize_t ret = -1;
 
-    if((filename_p = PyMem_MALLOC(strlen(filename) + 1)) == NULL)
+    /* Zero the padding left before the first compact chunk, if any. */
+    if(mapped_file_seek(mf, mf->eof, SEEK_SET) != 0)
         goto _err;
 
-    strcpy(filename_p, filename);
-
-    if(MoveFileExA(mf->filename, filename,
-            MOVEFILE_WRITE_THROUGH | MOVEFILE_REPLACE_EXISTING) == 0)
-    {
-        serror("mapped_file_rename: MoveFileExA");
-        PyMem_FREE(filename_p);
+    if(mapped_file_memset(mf, 0, pos - mf->eof + size) != 0)
         goto _err;
-    }
 
-    PyMem_FREE(mf->filename);
-    mf->filename = filename_p;
+    if(mapped_file_write_chunk_header(mf, pos + header_size, size) != 0)
+        goto _err;
 
-    ret = 0;
+    ret = (ssize_t)(pos + header_size);
 
 _err:
     return ret;
 }
 
 
-/* Instructs Microsoft Windows to delete the file once it's closed. We can't
- * directly delete the file in any other way and the whole process should be
- * transparent to the user.
+/* Append a chunk of `size' bytes, including its size header, in the last
+ * segment of segmented file `mf', adding a new segment if it doesn't fit.
  */
-int mapped_file_unlink(mapped_file_t *mf)
+static ssize_t mapped_file_append_segmented_chunk(mapped_file_t *mf,
+        size_t size)
 {
-    HANDLE fd;
-
-    int ret = -1;
+    mapped_file_t *segment;
+    ssize_t pos, ret = -1;
 
-    if((fd = ReOpenFile(mf->fd,  GENERIC_READ | GENERIC_WRITE,
-            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-            FILE_FLAG_DELETE_ON_CLOSE)) == INVALID_HANDLE_VALUE)
+    if(size > SEGMENT_SIZE - CHUNK_START(mf, sizeof(uint64_t)))
     {
-        serror("mapped_file_unlink: ReOpenFile");
+        PyErr_SetString(PyExc_ValueError, "Object too large");
         goto _err;
     }
 
-    CloseHandle(mf->fd);
-    mf->fd = fd;
+    segment = mf->segments[mf->num_segments - 1];
+    if(CHUNK_START(mf, segment->eof) + size > SEGMENT_SIZE)
+    {
+        if(mapped_file_add_segment(mf, 1) != 0)
+            goto _err;
+        segment = mf->segments[mf->num_segments - 1];
+    }
 
-    ret = 0;
+    mf->size -= segment->size;
+    pos = mapped_file_append_chunk(segment, size);
+    mf->size += segment->size;
+
+    if(pos < 0)
+        goto _err;
+
+    ret = (ssize_t)SEGMENT_POS(mf->num_segments - 1, (size_t)pos);
 
 _err:
     return ret;
 }
 
 
-/* Equivalent to `close()' for memory mapped files. It's not safe to access `mf'
- * after a call to `mapped_file_close()'.
+/* Return the position of a chunk of size `size' in memory mapped file `mf'.
+ * It's safe to seek there and write `size' bytes. On error -1 is returned.
  */
-void mapped_file_close(mapped_file_t *mf)
+ssize_t mapped_file_allocate_chunk(mapped_file_t *mf, size_t size)
 {
-    UnmapViewOfFile(mf->address);
-    CloseHandle(mf->fd);
-    mapped_file_free(mf);
-}
-
-
-#else
+    hole_t hole;
+    rbnode_t *node;
 
-/* Truncate file `fd' at `size' bytes and map it in memory. */
-static void *map_file(int fd, size_t size)
-{
-    struct stat st;
+    ssize_t ret = -1;
 
-    void *address = NULL;
 
     if(size > SSIZE_MAX)
         goto _err;
 
-    /* Use `fstat()' to read file's original size. */
-    if(fstat(fd, &st) != 0)
+    if((size = HOLE_SIZE(mf, size)) > CHUNK_SIZE_MAX(mf))
     {
-        serror("map_file: fstat");
+        PyErr_SetString(PyExc_ValueError, "Object too large");
         goto _err;
     }
 
-    if(ftruncate(fd, size) != 0)
-    {
+    hole.pos = 0;
+    hole.size = size;
+    node = rbtree_find_node(mf->holes, &hole);
+
+    if(node == NULL)
+    {
+        if(mf->options & MF_SEGMENTED)
+            ret = mapped_file_append_segmented_chunk(mf, size);
+        else
+            ret = mapped_file_append_chunk(mf, size);
+    }
+    else
+    {
+        ret = (ssize_t)(((hole_t *)node->data)->pos + CHUNK_HEADER_SIZE(mf));
+        PyMem_FREE(node->data);
+        rbtree_delete_node(mf->holes, node);
+    }
+
+_err:
+    return ret;
+}
+
+
+/* Mark the chunk at position `pos' in mapped file `mf' as free. Chunk must have
+ * been allocated using `mapped_file_allocate_chunk()'.
+ */
+void mapped_file_free_chunk(mapped_file_t *mf, size_t pos)
+{
+    hole_t *hole;
+    size_t size;
+
+    if(mapped_file_read_chunk_header(mf, pos, &size) != 0)
+        goto _err;
+
+    pos -= CHUNK_HEADER_SIZE(mf);
+    size = CHUNK_SIZE(size);
+    if(mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    if((hole = PyMem_MALLOC(sizeof(hole_t))) == NULL)
+        goto _err;
+
+    hole->pos = pos;
+    hole->size = size;
+    rbtree_insert_node(mf->pending != NULL ? mf->pending : mf->holes, hole);
+
+_err:
+    return;
+}
+
+
+/* Start deferring frees of chunks in mapped file `mf' until they're released by
+ * `mapped_file_release_chunks()', if `defer' is non-zero, or stop deferring,
+ * releasing chunks freed so far, otherwise. Write-ahead logs rely on this to
+ * keep chunks referred to by a checkpoint intact until the next one, snapshots
+ * to keep the chunks they copy intact. Calls to start and stop deferring must be
+ * balanced.
+ */
+int mapped_file_defer_frees(mapped_file_t *mf, int defer)
+{
+    int ret = -1;
+
+    if(defer && mf->pending == NULL &&
+            (mf->pending = rbtree_alloc(hole_cmp)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    if(defer)
+        mf->deferrals += 1;
+    else if(mf->deferrals > 0 && --mf->deferrals == 0)
+    {
+        mapped_file_release_chunks(mf);
+        rbtree_free(mf->pending);
+        mf->pending = NULL;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Set `MF_COMPACT_CHUNKS' on mapped file `mf', and on its segments, if any.
+ * Used when the format of an existing file is recorded elsewhere.
+ */
+void mapped_file_set_compact_chunks(mapped_file_t *mf)
+{
+    size_t i;
+
+    mf->options |= MF_COMPACT_CHUNKS;
+    for(i = 0; i < mf->num_segments; i++)
+        mf->segments[i]->options |= MF_COMPACT_CHUNKS;
+}
+
+
+/* Chunk references are ordered by chunk position. */
+static int chunk_ref_cmp(const void *a, const void *b)
+{
+    chunk_ref_t *ra = (chunk_ref_t *)a;
+    chunk_ref_t *rb = (chunk_ref_t *)b;
+    int ret = 0;
+
+    if(ra->pos < rb->pos)
+        ret = -1;
+    if(ra->pos > rb->pos)
+        ret = 1;
+    return ret;
+}
+
+
+/* Make chunks of mapped file `mf' freed while frees were deferred available for
+ * reuse, unless someone else defers frees too.
+ */
+void mapped_file_release_chunks(mapped_file_t *mf)
+{
+    rbnode_t *node;
+
+    if(mf->pending == NULL || mf->deferrals > 1)
+        return;
+
+    while((node = RBTREE_FIRST(mf->pending)) != RBTREE_NIL(mf->pending))
+        rbtree_insert_node(mf->holes, rbtree_delete_node(mf->pending, node));
+}
+
+
+/* Copy the contents of mapped file `mf' in file `filename', which is replaced
+ * only once the copy is on disk, so that it holds either its old contents or
+ * the new ones, whenever the system crashes.
+ */
+int mapped_file_save(mapped_file_t *mf, const char *filename)
+{
+    char *tmp_filename, *p;
+
+    int ret = -1;
+
+    if((tmp_filename = PyMem_MALLOC(strlen(filename) + 5)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err1;
+    }
+
+    sprintf(tmp_filename, "%s.tmp", filename);
+
+    /* Leftovers of a crash while saving are discarded. */
+    rm_file(tmp_filename);
+
+    if(mapped_file_clone(mf, tmp_filename) != 0)
+        goto _err2;
+
+    if(sync_file(tmp_filename) != 0 || mv_file(tmp_filename, filename) != 0)
+    {
+        rm_file(tmp_filename);
+        goto _err2;
+    }
+
+    /* The directory holding the new file has to reach the disk as well. */
+    if((p = strrchr(tmp_filename, PATH_SEP)) != NULL)
+    {
+        *p = 0;
+        if(sync_file(tmp_filename) != 0)
+            goto _err2;
+    }
+
+    ret = 0;
+
+_err2:
+    PyMem_FREE(tmp_filename);
+
+_err1:
+    return ret;
+}
+
+
+/* Add mapped file `mf' to the `*num_copiesp' copies at `*copiesp', to be copied
+ * in file `filename' by `mapped_file_copy_frozen()' once the lock of the owner
+ * of `mf' is released. Only the contents up to the current EOF are copied, and,
+ * until `mapped_file_thaw()' is called, freed chunks aren't reused, so the copy
+ * holds all chunks allocated so far, as they are now, even if `mf' keeps being
+ * modified meanwhile.
+ */
+int mapped_file_freeze(mapped_file_t *mf, const char *filename,
+        file_copy_t **copiesp, size_t *num_copiesp)
+{
+    mapped_file_t **mfs = &mf;
+    file_copy_t *copies, *copy;
+    size_t i, num_mfs = 1;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+    {
+        mfs = mf->segments;
+        num_mfs = mf->num_segments;
+    }
+
+    if((copies = PyMem_REALLOC(*copiesp,
+            (*num_copiesp + num_mfs) * sizeof(file_copy_t))) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    *copiesp = copies;
+
+    for(i = 0; i < num_mfs; i++)
+    {
+        /* Buffered files are written back first. */
+        if(mfs[i]->pool != NULL && buffer_pool_flush(mfs[i]->pool,
+                mfs[i]->pool_file, 0, mfs[i]->size) != 0)
+            goto _err;
+
+        copy = &copies[*num_copiesp];
+        copy->src = PyMem_MALLOC(strlen(mfs[i]->filename) + 1);
+        copy->dst = segment_filename(filename, i);
+        copy->size = mfs[i]->eof;
+
+        if(copy->src == NULL || copy->dst == NULL)
+        {
+            PyMem_FREE(copy->src);
+            PyMem_FREE(copy->dst);
+            PyErr_NoMemory();
+            goto _err;
+        }
+
+        strcpy(copy->src, mfs[i]->filename);
+        *num_copiesp += 1;
+    }
+
+    /* Nothing is freed in read-only files. */
+    if(mf->readonly == 0 && mapped_file_defer_frees(mf, 1) != 0)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Let chunks of mapped file `mf' freed since `mapped_file_freeze()' be reused. */
+void mapped_file_thaw(mapped_file_t *mf)
+{
+    if(mf->readonly == 0)
+        mapped_file_defer_frees(mf, 0);
+}
+
+
+/* Deallocate `num_copies' copies at `copies'. */
+void mapped_file_free_copies(file_copy_t *copies, size_t num_copies)
+{
+    size_t i;
+
+    for(i = 0; i < num_copies; i++)
+    {
+        PyMem_FREE(copies[i].src);
+        PyMem_FREE(copies[i].dst);
+    }
+    PyMem_FREE(copies);
+}
+
+
+/* Start reading in `[start, end)' in mapped file `mf', clipped to its size. */
+static void mapped_file_prefetch_range(mapped_file_t *mf, size_t start,
+        size_t end)
+{
+    if(end > mf->size)
+        end = mf->size;
+
+    if(start < end)
+        mapped_file_advise(mf, start, end - start, MF_ACCESS_WILLNEED);
+}
+
+
+/* Read the blocks holding the first `PREFETCH_SIZE' bytes of the chunks
+ * referenced by the `num_refs' entries of `refs', sorted by chunk position, in
+ * the buffer pool of `mf', all at once.
+ */
+static void mapped_file_prefetch_blocks(mapped_file_t *mf, chunk_ref_t *refs,
+        size_t num_refs)
+{
+    size_t i, block, last, n = 0, *blocks, header_size = CHUNK_HEADER_SIZE(mf);
+
+    /* Chunks overlap with two blocks at most. */
+    if((blocks = PyMem_NEW(size_t, num_refs * 2)) == NULL)
+        goto _err;
+
+    for(i = 0; i < num_refs; i++)
+    {
+        if(refs[i].pos < header_size)
+            continue;
+
+        block = (refs[i].pos - header_size) / BUFFER_BLOCK_SIZE;
+        last = (refs[i].pos - header_size + PREFETCH_SIZE - 1) /
+            BUFFER_BLOCK_SIZE;
+
+        for(; block <= last; block++)
+            if(n == 0 || blocks[n - 1] < block)
+                blocks[n++] = block;
+    }
+
+    buffer_pool_prefetch(mf->pool, mf->pool_file, blocks, n);
+    PyMem_FREE(blocks);
+
+_err:
+    return;
+}
+
+
+/* Prefetch chunks of segmented file `mf' referenced by the `num_refs' entries
+ * of `refs', sorted by chunk position, one segment at a time.
+ */
+static void mapped_file_prefetch_segmented(mapped_file_t *mf, chunk_ref_t *refs,
+        size_t num_refs)
+{
+    size_t i, j, k, segment;
+
+    for(i = 0; i < num_refs; i = j)
+    {
+        segment = SEGMENT_OF(refs[i].pos);
+        for(j = i; j < num_refs && SEGMENT_OF(refs[j].pos) == segment; j++)
+            refs[j].pos = SEGMENT_OFFSET(refs[j].pos);
+
+        if(segment < mf->num_segments)
+            mapped_file_prefetch_chunks(mf->segments[segment], &refs[i], j - i);
+
+        for(k = i; k < j; k++)
+            refs[k].pos = SEGMENT_POS(segment, refs[k].pos);
+    }
+}
+
+
+/* Start reading in the chunks referenced by the `num_refs' entries of `refs',
+ * without waiting for them. Sorts `refs' by chunk position, so that nearby
+ * chunks are read in by a single call. Only the first `PREFETCH_SIZE' bytes of
+ * each chunk are read in, as reading chunk headers would block; the kernel's
+ * own read ahead takes care of the rest of larger chunks. Chunks of buffered
+ * files are read in the buffer pool instead, all at once, and waited for.
+ */
+void mapped_file_prefetch_chunks(mapped_file_t *mf, chunk_ref_t *refs,
+        size_t num_refs)
+{
+    size_t i, pos, start = 0, end = 0, header_size = CHUNK_HEADER_SIZE(mf);
+
+    qsort(refs, num_refs, sizeof(chunk_ref_t), chunk_ref_cmp);
+
+    if(mf->options & MF_SEGMENTED)
+    {
+        mapped_file_prefetch_segmented(mf, refs, num_refs);
+        return;
+    }
+
+    if(mf->pool != NULL)
+    {
+        mapped_file_prefetch_blocks(mf, refs, num_refs);
+        return;
+    }
+
+    for(i = 0; i < num_refs; i++)
+    {
+        if(refs[i].pos < header_size)
+            continue;
+
+        /* Include the chunk's size header. */
+        pos = refs[i].pos - header_size;
+
+        if(start < end && pos <= end)
+        {
+            if(pos + PREFETCH_SIZE > end)
+                end = pos + PREFETCH_SIZE;
+            continue;
+        }
+
+        mapped_file_prefetch_range(mf, start, end);
+        start = pos;
+        end = pos + PREFETCH_SIZE;
+    }
+
+    mapped_file_prefetch_range(mf, start, end);
+}
+
+
+/* Set the flags in the size header of the chunk at position `pos'. */
+static int mapped_file_set_chunk_flags(mapped_file_t *mf, size_t pos,
+        size_t flags)
+{
+    size_t size;
+    int ret = -1;
+
+    if(mapped_file_read_chunk_header(mf, pos, &size) != 0)
+        goto _err;
+
+    if(mapped_file_write_chunk_header(mf, pos, CHUNK_SIZE(size) | flags) != 0)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Compress `size' bytes at `data', using dictionary `dict' if not `NULL', in a
+ * newly allocated buffer returned in `*bufp'. The buffer begins with the
+ * uncompressed size as a `uint32_t'. If the data is not worth compressing (i.e.
+ * the chunk in mapped file `mf' wouldn't get smaller), -1 is returned and
+ * `*bufp' is left untouched.
+ */
+static ssize_t mapped_file_compress(mapped_file_t *mf, const char *data,
+        size_t size, const lz4_dict_t *dict, char **bufp)
+{
+    char *buf;
+    uint32_t raw_size;
+    ssize_t csize, ret = -1;
+
+    if(size > LZ4_MAX_INPUT_SIZE)
+        goto _err;
+
+    if((buf = PyMem_MALLOC(sizeof(uint32_t) + LZ4_COMPRESS_BOUND(size))) == NULL)
+        goto _err;
+
+    raw_size = (uint32_t)size;
+    memcpy(buf, &raw_size, sizeof(uint32_t));
+
+    if((csize = lz4_compress(data, size, buf + sizeof(uint32_t),
+            LZ4_COMPRESS_BOUND(size), dict)) < 0 ||
+            HOLE_SIZE(mf, sizeof(uint32_t) + csize) >= HOLE_SIZE(mf, size))
+    {
+        PyMem_FREE(buf);
+        goto _err;
+    }
+
+    *bufp = buf;
+    ret = (ssize_t)(sizeof(uint32_t) + csize);
+
+_err:
+    return ret;
+}
+
+
+/* Allocate a chunk of appropriate size from mapped file `mf' and store Python
+ * string object `obj', as returned by `marshal()', in it, compressing it first
+ * if `em_obj' asks for it.
+ */
+ssize_t mapped_file_marshal_string_object(em_common_t *em_obj,
+        mapped_file_t *mf, PyObject *obj)
+{
+    Py_ssize_t size;
+    char *data, *buf = NULL;
+    lz4_dict_t *dict = NULL;
+    size_t threshold = COMPRESSION_THRESHOLD, flags = 0;
+    ssize_t csize, pos, ret = -1;
+
+#if PY_MAJOR_VERSION >= 3
+    if(PyBytes_AsStringAndSize(obj, &data, &size) == -1)
+        goto _err;
+#else
+    if(PyString_AsStringAndSize(obj, &data, &size) == -1)
+        goto _err;
+#endif
+
+    if(em_obj->compression == COMPRESSION_LZ4_DICT && em_obj->dict != NULL)
+    {
+        dict = em_obj->dict;
+        threshold = DICT_COMPRESSION_THRESHOLD;
+    }
+
+    if(em_obj->compression != COMPRESSION_NONE && (size_t)size >= threshold &&
+            (csize = mapped_file_compress(mf, data, (size_t)size, dict, &buf)) >= 0)
+    {
+        data = buf;
+        size = csize;
+        flags |= CHUNK_COMPRESSED;
+        if(dict != NULL)
+            flags |= CHUNK_DICT;
+    }
+
+    if((pos = mapped_file_allocate_chunk(mf, (size_t)size)) < 0)
+        goto _err;
+
+    if(mapped_file_set_chunk_flags(mf, pos, flags) != 0)
+    {
+        mapped_file_free_chunk(mf, pos);
+        goto _err;
+    }
+
+    if(mapped_file_pwrite(mf, data, size, pos) != size)
+    {
+        mapped_file_free_chunk(mf, pos);
+        goto _err;
+    }
+
+    ret = pos;
+
+_err:
+    if(buf != NULL)
+        PyMem_FREE(buf);
+    return ret;
+}
+
+
+/* Allocate a chunk of appropriate size from mapped file `mf' and marshal Python
+ * object `obj' in it.
+ */
+ssize_t mapped_file_marshal_object(em_common_t *em_obj, mapped_file_t *mf,
+        PyObject *obj)
+{
+    PyObject *str;
+
+    ssize_t pos = -1;
+
+    if((str = marshal(em_obj, obj)) == NULL)
+        goto _err;
+
+    pos = mapped_file_marshal_string_object(em_obj, mf, str);
+    Py_DECREF(str);
+
+_err:
+    return pos;
+}
+
+
+/* Return the size of chunk at position `pos' in mapped file `mf' and store its
+ * flags in `*flagsp'. Chunk must have been allocated using
+ * `mapped_file_allocate_chunk()'.
+ */
+static ssize_t mapped_file_get_chunk_size(mapped_file_t *mf, size_t pos,
+        size_t *flagsp)
+{
+    size_t size;
+    ssize_t ret = -1;
+
+    if(mapped_file_read_chunk_header(mf, pos, &size) != 0)
+        goto _err;
+
+    *flagsp = size & CHUNK_FLAGS;
+    ret = (ssize_t)(CHUNK_SIZE(size) - CHUNK_HEADER_SIZE(mf));
+
+_err:
+    return ret;
+}
+
+
+/* Decompress a chunk of `size' bytes at `data', previously compressed by
+ * `mapped_file_compress()' using dictionary `dict', in a new string object.
+ */
+static PyObject *mapped_file_decompress(const char *data, size_t size,
+        const lz4_dict_t *dict)
+{
+    uint32_t raw_size;
+    PyObject *str = NULL;
+
+    if(size < sizeof(uint32_t))
+        goto _err;
+
+    memcpy(&raw_size, data, sizeof(uint32_t));
+
+#if PY_MAJOR_VERSION >= 3
+    if((str = PyBytes_FromStringAndSize(NULL, raw_size)) == NULL)
+        goto _err;
+
+    if(lz4_decompress(data + sizeof(uint32_t), size - sizeof(uint32_t),
+            PyBytes_AS_STRING(str), raw_size, dict) != (ssize_t)raw_size)
+        goto _err;
+#else
+    if((str = PyString_FromStringAndSize(NULL, raw_size)) == NULL)
+        goto _err;
+
+    if(lz4_decompress(data + sizeof(uint32_t), size - sizeof(uint32_t),
+            PyString_AS_STRING(str), raw_size, dict) != (ssize_t)raw_size)
+        goto _err;
+#endif
+
+    return str;
+
+_err:
+    Py_XDECREF(str);
+    PyErr_SetString(PyExc_RuntimeError, "Corrupted compressed chunk");
+    return NULL;
+}
+
+
+/* Return the contents of the chunk at position `pos' in memory mapped file
+ * `mf' as a string object, decompressing them if needed.
+ */
+PyObject *mapped_file_get_chunk_data(em_common_t *em_obj, mapped_file_t *mf,
+        size_t pos)
+{
+    ssize_t size;
+    size_t flags;
+    char *data, *buf = NULL;
+    PyObject *str = NULL;
+
+    if((size = mapped_file_get_chunk_size(mf, pos, &flags)) < 0 ||
+            mapped_file_check_range(mf, pos, size) == 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Invalid chunk position");
+        goto _err;
+    }
+
+    /* Chunks of buffered files are copied out of the buffer pool. */
+    if(mf->pool != NULL)
+    {
+        if((buf = PyMem_MALLOC(size)) == NULL)
+        {
+            PyErr_NoMemory();
+            goto _err;
+        }
+
+        if(mapped_file_pread(mf, buf, size, pos) != size)
+            goto _err;
+
+        data = buf;
+    }
+    else
+        data = mapped_file_ptr(mf, pos, size);
+
+    if(flags & CHUNK_DICT && em_obj->dict == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Compression dictionary missing");
+        goto _err;
+    }
+
+    if(flags & CHUNK_COMPRESSED)
+    {
+        str = mapped_file_decompress(data, size,
+            flags & CHUNK_DICT ? em_obj->dict : NULL);
+    }
+    else
+    {
+#if PY_MAJOR_VERSION >= 3
+        str = PyBytes_FromStringAndSize(data, size);
+#else
+        str = PyString_FromStringAndSize(data, size);
+#endif
+    }
+
+_err:
+    if(buf != NULL)
+        PyMem_FREE(buf);
+    return str;
+}
+
+
+/* Unmarshal a Python object from position `pos' in memory mapped file `mf'. */
+PyObject *mapped_file_unmarshal_object(em_common_t *em_obj, mapped_file_t *mf,
+        size_t pos)
+{
+    PyObject *str, *ret = NULL;
+
+    if((str = mapped_file_get_chunk_data(em_obj, mf, pos)) == NULL)
+        goto _err;
+
+    ret = unmarshal(em_obj, str);
+
+    Py_DECREF(str);
+
+_err:
+    return ret;
+}
+
+
+/* Sample chunks of each segment of segmented file `mf', beginning at position
+ * `pos' in each of them, taking a share of `size' proportional to the size of
+ * the segment.
+ */
+static ssize_t mapped_file_sample_segmented(em_common_t *em_obj,
+        mapped_file_t *mf, size_t pos, char *buf, size_t size)
+{
+    mapped_file_t *segment;
+    size_t i, share, copied = 0, remaining = 0, *sizes;
+    ssize_t ret = -1;
+
+    if((sizes = PyMem_NEW(size_t, mf->num_segments)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err;
+    }
+
+    for(i = 0; i < mf->num_segments; i++)
+    {
+        segment = mf->segments[i];
+        sizes[i] = segment->eof > pos ? segment->eof - pos : 0;
+        remaining += sizes[i];
+    }
+
+    for(i = 0; i < mf->num_segments && remaining > 0; i++)
+    {
+        share = (size_t)((double)(size - copied) * sizes[i] / remaining);
+        remaining -= sizes[i];
+
+        if((ret = mapped_file_sample_chunks(em_obj, mf->segments[i], pos,
+                buf + copied, share)) < 0)
+            goto _err;
+
+        copied += (size_t)ret;
+    }
+
+    ret = (ssize_t)copied;
+
+_err:
+    PyMem_FREE(sizes);
+    return ret;
+}
+
+
+/* Copy the contents of chunks in mapped file `mf', beginning with the chunk
+ * whose size header is at position `pos', in `buf'. Chunks are picked evenly
+ * throughout the file, so that at most `size' bytes are copied, and only the
+ * first `CHUNK_SAMPLE_SIZE' bytes of each chunk are considered. Returns the
+ * number of bytes copied or -1 on error.
+ */
+ssize_t mapped_file_sample_chunks(em_common_t *em_obj, mapped_file_t *mf,
+        size_t pos, char *buf, size_t size)
+{
+    size_t chunk_size, start, stride, copied = 0, header_size;
+    Py_ssize_t data_size;
+    char *data;
+    PyObject *str;
+
+    ssize_t ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_sample_segmented(em_obj, mf, pos, buf, size);
+
+    header_size = CHUNK_HEADER_SIZE(mf);
+    start = pos = CHUNK_START(mf, pos);
+
+    if(size == 0 || mf->eof <= pos)
+        goto _ok;
+
+    /* Sample one byte out of every `stride' bytes in the file. */
+    stride = (mf->eof - start) / size + 1;
+
+    while(pos + header_size <= mf->eof && copied < size)
+    {
+        if(mapped_file_read_chunk_header(mf, pos + header_size, &chunk_size) != 0)
+            goto _err;
+
+        chunk_size = CHUNK_SIZE(chunk_size);
+        if(chunk_size < header_size ||
+                mapped_file_check_range(mf, pos, chunk_size) == 0)
+            break;
+
+        if(copied * stride <= pos - start)
+        {
+            if((str = mapped_file_get_chunk_data(em_obj, mf, pos + header_size)) == NULL)
+                goto _err;
+
+#if PY_MAJOR_VERSION >= 3
+            PyBytes_AsStringAndSize(str, &data, &data_size);
+#else
+            PyString_AsStringAndSize(str, &data, &data_size);
+#endif
+            if(data_size > CHUNK_SAMPLE_SIZE)
+                data_size = CHUNK_SAMPLE_SIZE;
+            if((size_t)data_size > size - copied)
+                data_size = size - copied;
+
+            memcpy(buf + copied, data, data_size);
+            copied += data_size;
+            Py_DECREF(str);
+        }
+
+        pos += chunk_size;
+    }
+
+_ok:
+    ret = (ssize_t)copied;
+
+_err:
+    return ret;
+}
+
+
+#ifdef _WIN32
+
+/* Truncate file `fd' at `size' bytes and map it in memory. Read-only files are
+ * mapped as they are, without being truncated. Called with the GIL released.
+ */
+static void *map_file(HANDLE fd, LARGE_INTEGER size, int readonly)
+{
+    LARGE_INTEGER disk_size, cur_off;
+    HANDLE h;
+    void *address;
+
+
+    if(size.QuadPart < 0 || size.QuadPart > SSIZE_MAX)
+        goto _err1;
+
+    GetFileSizeEx(fd, &disk_size);
+
+    if(size.QuadPart == 0)
+        size = disk_size;
+
+    if(readonly)
+    {
+        if((h = CreateFileMappingA(fd, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL)
+        {
+            serror("map_file: CreateFileMappingA");
+            goto _err1;
+        }
+
+        if((address = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0)) == NULL)
+            serror("map_file: MapViewOfFile");
+
+        CloseHandle(h);
+        return address;
+    }
+
+    /* Quoting the MSDN page for `SetFilePointerEx()':
+     *
+     * "If the file is extended, the contents of the file between the old end of
+     * the file and the new end of the file are not guaranteed to be zero; the
+     * behavior is defined by the file system."
+     *
+     * Looks like for NTFS, the extended part of the file is filled with zeros.
+     */
+    if(SetFilePointerEx(fd, size, &cur_off, FILE_BEGIN) == FALSE)
+    {
+        serror("map_file: SetFilePointerEx");
+        goto _err1;
+    }
+
+    if(SetEndOfFile(fd) == FALSE)
+    {
+        serror("map_file: SetEndOfFile");
+        goto _err2;
+    }
+
+    if((h = CreateFileMappingA(fd, NULL, PAGE_READWRITE, 0, 0, NULL)) == NULL)
+    {
+        serror("map_file: CreateFileMappingA");
+        goto _err3;
+    }
+
+    if((address = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, 0)) == NULL)
+        serror("map_file: MapViewOfFile");
+
+    /* We need not keep a reference to the file mapping object, we can safely
+     * close it now. Quoting the MSDN page for `CreateFileMapping()':
+     *
+     * "Mapped views of a file mapping object maintain internal references to
+     * the object, and a file mapping object does not close until all references
+     * to it are released. Therefore, to fully close a file mapping object, an
+     * application must unmap all mapped views of the file mapping object by
+     * calling UnmapViewOfFile and close the file mapping object handle by
+     * calling CloseHandle. These functions can be called in any order."
+     */
+    CloseHandle(h);
+    return address;
+
+_err3:
+    SetFilePointerEx(fd, disk_size, NULL, FILE_BEGIN);
+    SetEndOfFile(fd);
+
+_err2:
+    SetFilePointerEx(fd, cur_off, NULL, FILE_BEGIN);
+
+_err1:
+    return NULL;
+}
+
+
+/* Open existing file `filename' and map it in memory. If `readonly' is non-zero
+ * the file is opened and mapped read-only. Options in `options' are recorded,
+ * but have no effect on Microsoft Windows.
+ */
+mapped_file_t *mapped_file_open(const char *filename, int readonly, int options)
+{
+    HANDLE fd;
+    LARGE_INTEGER disk_size;
+    DWORD access = GENERIC_READ;
+    void *address;
+    mapped_file_t *mf;
+
+    if(options & MF_SEGMENTED)
+        return mapped_file_open_segmented(filename, readonly, options);
+
+    if(readonly == 0)
+        access |= GENERIC_WRITE;
+
+    if((fd = CreateFileA(filename, access,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("mapped_file_open: CreateFileA");
+        goto _err1;
+    }
+
+    GetFileSizeEx(fd, &disk_size);
+
+    Py_BEGIN_ALLOW_THREADS
+    address = map_file(fd, disk_size, readonly);
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+        goto _err2;
+
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err3;
+
+    mf->fd = fd;
+    mf->address = address;
+    mf->size = (size_t)disk_size.QuadPart;
+    mf->eof = (size_t)disk_size.QuadPart;
+    mf->readonly = (char)readonly;
+    mf->options = options;
+    return mf;
+
+_err3:
+    UnmapViewOfFile(address);
+
+_err2:
+    CloseHandle(fd);
+
+_err1:
+    return NULL;
+}
+
+
+/* Create file `filename', truncate it at `size' bytes and map it in memory. See
+ * `mapped_file_open()' for `options'. Segments of segmented files begin with
+ * `SEGMENT_INITIAL_SIZE' bytes instead.
+ */
+mapped_file_t *mapped_file_create(const char *filename, size_t size,
+        int options)
+{
+    HANDLE fd;
+    LARGE_INTEGER lsize;
+    void *address;
+    mapped_file_t *mf;
+
+    if(options & MF_SEGMENTED)
+        return mapped_file_create_segmented(filename, options);
+
+    if((fd = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        CREATE_ALWAYS, 0, NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("mapped_file_create: CreateFileA");
+        goto _err1;
+    }
+
+    lsize.QuadPart = size;
+
+    Py_BEGIN_ALLOW_THREADS
+    address = map_file(fd, lsize, 0);
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+        goto _err2;
+
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err3;
+
+    mf->fd = fd;
+    mf->address = address;
+    mf->size = size;
+    mf->options = options;
+    return mf;
+
+_err3:
+    UnmapViewOfFile(address);
+
+_err2:
+    CloseHandle(fd);
+
+_err1:
+    return NULL;
+}
+
+
+/* Write back `size' bytes starting from position `pos' in mapped file `mf'.
+ * `FlushViewOfFile()' never waits for the disk, so `async' makes no difference.
+ */
+static int flush_range(mapped_file_t *mf, size_t pos, size_t size, int async)
+{
+    BOOL flushed;
+
+    UNREFERENCED_PARAMETER(async);
+
+    Py_BEGIN_ALLOW_THREADS
+    flushed = FlushViewOfFile((char *)mf->address + pos, size);
+    Py_END_ALLOW_THREADS
+
+    return flushed == FALSE ? -1 : 0;
+}
+
+
+/* Synchronize memory contents to disk. */
+int mapped_file_sync(mapped_file_t *mf, size_t pos, size_t size)
+{
+    int ret = -1;
+
+    if(mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    /* Nothing to write back for read-only mappings. */
+    if(mf->readonly)
+        goto _ok;
+
+    if(flush_range(mf, pos, size, 0) != 0)
+        goto _err;
+
+_ok:
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform. It's a
+ * no-op for now; may be implemented in the future using `ReOpenFile()'.
+ */
+int mapped_file_set_access(mapped_file_t *mf, int advice)
+{
+    UNREFERENCED_PARAMETER(mf);
+    UNREFERENCED_PARAMETER(advice);
+    return 0;
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform on `size'
+ * bytes starting from position `pos'. A no-op too, see above.
+ */
+int mapped_file_advise(mapped_file_t *mf, size_t pos, size_t size, int advice)
+{
+    UNREFERENCED_PARAMETER(mf);
+    UNREFERENCED_PARAMETER(pos);
+    UNREFERENCED_PARAMETER(size);
+    UNREFERENCED_PARAMETER(advice);
+    return 0;
+}
+
+
+/* Equivalent to `ftruncate()' for memory mapped files. */
+int mapped_file_truncate(mapped_file_t *mf, size_t size)
+{
+    LARGE_INTEGER lsize;
+    void *address;
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_truncate_segmented(mf, size);
+
+    if(mf->readonly)
+        goto _err;
+
+    /* We need to unmap before actually re-mapping the file. Unfortunately,
+     * there's no `mremap()' equivalent on Microsoft Windows.
+     */
+    lsize.QuadPart = size;
+
+    Py_BEGIN_ALLOW_THREADS
+    UnmapViewOfFile(mf->address);
+    address = map_file(mf->fd, lsize, 0);
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+        goto _err;
+
+    mf->address = address;
+    mf->size = size;
+    if(mf->pos > size)
+        mf->pos = size;
+    if(mf->eof > size)
+        mf->eof = size;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Map read-only file `mf' again, at its current size on disk. Used to follow
+ * files resized by another process.
+ */
+int mapped_file_remap(mapped_file_t *mf)
+{
+    LARGE_INTEGER disk_size;
+    void *address;
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_remap_segmented(mf);
+
+    if(GetFileSizeEx(mf->fd, &disk_size) == FALSE)
+    {
+        serror("mapped_file_remap: GetFileSizeEx");
+        goto _err;
+    }
+
+    if((size_t)disk_size.QuadPart == mf->size)
+        goto _ok;
+
+    Py_BEGIN_ALLOW_THREADS
+    address = map_file(mf->fd, disk_size, 1);
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+        goto _err;
+
+    UnmapViewOfFile(mf->address);
+
+    mf->address = address;
+    mf->size = (size_t)disk_size.QuadPart;
+    mf->eof = mf->size;
+    if(mf->pos > mf->size)
+        mf->pos = mf->size;
+
+_ok:
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Copy the contents of mapped file `mf' in new file `filename'. */
+int mapped_file_clone(mapped_file_t *mf, const char *filename)
+{
+    HANDLE fd;
+    DWORD size, written;
+    size_t pos = 0;
+    BOOL ok = TRUE;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_clone_segmented(mf, filename);
+
+    if((fd = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_NEW, 0,
+            NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("mapped_file_clone: CreateFileA");
+        goto _err1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    while(ok && pos < mf->size)
+    {
+        size = (DWORD)(mf->size - pos < CLONE_BLOCK_SIZE ?
+            mf->size - pos : CLONE_BLOCK_SIZE);
+        ok = WriteFile(fd, (char *)mf->address + pos, size, &written, NULL) &&
+            written == size;
+        pos += size;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(ok == FALSE)
+    {
+        serror("mapped_file_clone: WriteFile");
+        goto _err2;
+    }
+
+    CloseHandle(fd);
+    ret = 0;
+    goto _err1;
+
+_err2:
+    CloseHandle(fd);
+    DeleteFileA(filename);
+
+_err1:
+    return ret;
+}
+
+
+/* Copy file `copy->src' in new file `copy->dst', up to `copy->size' bytes. Must
+ * be called with the GIL released.
+ */
+static int copy_frozen_file(file_copy_t *copy)
+{
+    HANDLE src, dst;
+    DWORD size, done;
+    size_t pos = 0;
+    char *buf;
+    BOOL ok = TRUE;
+
+    int ret = -1;
+
+    if((buf = malloc(CLONE_BLOCK_SIZE)) == NULL)
+        goto _err1;
+
+    if((src = CreateFileA(copy->src, GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("copy_frozen_file: CreateFileA");
+        goto _err2;
+    }
+
+    if((dst = CreateFileA(copy->dst, GENERIC_WRITE, 0, NULL, CREATE_NEW, 0,
+            NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("copy_frozen_file: CreateFileA");
+        goto _err3;
+    }
+
+    /* Contents past `copy->size' were added after freezing, and are dropped. */
+    while(ok && pos < copy->size)
+    {
+        size = (DWORD)(copy->size - pos < CLONE_BLOCK_SIZE ?
+            copy->size - pos : CLONE_BLOCK_SIZE);
+        ok = ReadFile(src, buf, size, &done, NULL) && done == size &&
+            WriteFile(dst, buf, size, &done, NULL) && done == size;
+        pos += size;
+    }
+
+    CloseHandle(dst);
+
+    if(ok == FALSE)
+    {
+        serror("copy_frozen_file: WriteFile");
+        DeleteFileA(copy->dst);
+        goto _err3;
+    }
+
+    ret = 0;
+
+_err3:
+    CloseHandle(src);
+
+_err2:
+    free(buf);
+
+_err1:
+    return ret;
+}
+
+
+/* Copy the `num_copies' files at `copies', frozen by `mapped_file_freeze()'. If
+ * any copy fails, those made so far are removed.
+ */
+int mapped_file_copy_frozen(file_copy_t *copies, size_t num_copies)
+{
+    size_t i;
+    int ret = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    for(i = 0; i < num_copies && ret == 0; i++)
+        ret = copy_frozen_file(&copies[i]);
+    if(ret != 0)
+    {
+        while(--i > 0)
+            DeleteFileA(copies[i - 1].dst);
+    }
+    Py_END_ALLOW_THREADS
+
+    return ret;
+}
+
+
+/* Take an advisory lock on mapped file `mf', exclusive if `exclusive' is non-
+ * zero, shared otherwise, without waiting. Returns -1 if the lock is held by
+ * another process. The lock is released when `mf' is closed. A single byte far
+ * past the end of the file is locked, as locks on Microsoft Windows are
+ * mandatory and would otherwise block access to the file's contents.
+ */
+int mapped_file_lock(mapped_file_t *mf, int exclusive)
+{
+    OVERLAPPED ov;
+    DWORD flags = LOCKFILE_FAIL_IMMEDIATELY;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        mf = mf->segments[0];
+
+    if(exclusive)
+        flags |= LOCKFILE_EXCLUSIVE_LOCK;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = 0xffffffff;
+    ov.OffsetHigh = 0x7fffffff;
+
+    if(LockFileEx(mf->fd, flags, 0, 1, 0, &ov) == FALSE)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Equivalent to `rename()' for memory mapped files. */
+int mapped_file_rename(mapped_file_t *mf, const char *filename)
+{
+    char *filename_p;
+
+    int ret = -1;
+
+    if((filename_p = PyMem_MALLOC(strlen(filename) + 1)) == NULL)
+        goto _err;
+
+    strcpy(filename_p, filename);
+
+    if(MoveFileExA(mf->filename, filename,
+            MOVEFILE_WRITE_THROUGH | MOVEFILE_REPLACE_EXISTING) == 0)
+    {
+        serror("mapped_file_rename: MoveFileExA");
+        PyMem_FREE(filename_p);
+        goto _err;
+    }
+
+    PyMem_FREE(mf->filename);
+    mf->filename = filename_p;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Instructs Microsoft Windows to delete the file once it's closed. We can't
+ * directly delete the file in any other way and the whole process should be
+ * transparent to the user.
+ */
+int mapped_file_unlink(mapped_file_t *mf)
+{
+    HANDLE fd;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_unlink_segmented(mf);
+
+    if((fd = ReOpenFile(mf->fd,  GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            FILE_FLAG_DELETE_ON_CLOSE)) == INVALID_HANDLE_VALUE)
+    {
+        serror("mapped_file_unlink: ReOpenFile");
+        goto _err;
+    }
+
+    CloseHandle(mf->fd);
+    mf->fd = fd;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Equivalent to `close()' for memory mapped files. It's not safe to access `mf'
+ * after a call to `mapped_file_close()'.
+ */
+void mapped_file_close(mapped_file_t *mf)
+{
+    if(mf->options & MF_SEGMENTED)
+    {
+        mapped_file_close_segmented(mf);
+        return;
+    }
+
+    UnmapViewOfFile(mf->address);
+    CloseHandle(mf->fd);
+    mapped_file_free(mf);
+}
+
+
+/* Memory budgets aren't enforced on Microsoft Windows, which offers no cheap
+ * way of telling which pages of a view are resident.
+ */
+size_t mapped_file_resident(mapped_file_t *mf)
+{
+    UNREFERENCED_PARAMETER(mf);
+    return 0;
+}
+
+
+size_t mapped_file_evict(mapped_file_t *mf, size_t size, size_t *handp)
+{
+    UNREFERENCED_PARAMETER(mf);
+    UNREFERENCED_PARAMETER(size);
+    UNREFERENCED_PARAMETER(handp);
+    return 0;
+}
+
+
+/* Buffered access isn't implemented on Microsoft Windows, where files remain
+ * mapped.
+ */
+int mapped_file_set_buffered(mapped_file_t *mf, size_t size, int direct)
+{
+    UNREFERENCED_PARAMETER(mf);
+    UNREFERENCED_PARAMETER(size);
+    UNREFERENCED_PARAMETER(direct);
+    return 0;
+}
+
+
+static int mapped_file_attach_pool(mapped_file_t *mf, buffer_pool_t *pool)
+{
+    UNREFERENCED_PARAMETER(mf);
+    UNREFERENCED_PARAMETER(pool);
+    return -1;
+}
+
+
+#else
+
+/* Truncate file `fd' at `size' bytes and map it in memory. Read-only files are
+ * mapped as they are, without being truncated. Called with the GIL released.
+ */
+static void *map_file(int fd, size_t size, int readonly)
+{
+    struct stat st;
+
+    void *address = NULL;
+
+    if(size > SSIZE_MAX)
+        goto _err;
+
+    if(readonly)
+    {
+        address = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if(address == MAP_FAILED)
+        {
+            address = NULL;
+            serror("map_file: mmap");
+        }
+
+        goto _err;
+    }
+
+    /* Use `fstat()' to read file's original size. */
+    if(fstat(fd, &st) != 0)
+    {
+        serror("map_file: fstat");
+        goto _err;
+    }
+
+    if(ftruncate(fd, size) != 0)
+    {
         serror("map_file: ftruncate");
         goto _err;
     }
 
-    address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(address == MAP_FAILED)
+    {
+        /* Make sure we return `NULL' instead of `MAP_FAILED'. */
+        address = NULL;
+
+        serror("map_file: mmap");
+
+        /* Restore original file size on failure to avoid undefined behaviour
+         * when accessing a memory mapped region for a file that has, for
+         * example, been shrunk by `ftruncate()'.
+         */
+        if(ftruncate(fd, st.st_size) != 0)
+            serror("map_file: ftruncate");
+    }
+
+_err:
+    return address;
+}
+
+
+/* Apply options `options' to the mapping of `size' bytes at `address'. Returns
+ * non-zero if the mapping couldn't be locked; other options are mere hints, so
+ * their failures are ignored. Called with the GIL released.
+ */
+static int map_options(void *address, size_t size, int options)
+{
+    volatile const char *p;
+    long pagesize;
+    size_t pos;
+
+    int ret = 0;
+
+    /* Random accesses to large index files are dominated by TLB misses, which
+     * huge pages reduce by a factor of 512.
+     */
+#ifdef MADV_HUGEPAGE
+    if(options & MF_HUGEPAGES)
+        madvise(address, size, MADV_HUGEPAGE);
+#endif
+
+    /* Locking the whole mapping reads it in too. On Linux, pages may instead be
+     * locked as they're first accessed, unless prefaulting was requested.
+     */
+    if(options & MF_LOCKED)
+    {
+#ifdef MLOCK_ONFAULT
+        if((options & MF_PREFAULT) == 0 &&
+                mlock2(address, size, MLOCK_ONFAULT) == 0)
+            goto _ret;
+#endif
+        if((ret = mlock(address, size)) != 0)
+            serror("map_options: mlock");
+        goto _ret;
+    }
+
+    if((options & MF_PREFAULT) == 0)
+        goto _ret;
+
+    /* Since Linux 5.14 the kernel can read in the file and populate the page
+     * tables in one go. Elsewhere, touch every page instead.
+     */
+#ifdef MADV_POPULATE_READ
+    if(madvise(address, size, MADV_POPULATE_READ) == 0)
+        goto _ret;
+#endif
+
+    if((pagesize = sysconf(_SC_PAGESIZE)) == -1)
+        goto _ret;
+
+    madvise(address, size, MADV_WILLNEED);
+
+    for(p = address, pos = 0; pos < size; pos += pagesize)
+        (void)p[pos];
+
+_ret:
+    return ret;
+}
+
+
+/* Open existing file `filename' and map it in memory. If `readonly' is non-zero
+ * the file is opened and mapped read-only. Options in `options' are `MF_XXX'
+ * constants.
+ */
+mapped_file_t *mapped_file_open(const char *filename, int readonly, int options)
+{
+    int fd;
+    struct stat st;
+    void *address;
+    mapped_file_t *mf;
+    int locked = 0;
+
+    if(options & MF_SEGMENTED)
+        return mapped_file_open_segmented(filename, readonly, options);
+
+    if((fd = open(filename, readonly ? O_RDONLY : O_RDWR)) < 0)
+    {
+        serror("mapped_file_open: fopen");
+        goto _err1;
+    }
+
+    if(fstat(fd, &st) != 0)
+    {
+        serror("mapped_file_open: fstat");
+        goto _err2;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if((address = map_file(fd, st.st_size, readonly)) != NULL &&
+            (locked = map_options(address, st.st_size, options)) != 0)
+    {
+        munmap(address, st.st_size);
+        address = NULL;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+    {
+        if(locked != 0)
+            PyErr_Format(PyExc_RuntimeError, "Cannot lock \"%s\" in memory",
+                filename);
+        goto _err2;
+    }
+
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err3;
+
+    mf->fd = fd;
+    mf->address = address;
+    mf->size = st.st_size;
+    mf->eof = st.st_size;
+    mf->readonly = (char)readonly;
+    mf->options = options;
+    return mf;
+
+_err3:
+    munmap(address, st.st_size);
+
+_err2:
+    close(fd);
+
+_err1:
+    return NULL;
+}
+
+
+/* Create file `filename', truncate it at `size' bytes and map it in memory. See
+ * `mapped_file_open()' for `options'. Segments of segmented files begin with
+ * `SEGMENT_INITIAL_SIZE' bytes instead.
+ */
+mapped_file_t *mapped_file_create(const char *filename, size_t size,
+        int options)
+{
+    int fd;
+    void *address;
+    mapped_file_t *mf;
+    int locked = 0;
+
+    if(options & MF_SEGMENTED)
+        return mapped_file_create_segmented(filename, options);
+
+    if((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    {
+        serror("mapped_file_create: open");
+        goto _err1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if((address = map_file(fd, size, 0)) != NULL &&
+            (locked = map_options(address, size, options)) != 0)
+    {
+        munmap(address, size);
+        address = NULL;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+    {
+        if(locked != 0)
+            PyErr_Format(PyExc_RuntimeError, "Cannot lock \"%s\" in memory",
+                filename);
+        goto _err2;
+    }
+
+    if((mf = mapped_file_alloc(filename)) == NULL)
+        goto _err3;
+
+    mf->fd = fd;
+    mf->address = address;
+    mf->size = size;
+    mf->options = options;
+    return mf;
+
+_err3:
+    munmap(address, size);
+
+_err2:
+    close(fd);
+    unlink(filename);
+
+_err1:
+    return NULL;
+}
+
+
+/* Write back `size' bytes starting from position `pos' in mapped file `mf'.
+ * Synchronous write back blocks until all dirty pages hit the disk, while
+ * asynchronous write back merely schedules it.
+ */
+static int flush_range(mapped_file_t *mf, size_t pos, size_t size, int async)
+{
+    int ret;
+
+    /* Buffered files are written back from the buffer pool and then synced
+     * like regular files.
+     */
+    if(mf->pool != NULL)
+    {
+        if(buffer_pool_flush(mf->pool, mf->pool_file, pos, size) != 0)
+            return -1;
+
+        Py_BEGIN_ALLOW_THREADS
+#ifdef SYNC_FILE_RANGE_WRITE
+        if(async)
+            ret = sync_file_range(mf->fd, pos, size, SYNC_FILE_RANGE_WRITE);
+        else
+#endif
+#ifdef __APPLE__
+        ret = async ? 0 : fsync(mf->fd);
+#else
+        ret = async ? 0 : fdatasync(mf->fd);
+#endif
+        Py_END_ALLOW_THREADS
+
+        return ret;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+#ifdef SYNC_FILE_RANGE_WRITE
+    /* On Linux, `MS_ASYNC' is a no-op, as the kernel tracks dirty pages of
+     * shared mappings anyway. Start write back of the range explicitly.
+     */
+    if(async)
+        ret = sync_file_range(mf->fd, pos, size, SYNC_FILE_RANGE_WRITE);
+    else
+#endif
+    ret = msync((char *)mf->address + pos, size, async ? MS_ASYNC : MS_SYNC);
+    Py_END_ALLOW_THREADS
+
+    return ret;
+}
+
+
+/* Synchronize memory contents to disk. */
+int mapped_file_sync(mapped_file_t *mf, size_t pos, size_t size)
+{
+    int ret = -1;
+
+    if(mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    /* Nothing to write back for read-only mappings. */
+    if(mf->readonly)
+    {
+        ret = 0;
+        goto _err;
+    }
+
+    ret = flush_range(mf, pos, size, 0);
+
+_err:
+    return ret;
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform. */
+int mapped_file_set_access(mapped_file_t *mf, int advice)
+{
+    size_t i;
+    int ret = 0;
+
+    if((mf->options & MF_SEGMENTED) == 0)
+        return mapped_file_advise(mf, 0, mf->size, advice);
+
+    for(i = 0; i < mf->num_segments; i++)
+    {
+        if(mapped_file_set_access(mf->segments[i], advice) != 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+
+/* Equivalent to `madvise()' for files that aren't mapped. */
+static int fadvise(int fd, size_t pos, size_t size, int advice)
+{
+    int ret = 0;
+
+#ifdef POSIX_FADV_NORMAL
+    switch(advice)
+    {
+        case MF_ACCESS_NORMAL:
+            advice = POSIX_FADV_NORMAL;
+            break;
+        case MF_ACCESS_RANDOM:
+            advice = POSIX_FADV_RANDOM;
+            break;
+        case MF_ACCESS_SEQUENTIAL:
+            advice = POSIX_FADV_SEQUENTIAL;
+            break;
+        case MF_ACCESS_WILLNEED:
+            advice = POSIX_FADV_WILLNEED;
+            break;
+        default:
+            advice = POSIX_FADV_DONTNEED;
+            break;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = posix_fadvise(fd, pos, size, advice);
+    Py_END_ALLOW_THREADS
+
+    if(ret != 0)
+    {
+        errno = ret;
+        serror("mapped_file_advise: posix_fadvise");
+        ret = -1;
+    }
+#endif
+
+    return ret;
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform on the
+ * parts of segmented file `mf' in `[pos, pos + size)', clipped to the size of
+ * each segment.
+ */
+static int mapped_file_advise_segmented(mapped_file_t *mf, size_t pos,
+        size_t size, int advice)
+{
+    mapped_file_t *segment;
+    size_t offset, span, end = pos + size;
+
+    int ret = 0;
+
+    while(pos < end && SEGMENT_OF(pos) < mf->num_segments)
+    {
+        segment = mf->segments[SEGMENT_OF(pos)];
+        offset = SEGMENT_OFFSET(pos);
+
+        span = SEGMENT_SIZE - offset;
+        if(span > end - pos)
+            span = end - pos;
+
+        if(offset < segment->size && mapped_file_advise(segment, offset,
+                span < segment->size - offset ? span : segment->size - offset,
+                advice) != 0)
+            ret = -1;
+
+        pos += span;
+    }
+
+    return ret;
+}
+
+
+/* Give kernel a hint about the type of access we are going to perform on `size'
+ * bytes starting from position `pos'. With `MF_ACCESS_WILLNEED', the kernel
+ * starts reading them in, without waiting for them.
+ */
+int mapped_file_advise(mapped_file_t *mf, size_t pos, size_t size, int advice)
+{
+    long pagesize;
+    size_t offset;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_advise_segmented(mf, pos, size, advice);
+
+    if(advice != MF_ACCESS_NORMAL && advice != MF_ACCESS_RANDOM &&
+            advice != MF_ACCESS_SEQUENTIAL && advice != MF_ACCESS_WILLNEED &&
+            advice != MF_ACCESS_DONTNEED)
+        goto _err;
+
+    if(mapped_file_check_range(mf, pos, size) == 0)
+        goto _err;
+
+    if(size == 0)
+    {
+        ret = 0;
+        goto _err;
+    }
+
+    /* Hints for buffered files apply to the page cache underneath. */
+    if(mf->pool != NULL)
+    {
+        ret = fadvise(mf->fd, pos, size, advice);
+        goto _err;
+    }
+
+    if((pagesize = sysconf(_SC_PAGESIZE)) == -1)
+    {
+        serror("mapped_file_advise: sysconf");
+        goto _err;
+    }
+
+    /* `madvise()' expects a page aligned address. */
+    offset = pos % pagesize;
+    pos -= offset;
+    size += offset;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = madvise((char *)mf->address + pos, size, advice);
+    Py_END_ALLOW_THREADS
+
+    if(ret < 0)
+        serror("mapped_file_advise: madvise");
+
+_err:
+    return ret;
+}
+
+
+/* Truncate file `fd', currently mapped at `address' with size `mf_size', at
+ * `size' bytes and resize the memory mapping accordingly. Returns the, possibly
+ * new, address of the mapping or `NULL' on failure, in which case the file is
+ * left untouched. Doesn't touch any Python objects, so it's called with the GIL
+ * released.
+ */
+static void *remap_file(int fd, void *mf_address, size_t mf_size, size_t size)
+{
+    long pagesize;
+    size_t aligned_size, aligned_mf_size;
+
+    void *address = NULL;
+
+
+    /* Truncate the file to the requested size first. If resizing the memory
+     * mapping fails, we can easily restore the original file size by calling
+     * `ftruncate()' again.
+     */
+    if(ftruncate(fd, size) != 0)
+    {
+        serror("mapped_file_truncate: ftruncate");
+        goto _err1;
+    }
+
+    /* When shrinking the memory mapped file, just unmap part of the mapping. */
+    if(size < mf_size)
+    {
+        /* According to the manual page, this is the portable way of reading the
+         * system's page size.
+         */
+        if((pagesize = sysconf(_SC_PAGESIZE)) == -1)
+        {
+            serror("mapped_file_truncate: sysconf");
+            goto _err2;
+        }
+
+        /* Align sizes to the next multiple of the page size, as `munmap()' will
+         * unmap any page overlapping with the given argument.
+         */
+        aligned_size = (size + pagesize - 1) & ~(pagesize - 1);
+        aligned_mf_size = (mf_size + pagesize - 1) & ~(pagesize - 1);
+
+        if(aligned_size < aligned_mf_size &&
+                munmap((char *)mf_address + aligned_size,
+                    aligned_mf_size - aligned_size) != 0)
+        {
+            serror("mapped_file_truncate: munmap");
+            goto _err2;
+        }
+
+        address = mf_address;
+    }
+
+    /* When increasing the size of the memory mapped file, we have to re-map the
+     * underlying file pages.
+     */
+    else
+    {
+#if defined __linux__ || defined __NetBSD__
+        /* Linux and NetBSD implement `mremap()'. I haven't tested the code on
+         * NetBSD, but this is good news anyway.
+         */
+        address = mremap(mf_address, mf_size, size, MREMAP_MAYMOVE);
+
+        if(address == MAP_FAILED)
+        {
+            address = NULL;
+            serror("mapped_file_truncate: mremap");
+            goto _err2;
+        }
+#else
+        /* On other OSes, like MacOS X and FreeBSD, we have to take the slow path
+         * which involves creating a larger memory mapping and then unmapping the
+         * old one.
+         */
+        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if(address == MAP_FAILED)
+        {
+            address = NULL;
+            serror("mapped_file_truncate: mmap");
+            goto _err2;
+        }
+
+        munmap(mf_address, mf_size);
+#endif
+    }
+
+    return address;
+
+_err2:
+    if(ftruncate(fd, mf_size) != 0)
+        serror("mapped_file_truncate: ftruncate");
+
+_err1:
+    return NULL;
+}
+
+
+/* Equivalent to `ftruncate()' for memory mapped files. */
+int mapped_file_truncate(mapped_file_t *mf, size_t size)
+{
+    void *address;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_truncate_segmented(mf, size);
+
+    if(size > SSIZE_MAX || mf->readonly)
+        goto _err;
+
+    if(size == mf->size)
+        goto _ok;
+
+    if(mf->pool != NULL)
+    {
+        if(ftruncate(mf->fd, size) != 0)
+        {
+            serror("mapped_file_truncate: ftruncate");
+            goto _err;
+        }
+
+        buffer_pool_truncate(mf->pool, mf->pool_file, size);
+        address = NULL;
+    }
+    else
+    {
+        /* Resizing large files may take a while; let other threads run. */
+        Py_BEGIN_ALLOW_THREADS
+        if((address = remap_file(mf->fd, mf->address, mf->size, size)) != NULL)
+            map_options(address, size, mf->options & (MF_HUGEPAGES | MF_LOCKED));
+        Py_END_ALLOW_THREADS
+
+        if(address == NULL)
+            goto _err;
+    }
 
-    if(address == MAP_FAILED)
+    mf->address = address;
+    mf->size = size;
+    if(mf->pos > size)
+        mf->pos = size;
+    if(mf->eof > size)
+        mf->eof = size;
+
+_ok:
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Map read-only file `mf' again, at its current size on disk. Used to follow
+ * files resized by another process.
+ */
+int mapped_file_remap(mapped_file_t *mf)
+{
+    struct stat st;
+    void *address;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_remap_segmented(mf);
+
+    if(fstat(mf->fd, &st) != 0)
     {
-        /* Make sure we return `NULL' instead of `MAP_FAILED'. */
+        serror("mapped_file_remap: fstat");
+        goto _err;
+    }
+
+    if((size_t)st.st_size == mf->size)
+        goto _ok;
+
+    /* Buffered files are resized by just updating their size. */
+    if(mf->pool != NULL)
+    {
+        buffer_pool_truncate(mf->pool, mf->pool_file, st.st_size);
         address = NULL;
+        goto _resized;
+    }
 
-        serror("map_file: mmap");
+    Py_BEGIN_ALLOW_THREADS
+    if((address = map_file(mf->fd, st.st_size, 1)) != NULL)
+        map_options(address, st.st_size,
+            mf->options & (MF_HUGEPAGES | MF_LOCKED));
+    Py_END_ALLOW_THREADS
+
+    if(address == NULL)
+        goto _err;
+
+    munmap(mf->address, mf->size);
+
+_resized:
+    mf->address = address;
+    mf->size = st.st_size;
+    mf->eof = st.st_size;
+    if(mf->pos > mf->size)
+        mf->pos = mf->size;
+
+_ok:
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Write `size' bytes at `address' in file `fd', leaving holes in place of
+ * blocks of zeros, as files are mostly preallocated space.
+ */
+static int copy_mapping(int fd, const char *address, size_t size)
+{
+    size_t pos, block_size;
+    ssize_t written;
+
+    int ret = -1;
+
+    for(pos = 0; pos < size; pos += block_size)
+    {
+        block_size = size - pos < CLONE_BLOCK_SIZE ? size - pos : CLONE_BLOCK_SIZE;
+
+        if(address[pos] == 0 &&
+                memcmp(&address[pos], &address[pos + 1], block_size - 1) == 0)
+            continue;
+
+        for(written = 0; written < (ssize_t)block_size; written += ret)
+        {
+            if((ret = pwrite(fd, &address[pos + written], block_size - written,
+                    pos + written)) <= 0)
+                goto _err;
+        }
+    }
+
+    ret = ftruncate(fd, size);
+
+_err:
+    return ret < 0 ? -1 : 0;
+}
+
+
+/* Copy the contents of mapped file `mf' in new file `filename'. Where the file
+ * system supports it (e.g. Btrfs or XFS on Linux), the new file shares its
+ * blocks with `mf' until either of them is modified.
+ */
+int mapped_file_clone(mapped_file_t *mf, const char *filename)
+{
+    int fd, cloned = -1;
+    char *address = mf->address;
+
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_clone_segmented(mf, filename);
+
+    /* Buffered files are written back first, and mapped just for copying. */
+    if(mf->pool != NULL &&
+            buffer_pool_flush(mf->pool, mf->pool_file, 0, mf->size) != 0)
+        goto _err1;
+
+    if((fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0)
+    {
+        serror("mapped_file_clone: open");
+        goto _err1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+#ifdef FICLONE
+    cloned = ioctl(fd, FICLONE, mf->fd);
+#endif
+    if(cloned != 0 && address == NULL && mf->size > 0)
+        address = map_file(mf->fd, mf->size, 1);
+    if(cloned != 0 && (address != NULL || mf->size == 0))
+        cloned = copy_mapping(fd, address, mf->size);
+    if(address != mf->address && address != NULL)
+        munmap(address, mf->size);
+    Py_END_ALLOW_THREADS
+
+    if(cloned != 0)
+    {
+        serror("mapped_file_clone: copy_mapping");
+        goto _err2;
+    }
+
+    close(fd);
+    ret = 0;
+    goto _err1;
+
+_err2:
+    close(fd);
+    unlink(filename);
+
+_err1:
+    return ret;
+}
+
+
+/* Copy file `copy->src' in new file `copy->dst', up to `copy->size' bytes,
+ * sharing blocks between them where possible, like `mapped_file_clone()'. Must
+ * be called with the GIL released.
+ */
+static int copy_frozen_file(file_copy_t *copy)
+{
+    int src, dst, cloned = -1;
+    char *address = NULL;
+
+    int ret = -1;
+
+    if((src = open(copy->src, O_RDONLY)) < 0)
+    {
+        serror("copy_frozen_file: open");
+        goto _err1;
+    }
+
+    if((dst = open(copy->dst, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0)
+    {
+        serror("copy_frozen_file: open");
+        goto _err2;
+    }
+
+    /* Contents past `copy->size' were added after freezing, and are dropped. */
+#ifdef FICLONE
+    if(ioctl(dst, FICLONE, src) == 0)
+        cloned = ftruncate(dst, copy->size);
+#endif
+    if(cloned != 0 && copy->size > 0 &&
+            (address = map_file(src, copy->size, 1)) == NULL)
+        goto _err3;
+    if(cloned != 0)
+        cloned = copy_mapping(dst, address, copy->size);
+    if(address != NULL)
+        munmap(address, copy->size);
+
+    if(cloned != 0)
+    {
+        serror("copy_frozen_file: copy_mapping");
+        goto _err3;
+    }
+
+    ret = 0;
+    goto _err2;
+
+_err3:
+    unlink(copy->dst);
+
+_err2:
+    if(dst >= 0)
+        close(dst);
+    close(src);
+
+_err1:
+    return ret;
+}
+
+
+/* Copy the `num_copies' files at `copies', frozen by `mapped_file_freeze()'. If
+ * any copy fails, those made so far are removed.
+ */
+int mapped_file_copy_frozen(file_copy_t *copies, size_t num_copies)
+{
+    size_t i;
+    int ret = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    for(i = 0; i < num_copies && ret == 0; i++)
+        ret = copy_frozen_file(&copies[i]);
+    if(ret != 0)
+    {
+        while(--i > 0)
+            unlink(copies[i - 1].dst);
+    }
+    Py_END_ALLOW_THREADS
+
+    return ret;
+}
+
+
+/* Take an advisory lock on mapped file `mf', exclusive if `exclusive' is non-
+ * zero, shared otherwise, without waiting. Returns -1 if the lock is held by
+ * another process. The lock is released when `mf' is closed.
+ */
+int mapped_file_lock(mapped_file_t *mf, int exclusive)
+{
+    int ret = -1;
+
+    if(mf->options & MF_SEGMENTED)
+        mf = mf->segments[0];
+
+    if(flock(mf->fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0)
+        goto _err;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Equivalent to `rename()' for memory mapped files. */
+int mapped_file_rename(mapped_file_t *mf, const char *filename)
+{
+    char *filename_p;
+
+    int ret = -1;
+
+    if((filename_p = PyMem_MALLOC(strlen(filename) + 1)) == NULL)
+        goto _err;
+
+    strcpy(filename_p, filename);
+
+    if(rename(mf->filename, filename) != 0)
+    {
+        serror("mapped_file_rename: rename");
+        PyMem_FREE(filename_p);
+        goto _err;
+    }
+
+    PyMem_FREE(mf->filename);
+    mf->filename = filename_p;
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Equivalent to `unlink()' for memory mapped files. */
+int mapped_file_unlink(mapped_file_t *mf)
+{
+    if(mf->options & MF_SEGMENTED)
+        return mapped_file_unlink_segmented(mf);
+
+    return unlink(mf->filename);
+}
+
+
+/* Equivalent to `close()' for memory mapped files. It's not safe to access `mf'
+ * after a call to `mapped_file_close()'.
+ */
+void mapped_file_close(mapped_file_t *mf)
+{
+    if(mf->options & MF_SEGMENTED)
+    {
+        mapped_file_close_segmented(mf);
+        return;
+    }
 
-        /* Restore original file size on failure to avoid undefined behaviour
-         * when accessing a memory mapped region for a file that has, for
-         * example, been shrunk by `ftruncate()'.
-         */
-        if(ftruncate(fd, st.st_size) != 0)
-            serror("map_file: ftruncate");
+    /* Segments share the buffer pool of their segmented file. */
+    if(mf->pool != NULL)
+    {
+        if(mf->readonly == 0 &&
+                buffer_pool_flush(mf->pool, mf->pool_file, 0, mf->size) != 0)
+            PyErr_WriteUnraisable(NULL);
+        if((mf->options & MF_SEGMENT) == 0)
+            buffer_pool_free(mf->pool);
     }
+    else
+        munmap(mf->address, mf->size);
 
-_err:
-    return address;
+    close(mf->fd);
+    mapped_file_free(mf);
 }
 
 
-/* Open existing file `filename' and map it in memory. */
-mapped_file_t *mapped_file_open(const char *filename)
+/* Estimate the number of bytes of `mf' resident in memory, by asking the kernel
+ * about `RESIDENCY_SAMPLES' pages evenly spread over the file, at most.
+ */
+size_t mapped_file_resident(mapped_file_t *mf)
 {
-    int fd;
-    struct stat st;
-    void *address;
-    mapped_file_t *mf;
+    long pagesize;
+    size_t i, num_pages, step, samples = 0, resident = 0;
+    unsigned char vec;
 
+    if(mf->pool != NULL)
+    {
+        resident = buffer_pool_resident(mf->pool);
+        goto _ret;
+    }
 
-    if((fd = open(filename, O_RDWR)) < 0)
+    if(mf->options & MF_SEGMENTED)
     {
-        serror("mapped_file_open: fopen");
-        goto _err1;
+        for(i = 0; i < mf->num_segments; i++)
+            resident += mapped_file_resident(mf->segments[i]);
+        goto _ret;
     }
 
-    if(fstat(fd, &st) != 0)
+    if((pagesize = sysconf(_SC_PAGESIZE)) == -1 || mf->size == 0)
+        goto _ret;
+
+    num_pages = (mf->size + pagesize - 1) / pagesize;
+    step = num_pages > RESIDENCY_SAMPLES ? num_pages / RESIDENCY_SAMPLES : 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    for(i = 0; i < num_pages; i += step)
     {
-        serror("mapped_file_open: fstat");
-        goto _err2;
+        if(mincore((char *)mf->address + i * pagesize, pagesize, (void *)&vec) != 0)
+            break;
+        resident += vec & 1;
+        samples += 1;
     }
+    Py_END_ALLOW_THREADS
 
-    if((address = map_file(fd, st.st_size)) == NULL)
-        goto _err2;
+    if(samples > 0)
+        resident = (size_t)((double)resident / samples * mf->size);
 
-    if((mf = mapped_file_alloc(filename)) == NULL)
-        goto _err3;
+_ret:
+    return resident;
+}
 
-    mf->fd = fd;
-    mf->address = address;
-    mf->size = st.st_size;
-    mf->eof = st.st_size;
-    return mf;
 
-_err3:
-    munmap(address, st.st_size);
+/* Drop about `size' bytes of segmented file `mf' from memory, sweeping its
+ * segments in turn. The segment `*handp' points to is swept first, starting
+ * where its own hand was left.
+ */
+static size_t mapped_file_evict_segmented(mapped_file_t *mf, size_t size,
+        size_t *handp)
+{
+    size_t i, segment = SEGMENT_OF(*handp), hand = SEGMENT_OFFSET(*handp);
+    size_t evicted = 0;
 
-_err2:
-    close(fd);
+    for(i = 0; i <= mf->num_segments && evicted < size; i++)
+    {
+        if(segment >= mf->num_segments)
+        {
+            segment = 0;
+            hand = 0;
+        }
 
-_err1:
-    return NULL;
+        evicted += mapped_file_evict(mf->segments[segment], size - evicted, &hand);
+
+        if(evicted < size)
+        {
+            segment += 1;
+            hand = 0;
+        }
+    }
+
+    *handp = SEGMENT_POS(segment, hand);
+    return evicted;
 }
 
 
-/* Create file `filename', truncate it at `size' bytes and map it in memory. */
-mapped_file_t *mapped_file_create(const char *filename, size_t size)
+/* Drop about `size' bytes of `mf' from memory. The file is swept in blocks of
+ * `EVICT_BLOCK_SIZE' bytes, like the hand of a clock, starting from `*handp',
+ * which is left pointing at the block to sweep next. Pages accessed since the
+ * hand last passed are just as likely to be evicted as any other, but the
+ * kernel reads them back in if they're really hot. Returns the number of bytes
+ * evicted. Buffer pools are bounded already, so buffered files are left alone.
+ */
+size_t mapped_file_evict(mapped_file_t *mf, size_t size, size_t *handp)
 {
-    int fd;
-    void *address;
-    mapped_file_t *mf;
+    long pagesize;
+    size_t i, pos, block_size, num_pages, resident, swept = 0, evicted = 0;
+    unsigned char vec[EVICT_BLOCK_SIZE / 4096];
+    char *address;
 
+    if(mf->options & MF_SEGMENTED && mf->pool == NULL)
+        return mapped_file_evict_segmented(mf, size, handp);
 
-    if((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    if(mf->pool != NULL || (pagesize = sysconf(_SC_PAGESIZE)) == -1 ||
+            pagesize > EVICT_BLOCK_SIZE)
+        goto _ret;
+
+    Py_BEGIN_ALLOW_THREADS
+    while(evicted < size && swept < mf->size)
     {
-        serror("mapped_file_create: open");
-        goto _err1;
-    }
+        pos = *handp < mf->size ? *handp : 0;
+        block_size = mf->size - pos;
+        if(block_size > EVICT_BLOCK_SIZE)
+            block_size = EVICT_BLOCK_SIZE;
 
-    if((address = map_file(fd, size)) == NULL)
-        goto _err2;
+        *handp = pos + block_size;
+        swept += block_size;
 
-    if((mf = mapped_file_alloc(filename)) == NULL)
-        goto _err3;
+        address = (char *)mf->address + pos;
+        num_pages = (block_size + pagesize - 1) / pagesize;
+        if(num_pages > sizeof(vec) || mincore(address, block_size, vec) != 0)
+            break;
 
-    mf->fd = fd;
-    mf->address = address;
-    mf->size = size;
-    return mf;
+        for(i = 0, resident = 0; i < num_pages; i++)
+            resident += vec[i] & 1;
 
-_err3:
-    munmap(address, size);
+        if(resident == 0)
+            continue;
 
-_err2:
-    close(fd);
-    unlink(filename);
+        /* Since Linux 5.4 the kernel can reclaim the pages right away. Else,
+         * unmap them and drop them from the page cache, which works for clean
+         * pages only; dirty ones are dropped once written back.
+         */
+#ifdef MADV_PAGEOUT
+        if(madvise(address, block_size, MADV_PAGEOUT) != 0)
+#endif
+        {
+            madvise(address, block_size, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(mf->fd, pos, block_size, POSIX_FADV_DONTNEED);
+#endif
+        }
 
-_err1:
-    return NULL;
+        evicted += resident * pagesize;
+    }
+    Py_END_ALLOW_THREADS
+
+_ret:
+    return evicted;
 }
 
 
-/* Synchronize memory contents to disk. */
-int mapped_file_sync(mapped_file_t *mf, size_t pos, size_t size)
+
+/* Access mapped file `mf' through buffer pool `pool', rather than by mapping it
+ * in memory. The file is opened for direct I/O if the pool asks for it.
+ */
+static int mapped_file_attach_pool(mapped_file_t *mf, buffer_pool_t *pool)
 {
+    ssize_t file;
+
     int ret = -1;
 
-    if(mapped_file_check_range(mf, pos, size) == 0)
+#ifdef O_DIRECT
+    if(pool->direct)
+        fcntl(mf->fd, F_SETFL, fcntl(mf->fd, F_GETFL) | O_DIRECT);
+#endif
+
+    if((file = buffer_pool_add_file(pool, mf->fd, mf->size)) < 0)
         goto _err;
 
-    ret = msync((char *)mf->address + pos, size, MS_SYNC);
+    if(mf->address != NULL)
+        munmap(mf->address, mf->size);
+
+    mf->address = NULL;
+    mf->pool = pool;
+    mf->pool_file = (size_t)file;
+
+    ret = 0;
 
 _err:
     return ret;
 }
 
 
-/* Give kernel a hint about the type of access we are going to perform. */
-int mapped_file_set_access(mapped_file_t *mf, int advice)
+/* Access mapped file `mf' with `pread()' and `pwrite()', through a buffer pool
+ * of `size' bytes, rather than by mapping it in memory. If `direct' is non-zero
+ * and the platform supports it, the page cache is bypassed. Pointers returned
+ * by `mapped_file_ptr()' are no longer available. All segments of segmented
+ * files, including those added later, share a single pool.
+ */
+int mapped_file_set_buffered(mapped_file_t *mf, size_t size, int direct)
 {
+    buffer_pool_t *pool;
+    size_t i;
+
     int ret = -1;
 
-    if(advice != MF_ACCESS_NORMAL && advice != MF_ACCESS_RANDOM &&
-            advice != MF_ACCESS_SEQUENTIAL)
+    if(mf->pool != NULL)
+        goto _ok;
+
+#ifndef O_DIRECT
+    direct = 0;
+#endif
+
+    if((pool = buffer_pool_new(size, direct)) == NULL)
         goto _err;
 
-    if((ret = madvise(mf->address, mf->size, advice)) < 0)
-        serror("mapped_file_set_access: madvise");
+    if((mf->options & MF_SEGMENTED) == 0)
+    {
+        if(mapped_file_attach_pool(mf, pool) != 0)
+        {
+            buffer_pool_free(pool);
+            goto _err;
+        }
+        goto _ok;
+    }
+
+    /* Segments attached so far keep using the pool on failure, so it's freed
+     * when `mf' is closed.
+     */
+    mf->pool = pool;
+    for(i = 0; i < mf->num_segments; i++)
+    {
+        if(mapped_file_attach_pool(mf->segments[i], pool) != 0)
+            goto _err;
+    }
+
+_ok:
+    ret = 0;
+
 _err:
     return ret;
 }
 
 
-/* Equivalent to `ftruncate()' for memory mapped files. */
-int mapped_file_truncate(mapped_file_t *mf, size_t size)
-{
-    long pagesize;
+#endif /* _WIN32 */
 
-    void *mf_address = mf->address, *address = NULL;
-    size_t mf_size = mf->size;
-    int mf_fd = mf->fd;
 
+/* Mark all blocks of mapped file `mf' clean. */
+static void mapped_file_clear_dirty(mapped_file_t *mf)
+{
+    if(mf->dirty_size > 0)
+    {
+        memset(mf->dirty, 0, mf->dirty_size);
+        memset(mf->unscheduled, 0, mf->dirty_size);
+    }
+}
 
-    if(size > SSIZE_MAX)
-        goto _err1;
 
-    if(size == mf_size)
-        goto _ok;
+/* Write back the blocks of mapped file `mf' set in block bitmap `bitmap', and
+ * clear them. Runs of adjacent blocks are written back with a single call.
+ */
+static int flush_blocks(mapped_file_t *mf, unsigned char *bitmap, int async)
+{
+    size_t block, first, nblocks, pos, size;
 
+    int ret = -1;
 
-    /* Truncate the file to the requested size first. If resizing the memory
-     * mapping fails, we can easily restore the original file size by calling
-     * `ftruncate()' again.
-     */
-    if(ftruncate(mf_fd, size) != 0)
-    {
-        serror("mapped_file_truncate: ftruncate");
-        goto _err1;
-    }
+    nblocks = mf->dirty_size * 8;
+    block = 0;
 
-    /* When shrinking the memory mapped file, just unmap part of the mapping. */
-    if(size < mf_size)
+    while(block < nblocks)
     {
-        /* According to the manual page, this is the portable way of reading the
-         * system's page size.
-         */
-        if((pagesize = sysconf(_SC_PAGESIZE)) == -1)
+        /* Skip clean blocks a byte of the bitmap at a time. */
+        if(block % 8 == 0 && bitmap[block / 8] == 0)
         {
-            serror("mapped_file_truncate: sysconf");
-            goto _err2;
+            block += 8;
+            continue;
         }
 
-        /* Align sizes to the next multiple of the page size, as `munmap()' will
-         * unmap any page overlapping with the given argument.
-         */
-        size = (size + pagesize - 1) & ~(pagesize - 1);
-        mf_size = (mf_size + pagesize - 1) & ~(pagesize - 1);
-
-        if(size < mf_size &&
-                munmap((char *)mf_address + size, mf_size - size) != 0)
+        if((bitmap[block / 8] & (1 << (block % 8))) == 0)
         {
-            serror("mapped_file_truncate: munmap");
-            goto _err2;
+            block += 1;
+            continue;
         }
 
-        address = mf_address;
-    }
+        first = block;
+        while(block < nblocks && (bitmap[block / 8] & (1 << (block % 8))) != 0)
+            block += 1;
 
-    /* When increasing the size of the memory mapped file, we have to re-map the
-     * underlying file pages.
-     */
-    else if(size > mf_size)
-    {
-#if defined __linux__ || defined __NetBSD__
-        /* Linux and NetBSD implement `mremap()'. I haven't tested the code on
-         * NetBSD, but this is good news anyway.
-         */
-        address = mremap(mf_address, mf_size, size, MREMAP_MAYMOVE);
+        /* Blocks past the end of a file that has shrunk are left alone. */
+        pos = first * DIRTY_BLOCK_SIZE;
+        if(pos >= mf->size)
+            break;
 
-        if(address == MAP_FAILED)
-        {
-            serror("mapped_file_truncate: mremap");
-            goto _err2;
-        }
-#else
-        /* On other OSes, like MacOS X and FreeBSD, we have to take the slow path
-         * which involves creating a larger memory mapping and then unmapping the
-         * old one.
-         */
-        address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mf_fd, 0);
+        size = (block - first) * DIRTY_BLOCK_SIZE;
+        if(size > mf->size - pos)
+            size = mf->size - pos;
 
-        if(address == MAP_FAILED)
-        {
-            serror("mapped_file_truncate: mmap");
-            goto _err2;
-        }
+        if(flush_range(mf, pos, size, async) != 0)
+            goto _err;
 
-        munmap(mf_address, mf_size);
-#endif
+        for(; first < block; first++)
+            bitmap[first / 8] &= ~(1 << (first % 8));
     }
 
-    mf->address = address;
-    mf->size = size;
-    if(mf->pos > size)
-        mf->pos = size;
-    if(mf->eof > size)
-        mf->eof = size;
-
-_ok:
-    return 0;
-
-_err2:
-    if(ftruncate(mf_fd, mf_size) != 0)
-        serror("mapped_file_truncate: ftruncate");
+    ret = 0;
 
-_err1:
-    return -1;
+_err:
+    return ret;
 }
 
 
-/* Equivalent to `rename()' for memory mapped files. */
-int mapped_file_rename(mapped_file_t *mf, const char *filename)
+/* Write back the blocks of mapped file `mf' modified since the last flush. An
+ * asynchronous flush only starts write back of the blocks modified since the
+ * last flush of any kind, with no guarantee as to when it completes, so they
+ * are kept dirty until flushed synchronously. Calling it periodically keeps
+ * the amount of data waiting to be written back bounded.
+ */
+int mapped_file_flush(mapped_file_t *mf, int async)
 {
-    char *filename_p;
+    size_t i;
 
     int ret = -1;
 
-    if((filename_p = PyMem_MALLOC(strlen(filename) + 1)) == NULL)
-        goto _err;
-
-    strcpy(filename_p, filename);
+    if(mf->readonly)
+        goto _ok;
 
-    if(rename(mf->filename, filename) != 0)
+    if(mf->options & MF_SEGMENTED)
     {
-        serror("mapped_file_rename: rename");
-        PyMem_FREE(filename_p);
-        goto _err;
+        for(i = 0; i < mf->num_segments; i++)
+        {
+            if(mapped_file_flush(mf->segments[i], async) != 0)
+                goto _err;
+        }
+        goto _ok;
     }
 
-    PyMem_FREE(mf->filename);
-    mf->filename = filename_p;
+    if(mf->all_dirty)
+    {
+        if(flush_range(mf, 0, mf->size, async) != 0)
+            goto _err;
 
+        if(async == 0)
+        {
+            mapped_file_clear_dirty(mf);
+            mf->all_dirty = 0;
+        }
+    }
+    else if(async)
+    {
+        if(flush_blocks(mf, mf->unscheduled, 1) != 0)
+            goto _err;
+    }
+    else
+    {
+        if(flush_blocks(mf, mf->dirty, 0) != 0)
+            goto _err;
+        mapped_file_clear_dirty(mf);
+    }
+
+_ok:
     ret = 0;
 
 _err:
     return ret;
 }
-
-
-/* Equivalent to `unlink()' for memory mapped files. */
-int mapped_file_unlink(mapped_file_t *mf)
-{
-    return unlink(mf->filename);
-}
-
-
-/* Equivalent to `close()' for memory mapped files. It's not safe to access `mf'
- * after a call to `mapped_file_close()'.
- */
-void mapped_file_close(mapped_file_t *mf)
-{
-    munmap(mf->address, mf->size);
-    close(mf->fd);
-    mapped_file_free(mf);
-}
-
-#endif /* _WIN32 */
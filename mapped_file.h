@@ -3,25 +3,118 @@
 
 #include "common.h"
 #include "rbtree.h"
+#include "buffer_pool.h"
 
 #ifdef _WIN32
 #include <Windows.h>
 #define MF_ACCESS_NORMAL     0
 #define MF_ACCESS_RANDOM     0
 #define MF_ACCESS_SEQUENTIAL 0
+#define MF_ACCESS_WILLNEED   0
+#define MF_ACCESS_DONTNEED   0
 #else /* _WIN32 */
+#include <sys/mman.h>
 #define MF_ACCESS_NORMAL     MADV_NORMAL
 #define MF_ACCESS_RANDOM     MADV_RANDOM
 #define MF_ACCESS_SEQUENTIAL MADV_SEQUENTIAL
+#define MF_ACCESS_WILLNEED   MADV_WILLNEED
+#define MF_ACCESS_DONTNEED   MADV_DONTNEED
 #endif /* _WIN32 */
 
+/* Options of `mapped_file_open()' and `mapped_file_create()'. */
+#define MF_HUGEPAGES 1  /* Back mapping with transparent huge pages */
+#define MF_PREFAULT  2  /* Read in and map the whole file when opened */
+#define MF_LOCKED    4  /* Lock mapping in memory */
+#define MF_SEGMENTED 8  /* Split file in segments, see below */
+#define MF_SEGMENT   16 /* File is a segment of a segmented file */
+#define MF_COMPACT_CHUNKS 32 /* Chunks have 32-bit size headers, see below */
+
+/* Segmented files are made of segment files of `SEGMENT_SIZE' bytes at most,
+ * named after the first one, followed by ".1", ".2" and so on. Each segment
+ * begins with a `uint64_t' magic number, and positions in segmented files hold
+ * the segment number in the bits above `SEGMENT_SHIFT'. When the last segment
+ * is full, a new one is added, so growing the file never copies nor remaps
+ * what's already there.
+ */
+#define SEGMENT_SHIFT        30
+#define SEGMENT_SIZE         ((size_t)1 << SEGMENT_SHIFT)
+#define SEGMENT_OF(x)        ((x) >> SEGMENT_SHIFT)
+#define SEGMENT_OFFSET(x)    ((x) & (SEGMENT_SIZE - 1))
+#define SEGMENT_POS(s, x)    (((size_t)(s) << SEGMENT_SHIFT) | (x))
+#define SEGMENT_INITIAL_SIZE (1 << 16)
+
 /* Macros used by the allocator API. */
 #define MASK         (~(sizeof(size_t) - 1))
 #define ALIGN(x)     (((x) + sizeof(size_t) - 1) & MASK)
-#define HOLE_SIZE(x) (ALIGN(x) + sizeof(size_t))
+#define HOLE_SIZE(mf, x) ALIGN((x) + CHUNK_HEADER_SIZE(mf))
+
+/* Chunks of files with `MF_COMPACT_CHUNKS' set have a `uint32_t' size header
+ * instead of a `size_t' one, which saves a word per chunk, up to half of the
+ * space taken by small objects. These chunks begin 4 bytes before an aligned
+ * position, so chunk positions, past the header, are still aligned. Chunks are
+ * laid out back to back from `CHUNK_START()' of the end of the file header.
+ */
+#define CHUNK_HEADER_SIZE(mf) \
+    (((mf)->options & MF_COMPACT_CHUNKS) ? sizeof(uint32_t) : sizeof(size_t))
+#define CHUNK_START(mf, x) \
+    (ALIGN((x) + CHUNK_HEADER_SIZE(mf)) - CHUNK_HEADER_SIZE(mf))
+#define CHUNK_SIZE_MAX(mf) \
+    (((mf)->options & MF_COMPACT_CHUNKS) ? (size_t)UINT32_MAX & MASK : SSIZE_MAX)
+
+/* Chunk sizes are always aligned, so the low bits of each chunk's size header
+ * are free to hold per-chunk flags.
+ */
+#define CHUNK_FLAGS      (sizeof(size_t) - 1)
+#define CHUNK_SIZE(x)    ((x) & MASK)
+#define CHUNK_COMPRESSED 1
+#define CHUNK_DICT       2
+
+/* Chunk positions are aligned too, so compact indices store them in units of
+ * the alignment, as 32-bit integers, which covers files of up to 32GB.
+ */
+#define COMPACT_POS(x)  ((uint32_t)((x) / sizeof(size_t)))
+#define EXPAND_POS(x)   ((size_t)(x) * sizeof(size_t))
+#define COMPACT_POS_MAX EXPAND_POS(UINT32_MAX)
+
+/* Chunks smaller than this are never compressed. A lower threshold applies when
+ * a shared compression dictionary is available.
+ */
+#define COMPRESSION_THRESHOLD      64
+#define DICT_COMPRESSION_THRESHOLD 16
+
+/* Unit of copying in `mapped_file_clone()', when blocks can't be shared. */
+#define CLONE_BLOCK_SIZE (1 << 16)
+
+/* Granularity of dirty-range tracking. Must be a multiple of the page size. */
+#define DIRTY_BLOCK_SIZE (1 << 16)
+
+/* When iterators read ahead a window of index entries, the chunks these point
+ * to are read ahead too, unless they're scattered over more than this many
+ * bytes.
+ */
+#define READAHEAD_MAX_SPAN (16 << 20)
 
+/* Number of bytes read ahead from each chunk prefetched by iterators. */
+#define PREFETCH_SIZE 4096
 
-/* A structure that represents a mapped file. */
+/* Number of pages sampled by `mapped_file_resident()'. */
+#define RESIDENCY_SAMPLES 1024
+
+/* Unit of eviction in `mapped_file_evict()'. Must be a multiple of the page
+ * size.
+ */
+#define EVICT_BLOCK_SIZE (1 << 21)
+
+/* Maximum number of bytes taken from each chunk by `mapped_file_sample_chunks()'. */
+#define CHUNK_SAMPLE_SIZE 1024
+
+
+/* A structure that represents a mapped file. While frees are deferred (see
+ * `mapped_file_defer_frees()'), freed chunks are kept in `pending' rather than in
+ * `holes', so that their contents stay intact until they're released. Write-
+ * ahead logs and snapshots being copied may defer frees at the same time, so
+ * `deferrals' counts them.
+ */
 typedef struct mapped_file
 {
     char *filename;   /* Name of mapped file */
@@ -30,14 +123,46 @@ typedef struct mapped_file
 #else
     int fd;           /* File descriptor of mapped file */
 #endif
-    void *address;    /* Address where file was mapped */
+    void *address;    /* Address where file was mapped, `NULL' if buffered */
     size_t size;      /* Size of mapped file */
     size_t pos;       /* Current position in mapped buffer */
     size_t eof;       /* Mapped file EOF position */
     rbtree_t *holes;  /* Red-black tree of holes in mapped buffer */
+    rbtree_t *pending; /* Holes not to be reused yet, see above, or `NULL' */
+    int deferrals;    /* Number of users deferring frees */
+    char readonly;    /* Non-zero if file is mapped read-only */
+    int options;      /* Options file was opened with, `MF_XXX' constants */
+    buffer_pool_t *pool;   /* Buffer pool if accessed with `pread()' and `pwrite()' */
+    size_t pool_file;      /* Number of file in `pool' */
+    unsigned char *dirty;  /* Bitmap of blocks modified since last synchronized */
+    unsigned char *unscheduled; /* Bitmap of blocks modified since last flushed */
+    size_t dirty_size;     /* Size of each block bitmap in bytes */
+    char all_dirty;        /* Non-zero if the bitmaps couldn't be grown */
+    struct mapped_file **segments; /* Segments of a segmented file */
+    size_t num_segments;   /* Number of entries in `segments' */
 } mapped_file_t;
 
 
+/* A mapped file frozen by `mapped_file_freeze()', so that it can be copied
+ * without holding the lock of the mapped file's owner.
+ */
+typedef struct file_copy
+{
+    char *src;        /* Name of file to copy */
+    char *dst;        /* Name of copy */
+    size_t size;      /* Number of bytes to copy */
+} file_copy_t;
+
+/* A chunk and the index entry pointing to it. Iterators sort these in order to
+ * read chunks in the order they appear in the file.
+ */
+typedef struct chunk_ref
+{
+    size_t pos;       /* Position of chunk, 0 if none */
+    size_t index;     /* Index entry pointing to chunk */
+} chunk_ref_t;
+
+
 /* A structure that represents a hole in the mapped buffer. */
 typedef struct hole
 {
@@ -47,8 +172,12 @@ typedef struct hole
 
 
 ssize_t mapped_file_read(mapped_file_t *, void *, size_t);
+ssize_t mapped_file_pread(mapped_file_t *, void *, size_t, size_t);
+void *mapped_file_ptr(mapped_file_t *, size_t, size_t);
 ssize_t mapped_file_write(mapped_file_t *, void *, size_t);
+ssize_t mapped_file_pwrite(mapped_file_t *, void *, size_t, size_t);
 int mapped_file_memset(mapped_file_t *, int, size_t);
+void mapped_file_mark_dirty(mapped_file_t *, size_t, size_t);
 int mapped_file_seek(mapped_file_t *, ssize_t, int);
 size_t mapped_file_tell(mapped_file_t *);
 size_t mapped_file_get_size(mapped_file_t *);
@@ -56,17 +185,39 @@ size_t mapped_file_get_eof(mapped_file_t *);
 
 ssize_t mapped_file_allocate_chunk(mapped_file_t *, size_t);
 void mapped_file_free_chunk(mapped_file_t *, size_t);
+int mapped_file_defer_frees(mapped_file_t *, int);
+void mapped_file_release_chunks(mapped_file_t *);
+void mapped_file_set_compact_chunks(mapped_file_t *);
 
+ssize_t mapped_file_marshal_string_object(em_common_t *, mapped_file_t *,
+    PyObject *);
 ssize_t mapped_file_marshal_object(em_common_t *, mapped_file_t *, PyObject *);
+PyObject *mapped_file_get_chunk_data(em_common_t *, mapped_file_t *, size_t);
 PyObject *mapped_file_unmarshal_object(em_common_t *, mapped_file_t *, size_t);
+void mapped_file_prefetch_chunks(mapped_file_t *, chunk_ref_t *, size_t);
+ssize_t mapped_file_sample_chunks(em_common_t *, mapped_file_t *, size_t,
+    char *, size_t);
 
-mapped_file_t *mapped_file_open(const char *);
-mapped_file_t *mapped_file_create(const char *, size_t);
+mapped_file_t *mapped_file_open(const char *, int, int);
+mapped_file_t *mapped_file_create(const char *, size_t, int);
+int mapped_file_set_buffered(mapped_file_t *, size_t, int);
 int mapped_file_sync(mapped_file_t *, size_t, size_t);
+int mapped_file_flush(mapped_file_t *, int);
 int mapped_file_set_access(mapped_file_t *, int);
+int mapped_file_advise(mapped_file_t *, size_t, size_t, int);
 int mapped_file_truncate(mapped_file_t *, size_t);
+int mapped_file_remap(mapped_file_t *);
+int mapped_file_lock(mapped_file_t *, int);
+int mapped_file_clone(mapped_file_t *, const char *);
+int mapped_file_save(mapped_file_t *, const char *);
+int mapped_file_freeze(mapped_file_t *, const char *, file_copy_t **, size_t *);
+void mapped_file_thaw(mapped_file_t *);
+int mapped_file_copy_frozen(file_copy_t *, size_t);
+void mapped_file_free_copies(file_copy_t *, size_t);
 int mapped_file_rename(mapped_file_t *, const char *);
 int mapped_file_unlink(mapped_file_t *);
 void mapped_file_close(mapped_file_t *);
+size_t mapped_file_resident(mapped_file_t *);
+size_t mapped_file_evict(mapped_file_t *, size_t, size_t *);
 
 #endif /* _MAPPED_FILE_H_ */
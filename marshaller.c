@@ -9,11 +9,23 @@
  * Python 2.x and "_pickle" on Python 3.x.
  *
  * However, the API allows for EM types to implement their own serialization and
- * deserialization methods (see `em_common_t' in "common.h").
+ * deserialization methods (see `em_common_t' in "common.h"), or to share class
+ * names between stored objects via a class table (see "class_table.c").
  */
 #include <Python.h>
 
 #include "marshaller.h"
+#include "class_table.h"
+
+
+/* Pickles of protocol 2 and above begin with a PROTO opcode and its argument,
+ * and those of protocol 4 and above go on with a FRAME opcode and its 8-byte
+ * argument, none of which are needed to unpickle them.
+ */
+#define PICKLE_PROTO      0x80
+#define PICKLE_PROTO_SIZE 2
+#define PICKLE_FRAME      0x95
+#define PICKLE_FRAME_SIZE 9
 
 
 static PyObject *module;
@@ -81,6 +93,8 @@ PyObject *marshal(em_common_t *em_obj, PyObject *obj)
     {
         if(em_obj->pickler)
             r = PyObject_CallFunctionObjArgs(em_obj->pickle, obj, NULL);
+        else if(em_obj->classes)
+            r = class_table_marshal(em_obj->classes, obj);
         else
             r = PyObject_CallFunctionObjArgs(marshal_method, obj, proto, NULL);
     }
@@ -101,6 +115,8 @@ PyObject *unmarshal(em_common_t *em_obj, PyObject *obj)
     {
         if(em_obj->unpickler)
             r = PyObject_CallFunctionObjArgs(em_obj->unpickle, obj, NULL);
+        else if(em_obj->classes)
+            r = class_table_unmarshal(em_obj->classes, obj);
         else
             r = PyObject_CallFunctionObjArgs(unmarshal_method, obj, NULL);
     }
@@ -109,6 +125,84 @@ PyObject *unmarshal(em_common_t *em_obj, PyObject *obj)
 }
 
 
+/* Pack string object `str', as returned by `marshal()', in `*valuep' if it's
+ * up to `max_size' bytes long, as an inline value (see `IS_INLINE()'). Pickles
+ * made by the default marshaller are stripped of their prologue first. Returns
+ * 1 if `str' was packed, 0 if it's too large, or -1 on error.
+ */
+int marshal_inline(em_common_t *em_obj, PyObject *str, size_t max_size,
+        size_t *valuep)
+{
+    unsigned char *data;
+    Py_ssize_t size, i;
+    size_t value;
+    int ret = -1;
+
+#if PY_MAJOR_VERSION >= 3
+    if(PyBytes_AsStringAndSize(str, (char **)&data, &size) == -1)
+        goto _err;
+#else
+    if(PyString_AsStringAndSize(str, (char **)&data, &size) == -1)
+        goto _err;
+#endif
+
+    if(em_obj->pickler == NULL && em_obj->classes == NULL &&
+            size >= PICKLE_PROTO_SIZE && data[0] == PICKLE_PROTO)
+    {
+        data += PICKLE_PROTO_SIZE;
+        size -= PICKLE_PROTO_SIZE;
+
+        if(size >= PICKLE_FRAME_SIZE && data[0] == PICKLE_FRAME)
+        {
+            data += PICKLE_FRAME_SIZE;
+            size -= PICKLE_FRAME_SIZE;
+        }
+    }
+
+    ret = 0;
+
+    if((size_t)size > max_size)
+        goto _err;
+
+    /* The size goes in the low byte, next to the tag bit, followed by the data. */
+    value = ((size_t)size << 1) | 1;
+    for(i = 0; i < size; i++)
+        value |= (size_t)data[i] << (8 * (i + 1));
+
+    *valuep = value;
+    ret = 1;
+
+_err:
+    return ret;
+}
+
+
+/* Unmarshal object from inline value `value', packed by `marshal_inline()'. */
+PyObject *unmarshal_inline(em_common_t *em_obj, size_t value)
+{
+    char data[sizeof(size_t)];
+    size_t size = (value & 0xff) >> 1, i;
+    PyObject *str, *r = NULL;
+
+    for(i = 0; i < size && i < sizeof(data) - 1; i++)
+        data[i] = (char)(value >> (8 * (i + 1)));
+
+#if PY_MAJOR_VERSION >= 3
+    if((str = PyBytes_FromStringAndSize(data, i)) == NULL)
+        goto _err;
+#else
+    if((str = PyString_FromStringAndSize(data, i)) == NULL)
+        goto _err;
+#endif
+
+    r = unmarshal(em_obj, str);
+    Py_DECREF(str);
+
+_err:
+    return r;
+}
+
+
 void marshaller_fini(void)
 {
     Py_DECREF(proto);
@@ -6,6 +6,8 @@
 int marshaller_init(void);
 PyObject *marshal(em_common_t *, PyObject *);
 PyObject *unmarshal(em_common_t *, PyObject *);
+int marshal_inline(em_common_t *, PyObject *, size_t, size_t *);
+PyObject *unmarshal_inline(em_common_t *, size_t);
 void marshaller_fini(void);
 
 #endif /* _MARSHALLER_H_ */
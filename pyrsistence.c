@@ -4,6 +4,7 @@
  * pyrsistence.c - Python extension entry point.
  */
 #include "marshaller.h"
+#include "class_table.h"
 #include "em_dict.h"
 #include "em_list.h"
 
@@ -42,6 +43,12 @@ PyMODINIT_FUNC initpyrsistence(void)
     register_em_list_object(module);
 
     marshaller_init();
+    class_table_init();
+
+#ifdef Py_GIL_DISABLED
+    /* All state is protected by per-object locks (see "lock.c"). */
+    PyUnstable_Module_SetGIL(module, Py_MOD_GIL_NOT_USED);
+#endif
 
 #if PY_MAJOR_VERSION >= 3
     return module;
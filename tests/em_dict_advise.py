@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+'''em_dict_advise.py - Checks hints given to the operating system about how
+external memory dictionaries are going to be accessed.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+VALUE_SIZE = 0x200
+
+HINTS = ['normal', 'sequential', 'random', 'willneed', 'dontneed']
+
+
+def value_of(i):
+    return ('%d-' % i).ljust(VALUE_SIZE, 'x')
+
+
+def verify(em_dict, what):
+    if sorted(em_dict.items()) != [(i, value_of(i)) for i in util.xrange(NUM_ITEMS)]:
+        util.msg('FATAL! Mismatch in items %s' % what)
+    for i in util.xrange(0, NUM_ITEMS, 0x10):
+        if em_dict[i] != value_of(i):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = os.path.abspath(util.make_temp_name('em_dict'))
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i)
+    em_dict.flush()
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Giving hints on external memory dictionary access')
+
+    # Hints change nothing but performance.
+    for hint in HINTS:
+        em_dict.advise(hint)
+        verify(em_dict, 'after "%s" hint' % hint)
+
+        for start, end in [(0, 0x100), (0x100, None), (0, 1 << 40), (1 << 40, 1 << 41)]:
+            em_dict.advise(hint, start, end)
+            em_dict.advise(hint, start=start, end=end)
+        verify(em_dict, 'after "%s" hint on ranges' % hint)
+
+    # Dropping the whole dictionary from memory unmaps its pages, which are
+    # read back in when accessed again.
+    verify(em_dict, 'before dropping')
+    size = util.resident_size(dirname)
+    em_dict.advise('dontneed')
+    if size is not None and util.resident_size(dirname) > size // 4:
+        util.msg('FATAL! %d KB of %d KB still in memory after "dontneed" hint' % (util.resident_size(dirname), size))
+    verify(em_dict, 'after dropping')
+
+    # A range drops part of it only.
+    size = util.resident_size(dirname)
+    em_dict.advise('dontneed', 0, 0x1000)
+    if size is not None and not size // 4 < util.resident_size(dirname) < size:
+        util.msg('FATAL! %d KB of %d KB in memory after "dontneed" hint on range' % (util.resident_size(dirname), size))
+    verify(em_dict, 'after dropping range')
+
+    for args in [('unknown', ), ('random', -1), ('random', 0x10, 0x8)]:
+        try:
+            em_dict.advise(*args)
+            util.msg('FATAL! Accepted %r' % (args, ))
+        except ValueError:
+            pass
+
+    try:
+        em_dict.advise('random', 0, 'end')
+        util.msg('FATAL! Invalid range end accepted')
+    except TypeError:
+        pass
+
+    em_dict.close()
+
+    # Read-only dictionaries take hints too.
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    for hint in HINTS:
+        em_dict.advise(hint)
+        em_dict.advise(hint, 0x100, 0x200)
+    verify(em_dict, 'after re-opening read-only')
+    em_dict.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Remove external memory dictionary from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
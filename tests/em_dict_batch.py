@@ -0,0 +1,148 @@
+#!/usr/bin/env python
+'''em_dict_batch.py - Checks batched reads of external memory dictionaries,
+with `io_uring' and with the pool of threads it falls back to.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x20000
+
+BUFFER_POOL_SIZE = 0x400000
+
+PREFETCH = 0x40
+
+# One in this many keys is deleted.
+DELETE_STRIDE = 7
+
+# Set to have the pool of threads issue batched reads (see "batch_io.h").
+NO_IO_URING = 'PYRSISTENCE_NO_IO_URING'
+
+BATCH_IO_THREADS = 16
+
+
+def value_of(i):
+    return [i, 'value-%d-' % i * (i % 0x20), None][i % 3]
+
+
+def num_threads():
+    '''Return the number of threads of this process, or `None' if unknown.'''
+    if os.path.isdir('/proc/self/task'):
+        return len(os.listdir('/proc/self/task'))
+    return None
+
+
+def verify(em_dict, keys, what):
+
+    # Plain lookups, one at a time.
+    values = [em_dict[k] for k in keys]
+    if values != [value_of(k) for k in keys]:
+        util.msg('FATAL! Mismatch in plain lookups %s' % what)
+
+    if em_dict.get_many(keys) != values:
+        util.msg('FATAL! Mismatch in batched lookups %s' % what)
+
+    # Batched reads while iterating.
+    items = sorted(em_dict.items(prefetch=PREFETCH, reorder=True))
+    if items != sorted(em_dict.items()):
+        util.msg('FATAL! Mismatch in reordered iteration %s' % what)
+
+
+def main(argv):
+
+    for records in [False, True]:
+
+        util.msg('Populating external memory dictionary (records=%s)' % records)
+
+        t1 = time.time()
+
+        dirname = util.make_temp_name('em_dict')
+
+        em_dict = pyrsistence.EMDict(dirname, records=records)
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = value_of(i)
+
+        # Deleted slots are probed past by batched lookups, like by plain ones.
+        for i in util.xrange(0, NUM_ITEMS, DELETE_STRIDE):
+            del em_dict[i]
+        em_dict.close()
+
+        keys = [i for i in util.xrange(NUM_ITEMS) if i % DELETE_STRIDE != 0]
+        random.shuffle(keys)
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Verifying batched lookups')
+
+        em_dict = pyrsistence.EMDict(dirname)
+        verify(em_dict, keys, 'through mapped files')
+        em_dict.close()
+
+        # Batches are read in the buffer pool with `io_uring', if the kernel
+        # allows, and by the pool of threads otherwise.
+        for no_io_uring in [False, True]:
+            what = 'through buffer pool (%s)' % ('threads' if no_io_uring else 'io_uring')
+
+            if no_io_uring:
+                os.environ[NO_IO_URING] = '1'
+
+            n = num_threads()
+            em_dict = pyrsistence.EMDict(dirname, buffer_pool=BUFFER_POOL_SIZE)
+            verify(em_dict, keys, what)
+
+            if no_io_uring and n is not None and num_threads() < n + BATCH_IO_THREADS:
+                util.msg('FATAL! Pool of threads not used %s' % what)
+
+            em_dict.close()
+
+            if no_io_uring:
+                del os.environ[NO_IO_URING]
+
+        # Empty and duplicate keys are fine, missing ones aren't.
+        em_dict = pyrsistence.EMDict(dirname, buffer_pool=BUFFER_POOL_SIZE)
+        if em_dict.get_many([]) != [] or em_dict.get_many((1, 1)) != [value_of(1)] * 2:
+            util.msg('FATAL! Mismatch in batched lookups of duplicate keys')
+
+        try:
+            em_dict.get_many(keys[:0x1000] + [NUM_ITEMS])
+            util.msg('FATAL! Missing key found')
+        except KeyError:
+            pass
+
+        try:
+            em_dict.get_many(keys[:0x1000] + [DELETE_STRIDE])
+            util.msg('FATAL! Deleted key found')
+        except KeyError:
+            pass
+
+        try:
+            em_dict.get_many([[]])
+            util.msg('FATAL! Unhashable key found')
+        except TypeError:
+            pass
+
+        em_dict.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory dictionary from disk.
+        shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
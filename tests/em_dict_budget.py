@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+'''em_dict_budget.py - Checks external memory dictionaries kept within a memory
+budget, by evicting parts of "values.bin" in the background.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+VALUE_SIZE = 0x400
+
+MEMORY_BUDGET = 0x800000
+
+BUFFER_POOL_SIZE = 0x400000
+
+SEGMENT_SIZE = 1 << 30
+
+# Seconds the background thread takes to enforce the budget, at most.
+BUDGET_DELAY = 5
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)).ljust(VALUE_SIZE, 'x')
+
+
+def resident_size(dirname):
+    '''Return the number of bytes of mappings of "values.bin" segments in
+    "dirname" that are in memory, or `None' if unknown.'''
+    sizes = util.mapping_sizes(dirname, ['Rss'])
+    if sizes is None:
+        return None
+    return sum(size * 1024 for filename, size in sizes.items()
+        if filename.startswith('values.bin'))
+
+
+def verify(em_dict, version_of, what):
+    if len(em_dict) != NUM_ITEMS:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), NUM_ITEMS, what))
+
+    keys = list(util.xrange(NUM_ITEMS))
+    random.shuffle(keys)
+    for i in keys:
+        if em_dict[i] != value_of(i, version_of(i)):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def wait_for_budget(dirname, what):
+    '''Wait for the values of the dictionary in "dirname" to be evicted down to
+    about the memory budget.'''
+    size = resident_size(dirname)
+    if size is None:
+        return
+
+    t = time.time()
+    while size > MEMORY_BUDGET and time.time() - t < BUDGET_DELAY:
+        time.sleep(0.1)
+        size = resident_size(dirname)
+
+    if size > MEMORY_BUDGET:
+        util.msg('FATAL! %d bytes of values resident %s' % (size, what))
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionary with values in segments')
+
+    t1 = time.time()
+
+    dirname = os.path.abspath(util.make_temp_name('em_dict'))
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(NUM_ITEMS // 2):
+        em_dict[i] = value_of(i, 0)
+    em_dict.close()
+
+    # A full, sparse, segment sits between the first and the last one, where
+    # the rest of the values go.
+    with open(os.path.join(dirname, 'values.bin'), 'rb') as fp:
+        magic = fp.read(8)
+
+    with open(os.path.join(dirname, 'values.bin.1'), 'wb') as fp:
+        fp.write(magic)
+        fp.truncate(SEGMENT_SIZE)
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(NUM_ITEMS // 2, NUM_ITEMS):
+        em_dict[i] = value_of(i, 0)
+    em_dict.close()
+
+    if not os.path.exists(os.path.join(dirname, 'values.bin.2')):
+        util.msg('FATAL! Values not stored in a new segment')
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Reading external memory dictionary within memory budget')
+
+    em_dict = pyrsistence.EMDict(dirname, memory_budget=MEMORY_BUDGET)
+    verify(em_dict, lambda i: 0, 'within memory budget')
+    wait_for_budget(dirname, 'after reading')
+
+    # Lookups fault evicted pages back in, while the budget keeps being
+    # enforced.
+    verify(em_dict, lambda i: 0, 'after eviction')
+
+    # Modified pages are dropped once written back.
+    for i in util.xrange(0, NUM_ITEMS, 2):
+        em_dict[i] = value_of(i, 1)
+    em_dict.flush()
+    verify(em_dict, lambda i: 1 - i % 2, 'after overwriting')
+    wait_for_budget(dirname, 'after overwriting')
+    em_dict.close()
+
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    verify(em_dict, lambda i: 1 - i % 2, 'after re-opening')
+    em_dict.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Buffered files are bounded by their pool already and aren't evicted from.
+    util.msg('Reading external memory dictionary through buffer pool within memory budget')
+
+    em_dict = pyrsistence.EMDict(dirname, memory_budget=MEMORY_BUDGET,
+        buffer_pool=BUFFER_POOL_SIZE)
+    verify(em_dict, lambda i: 1 - i % 2, 'through buffer pool')
+    time.sleep(1.5)
+    for i in util.xrange(1, NUM_ITEMS, 2):
+        em_dict[i] = value_of(i, 1)
+    verify(em_dict, lambda i: 1, 'after overwriting through buffer pool')
+    em_dict.close()
+
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    verify(em_dict, lambda i: 1, 'after re-opening')
+    em_dict.close()
+
+    try:
+        pyrsistence.EMDict(dirname, memory_budget=-1).close()
+        util.msg('FATAL! Negative memory budget accepted')
+    except ValueError:
+        pass
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory dictionary from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
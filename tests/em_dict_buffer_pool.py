@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+'''em_dict_buffer_pool.py - Checks external memory dictionaries accessing their
+data files through a buffer pool much smaller than them.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+# 16 blocks of 64KB, while the data files grow to several MB.
+BUFFER_POOL_SIZE = 0x100000
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)) * (i % 0x20)
+
+
+def verify(em_dict, version_of, what):
+    if len(em_dict) != NUM_ITEMS:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), NUM_ITEMS, what))
+
+    # Random order, so that blocks keep being evicted and read in again.
+    keys = list(util.xrange(NUM_ITEMS))
+    random.shuffle(keys)
+    for i in keys:
+        if em_dict['key-%d' % i] != value_of(i, version_of(i)):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    for direct_io in [False, True]:
+
+        util.msg('Populating external memory dictionary through buffer pool '
+            '(direct_io=%s)' % direct_io)
+
+        t1 = time.time()
+
+        dirname = util.make_temp_name('em_dict')
+        snapshot_dirname = util.make_temp_name('em_dict_snapshot')
+
+        em_dict = pyrsistence.EMDict(dirname, buffer_pool=BUFFER_POOL_SIZE,
+            direct_io=direct_io)
+        for i in util.xrange(NUM_ITEMS):
+            em_dict['key-%d' % i] = value_of(i, 0)
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Verifying external memory dictionary contents')
+
+        verify(em_dict, lambda i: 0, 'after population')
+
+        # Overwrite every other value in random order; dirty blocks are written
+        # back as they're evicted.
+        keys = list(util.xrange(0, NUM_ITEMS, 2))
+        random.shuffle(keys)
+        for i in keys:
+            em_dict['key-%d' % i] = value_of(i, 1)
+
+        verify(em_dict, lambda i: 1 - i % 2, 'after overwriting')
+
+        # Blocks still dirty in the pool reach the files on `flush()'.
+        em_dict.flush()
+        for i in util.xrange(1, NUM_ITEMS, 2):
+            em_dict['key-%d' % i] = value_of(i, 1)
+        em_dict.close()
+
+        # The files hold everything written through the pool.
+        em_dict = pyrsistence.EMDict(dirname, readonly=True)
+        verify(em_dict, lambda i: 1, 'after re-opening without buffer pool')
+        em_dict.close()
+
+        em_dict = pyrsistence.EMDict(dirname, buffer_pool=BUFFER_POOL_SIZE,
+            direct_io=direct_io)
+        verify(em_dict, lambda i: 1, 'after re-opening')
+        for i in util.xrange(NUM_ITEMS):
+            em_dict['key-%d' % i] = value_of(i, 2)
+
+        # Snapshots copy the files once blocks dirty in the pool are written
+        # back.
+        snapshot = em_dict.snapshot(snapshot_dirname)
+        em_dict.close()
+        verify(snapshot, lambda i: 2, 'in snapshot')
+        snapshot.close()
+        shutil.rmtree(snapshot_dirname)
+
+        em_dict = pyrsistence.EMDict(dirname, readonly=True,
+            buffer_pool=BUFFER_POOL_SIZE)
+        verify(em_dict, lambda i: 2, 'after re-opening read-only')
+        em_dict.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory dictionary from disk.
+        shutil.rmtree(dirname)
+
+    # Readers would keep serving stale blocks from their pool.
+    util.msg('Checking invalid buffer pool options')
+
+    dirname = util.make_temp_name('em_dict')
+    pyrsistence.EMDict(dirname).close()
+
+    for kwargs in [{'reader': True, 'buffer_pool': BUFFER_POOL_SIZE},
+            {'buffer_pool': -1}, {'direct_io': True}]:
+        try:
+            pyrsistence.EMDict(dirname, **kwargs).close()
+            util.msg('FATAL! Accepted %r' % kwargs)
+        except ValueError:
+            pass
+
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
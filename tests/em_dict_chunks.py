@@ -0,0 +1,178 @@
+#!/usr/bin/env python
+'''em_dict_chunks.py - Checks the layout of chunks in files of external memory
+dictionaries with compact, 4-byte, chunk headers.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+# Size of the header of "keys.bin" and "values.bin".
+HDR_SIZE = 8
+
+CHUNK_HEADER_SIZE = 4
+
+CHUNK_COMPRESSED = 1
+CHUNK_DICT = 2
+
+
+def align(x):
+    return (x + 7) & ~7
+
+
+def value_of(i):
+    return [True, i, 'value' * 20, 'value-%d' % i][i % 4]
+
+
+def read_chunks(filename):
+    '''Walk the chunks of "filename" and return a list of (position, size,
+    flags) tuples, position being that of the data past the size header.'''
+
+    with open(filename, 'rb') as fp:
+        data = fp.read()
+
+    # The first chunk begins 4 bytes before an aligned position, past zeroed
+    # padding.
+    pos = align(HDR_SIZE + CHUNK_HEADER_SIZE) - CHUNK_HEADER_SIZE
+    if data[HDR_SIZE:pos] != b'\0' * (pos - HDR_SIZE):
+        util.msg('FATAL! Padding before first chunk of "%s" not zeroed' % filename)
+
+    chunks = []
+    while pos < len(data):
+        header = struct.unpack('<I', data[pos:pos + CHUNK_HEADER_SIZE])[0]
+        size, flags = header & ~7, header & 7
+        if size == 0 or (pos + CHUNK_HEADER_SIZE) % 8 != 0:
+            util.msg('FATAL! Invalid chunk at %d of "%s"' % (pos, filename))
+            break
+        chunks.append((pos + CHUNK_HEADER_SIZE, size, flags))
+        pos += size
+    return chunks
+
+
+def verify(em_dict, num_items, what):
+    if len(em_dict) != num_items:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), num_items, what))
+    for i in util.xrange(num_items):
+        if em_dict[i] != value_of(i):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionaries with normal and compact chunks')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+    compact_dirname = util.make_temp_name('em_dict_compact')
+
+    em_dict = pyrsistence.EMDict(dirname, compression='lz4')
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, compression='lz4',
+        compact_chunks=True)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i)
+        compact_em_dict[i] = value_of(i)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying chunk layout')
+
+    verify(compact_em_dict, NUM_ITEMS, 'after population')
+
+    # Overwrite each value; chunks freed meanwhile are reused for values of the
+    # same size, so "values.bin" barely grows.
+    compact_em_dict.close()
+    size = os.path.getsize(os.path.join(compact_dirname, 'values.bin'))
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, compression='lz4')
+    for i in util.xrange(NUM_ITEMS):
+        compact_em_dict[i] = value_of(i)
+    compact_em_dict.close()
+
+    if os.path.getsize(os.path.join(compact_dirname, 'values.bin')) - size > size // 0x10:
+        util.msg('FATAL! Chunks freed in "values.bin" not reused')
+
+    em_dict.close()
+
+    # Keys and values are in chunks with 4-byte headers. Small objects, such as
+    # `True', fit in 8 bytes instead of 16.
+    chunks = read_chunks(os.path.join(compact_dirname, 'keys.bin'))
+    if len(chunks) != NUM_ITEMS:
+        util.msg('FATAL! Got %d chunks in "keys.bin" but expected %d' % (len(chunks), NUM_ITEMS))
+
+    chunks = read_chunks(os.path.join(compact_dirname, 'values.bin'))
+    if len([chunk for chunk in chunks if chunk[1] == 8]) < NUM_ITEMS // 4:
+        util.msg('FATAL! Small objects not in 8-byte chunks')
+
+    size = os.path.getsize(os.path.join(dirname, 'values.bin'))
+    compact_size = os.path.getsize(os.path.join(compact_dirname, 'values.bin'))
+    if compact_size >= size:
+        util.msg('FATAL! Compact chunks take %d bytes, normal chunks %d bytes' % (compact_size, size))
+
+    # Compression flags are kept in the low bits of 32-bit size headers.
+    chunks = read_chunks(os.path.join(compact_dirname, 'values.bin'))
+    if len([chunk for chunk in chunks if chunk[2] == CHUNK_COMPRESSED]) < NUM_ITEMS // 4:
+        util.msg('FATAL! Compressed chunks not flagged')
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    shutil.rmtree(dirname)
+
+    # The format of "keys.bin" and "values.bin" is picked up from "index.bin"
+    # when re-opening.
+    util.msg('Re-opening external memory dictionary with compact chunks')
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, compression='lz4-dict')
+    verify(compact_em_dict, NUM_ITEMS, 'after re-opening')
+
+    for i in util.xrange(NUM_ITEMS, 2 * NUM_ITEMS):
+        compact_em_dict[i] = value_of(i)
+    verify(compact_em_dict, 2 * NUM_ITEMS, 'after growing')
+
+    # Chunks of deleted keys are reused when the keys are added back.
+    for i in util.xrange(0, NUM_ITEMS, 8):
+        del compact_em_dict[i]
+    for i in util.xrange(0, NUM_ITEMS, 8):
+        compact_em_dict[i] = value_of(i)
+    verify(compact_em_dict, 2 * NUM_ITEMS, 'after deleting and re-adding')
+    compact_em_dict.close()
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, readonly=True)
+    verify(compact_em_dict, 2 * NUM_ITEMS, 'after re-opening read-only')
+    compact_em_dict.close()
+
+    chunks = read_chunks(os.path.join(compact_dirname, 'keys.bin'))
+    if len(chunks) != 2 * NUM_ITEMS:
+        util.msg('FATAL! Got %d chunks in "keys.bin" but expected %d' % (len(chunks), 2 * NUM_ITEMS))
+
+    # Objects compressed with the shared dictionary have both flags set.
+    chunks = read_chunks(os.path.join(compact_dirname, 'values.bin'))
+    if len([chunk for chunk in chunks if chunk[2] == CHUNK_COMPRESSED | CHUNK_DICT]) == 0:
+        util.msg('FATAL! Chunks compressed with dictionary not flagged')
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory dictionary from disk.
+    shutil.rmtree(compact_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,150 @@
+#!/usr/bin/env python
+'''em_dict_compact.py - Checks external memory dictionaries with compact
+indices, keeping 32-bit hash values and positions.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x40000
+
+# Size of the header of "index.bin" and offset of its `flags' field.
+HDR_SIZE = 56
+FLAGS_OFFSET = 48
+
+COMPACT_POS_LIMIT = 32 << 30
+
+
+def verify(em_dict, num_items, what):
+    if len(em_dict) != num_items:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), num_items, what))
+    for i in util.xrange(num_items):
+        if em_dict['key-%d' % i] != i:
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+    if 'key-%d' % num_items in em_dict:
+        util.msg('FATAL! Found missing element %s' % what)
+
+
+def main(argv):
+
+    util.msg('Populating normal and compact external memory dictionaries')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+    compact_dirname = util.make_temp_name('em_dict_compact')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, compact_index=True)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict['key-%d' % i] = i
+        compact_em_dict['key-%d' % i] = i
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying external memory dictionary contents')
+
+    verify(compact_em_dict, NUM_ITEMS, 'after population')
+
+    em_dict.close()
+    compact_em_dict.close()
+
+    # Entries take 12 bytes instead of 24.
+    size = os.path.getsize(os.path.join(dirname, 'index.bin'))
+    compact_size = os.path.getsize(os.path.join(compact_dirname, 'index.bin'))
+    if (compact_size - HDR_SIZE) * 2 != size - HDR_SIZE:
+        util.msg('FATAL! Compact index of %d bytes, normal index of %d bytes' % (compact_size, size))
+
+    # The format is picked up from "index.bin" when re-opening.
+    compact_em_dict = pyrsistence.EMDict(compact_dirname)
+    verify(compact_em_dict, NUM_ITEMS, 'after re-opening')
+    compact_em_dict.close()
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname, readonly=True)
+    verify(compact_em_dict, NUM_ITEMS, 'after re-opening read-only')
+    compact_em_dict.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    shutil.rmtree(dirname)
+
+    # Deleted slots, whose value position isn't a multiple of the chunk
+    # alignment, survive being stored in compact entries and resizing.
+    util.msg('Deleting from compact external memory dictionary')
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname)
+    for i in util.xrange(NUM_ITEMS // 2, NUM_ITEMS):
+        del compact_em_dict['key-%d' % i]
+    compact_em_dict.close()
+
+    compact_em_dict = pyrsistence.EMDict(compact_dirname)
+    verify(compact_em_dict, NUM_ITEMS // 2, 'after deletion')
+    for i in util.xrange(NUM_ITEMS // 2, NUM_ITEMS * 2):
+        compact_em_dict['key-%d' % i] = i
+    verify(compact_em_dict, NUM_ITEMS * 2, 'after re-insertion')
+    compact_em_dict.close()
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Indices using features unknown to this version are refused.
+    util.msg('Checking unknown index flags')
+
+    filename = os.path.join(compact_dirname, 'index.bin')
+    with open(filename, 'r+b') as fp:
+        fp.seek(FLAGS_OFFSET)
+        flags = struct.unpack('<Q', fp.read(8))[0]
+        fp.seek(FLAGS_OFFSET)
+        fp.write(struct.pack('<Q', flags | 0x100))
+
+    try:
+        pyrsistence.EMDict(compact_dirname)
+        util.msg('FATAL! Unknown index flags accepted')
+    except RuntimeError:
+        pass
+
+    shutil.rmtree(compact_dirname)
+
+    # Positions in "keys.bin" and "values.bin" must stay below 32GB. Sparse
+    # files fill that space.
+    util.msg('Checking limits of compact index')
+
+    em_dict = pyrsistence.EMDict(compact_dirname, compact_index=True)
+    em_dict['key'] = 'value'
+    em_dict.close()
+
+    with open(os.path.join(compact_dirname, 'keys.bin'), 'r+b') as fp:
+        fp.truncate(COMPACT_POS_LIMIT)
+
+    em_dict = pyrsistence.EMDict(compact_dirname)
+    try:
+        em_dict['new-key'] = 'value'
+        util.msg('FATAL! Key stored past 32GB')
+    except OverflowError:
+        pass
+
+    if 'new-key' in em_dict or em_dict['key'] != 'value' or len(em_dict) != 1:
+        util.msg('FATAL! Mismatch after overflow')
+
+    em_dict.close()
+    shutil.rmtree(compact_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,70 @@
+#!/usr/bin/env python
+'''em_dict_compression.py - Integrity benchmark for compressed external memory
+dictionaries.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+def dir_size(dirname):
+    return sum(os.path.getsize(os.path.join(dirname, name)) for name in os.listdir(dirname))
+
+
+def main(argv):
+
+    # Initialize new compressed external memory dictionary.
+    util.msg('Populating normal and compressed external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    # Objects stored before the dictionary is trained are compressed on their
+    # own, the rest are compressed using the shared dictionary.
+    d = {}
+    em_dict = pyrsistence.EMDict(dirname, compression='lz4-dict')
+    for i in util.xrange(0x100000):
+        if i == 0x10000:
+            util.msg('Trained %d byte dictionary' % em_dict.train_dictionary())
+        v = 'value-%d-' % random.randrange(0x100) * random.randrange(0x20)
+        em_dict[i] = v
+        d[i] = v
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Re-open without requesting compression; compressed chunks must still be
+    # readable.
+    em_dict.close()
+    util.msg('Compressed size is %d bytes' % dir_size(dirname))
+    em_dict = pyrsistence.EMDict(dirname)
+
+    util.msg('Verifying compressed external memory dictionary contents')
+
+    for i in util.xrange(0x100000):
+        if em_dict[i] != d[i]:
+            util.msg('FATAL! Mismatch in element %d: Got %r but expected %r' % (i, em_dict[i], d[i]))
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+'''em_dict_durability.py - Benchmark for external memory dictionaries with
+write-ahead logging. Also checks that logged operations are recovered after a
+simulated power loss, where either none of the writes to the memory mapped files
+since the last checkpoint reached the disk, or only some pages of the index
+did.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import glob
+import shutil
+import multiprocessing
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x2000
+
+PAGE_SIZE = 4096
+
+# Memory mapped files of the dictionary; the log and the checkpoint of the index
+# are written with plain file I/O and are synchronized to disk explicitly.
+MAPPED_FILES = ['index.bin', 'keys.bin', 'values.bin*']
+
+
+def expected(i):
+    if i % 3 == 0:
+        return None
+    elif i % 3 == 1:
+        return 'new-value-%d' % i * (i % 7)
+    return 'value-%d' % i
+
+
+def writer(dirname, saved_dirname, durability):
+    em_dict = pyrsistence.EMDict(dirname, durability=durability)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = 'value-%d' % i
+    em_dict.close()
+
+    # Opening a dictionary checkpoints its log; save the memory mapped files as
+    # they are on disk then.
+    em_dict = pyrsistence.EMDict(dirname, durability=durability)
+    os.mkdir(saved_dirname)
+    for pattern in MAPPED_FILES:
+        for filename in glob.glob(os.path.join(dirname, pattern)):
+            shutil.copy(filename, saved_dirname)
+
+    # Overwrite, delete and add items, so that chunks freed since the checkpoint
+    # would be reused.
+    for i in util.xrange(0, NUM_ITEMS, 3):
+        del em_dict[i]
+    for i in util.xrange(1, 2 * NUM_ITEMS, 3):
+        em_dict[i] = 'new-value-%d' % i * (i % 7)
+    em_dict.commit()
+
+    # Die without closing the dictionary.
+    os._exit(0)
+
+
+def simulate_power_loss(dirname, saved_dirname, torn):
+
+    # Tear "index.bin", by rolling every other page back to the checkpoint.
+    if torn:
+        filename = os.path.join(dirname, 'index.bin')
+        with open(os.path.join(saved_dirname, 'index.bin'), 'rb') as fp:
+            saved = fp.read()
+        with open(filename, 'r+b') as fp:
+            for pos in util.xrange(0, len(saved), 2 * PAGE_SIZE):
+                fp.seek(pos)
+                fp.write(saved[pos:pos + PAGE_SIZE])
+        return
+
+    # Roll all memory mapped files back to the checkpoint.
+    for pattern in MAPPED_FILES:
+        for filename in glob.glob(os.path.join(dirname, pattern)):
+            os.unlink(filename)
+    for filename in os.listdir(saved_dirname):
+        shutil.copy(os.path.join(saved_dirname, filename), dirname)
+
+
+def lost_items(dirname):
+    em_dict = pyrsistence.EMDict(dirname)
+    lost = 0
+    for i in util.xrange(2 * NUM_ITEMS):
+        value = expected(i) if i < NUM_ITEMS or i % 3 == 1 else None
+        try:
+            if (em_dict[i] if i in em_dict else None) != value:
+                lost += 1
+        except RuntimeError:
+            lost += 1
+    try:
+        keys = list(em_dict.keys())
+        if len(keys) != len(set(keys)):
+            lost += 1
+    except RuntimeError:
+        lost += 1
+    em_dict.close()
+    return lost
+
+
+def main(argv):
+
+    for durability, torn in [(d, t)
+            for d in ['none', 'async', 'batch', 'op'] for t in [False, True]]:
+
+            util.msg('Populating external memory dictionary (durability="%s")' %
+                durability)
+
+            t1 = time.time()
+
+            dirname = util.make_temp_name('em_dict')
+            saved_dirname = util.make_temp_name('em_dict_saved')
+
+            process = multiprocessing.Process(target=writer,
+                args=(dirname, saved_dirname, durability))
+            process.start()
+            process.join()
+
+            t2 = time.time()
+            util.msg('Done in %d sec.' % (t2 - t1))
+
+            util.msg('Simulating power loss (%s)' % ('torn index' if torn else
+                'all files rolled back'))
+            simulate_power_loss(dirname, saved_dirname, torn)
+
+            util.msg('Verifying external memory dictionary contents')
+
+            lost = lost_items(dirname)
+            if durability == 'none' and lost == 0:
+                util.msg('FATAL! Power loss not simulated')
+            elif durability != 'none' and lost > 0:
+                util.msg('FATAL! %d elements lost' % lost)
+
+            # Once recovered and closed, the dictionary is consistent on its own.
+            if durability != 'none' and lost_items(dirname) > 0:
+                util.msg('FATAL! Elements lost after re-opening')
+
+            t3 = time.time()
+            util.msg('Done in %d sec.' % (t3 - t2))
+
+            # Remove external memory dictionary from disk.
+            shutil.rmtree(dirname)
+            shutil.rmtree(saved_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
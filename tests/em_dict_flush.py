@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+'''em_dict_flush.py - Checks that flushing external memory dictionaries writes
+back every modified part of their files, however much they've grown.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x20000
+
+VALUE_SIZE = 0x200
+
+NUM_MODIFIED = 0x100
+
+# Seconds asynchronous write back takes to complete, at most.
+WRITE_BACK_DELAY = 5
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)).ljust(VALUE_SIZE, 'x')
+
+
+def check_clean(dirname, what):
+    size = util.dirty_size(dirname)
+    if size is not None and size > 0:
+        util.msg('FATAL! %d KB modified not written back %s' % (size, what))
+
+
+def verify(em_dict, num_items, versions, what):
+    if len(em_dict) != num_items:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), num_items, what))
+    for i in util.xrange(num_items):
+        if em_dict[i] != value_of(i, versions.get(i, 0)):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = os.path.abspath(util.make_temp_name('em_dict'))
+
+    # The files, and the bitmaps tracking their modified blocks, grow many
+    # times over while populating.
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i, 0)
+
+    em_dict.flush()
+    check_clean(dirname, 'after growing')
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Only the few blocks modified since are written back.
+    util.msg('Flushing mostly unmodified external memory dictionary')
+
+    versions = {}
+    for n in util.xrange(4):
+        for i in random.sample(range(NUM_ITEMS), NUM_MODIFIED):
+            versions[i] = versions.get(i, 0) + 1
+            em_dict[i] = value_of(i, versions[i])
+
+        if n % 2 == 0:
+            em_dict.flush()
+        else:
+            # Asynchronous write back completes on its own, shortly after.
+            em_dict.flush(async_=True)
+            t = time.time()
+            while util.dirty_size(dirname) and time.time() - t < WRITE_BACK_DELAY:
+                time.sleep(0.1)
+
+        check_clean(dirname, 'after flush %d' % n)
+
+    # Items added at the end grow the files, and the bitmaps, again.
+    for i in util.xrange(NUM_ITEMS, 2 * NUM_ITEMS):
+        em_dict[i] = value_of(i, 0)
+    em_dict.flush()
+    check_clean(dirname, 'after growing again')
+
+    verify(em_dict, 2 * NUM_ITEMS, versions, 'after flushing')
+    em_dict.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    util.msg('Re-opening external memory dictionary')
+
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    verify(em_dict, 2 * NUM_ITEMS, versions, 'after re-opening')
+    em_dict.close()
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory dictionary from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,120 @@
+#!/usr/bin/env python
+'''em_dict_flusher.py - Checks the background thread writing back modifications
+of external memory dictionaries opened with a flush interval.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+VALUE_SIZE = 0x200
+
+FLUSH_INTERVAL = 0.1
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)).ljust(VALUE_SIZE, 'x')
+
+
+def num_threads():
+    '''Return the number of threads of this process, or `None' if unknown.'''
+    if os.path.isdir('/proc/self/task'):
+        return len(os.listdir('/proc/self/task'))
+    return None
+
+
+def verify(em_dict, version, what):
+    if len(em_dict) != NUM_ITEMS:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), NUM_ITEMS, what))
+    for i in util.xrange(NUM_ITEMS):
+        if em_dict[i] != value_of(i, version):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionary with flush interval')
+
+    t1 = time.time()
+
+    dirname = os.path.abspath(util.make_temp_name('em_dict'))
+
+    n = num_threads()
+    em_dict = pyrsistence.EMDict(dirname, flush_interval=FLUSH_INTERVAL)
+    if n is not None and num_threads() != n + 1:
+        util.msg('FATAL! Flusher thread not started')
+
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i, 0)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Modified pages are written back within a few intervals, rather than when
+    # the operating system gets to them, typically 30 seconds later.
+    util.msg('Waiting for modifications to be written back')
+
+    size = util.dirty_size(dirname)
+    if size is not None:
+        for i in util.xrange(20):
+            if util.dirty_size(dirname) <= size // 4:
+                break
+            time.sleep(FLUSH_INTERVAL)
+        else:
+            util.msg('FATAL! %d KB of %d KB modified not written back' % (util.dirty_size(dirname), size))
+
+    # The flusher only takes the lock briefly, so modifications go on.
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i, 1)
+    verify(em_dict, 1, 'while flushing')
+
+    em_dict.close()
+    if n is not None and num_threads() != n:
+        util.msg('FATAL! Flusher thread not stopped')
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    util.msg('Re-opening external memory dictionary')
+
+    em_dict = pyrsistence.EMDict(dirname, flush_interval=FLUSH_INTERVAL)
+    verify(em_dict, 1, 'after re-opening')
+    em_dict.close()
+
+    # There's nothing to write back in read-only dictionaries.
+    em_dict = pyrsistence.EMDict(dirname, readonly=True,
+        flush_interval=FLUSH_INTERVAL)
+    if n is not None and num_threads() != n:
+        util.msg('FATAL! Flusher thread started for read-only dictionary')
+    verify(em_dict, 1, 'after re-opening read-only')
+    em_dict.close()
+
+    try:
+        pyrsistence.EMDict(dirname, flush_interval=-1).close()
+        util.msg('FATAL! Negative flush interval accepted')
+    except ValueError:
+        pass
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory dictionary from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+'''em_dict_gil.py - Make sure other threads keep running while external memory
+dictionaries resize their index and synchronize their files.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import threading
+import time
+
+import util
+import pyrsistence
+
+
+# Calls shorter than this are too short to tell whether the GIL was released.
+MIN_DURATION = 0.05
+
+# Other threads must have run at least this often during long calls.
+MIN_TICK_RATE = 100
+
+
+class Ticker(threading.Thread):
+    '''Records the time, every millisecond, for as long as it can run.'''
+
+    def __init__(self):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.running = True
+        self.ticks = []
+
+    def run(self):
+        while self.running:
+            self.ticks.append(time.time())
+            time.sleep(0.001)
+
+    def ticks_within(self, start, end):
+        return len([t for t in self.ticks if start < t < end])
+
+
+def check_call(ticker, what, start, end):
+    if end - start < MIN_DURATION:
+        util.msg('Longest %s took %.3f sec, too short to check' % (what, end - start))
+    elif ticker.ticks_within(start, end) < (end - start) * MIN_TICK_RATE:
+        util.msg('FATAL! Other threads ran %d times during %.3f sec of %s' % (
+            ticker.ticks_within(start, end), end - start, what))
+    else:
+        util.msg('%d ticks during %.3f sec of %s' % (ticker.ticks_within(start, end),
+            end - start, what))
+
+
+def main(argv):
+
+    ticker = Ticker()
+    ticker.start()
+
+    # Populate dictionary and find the longest insertion, which resized the
+    # index.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+    em_dict = pyrsistence.EMDict(dirname)
+
+    longest = (0, 0)
+    for i in util.xrange(0x200000):
+        start = time.time()
+        em_dict[i] = i
+        end = time.time()
+        if end - start > longest[1] - longest[0]:
+            longest = (start, end)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    check_call(ticker, 'insertion', longest[0], longest[1])
+
+    # Closing synchronizes and truncates all files.
+    util.msg('Closing external memory dictionary')
+
+    start = time.time()
+    em_dict.close()
+    end = time.time()
+
+    check_call(ticker, 'close()', start, end)
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    ticker.running = False
+    ticker.join()
+
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
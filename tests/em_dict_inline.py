@@ -0,0 +1,163 @@
+#!/usr/bin/env python
+'''em_dict_inline.py - Checks external memory dictionaries keeping small values
+in the index, instead of "values.bin".'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+# Values pickling to 3 bytes or less are inlined in compact indices too.
+SMALL_VALUES = [None, True, False, 0, 1, 0xff]
+
+# Values inlined in normal indices only.
+INLINE_VALUES = [-1, 0x100, 0x7fffffff, -0x80000000, '', 'a', 'abc']
+
+STORED_VALUES = [0x80000000, 'abcd', 'value' * 100, (1, 2), [None]]
+
+
+def value_of(i, values):
+    return values[i % len(values)]
+
+
+def values_size(dirname):
+    return sum(os.path.getsize(os.path.join(dirname, filename))
+        for filename in os.listdir(dirname) if filename.startswith('values.bin'))
+
+
+def verify(em_dict, values, what):
+    for i in util.xrange(NUM_ITEMS):
+        v = value_of(i, values)
+        r = em_dict[i]
+        if r != v or type(r) != type(v):
+            util.msg('FATAL! Mismatch in element %d %s: Got %r but expected %r' % (i, what, r, v))
+            break
+
+
+def main(argv):
+
+    for compact_index in [False, True]:
+
+        inline_values = SMALL_VALUES if compact_index else SMALL_VALUES + INLINE_VALUES
+
+        util.msg('Populating external memory dictionary with inline values '
+            '(compact_index=%s)' % compact_index)
+
+        t1 = time.time()
+
+        dirname = util.make_temp_name('em_dict')
+
+        em_dict = pyrsistence.EMDict(dirname, inline_values=True,
+            compact_index=compact_index)
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = value_of(i, inline_values)
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Verifying external memory dictionary contents')
+
+        verify(em_dict, inline_values, 'after population')
+
+        # Nothing but the header of "values.bin" is written.
+        em_dict.close()
+        if values_size(dirname) > 0x10:
+            util.msg('FATAL! Inline values stored in "values.bin"')
+
+        # Overwrite inline values with stored ones and back. The format is
+        # picked up from "index.bin" when re-opening.
+        em_dict = pyrsistence.EMDict(dirname)
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = value_of(i, STORED_VALUES)
+        verify(em_dict, STORED_VALUES, 'after storing')
+
+        size = values_size(dirname)
+
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = value_of(i, inline_values)
+        verify(em_dict, inline_values, 'after inlining again')
+
+        # Deleted entries, which have no key, aren't taken for inline values,
+        # and batched lookups read inline values from the index.
+        for i in util.xrange(0, NUM_ITEMS, 4):
+            del em_dict[i]
+        if len(em_dict) != NUM_ITEMS - NUM_ITEMS // 4 or 0 in em_dict:
+            util.msg('FATAL! Deleted inline values still present')
+
+        keys = [i for i in util.xrange(NUM_ITEMS) if i % 4]
+        if em_dict.get_many(keys) != [value_of(i, inline_values) for i in keys]:
+            util.msg('FATAL! Batched lookup of inline values failed')
+
+        for i in util.xrange(0, NUM_ITEMS, 4):
+            em_dict[i] = value_of(i, inline_values)
+        verify(em_dict, inline_values, 'after deleting and re-adding')
+
+        # Chunks given back by inlining are reused.
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = value_of(i, STORED_VALUES)
+        verify(em_dict, STORED_VALUES, 'after storing again')
+
+        if values_size(dirname) != size:
+            util.msg('FATAL! Chunks freed by inline values not reused')
+
+        em_dict.close()
+
+        em_dict = pyrsistence.EMDict(dirname, readonly=True)
+        verify(em_dict, STORED_VALUES, 'after re-opening')
+        em_dict.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory dictionary from disk.
+        shutil.rmtree(dirname)
+
+    # Compact indices with inline values keep positions in "values.bin" in
+    # units of 4 bytes, which covers 16GB. Sparse segments fill that space.
+    util.msg('Checking limit of "values.bin" with compact index and inline values')
+
+    dirname = util.make_temp_name('em_dict')
+
+    em_dict = pyrsistence.EMDict(dirname, inline_values=True, compact_index=True)
+    em_dict['key'] = 'value' * 100
+    em_dict.close()
+
+    with open(os.path.join(dirname, 'values.bin'), 'rb') as fp:
+        magic = fp.read(8)
+
+    for i in util.xrange(1, 16):
+        with open(os.path.join(dirname, 'values.bin.%d' % i), 'wb') as fp:
+            fp.write(magic)
+            fp.truncate(util.SEGMENT_SIZE)
+
+    em_dict = pyrsistence.EMDict(dirname)
+    try:
+        em_dict['new-key'] = 'value' * 100
+        util.msg('FATAL! Value stored past 16GB')
+    except OverflowError:
+        pass
+
+    # Inline values need no space in "values.bin".
+    em_dict['new-key'] = 1
+    if em_dict['new-key'] != 1 or em_dict['key'] != 'value' * 100 or len(em_dict) != 2:
+        util.msg('FATAL! Mismatch after overflow')
+
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+'''em_dict_lock_index.py - Checks external memory dictionaries and lists with
+their indices locked in memory.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+# Enough to resize the index, which starts with 65536 entries, twice.
+NUM_ITEMS = 0x30000
+
+
+def mapping_sizes(dirname, filename):
+    '''Return the number of KB of mappings of "filename" in "dirname" that are
+    in memory, and of those locked in memory, or `None' if unknown.'''
+    resident = util.mapping_sizes(dirname, ['Rss'])
+    locked = util.mapping_sizes(dirname, ['Locked'])
+    if resident is None or locked is None:
+        return None
+    return [resident.get(filename, 0), locked.get(filename, 0)]
+
+
+def check_locked(dirname, prefaulted, what):
+    sizes = mapping_sizes(dirname, 'index.bin')
+    if sizes is None:
+        return
+
+    # Pages of the index are locked as they're accessed, or all at once when
+    # prefaulted. Pages of the other files never are.
+    resident, locked = sizes
+    index_size = os.path.getsize(os.path.join(dirname, 'index.bin')) // 1024
+    if locked == 0 or locked < resident or (prefaulted and locked < index_size * 3 // 4):
+        util.msg('FATAL! %d KB of %d KB of index locked %s' % (locked, index_size, what))
+
+    if mapping_sizes(dirname, 'values.bin')[1] > 0:
+        util.msg('FATAL! Values locked %s' % what)
+
+
+def populate(em, start, end, append):
+    for i in util.xrange(start, end):
+        if append:
+            em.append('value-%d' % i)
+        else:
+            em[i] = 'value-%d' % i
+
+
+def verify(em, num_items, what):
+    if len(em) != num_items:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em), num_items, what))
+    for i in util.xrange(num_items):
+        if em[i] != 'value-%d' % i:
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    for name, cls in [('dictionary', pyrsistence.EMDict), ('list', pyrsistence.EMList)]:
+
+        util.msg('Populating external memory %s with locked index' % name)
+
+        t1 = time.time()
+
+        dirname = os.path.abspath(util.make_temp_name('em_%s' % name))
+        append = cls is pyrsistence.EMList
+
+        # Locking fails if the index exceeds `RLIMIT_MEMLOCK', unless running
+        # privileged.
+        try:
+            em = cls(dirname, lock_index=True, prefault='index')
+        except RuntimeError:
+            util.msg('Cannot lock index in memory, skipping')
+            shutil.rmtree(dirname)
+            continue
+
+        check_locked(dirname, True, 'after creating')
+
+        # The index stays locked when replaced by a larger one.
+        try:
+            populate(em, 0, NUM_ITEMS, append)
+        except RuntimeError:
+            util.msg('Cannot lock resized index in memory, skipping')
+            em.close()
+            shutil.rmtree(dirname)
+            continue
+
+        verify(em, NUM_ITEMS, 'after population')
+        check_locked(dirname, False, 'after resizing')
+        em.close()
+
+        if mapping_sizes(dirname, 'index.bin') not in [None, [0, 0]]:
+            util.msg('FATAL! Index still locked after closing')
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Re-opening external memory %s with locked index' % name)
+
+        # Without prefaulting, pages are locked as they're first accessed.
+        em = cls(dirname, lock_index=True)
+        verify(em, NUM_ITEMS, 'after re-opening')
+        check_locked(dirname, False, 'after re-opening')
+        populate(em, NUM_ITEMS, 2 * NUM_ITEMS, append)
+        verify(em, 2 * NUM_ITEMS, 'after growing')
+        em.close()
+
+        em = cls(dirname, readonly=True, lock_index=True, prefault='all')
+        check_locked(dirname, True, 'after re-opening read-only')
+        verify(em, 2 * NUM_ITEMS, 'after re-opening read-only')
+        em.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory data structure from disk.
+        shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
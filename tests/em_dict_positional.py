@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+'''em_dict_positional.py - Integrity benchmark for external memory dictionaries
+whose lookups, updates and iterators are interleaved, and whose data files are
+cut short.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+def make_value(i):
+    return 'value-%d-' % i * random.randrange(1, 0x40)
+
+
+def main(argv):
+
+    # Initialize new external memory dictionary.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    d = {}
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(0x10000):
+        d[i] = make_value(i)
+        em_dict[i] = d[i]
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Two iterators advance in turns, while values are looked up and replaced
+    # by values of other sizes. None of these may disturb the others.
+    util.msg('Interleaving iterators, lookups and updates')
+
+    items = em_dict.items()
+    keys = em_dict.keys()
+    seen = 0
+
+    for i in util.xrange(0x10000):
+        k, v = next(items)
+        if v != d[k]:
+            util.msg('FATAL! Iterator returned %r for key %r but expected %r' % (v, k, d[k]))
+
+        k = next(keys)
+        if k not in d:
+            util.msg('FATAL! Iterator returned unknown key %r' % (k, ))
+
+        k = random.randrange(0x10000)
+        if em_dict[k] != d[k]:
+            util.msg('FATAL! Mismatch in element %d: Got %r but expected %r' % (k, em_dict[k], d[k]))
+
+        k = random.randrange(0x10000)
+        d[k] = make_value(k)
+        em_dict[k] = d[k]
+        seen += 1
+
+    if seen != len(em_dict):
+        util.msg('FATAL! Iterated over %d keys but expected %d' % (seen, len(em_dict)))
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Cut "values.bin" in half. Values past its end must raise exceptions,
+    # rather than be read from beyond the mapping.
+    util.msg('Reading values of truncated external memory dictionary')
+
+    em_dict.close()
+
+    filename = os.path.join(dirname, 'values.bin')
+    with open(filename, 'r+b') as fp:
+        fp.truncate(os.path.getsize(filename) // 2)
+
+    em_dict = pyrsistence.EMDict(dirname)
+
+    good = bad = 0
+    for i in util.xrange(0x10000):
+        try:
+            v = em_dict[i]
+        except Exception:
+            bad += 1
+        else:
+            if v != d[i]:
+                util.msg('FATAL! Mismatch in element %d: Got %r but expected %r' % (i, v, d[i]))
+            good += 1
+
+    if good == 0 or bad == 0:
+        util.msg('FATAL! Read %d values and failed %d, expected some of each' % (good, bad))
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+'''em_dict_prefault.py - Checks external memory dictionaries and lists opened
+with huge pages and prefaulting of their files.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+# Enough to resize the index, which starts with 65536 entries, twice.
+NUM_ITEMS = 0x30000
+
+PREFAULTS = ['none', 'index', 'all']
+
+
+def check_prefaulted(dirname, prefault, what):
+    sizes = util.mapping_sizes(dirname, ['Rss'])
+    if sizes is None:
+        return
+
+    for filename in ['index.bin', 'values.bin']:
+        size = os.path.getsize(os.path.join(dirname, filename)) // 1024
+        prefaulted = prefault == 'all' or (prefault == 'index' and filename == 'index.bin')
+        if prefaulted and sizes.get(filename, 0) < size * 3 // 4:
+            util.msg('FATAL! %d KB of %d KB of "%s" in memory %s' % (sizes.get(filename, 0), size, filename, what))
+
+
+def main(argv):
+
+    for prefault in PREFAULTS:
+
+        util.msg('Populating external memory dictionary and list with '
+            'hugepages=True, prefault="%s"' % prefault)
+
+        t1 = time.time()
+
+        dict_dirname = os.path.abspath(util.make_temp_name('em_dict'))
+        list_dirname = os.path.abspath(util.make_temp_name('em_list'))
+
+        # The options apply to indices replaced when resizing too.
+        em_dict = pyrsistence.EMDict(dict_dirname, hugepages=True,
+            prefault=prefault)
+        em_list = pyrsistence.EMList(list_dirname, hugepages=True,
+            prefault=prefault)
+        for i in util.xrange(NUM_ITEMS):
+            em_dict[i] = 'value-%d' % i
+            em_list.append('value-%d' % i)
+        em_dict.close()
+        em_list.close()
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Re-opening external memory dictionary and list')
+
+        # Prefaulted files are in memory right after opening.
+        em_dict = pyrsistence.EMDict(dict_dirname, hugepages=True,
+            prefault=prefault)
+        check_prefaulted(dict_dirname, prefault, 'after opening dictionary')
+
+        em_list = pyrsistence.EMList(list_dirname, hugepages=True,
+            prefault=prefault)
+        check_prefaulted(list_dirname, prefault, 'after opening list')
+
+        for i in util.xrange(NUM_ITEMS, 2 * NUM_ITEMS):
+            em_dict[i] = 'value-%d' % i
+            em_list.append('value-%d' % i)
+
+        for i in util.xrange(2 * NUM_ITEMS):
+            if em_dict[i] != 'value-%d' % i or em_list[i] != 'value-%d' % i:
+                util.msg('FATAL! Mismatch in element %d' % i)
+                break
+
+        em_dict.close()
+        em_list.close()
+
+        em_dict = pyrsistence.EMDict(dict_dirname, readonly=True,
+            prefault=prefault)
+        if len(em_dict) != 2 * NUM_ITEMS or em_dict[0] != 'value-0':
+            util.msg('FATAL! Mismatch after re-opening read-only')
+        em_dict.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory dictionary and list from disk.
+        shutil.rmtree(dict_dirname)
+        shutil.rmtree(list_dirname)
+
+    dirname = util.make_temp_name('em_dict')
+    try:
+        pyrsistence.EMDict(dirname, prefault='some').close()
+        util.msg('FATAL! Invalid prefault mode accepted')
+    except ValueError:
+        pass
+
+    if os.path.exists(dirname):
+        shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
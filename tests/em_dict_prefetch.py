@@ -0,0 +1,197 @@
+#!/usr/bin/env python
+'''em_dict_prefetch.py - Checks that prefetching and reordering iterators of
+external memory dictionaries return the same items as plain ones, while items
+are overwritten and deleted.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x8000
+
+PREFETCH_WINDOWS = [1, 7, 0x40, 0x10000]
+
+# Items modified after every that many items returned.
+MODIFY_INTERVAL = 0x30
+
+# Keys are multiples of this, so that many of them collide in the index and
+# deleted items sit in the probe chains of the remaining ones.
+KEY_STRIDE = 0x10
+
+
+def value_of(k, version):
+    if version == 0:
+        return [k, 'value-%d-' % k * (k % 0x10), None][k % 3]
+    return 'value-%d-%d' % (k, version)
+
+
+def iterate(em_dict, kind, **kwargs):
+    return {'items': em_dict.items, 'keys': em_dict.keys,
+        'values': em_dict.values}[kind](**kwargs)
+
+
+def verify(em_dict, keys, what):
+    if len(em_dict) != len(keys):
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), len(keys), what))
+    for k in keys:
+        if em_dict[k] != value_of(k, 0):
+            util.msg('FATAL! Mismatch in element %d %s' % (k, what))
+            break
+
+
+def check_modified(em_dict, keys, prefetch, reorder):
+    '''Iterate the items of `em_dict' while overwriting and deleting random
+    items, returned or not yet. Each item must be returned once, with the value
+    it had when it was returned, unless it was deleted before.'''
+
+    versions = dict((k, 0) for k in keys)
+    seen = set()
+
+    for n, (k, v) in enumerate(em_dict.items(prefetch=prefetch, reorder=reorder)):
+        if k in seen or versions[k] is None or v != value_of(k, versions[k]):
+            util.msg('FATAL! Mismatch in element %d with prefetch=%d, reorder=%s' % (k, prefetch, reorder))
+            break
+        seen.add(k)
+
+        if n % MODIFY_INTERVAL == 0:
+            for i, k in enumerate(random.sample(keys, 0x10)):
+                if versions[k] is None:
+                    continue
+                if i % 4 == 0:
+                    versions[k] = None
+                    del em_dict[k]
+                else:
+                    versions[k] += 1
+                    em_dict[k] = value_of(k, versions[k])
+
+    remaining = set(k for k in keys if versions[k] is not None)
+    if not remaining <= seen:
+        util.msg('FATAL! Missed %d elements with prefetch=%d, reorder=%s' % (len(remaining - seen), prefetch, reorder))
+
+    if len(em_dict) != len(remaining):
+        util.msg('FATAL! Got %d elements but expected %d with prefetch=%d, reorder=%s' % (len(em_dict), len(remaining), prefetch, reorder))
+
+    # Deleted items aren't found any more, but the remaining ones are.
+    for k in keys:
+        if (k in em_dict) != (versions[k] is not None):
+            util.msg('FATAL! Wrong membership of element %d with prefetch=%d, reorder=%s' % (k, prefetch, reorder))
+            break
+
+    # Restore the original items for the next run, in the deleted slots.
+    for k in keys:
+        if versions[k] != 0:
+            em_dict[k] = value_of(k, 0)
+
+
+def main(argv):
+
+    for records in [False, True]:
+
+        util.msg('Populating external memory dictionary (records=%s)' % records)
+
+        t1 = time.time()
+
+        dirname = util.make_temp_name('em_dict')
+
+        # Items are added in random order, so that values aren't laid out in
+        # "values.bin" in index order.
+        keys = [i * KEY_STRIDE for i in util.xrange(NUM_ITEMS)]
+        random.shuffle(keys)
+
+        em_dict = pyrsistence.EMDict(dirname, records=records)
+        for k in keys:
+            em_dict[k] = value_of(k, 0)
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Verifying prefetching iterators')
+
+        for kind in ['items', 'keys', 'values']:
+            expected = sorted(iterate(em_dict, kind), key=repr)
+            if len(expected) != NUM_ITEMS:
+                util.msg('FATAL! Got %d %s but expected %d' % (len(expected), kind, NUM_ITEMS))
+
+            for prefetch in PREFETCH_WINDOWS:
+                for reorder in [False, True]:
+                    r = sorted(iterate(em_dict, kind, prefetch=prefetch,
+                        reorder=reorder), key=repr)
+                    if r != expected:
+                        util.msg('FATAL! Mismatch in %s with prefetch=%d, reorder=%s' % (kind, prefetch, reorder))
+
+        # Overwritten items are returned with their new values, whether they
+        # were prefetched already or not. Deleted items leave the probe chains
+        # of the remaining ones intact.
+        for prefetch in PREFETCH_WINDOWS[1:3]:
+            for reorder in [False, True]:
+                check_modified(em_dict, keys, prefetch, reorder)
+                verify(em_dict, keys, 'after restoring deleted items')
+
+        try:
+            del em_dict[-1]
+            util.msg('FATAL! Deleted missing element')
+        except KeyError:
+            pass
+
+        for kwargs in [{'prefetch': -1}, {'reorder': True}]:
+            try:
+                em_dict.items(**kwargs)
+                util.msg('FATAL! Accepted %r' % kwargs)
+            except ValueError:
+                pass
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Deleted slots count towards resizing the index, so that lookups
+        # always end at a free slot. They're dropped when it's rehashed, which
+        # keeps its size if they made up most of the load.
+        util.msg('Replacing all items of external memory dictionary')
+
+        size = os.path.getsize(os.path.join(dirname, 'index.bin'))
+
+        new_keys = keys
+        for n in util.xrange(1, 4):
+            for k in new_keys:
+                del em_dict[k]
+            if len(em_dict) != 0:
+                util.msg('FATAL! Got %d elements but expected none' % len(em_dict))
+
+            new_keys = [k + n for k in keys[:NUM_ITEMS // 2]]
+            for k in new_keys:
+                em_dict[k] = value_of(k, 0)
+
+        em_dict.close()
+
+        if os.path.getsize(os.path.join(dirname, 'index.bin')) != size:
+            util.msg('FATAL! Index grew from %d to %d bytes' % (size,
+                os.path.getsize(os.path.join(dirname, 'index.bin'))))
+
+        em_dict = pyrsistence.EMDict(dirname)
+        verify(em_dict, new_keys, 'after re-opening')
+        if sorted(em_dict.keys()) != sorted(new_keys):
+            util.msg('FATAL! Mismatch in keys after re-opening')
+
+        t4 = time.time()
+        util.msg('Done in %d sec.' % (t4 - t3))
+
+        # Close and remove external memory dictionary from disk.
+        em_dict.close()
+        shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
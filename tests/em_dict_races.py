@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+'''em_dict_races.py - Multi-process benchmark for external memory dictionary.
+Several processes open the dictionary in reader mode and look up keys, while
+the writer process keeps replacing their values with values of other sizes,
+whose chunks are freed and reused under the readers' feet.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import shutil
+import random
+import multiprocessing
+import time
+
+import util
+import pyrsistence
+
+
+NUM_READERS = 4
+NUM_KEYS = 0x1000
+
+
+def make_value(k, n):
+    return ('%d:%d,' % (k, n)) * (n % 16 + 1)
+
+
+def check_value(k, v):
+    try:
+        n = int(v.split(',', 1)[0].split(':')[1])
+        return v == make_value(k, n)
+    except Exception:
+        return False
+
+
+def reader(dirname, done, errors):
+    em_dict = pyrsistence.EMDict(dirname, reader=True)
+
+    lookups = 0
+    while not done.is_set():
+        k = random.randrange(NUM_KEYS)
+        try:
+            v = em_dict[k]
+        except Exception as e:
+            errors.put('Lookup of %d raised %r' % (k, e))
+        else:
+            if not check_value(k, v):
+                errors.put('Got %r for element %d' % (v, k))
+        lookups += 1
+
+    em_dict.close()
+    errors.put(lookups)
+
+
+def main(argv):
+
+    # Initialize new external memory dictionary.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for k in util.xrange(NUM_KEYS):
+        em_dict[k] = make_value(k, 0)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Replace values while readers look them up.
+    util.msg('Running %d reader processes and 1 writer process' % NUM_READERS)
+
+    done = multiprocessing.Event()
+    errors = multiprocessing.Queue()
+    processes = [multiprocessing.Process(target=reader,
+        args=(dirname, done, errors)) for n in util.xrange(NUM_READERS)]
+
+    for process in processes:
+        process.start()
+
+    for n in util.xrange(1, 0x40):
+        for k in util.xrange(NUM_KEYS):
+            em_dict[k] = make_value(k, n)
+
+    done.set()
+
+    lookups = finished = 0
+    while finished < NUM_READERS:
+        r = errors.get()
+        if isinstance(r, int):
+            lookups += r
+            finished += 1
+        else:
+            util.msg('FATAL! %s' % r)
+
+    for process in processes:
+        process.join()
+
+    util.msg('Readers made %d lookups' % lookups)
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+'''em_dict_readers.py - Multi-process benchmark for external memory dictionary.
+Several processes open the dictionary in reader mode and look up keys, while
+the writer process keeps inserting new ones.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import shutil
+import multiprocessing
+import time
+
+import util
+import pyrsistence
+
+
+NUM_READERS = 4
+
+
+def reader(dirname, n, errors):
+    em_dict = pyrsistence.EMDict(dirname, reader=True)
+
+    # Wait for the writer to catch up with us, if needed.
+    for i in util.xrange(n, 0x200000, NUM_READERS):
+        while len(em_dict) <= i:
+            time.sleep(0.01)
+        if em_dict[i] != i:
+            errors.put(i)
+
+    em_dict.close()
+    errors.put(None)
+
+
+def main(argv):
+
+    # Initialize new external memory dictionary.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(0x100000):
+        em_dict[i] = i
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # A second writer must not be allowed in.
+    try:
+        pyrsistence.EMDict(dirname)
+        util.msg('FATAL! Second writer allowed')
+    except RuntimeError:
+        pass
+
+    # Look up keys from several reader processes, while the dictionary keeps
+    # growing (and being resized) in this one.
+    util.msg('Running %d reader processes and 1 writer process' % NUM_READERS)
+
+    errors = multiprocessing.Queue()
+    processes = [multiprocessing.Process(target=reader,
+        args=(dirname, n, errors)) for n in util.xrange(NUM_READERS)]
+
+    for process in processes:
+        process.start()
+
+    for i in util.xrange(0x100000, 0x200000):
+        em_dict[i] = i
+
+    done = 0
+    while done < NUM_READERS:
+        i = errors.get()
+        if i is None:
+            done += 1
+        else:
+            util.msg('FATAL! Mismatch in element %d' % i)
+
+    for process in processes:
+        process.join()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
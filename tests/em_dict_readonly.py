@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+'''em_dict_readonly.py - Integrity benchmark for external memory dictionaries
+opened read-only, from a directory that can't be written to.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import stat
+import time
+
+import util
+import pyrsistence
+
+
+class Item(object):
+    def __init__(self, i):
+        self.i = i
+
+    def __eq__(self, other):
+        return isinstance(other, Item) and self.i == other.i
+
+
+def set_mode(dirname, mode):
+    for filename in os.listdir(dirname):
+        os.chmod(os.path.join(dirname, filename), mode & ~0o111)
+    os.chmod(dirname, mode)
+
+
+def get_stats(dirname):
+    stats = {}
+    for filename in os.listdir(dirname):
+        st = os.stat(os.path.join(dirname, filename))
+        stats[filename] = (st.st_size, st.st_mtime)
+    return stats
+
+
+def main(argv):
+
+    # Initialize new external memory dictionary.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    d = {}
+    em_dict = pyrsistence.EMDict(dirname, class_table=True)
+    for i in util.xrange(0x10000):
+        d[i] = Item(i)
+        em_dict[i] = d[i]
+    em_dict.close()
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Writers are excluded while the dictionary is open read-only.
+    util.msg('Opening external memory dictionary read-only')
+
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+
+    try:
+        pyrsistence.EMDict(dirname)
+    except RuntimeError:
+        pass
+    else:
+        util.msg('FATAL! Writer allowed alongside read-only open')
+
+    em_dict.close()
+
+    # Take write permissions away and push modification times back, so that
+    # any truncation or synchronization on close shows.
+    for filename in os.listdir(dirname):
+        os.utime(os.path.join(dirname, filename), (1000000, 1000000))
+
+    stats = get_stats(dirname)
+    set_mode(dirname, stat.S_IRUSR | stat.S_IXUSR)
+
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    other_em_dict = pyrsistence.EMDict(dirname, readonly=True)
+
+    if len(em_dict) != len(d):
+        util.msg('FATAL! Dictionary has %d items but expected %d' % (len(em_dict), len(d)))
+
+    for i in util.xrange(0x10000):
+        if em_dict[i] != d[i] or other_em_dict[i] != d[i]:
+            util.msg('FATAL! Mismatch in element %d' % i)
+
+    for k, v in em_dict.items():
+        if v != d[k]:
+            util.msg('FATAL! Iterator returned wrong value for key %d' % k)
+
+    try:
+        em_dict[0] = 0
+    except RuntimeError:
+        pass
+    else:
+        util.msg('FATAL! Read-only dictionary was modified')
+
+    em_dict.close()
+    other_em_dict.close()
+
+    if get_stats(dirname) != stats:
+        util.msg('FATAL! Files were modified by read-only open')
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Remove external memory dictionary from disk.
+    set_mode(dirname, stat.S_IRWXU)
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,129 @@
+#!/usr/bin/env python
+'''em_dict_records.py - Checks external memory dictionaries keeping keys along
+with their values in records, combined with the other storage formats.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_OPS = 0x10000
+
+NUM_KEYS = 0x1000
+
+# One in this many operations deletes a key instead.
+DELETE_RATE = 8
+
+OPTIONS = [
+    {},
+    {'inline_values': True},
+    {'inline_values': True, 'compact_index': True},
+    {'compact_chunks': True},
+    {'compression': 'lz4', 'compact_chunks': True, 'inline_values': True},
+    {'durability': 'op'}
+]
+
+
+def random_key(rand):
+    return rand.choice([rand.randrange(NUM_KEYS), 'key-%d' % rand.randrange(NUM_KEYS),
+        (rand.randrange(NUM_KEYS), 'key')])
+
+
+def random_value(rand):
+    return rand.choice([None, True, rand.randrange(0x100), 'v' * rand.randrange(0x100),
+        list(range(rand.randrange(0x40)))])
+
+
+def verify(em_dict, d, what):
+    for k, v in d.items():
+        if k not in em_dict or em_dict[k] != v:
+            util.msg('FATAL! Mismatch in element %r %s' % (k, what))
+            break
+    if em_dict.get_many(list(d.keys())) != list(d.values()):
+        util.msg('FATAL! Mismatch in batched lookups %s' % what)
+    if dict(em_dict.items()) != d:
+        util.msg('FATAL! Mismatch in items %s' % what)
+    if len(em_dict) != len(d):
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_dict), len(d), what))
+
+
+def main(argv):
+
+    for options in OPTIONS:
+
+        util.msg('Populating external memory dictionary with records (%r)' % options)
+
+        t1 = time.time()
+
+        dirname = util.make_temp_name('em_dict')
+
+        rand = random.Random(repr(options))
+
+        # Keys are overwritten many times, so that records are rewritten along
+        # with each new value, inline or not. Deleted keys free their records
+        # and are added back later.
+        d = {}
+        em_dict = pyrsistence.EMDict(dirname, records=True, **options)
+        for i in util.xrange(NUM_OPS):
+            k = random_key(rand)
+            if i % DELETE_RATE == 0:
+                if (k in em_dict) != (k in d):
+                    util.msg('FATAL! Wrong membership of element %r' % (k, ))
+                    break
+                if k in d:
+                    del em_dict[k]
+                    del d[k]
+                continue
+            v = random_value(rand)
+            em_dict[k] = v
+            d[k] = v
+
+        t2 = time.time()
+        util.msg('Done in %d sec.' % (t2 - t1))
+
+        util.msg('Verifying external memory dictionary contents')
+
+        verify(em_dict, d, 'after population')
+
+        # Records keep keys in "values.bin"; "keys.bin" holds its header only.
+        em_dict.close()
+        if os.path.getsize(os.path.join(dirname, 'keys.bin')) > 0x1000:
+            util.msg('FATAL! Keys stored in "keys.bin"')
+
+        # The format is picked up from "index.bin" when re-opening.
+        options = dict((k, v) for k, v in options.items() if k == 'compression')
+        em_dict = pyrsistence.EMDict(dirname, **options)
+        verify(em_dict, d, 'after re-opening')
+
+        em_dict['new-key'] = 'new-value'
+        d['new-key'] = 'new-value'
+        k = next(iter(d))
+        del em_dict[k]
+        del d[k]
+        em_dict.close()
+
+        em_dict = pyrsistence.EMDict(dirname, readonly=True)
+        verify(em_dict, d, 'after re-opening read-only')
+        em_dict.close()
+
+        t3 = time.time()
+        util.msg('Done in %d sec.' % (t3 - t2))
+
+        # Remove external memory dictionary from disk.
+        shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,152 @@
+#!/usr/bin/env python
+'''em_dict_snapshot.py - Checks snapshots of external memory dictionaries,
+taken while another thread keeps modifying them.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import threading
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x40000
+
+VALUE_SIZE = 0x400
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)).ljust(VALUE_SIZE, 'x')
+
+
+def values_size(dirname):
+    return sum(os.path.getsize(os.path.join(dirname, filename))
+        for filename in os.listdir(dirname) if filename.startswith('values.bin'))
+
+
+class Writer(threading.Thread):
+    '''Overwrites and adds items until stopped.'''
+
+    def __init__(self, em_dict):
+        super(Writer, self).__init__()
+        self.em_dict = em_dict
+        self.stopped = False
+        self.max_latency = 0
+
+    def run(self):
+        i = 0
+        while not self.stopped:
+            t = time.time()
+            self.em_dict[i % (2 * NUM_ITEMS)] = value_of(i % (2 * NUM_ITEMS), 1)
+            self.max_latency = max(self.max_latency, time.time() - t)
+            i += 7
+
+
+def main(argv):
+
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+    snapshot_dirname = util.make_temp_name('em_dict_snapshot')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i, 0)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Writers only wait for "index.bin" to be copied, not "values.bin", which
+    # is much larger.
+    util.msg('Taking snapshot while modifying external memory dictionary')
+
+    writer = Writer(em_dict)
+    writer.start()
+    time.sleep(0.1)
+
+    t = time.time()
+    snapshot = em_dict.snapshot(snapshot_dirname)
+    t = time.time() - t
+
+    writer.stopped = True
+    writer.join()
+
+    if writer.max_latency > 0.1 and writer.max_latency > t / 2:
+        util.msg('FATAL! Writer blocked for %.2f sec. while taking snapshot' % writer.max_latency)
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    util.msg('Verifying snapshot contents')
+
+    # Each item holds either version, but never a torn or missing value.
+    num_items = len(snapshot)
+    if num_items < NUM_ITEMS:
+        util.msg('FATAL! Got %d elements but expected %d at least' % (num_items, NUM_ITEMS))
+
+    for k, v in snapshot.items():
+        if v != value_of(k, 0) and v != value_of(k, 1):
+            util.msg('FATAL! Mismatch in element %d' % k)
+            break
+
+    if len(list(snapshot.keys())) != num_items:
+        util.msg('FATAL! Snapshot iteration inconsistent')
+
+    # Snapshots are frozen and read-only.
+    em_dict[2 * NUM_ITEMS] = value_of(2 * NUM_ITEMS, 0)
+    if 2 * NUM_ITEMS in snapshot or len(snapshot) != num_items:
+        util.msg('FATAL! Snapshot modified')
+
+    try:
+        snapshot[0] = None
+        util.msg('FATAL! Snapshot writable')
+    except RuntimeError:
+        pass
+
+    snapshot.close()
+    shutil.rmtree(snapshot_dirname)
+
+    # Once the snapshot is copied, freed chunks are reused again.
+    em_dict.close()
+    size = values_size(dirname)
+
+    em_dict = pyrsistence.EMDict(dirname)
+    em_dict.snapshot(snapshot_dirname).close()
+    for i in util.xrange(NUM_ITEMS):
+        em_dict[i] = value_of(i, 2)
+    em_dict.close()
+
+    if values_size(dirname) - size > size // 0x10:
+        util.msg('FATAL! Chunks freed after snapshot not reused')
+
+    shutil.rmtree(snapshot_dirname)
+
+    # Read-only dictionaries can be copied too.
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    snapshot = em_dict.snapshot(snapshot_dirname)
+    if len(snapshot) != len(em_dict) or snapshot[0] != value_of(0, 2):
+        util.msg('FATAL! Mismatch in snapshot of read-only dictionary')
+    snapshot.close()
+    em_dict.close()
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory dictionary and its snapshot from disk.
+    shutil.rmtree(dirname)
+    shutil.rmtree(snapshot_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
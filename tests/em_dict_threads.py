@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+'''em_dict_threads.py - Concurrency benchmark for external memory dictionary.
+Several threads look up keys while another one keeps inserting new ones.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import shutil
+import threading
+import time
+
+import util
+import pyrsistence
+
+
+NUM_READERS = 4
+
+
+def reader(em_dict, n, errors):
+    for i in util.xrange(n, 0x100000, NUM_READERS):
+        if em_dict[i] != i:
+            errors.append(i)
+
+
+def writer(em_dict):
+    for i in util.xrange(0x100000, 0x200000):
+        em_dict[i] = i
+
+
+def main(argv):
+
+    # Initialize new external memory dictionary.
+    util.msg('Populating external memory dictionary')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    for i in util.xrange(0x100000):
+        em_dict[i] = i
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Look up existing keys from several threads, while the dictionary keeps
+    # growing (and being resized) in another one.
+    util.msg('Running %d reader threads and 1 writer thread' % NUM_READERS)
+
+    errors = []
+    threads = [threading.Thread(target=reader, args=(em_dict, n, errors))
+        for n in util.xrange(NUM_READERS)]
+    threads.append(threading.Thread(target=writer, args=(em_dict, )))
+
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    for i in errors:
+        util.msg('FATAL! Mismatch in element %d' % i)
+
+    if len(em_dict) != 0x200000:
+        util.msg('FATAL! Expected %d elements but got %d' % (0x200000, len(em_dict)))
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+'''em_dict_upgrade.py - Integrity benchmark for external memory dictionaries
+created by earlier versions.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import time
+
+import util
+import pyrsistence
+
+
+def verify(em_dict, d):
+    if len(em_dict) != len(d):
+        util.msg('FATAL! Dictionary has %d items but expected %d' % (len(em_dict), len(d)))
+
+    for k in d:
+        if em_dict[k] != d[k]:
+            util.msg('FATAL! Mismatch in element %d: Got %r but expected %r' % (k, em_dict[k], d[k]))
+
+
+def upgrade(version, start=0):
+
+    # Lay out the files of a dictionary the way earlier versions did. If `start' is
+    # past `util.SEGMENT_SIZE', "values.bin" has grown past a segment.
+    util.msg('Creating external memory dictionary in format version %d' % version)
+    if start > 0:
+        util.msg('Values begin at offset %#x of "values.bin"' % start)
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_dict')
+
+    d = dict((i, ('value', i, 'x' * (i % 50))) for i in util.xrange(0, 0x10000, 3))
+    util.make_legacy_em_dict(dirname, d, version, start)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Readers can't upgrade the index.
+    util.msg('Opening external memory dictionary')
+
+    try:
+        pyrsistence.EMDict(dirname, reader=True)
+    except RuntimeError:
+        pass
+    else:
+        util.msg('FATAL! Reader opened dictionary in format version %d' % version)
+
+    # Read-only opens read it as it is.
+    em_dict = pyrsistence.EMDict(dirname, readonly=True)
+    verify(em_dict, d)
+    em_dict.close()
+
+    with open(os.path.join(dirname, 'index.bin'), 'rb') as fp:
+        magic, = struct.unpack('Q', fp.read(8))
+    if magic >> 56 != version:
+        util.msg('FATAL! Index was modified by read-only open')
+
+    # Writers upgrade it, and keep all items.
+    em_dict = pyrsistence.EMDict(dirname)
+    verify(em_dict, d)
+
+    with open(os.path.join(dirname, 'index.bin'), 'rb') as fp:
+        magic, = struct.unpack('Q', fp.read(8))
+    if magic >> 56 <= version:
+        util.msg('FATAL! Index was not upgraded')
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Add enough items to resize the upgraded index.
+    util.msg('Populating upgraded external memory dictionary')
+
+    for i in util.xrange(0x10000, 0x20000):
+        d[i] = i
+        em_dict[i] = i
+
+    for i in util.xrange(0, 0x10000, 6):
+        d[i] = 'value-%d' % i
+        em_dict[i] = d[i]
+
+    em_dict.close()
+
+    # Files grown past a segment by earlier versions are never split.
+    if start > util.SEGMENT_SIZE and os.path.exists(os.path.join(dirname, 'values.bin.1')):
+        util.msg('FATAL! Unsegmented "values.bin" split in segments')
+
+    em_dict = pyrsistence.EMDict(dirname)
+    verify(em_dict, d)
+    em_dict.close()
+
+    em_dict = pyrsistence.EMDict(dirname, reader=True)
+    verify(em_dict, d)
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Close and remove external memory dictionary from disk.
+    em_dict.close()
+    shutil.rmtree(dirname)
+
+
+def main(argv):
+
+    for version in util.xrange(len(util.LEGACY_DICT_HDR_WORDS)):
+        upgrade(version)
+
+    upgrade(util.SEGMENTED_VERSION - 1, util.SEGMENT_SIZE + 0x1000)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
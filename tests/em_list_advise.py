@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+'''em_list_advise.py - Checks hints given to the operating system about how
+external memory lists are going to be accessed.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x10000
+
+VALUE_SIZE = 0x200
+
+HINTS = ['normal', 'sequential', 'random', 'willneed', 'dontneed']
+
+
+def value_of(i):
+    return ('%d-' % i).ljust(VALUE_SIZE, 'x')
+
+
+def verify(em_list, what):
+    if list(em_list) != [value_of(i) for i in util.xrange(NUM_ITEMS)]:
+        util.msg('FATAL! Mismatch in items %s' % what)
+    for i in util.xrange(0, NUM_ITEMS, 0x10):
+        if em_list[i] != value_of(i):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating external memory list')
+
+    t1 = time.time()
+
+    dirname = os.path.abspath(util.make_temp_name('em_list'))
+
+    em_list = pyrsistence.EMList(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_list.append(value_of(i))
+    em_list.flush()
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Giving hints on external memory list access')
+
+    # Hints change nothing but performance.
+    for hint in HINTS:
+        em_list.advise(hint)
+        verify(em_list, 'after "%s" hint' % hint)
+
+        for start, end in [(0, 0x100), (0x100, None), (0, 1 << 40), (1 << 40, 1 << 41)]:
+            em_list.advise(hint, start, end)
+            em_list.advise(hint, start=start, end=end)
+        verify(em_list, 'after "%s" hint on ranges' % hint)
+
+    # Dropping the whole list from memory unmaps its pages, which are
+    # read back in when accessed again.
+    verify(em_list, 'before dropping')
+    size = util.resident_size(dirname)
+    em_list.advise('dontneed')
+    if size is not None and util.resident_size(dirname) > size // 4:
+        util.msg('FATAL! %d KB of %d KB still in memory after "dontneed" hint' % (util.resident_size(dirname), size))
+    verify(em_list, 'after dropping')
+
+    # A range drops part of it only.
+    size = util.resident_size(dirname)
+    em_list.advise('dontneed', 0, 0x1000)
+    if size is not None and not size // 4 < util.resident_size(dirname) < size:
+        util.msg('FATAL! %d KB of %d KB in memory after "dontneed" hint on range' % (util.resident_size(dirname), size))
+    verify(em_list, 'after dropping range')
+
+    for args in [('unknown', ), ('random', -1), ('random', 0x10, 0x8)]:
+        try:
+            em_list.advise(*args)
+            util.msg('FATAL! Accepted %r' % (args, ))
+        except ValueError:
+            pass
+
+    try:
+        em_list.advise('random', 0, 'end')
+        util.msg('FATAL! Invalid range end accepted')
+    except TypeError:
+        pass
+
+    em_list.close()
+
+    # Read-only lists take hints too.
+    em_list = pyrsistence.EMList(dirname, readonly=True)
+    for hint in HINTS:
+        em_list.advise(hint)
+        em_list.advise(hint, 0x100, 0x200)
+    verify(em_list, 'after re-opening read-only')
+    em_list.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Remove external memory list from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
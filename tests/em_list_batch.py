@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+'''em_list_batch.py - Checks batched reads of external memory lists, with
+`io_uring' and with the pool of threads it falls back to.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x20000
+
+BUFFER_POOL_SIZE = 0x400000
+
+PREFETCH = 0x40
+
+# Set to have the pool of threads issue batched reads (see "batch_io.h").
+NO_IO_URING = 'PYRSISTENCE_NO_IO_URING'
+
+BATCH_IO_THREADS = 16
+
+
+def value_of(i):
+    return [i, 'value-%d-' % i * (i % 0x20), None][i % 3]
+
+
+def num_threads():
+    '''Return the number of threads of this process, or `None' if unknown.'''
+    if os.path.isdir('/proc/self/task'):
+        return len(os.listdir('/proc/self/task'))
+    return None
+
+
+def verify(em_list, indices, what):
+
+    # Plain reads, one at a time.
+    values = [em_list[i] for i in indices]
+    if values != [value_of(i) for i in indices]:
+        util.msg('FATAL! Mismatch in plain reads %s' % what)
+
+    if em_list.get_many(indices) != values:
+        util.msg('FATAL! Mismatch in batched reads %s' % what)
+
+    # Batched reads while scanning.
+    values = sorted(em_list.scan(prefetch=PREFETCH, reorder=True), key=repr)
+    if values != sorted(em_list, key=repr):
+        util.msg('FATAL! Mismatch in reordered scan %s' % what)
+
+
+def main(argv):
+
+    util.msg('Populating external memory list')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+
+    em_list = pyrsistence.EMList(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_list.append(value_of(i))
+    em_list.close()
+
+    indices = list(util.xrange(NUM_ITEMS))
+    random.shuffle(indices)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying batched reads')
+
+    em_list = pyrsistence.EMList(dirname)
+    verify(em_list, indices, 'through mapped files')
+    em_list.close()
+
+    # Batches are read in the buffer pool with `io_uring', if the kernel
+    # allows, and by the pool of threads otherwise.
+    for no_io_uring in [False, True]:
+        what = 'through buffer pool (%s)' % ('threads' if no_io_uring else 'io_uring')
+
+        if no_io_uring:
+            os.environ[NO_IO_URING] = '1'
+
+        n = num_threads()
+        em_list = pyrsistence.EMList(dirname, buffer_pool=BUFFER_POOL_SIZE)
+        verify(em_list, indices, what)
+
+        if no_io_uring and n is not None and num_threads() < n + BATCH_IO_THREADS:
+            util.msg('FATAL! Pool of threads not used %s' % what)
+
+        em_list.close()
+
+        if no_io_uring:
+            del os.environ[NO_IO_URING]
+
+    # Indices must be in bounds.
+    em_list = pyrsistence.EMList(dirname, buffer_pool=BUFFER_POOL_SIZE)
+    if em_list.get_many([]) != [] or em_list.get_many((1, 1)) != [value_of(1)] * 2:
+        util.msg('FATAL! Mismatch in batched reads of duplicate indices')
+
+    for index in [NUM_ITEMS, -1]:
+        try:
+            em_list.get_many(indices[:0x1000] + [index])
+            util.msg('FATAL! Invalid index %d read' % index)
+        except IndexError:
+            pass
+
+    try:
+        em_list.get_many(['0'])
+        util.msg('FATAL! Invalid index type accepted')
+    except TypeError:
+        pass
+
+    em_list.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Remove external memory list from disk.
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+'''em_list_classes.py - Integrity benchmark for external memory lists storing
+class instances through a persistent class table.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import collections
+import time
+
+import util
+import pyrsistence
+
+
+class Point(object):
+
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+    def __eq__(self, other):
+        return type(other) is Point and (self.x, self.y) == (other.x, other.y)
+
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+
+def make_value(i):
+    return [Point(i, -i), collections.OrderedDict([('index', i)])]
+
+
+def main(argv):
+
+    # Initialize new external memory list with a class table.
+    util.msg('Populating external memory list')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+
+    em_list = pyrsistence.EMList(dirname, class_table=True)
+    for i in util.xrange(0x100000):
+        em_list.append(make_value(i))
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Re-open without requesting a class table; "classes.bin" is used anyway.
+    em_list.close()
+    util.msg('Class table size is %d bytes' % os.path.getsize(os.path.join(dirname, 'classes.bin')))
+    em_list = pyrsistence.EMList(dirname)
+
+    util.msg('Verifying external memory list contents')
+
+    for i in util.xrange(0x100000):
+        if em_list[i] != make_value(i):
+            util.msg('FATAL! Mismatch in element %d: Got %r' % (i, em_list[i]))
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory list from disk.
+    em_list.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
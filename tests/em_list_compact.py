@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+'''em_list_compact.py - Checks external memory lists with compact indices,
+keeping 32-bit positions.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x40000
+
+# Size of the header of "index.bin" and offset of its `flags' field.
+HDR_SIZE = 48
+FLAGS_OFFSET = 40
+
+COMPACT_POS_LIMIT = 32 << 30
+
+
+def verify(em_list, num_items, what):
+    if len(em_list) != num_items:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_list), num_items, what))
+    for i in util.xrange(num_items):
+        if em_list[i] != 'value-%d' % i:
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def main(argv):
+
+    util.msg('Populating normal and compact external memory lists')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+    compact_dirname = util.make_temp_name('em_list_compact')
+
+    em_list = pyrsistence.EMList(dirname)
+    compact_em_list = pyrsistence.EMList(compact_dirname, compact_index=True)
+    for i in util.xrange(NUM_ITEMS):
+        em_list.append('value-%d' % i)
+        compact_em_list.append('value-%d' % i)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying external memory list contents')
+
+    verify(compact_em_list, NUM_ITEMS, 'after population')
+
+    em_list.close()
+    compact_em_list.close()
+
+    # Entries take 4 bytes instead of 8.
+    size = os.path.getsize(os.path.join(dirname, 'index.bin'))
+    compact_size = os.path.getsize(os.path.join(compact_dirname, 'index.bin'))
+    if (compact_size - HDR_SIZE) * 2 != size - HDR_SIZE:
+        util.msg('FATAL! Compact index of %d bytes, normal index of %d bytes' % (compact_size, size))
+
+    # The format is picked up from "index.bin" when re-opening.
+    compact_em_list = pyrsistence.EMList(compact_dirname)
+    verify(compact_em_list, NUM_ITEMS, 'after re-opening')
+    compact_em_list.close()
+
+    compact_em_list = pyrsistence.EMList(compact_dirname, readonly=True)
+    verify(compact_em_list, NUM_ITEMS, 'after re-opening read-only')
+    compact_em_list.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    shutil.rmtree(dirname)
+
+    # Indices using features unknown to this version are refused.
+    util.msg('Checking unknown index flags')
+
+    filename = os.path.join(compact_dirname, 'index.bin')
+    with open(filename, 'r+b') as fp:
+        fp.seek(FLAGS_OFFSET)
+        flags = struct.unpack('<Q', fp.read(8))[0]
+        fp.seek(FLAGS_OFFSET)
+        fp.write(struct.pack('<Q', flags | 0x100))
+
+    try:
+        pyrsistence.EMList(compact_dirname)
+        util.msg('FATAL! Unknown index flags accepted')
+    except RuntimeError:
+        pass
+
+    shutil.rmtree(compact_dirname)
+
+    # Positions in "values.bin" must stay below 32GB. Sparse segments fill that
+    # space.
+    util.msg('Checking limit of compact index')
+
+    em_list = pyrsistence.EMList(compact_dirname, compact_index=True)
+    em_list.append('value')
+    em_list.close()
+
+    with open(os.path.join(compact_dirname, 'values.bin'), 'rb') as fp:
+        magic = fp.read(8)
+
+    for i in util.xrange(1, COMPACT_POS_LIMIT // util.SEGMENT_SIZE):
+        with open(os.path.join(compact_dirname, 'values.bin.%d' % i), 'wb') as fp:
+            fp.write(magic)
+            fp.truncate(util.SEGMENT_SIZE)
+
+    em_list = pyrsistence.EMList(compact_dirname)
+    try:
+        em_list.append('new-value')
+        util.msg('FATAL! Value appended past 32GB')
+    except OverflowError:
+        pass
+
+    try:
+        em_list[0] = 'new-value'
+        util.msg('FATAL! Value stored past 32GB')
+    except OverflowError:
+        pass
+
+    if len(em_list) != 1 or em_list[0] != 'value':
+        util.msg('FATAL! Mismatch after overflow')
+
+    em_list.close()
+    shutil.rmtree(compact_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
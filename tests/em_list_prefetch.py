@@ -0,0 +1,125 @@
+#!/usr/bin/env python
+'''em_list_prefetch.py - Checks that prefetching and reordering scans of
+external memory lists return the same items as plain ones.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import shutil
+import random
+import time
+
+import util
+import pyrsistence
+
+
+NUM_ITEMS = 0x8000
+
+PREFETCH_WINDOWS = [1, 7, 0x40, 0x10000]
+
+# Items modified after every that many items returned.
+MODIFY_INTERVAL = 0x30
+
+
+def value_of(i, version):
+    return ('%d-%d-' % (i, version)) * (i % 0x10 + 1)
+
+
+def index_of(value):
+    return int(value.split('-')[0])
+
+
+def check_modified(em_list, prefetch, reorder):
+    '''Scan `em_list' while overwriting random items, returned or not yet. Each
+    item must be returned once, with the value it had when it was returned.'''
+
+    versions = [0] * NUM_ITEMS
+    seen = set()
+
+    for n, v in enumerate(em_list.scan(prefetch=prefetch, reorder=reorder)):
+        i = index_of(v)
+        if i in seen or v != value_of(i, versions[i]):
+            util.msg('FATAL! Mismatch in element %d with prefetch=%d, reorder=%s' % (i, prefetch, reorder))
+            break
+        seen.add(i)
+
+        if n % MODIFY_INTERVAL == 0:
+            for j in random.sample(range(NUM_ITEMS), 0x10):
+                versions[j] += 1
+                em_list[j] = value_of(j, versions[j])
+
+    if len(seen) != NUM_ITEMS:
+        util.msg('FATAL! Got %d elements but expected %d with prefetch=%d, reorder=%s' % (len(seen), NUM_ITEMS, prefetch, reorder))
+
+    # Restore the original values for the next run.
+    for i in util.xrange(NUM_ITEMS):
+        if versions[i] != 0:
+            em_list[i] = value_of(i, 0)
+
+
+def main(argv):
+
+    util.msg('Populating external memory list')
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+
+    # Items are set in random order, so that values aren't laid out in
+    # "values.bin" in index order.
+    em_list = pyrsistence.EMList(dirname)
+    for i in util.xrange(NUM_ITEMS):
+        em_list.append(None)
+
+    indices = list(util.xrange(NUM_ITEMS))
+    random.shuffle(indices)
+    for i in indices:
+        em_list[i] = value_of(i, 0)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying prefetching scans')
+
+    expected = list(em_list)
+    if expected != [value_of(i, 0) for i in util.xrange(NUM_ITEMS)]:
+        util.msg('FATAL! Mismatch in plain scan')
+
+    for prefetch in PREFETCH_WINDOWS:
+        r = list(em_list.scan(prefetch=prefetch))
+        if r != expected:
+            util.msg('FATAL! Mismatch in scan with prefetch=%d' % prefetch)
+
+        # Reordered scans return the same items, in another order.
+        r = list(em_list.scan(prefetch=prefetch, reorder=True))
+        if sorted(r) != sorted(expected):
+            util.msg('FATAL! Mismatch in scan with prefetch=%d, reorder=True' % prefetch)
+
+    # Overwritten items are returned with their new values, whether they were
+    # prefetched already or not.
+    for prefetch in PREFETCH_WINDOWS[1:3]:
+        for reorder in [False, True]:
+            check_modified(em_list, prefetch, reorder)
+
+    for kwargs in [{'prefetch': -1}, {'reorder': True}]:
+        try:
+            em_list.scan(**kwargs)
+            util.msg('FATAL! Accepted %r' % kwargs)
+        except ValueError:
+            pass
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Close and remove external memory list from disk.
+    em_list.close()
+    shutil.rmtree(dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,141 @@
+#!/usr/bin/env python
+'''em_list_segments.py - Checks that "values.bin" of external memory lists is
+split in segments, which readers, snapshots and re-opening pick up.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import multiprocessing
+import time
+
+import util
+import pyrsistence
+
+
+SEGMENT_SIZE = 1 << 30
+
+VALUE_SIZE = 8 << 20
+
+# Enough values to fill the first segment and spill over to the second.
+NUM_VALUES = SEGMENT_SIZE // VALUE_SIZE + 0x20
+
+
+def make_value(data, i):
+    return struct.pack('<I', i) + data[4:]
+
+
+def verify(em_list, data, num_values, what):
+    if len(em_list) != num_values:
+        util.msg('FATAL! Got %d elements but expected %d %s' % (len(em_list), num_values, what))
+    for i in util.xrange(num_values):
+        if em_list[i] != make_value(data, i):
+            util.msg('FATAL! Mismatch in element %d %s' % (i, what))
+            break
+
+
+def reader(dirname, data, errors):
+    em_list = pyrsistence.EMList(dirname, reader=True)
+
+    # Wait for the writer to add the second segment.
+    while len(em_list) < NUM_VALUES:
+        time.sleep(0.01)
+    for i in util.xrange(NUM_VALUES - 1, -1, -1):
+        if em_list[i] != make_value(data, i):
+            errors.put(i)
+
+    em_list.close()
+    errors.put(None)
+
+
+def main(argv):
+
+    util.msg('Populating external memory list with %d values of %d bytes' % (NUM_VALUES, VALUE_SIZE))
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+    snapshot_dirname = util.make_temp_name('em_list_snapshot')
+
+    data = os.urandom(VALUE_SIZE)
+
+    em_list = pyrsistence.EMList(dirname)
+    em_list.append(make_value(data, 0))
+
+    # A reader opened before the second segment exists has to pick it up.
+    errors = multiprocessing.Queue()
+    process = multiprocessing.Process(target=reader, args=(dirname, data, errors))
+    process.start()
+
+    for i in util.xrange(1, NUM_VALUES):
+        em_list.append(make_value(data, i))
+
+    while True:
+        i = errors.get()
+        if i is None:
+            break
+        util.msg('FATAL! Mismatch in element %d in reader' % i)
+    process.join()
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    util.msg('Verifying external memory list contents')
+
+    if not os.path.exists(os.path.join(dirname, 'values.bin.1')):
+        util.msg('FATAL! Second segment not created')
+
+    for filename in ['values.bin', 'values.bin.1']:
+        if os.path.getsize(os.path.join(dirname, filename)) > SEGMENT_SIZE:
+            util.msg('FATAL! Segment "%s" larger than %d bytes' % (filename, SEGMENT_SIZE))
+
+    verify(em_list, data, NUM_VALUES, 'after population')
+
+    # A single value must fit in a segment.
+    try:
+        em_list.append(bytearray(SEGMENT_SIZE))
+        util.msg('FATAL! Object larger than a segment stored')
+    except ValueError:
+        pass
+
+    # Snapshots copy all segments.
+    snapshot = em_list.snapshot(snapshot_dirname)
+    if not os.path.exists(os.path.join(snapshot_dirname, 'values.bin.1')):
+        util.msg('FATAL! Second segment not copied in snapshot')
+    verify(snapshot, data, NUM_VALUES, 'in snapshot')
+    snapshot.close()
+
+    # The last segment is truncated on close and grows again once re-opened.
+    em_list.close()
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    util.msg('Re-opening external memory list')
+
+    em_list = pyrsistence.EMList(dirname)
+    verify(em_list, data, NUM_VALUES, 'after re-opening')
+
+    for i in util.xrange(NUM_VALUES, NUM_VALUES + 0x10):
+        em_list.append(make_value(data, i))
+    verify(em_list, data, NUM_VALUES + 0x10, 'after appending')
+
+    em_list.close()
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Remove external memory list and its snapshot from disk.
+    shutil.rmtree(dirname)
+    shutil.rmtree(snapshot_dirname)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -0,0 +1,122 @@
+#!/usr/bin/env python
+'''em_list_upgrade.py - Integrity benchmark for external memory lists created
+by earlier versions.'''
+
+__author__ = 'huku <huku@grhack.net>'
+
+
+import sys
+import os
+import shutil
+import struct
+import time
+
+import util
+import pyrsistence
+
+
+def verify(em_list, l):
+    if len(em_list) != len(l):
+        util.msg('FATAL! List has %d items but expected %d' % (len(em_list), len(l)))
+
+    for i in util.xrange(len(l)):
+        if em_list[i] != l[i]:
+            util.msg('FATAL! Mismatch in element %d: Got %r but expected %r' % (i, em_list[i], l[i]))
+
+
+def upgrade(version, start=0):
+
+    # Lay out the files of a list the way earlier versions did. If `start' is
+    # past `util.SEGMENT_SIZE', "values.bin" has grown past a segment.
+    util.msg('Creating external memory list in format version %d' % version)
+    if start > 0:
+        util.msg('Values begin at offset %#x of "values.bin"' % start)
+
+    t1 = time.time()
+
+    dirname = util.make_temp_name('em_list')
+
+    l = [['item', i, 'x' * (i % 50)] for i in util.xrange(1000)]
+    util.make_legacy_em_list(dirname, l, version, start)
+
+    t2 = time.time()
+    util.msg('Done in %d sec.' % (t2 - t1))
+
+    # Readers can't upgrade the index.
+    util.msg('Opening external memory list')
+
+    try:
+        pyrsistence.EMList(dirname, reader=True)
+    except RuntimeError:
+        pass
+    else:
+        util.msg('FATAL! Reader opened list in format version %d' % version)
+
+    # Read-only opens read it as it is.
+    em_list = pyrsistence.EMList(dirname, readonly=True)
+    verify(em_list, l)
+    em_list.close()
+
+    with open(os.path.join(dirname, 'index.bin'), 'rb') as fp:
+        magic, = struct.unpack('Q', fp.read(8))
+    if magic >> 56 != version:
+        util.msg('FATAL! Index was modified by read-only open')
+
+    # Writers upgrade it, and keep all items.
+    em_list = pyrsistence.EMList(dirname)
+    verify(em_list, l)
+
+    with open(os.path.join(dirname, 'index.bin'), 'rb') as fp:
+        magic, = struct.unpack('Q', fp.read(8))
+    if magic >> 56 <= version:
+        util.msg('FATAL! Index was not upgraded')
+
+    t3 = time.time()
+    util.msg('Done in %d sec.' % (t3 - t2))
+
+    # Add enough items to resize the upgraded index.
+    util.msg('Populating upgraded external memory list')
+
+    for i in util.xrange(1000, 0x10000):
+        l.append(i)
+        em_list.append(i)
+
+    for i in util.xrange(0, 1000, 2):
+        l[i] = 'item-%d' % i
+        em_list[i] = l[i]
+
+    em_list.close()
+
+    # Files grown past a segment by earlier versions are never split.
+    if start > util.SEGMENT_SIZE and os.path.exists(os.path.join(dirname, 'values.bin.1')):
+        util.msg('FATAL! Unsegmented "values.bin" split in segments')
+
+    em_list = pyrsistence.EMList(dirname)
+    verify(em_list, l)
+    em_list.close()
+
+    em_list = pyrsistence.EMList(dirname, reader=True)
+    verify(em_list, l)
+
+    t4 = time.time()
+    util.msg('Done in %d sec.' % (t4 - t3))
+
+    # Close and remove external memory list from disk.
+    em_list.close()
+    shutil.rmtree(dirname)
+
+
+def main(argv):
+
+    for version in util.xrange(len(util.LEGACY_LIST_HDR_WORDS)):
+        upgrade(version)
+
+    upgrade(util.SEGMENTED_VERSION - 1, util.SEGMENT_SIZE + 0x1000)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
+
+# EOF
@@ -8,6 +8,8 @@ import sys
 import os
 import tempfile
 import time
+import struct
+import pickle
 
 
 if sys.version_info >= (3, 0):
@@ -22,3 +24,108 @@ def msg(what):
 def make_temp_name(name):
     return '%s%s%s' % (tempfile.gettempdir(), os.path.sep, name)
 
+
+# Files of data structures begin with this magic number. In index files, its
+# last byte holds the format version, and it's followed by the used and total
+# number of entries, and as many words as listed below for earlier versions.
+# Chunks in data files hold pickles, after a word holding their size, header
+# included, rounded up to a multiple of the word size. Data files of versions
+# before `SEGMENTED_VERSION' weren't split in segments of `SEGMENT_SIZE' bytes.
+MAGIC = 0x0052444800444d45
+LEGACY_DICT_HDR_WORDS = [0, 1, 2, 3, 3]
+LEGACY_LIST_HDR_WORDS = [0, 1, 2, 2, 2]
+SEGMENTED_VERSION = 4
+SEGMENT_SIZE = 1 << 30
+WORD_SIZE = struct.calcsize('N')
+
+def write_legacy_chunks(filename, objs, start=0):
+    '''Write the pickles of `objs' in data file `filename' and return their
+    positions. If `start' is past the magic number, the pickles are written
+    from there on, past a hole.'''
+    positions = []
+    with open(filename, 'wb') as fp:
+        fp.write(struct.pack('Q', MAGIC))
+        fp.seek(max(start, fp.tell()))
+        for obj in objs:
+            data = pickle.dumps(obj, -1)
+            padding = -len(data) % WORD_SIZE
+            fp.write(struct.pack('N', WORD_SIZE + len(data) + padding))
+            positions.append(fp.tell())
+            fp.write(data + b'\0' * padding)
+    return positions
+
+def write_legacy_index(fp, version, used, size, hdr_words):
+    fp.write(struct.pack('QNN', MAGIC | version << 56, used, size))
+    fp.write(b'\0' * WORD_SIZE * hdr_words[version])
+
+def make_legacy_em_dict(dirname, d, version=0, start=0):
+    '''Create an external memory dictionary of format version `version' holding
+    the items of `d', whose keys must be distinct integers in [0, 65536). See
+    `write_legacy_chunks()' for `start'.'''
+    os.mkdir(dirname)
+    keys = sorted(d)
+    key_positions = write_legacy_chunks(os.path.join(dirname, 'keys.bin'), keys)
+    value_positions = write_legacy_chunks(os.path.join(dirname, 'values.bin'),
+        [d[k] for k in keys], start)
+    slots = [(0, 0, 0)] * 65536
+    for k, key_pos, value_pos in zip(keys, key_positions, value_positions):
+        slots[k] = (k, key_pos, value_pos)
+    with open(os.path.join(dirname, 'index.bin'), 'wb') as fp:
+        write_legacy_index(fp, version, len(keys), 65536 - 1,
+            LEGACY_DICT_HDR_WORDS)
+        for slot in slots:
+            fp.write(struct.pack('nNN', *slot))
+
+def make_legacy_em_list(dirname, l, version=0, start=0):
+    '''Create an external memory list of format version `version' holding the
+    items of `l'. See `write_legacy_chunks()' for `start'.'''
+    os.mkdir(dirname)
+    positions = write_legacy_chunks(os.path.join(dirname, 'values.bin'), l,
+        start)
+    capacity = 1
+    while capacity < len(positions):
+        capacity <<= 1
+    positions += [0] * (capacity - len(positions))
+    with open(os.path.join(dirname, 'index.bin'), 'wb') as fp:
+        write_legacy_index(fp, version, len(l), capacity,
+            LEGACY_LIST_HDR_WORDS)
+        for pos in positions:
+            fp.write(struct.pack('N', pos))
+
+def mapping_sizes(dirname, names):
+    '''Return a dictionary mapping names of files in `dirname' to the number of
+    KB their mappings account for, summed over the fields of "/proc/self/smaps"
+    named in `names', or `None' if unknown.'''
+    if not os.path.isfile('/proc/self/smaps'):
+        return None
+
+    sizes = {}
+    filename = None
+    with open('/proc/self/smaps') as fp:
+        for line in fp:
+            fields = line.split()
+            if not fields[0].endswith(':'):
+                filename = None
+                if fields[-1].startswith(dirname + os.path.sep):
+                    filename = os.path.basename(fields[-1])
+            elif filename is not None and fields[0][:-1] in names:
+                sizes[filename] = sizes.get(filename, 0) + int(fields[1])
+    return sizes
+
+def dirty_size(dirname):
+    '''Return the number of KB of mappings of files in `dirname' modified and
+    not yet written back, or `None' if unknown.'''
+
+    # Written back pages are write protected and marked clean again.
+    sizes = mapping_sizes(dirname, ['Shared_Dirty', 'Private_Dirty'])
+    if sizes is None:
+        return None
+    return sum(sizes.values())
+
+def resident_size(dirname):
+    '''Return the number of KB of mappings of files in `dirname' that are in
+    memory, or `None' if unknown.'''
+    sizes = mapping_sizes(dirname, ['Rss'])
+    if sizes is None:
+        return None
+    return sum(sizes.values())
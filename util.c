@@ -3,10 +3,16 @@
  *
  * util.c - Home of various helper functions that don't fit anywhere else.
  */
+#include "common.h"
 #include "util.h"
+#include "mapped_file.h"
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #ifdef DEBUG
@@ -42,10 +48,12 @@ void serror(const char *prefix)
 }
 
 
-/* Concatenate `dirname' and `filename' into a buffer of size `PATH_MAX'. */
+/* Concatenate `dirname' and `filename' into a per-thread buffer of size
+ * `PATH_MAX'.
+ */
 char *path_combine(const char *dirname, const char *filename)
 {
-    static char combined[PATH_MAX];
+    static THREAD_LOCAL char combined[PATH_MAX];
 
     char *ret = NULL;
 
@@ -99,6 +107,126 @@ void rm_dir(const char *dirname)
 }
 
 
+/* Platform independent function for checking whether a file exists. */
+int file_exists(const char *filename)
+{
+#ifdef _WIN32
+    return GetFileAttributesA(filename) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(filename, F_OK) == 0;
+#endif
+}
+
+
+/* Platform independent function for getting the size of a file in `*sizep'. */
+int file_size(const char *filename, size_t *sizep)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+
+    if(GetFileAttributesExA(filename, GetFileExInfoStandard, &attrs) == 0)
+        return -1;
+
+    *sizep = (size_t)(((uint64_t)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow);
+#else
+    struct stat st;
+
+    if(stat(filename, &st) != 0)
+        return -1;
+
+    *sizep = (size_t)st.st_size;
+#endif
+    return 0;
+}
+
+
+/* Platform independent function for removing a file. */
+void rm_file(const char *filename)
+{
+#ifdef _WIN32
+    DeleteFileA(filename);
+#else
+    unlink(filename);
+#endif
+}
+
+
+/* Platform independent function for atomically replacing file `dst' with file
+ * `src'.
+ */
+int mv_file(const char *src, const char *dst)
+{
+    int ret = -1;
+
+#ifdef _WIN32
+    if(MoveFileExA(src, dst,
+            MOVEFILE_WRITE_THROUGH | MOVEFILE_REPLACE_EXISTING) == 0)
+    {
+        serror("mv_file: MoveFileExA");
+        goto _err;
+    }
+#else
+    if(rename(src, dst) != 0)
+    {
+        serror("mv_file: rename");
+        goto _err;
+    }
+#endif
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Platform independent function for flushing file, or directory, `filename' to
+ * disk. Directories need not be flushed on Microsoft Windows, where `mv_file()'
+ * writes through.
+ */
+int sync_file(const char *filename)
+{
+    int ret = -1;
+
+#ifdef _WIN32
+    HANDLE fd;
+
+    if(GetFileAttributesA(filename) & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        ret = 0;
+        goto _err;
+    }
+
+    if((fd = CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ |
+            FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0,
+            NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("sync_file: CreateFileA");
+        goto _err;
+    }
+
+    if(FlushFileBuffers(fd))
+        ret = 0;
+    CloseHandle(fd);
+#else
+    int fd;
+
+    if((fd = open(filename, O_RDONLY)) < 0)
+    {
+        serror("sync_file: open");
+        goto _err;
+    }
+
+    if(fsync(fd) == 0)
+        ret = 0;
+    close(fd);
+#endif
+
+_err:
+    return ret;
+}
+
+
 /* Compare Python objects `obj1' and `obj2' and return true if equal. */
 int equal_objects(PyObject *obj1, PyObject *obj2)
 {
@@ -153,3 +281,111 @@ int valid_unpickler(PyObject *obj, PyObject **unpicklep)
 _ret:
     return ret;
 }
+
+
+/* Map durability mode name `name' to a `DURABILITY_XXX' constant. A `NULL' name
+ * means no write-ahead logging.
+ */
+int valid_durability(const char *name, int *durabilityp)
+{
+    int ret = -1;
+
+    if(name == NULL || strcmp(name, "none") == 0)
+        *durabilityp = DURABILITY_NONE;
+    else if(strcmp(name, "async") == 0)
+        *durabilityp = DURABILITY_ASYNC;
+    else if(strcmp(name, "batch") == 0)
+        *durabilityp = DURABILITY_BATCH;
+    else if(strcmp(name, "op") == 0)
+        *durabilityp = DURABILITY_OP;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Invalid durability mode \"%s\"", name);
+        goto _ret;
+    }
+
+    ret = 0;
+
+_ret:
+    return ret;
+}
+
+
+/* Map prefault mode name `name' to a `PREFAULT_XXX' constant. A `NULL' name
+ * means nothing is read in.
+ */
+int valid_prefault(const char *name, int *prefaultp)
+{
+    int ret = -1;
+
+    if(name == NULL || strcmp(name, "none") == 0)
+        *prefaultp = PREFAULT_NONE;
+    else if(strcmp(name, "index") == 0)
+        *prefaultp = PREFAULT_INDEX;
+    else if(strcmp(name, "all") == 0)
+        *prefaultp = PREFAULT_ALL;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Invalid prefault mode \"%s\"", name);
+        goto _ret;
+    }
+
+    ret = 0;
+
+_ret:
+    return ret;
+}
+
+
+/* Map access pattern name `name' to a `MF_ACCESS_XXX' constant. */
+int valid_access(const char *name, int *accessp)
+{
+    int ret = -1;
+
+    if(strcmp(name, "normal") == 0)
+        *accessp = MF_ACCESS_NORMAL;
+    else if(strcmp(name, "sequential") == 0)
+        *accessp = MF_ACCESS_SEQUENTIAL;
+    else if(strcmp(name, "random") == 0)
+        *accessp = MF_ACCESS_RANDOM;
+    else if(strcmp(name, "willneed") == 0)
+        *accessp = MF_ACCESS_WILLNEED;
+    else if(strcmp(name, "dontneed") == 0)
+        *accessp = MF_ACCESS_DONTNEED;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Invalid access pattern \"%s\"", name);
+        goto _ret;
+    }
+
+    ret = 0;
+
+_ret:
+    return ret;
+}
+
+
+/* Map compression mode name `name' to a `COMPRESSION_XXX' constant. A `NULL'
+ * name means no compression.
+ */
+int valid_compression(const char *name, int *compressionp)
+{
+    int ret = -1;
+
+    if(name == NULL || strcmp(name, "none") == 0)
+        *compressionp = COMPRESSION_NONE;
+    else if(strcmp(name, "lz4") == 0)
+        *compressionp = COMPRESSION_LZ4;
+    else if(strcmp(name, "lz4-dict") == 0)
+        *compressionp = COMPRESSION_LZ4_DICT;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Invalid compression mode \"%s\"", name);
+        goto _ret;
+    }
+
+    ret = 0;
+
+_ret:
+    return ret;
+}
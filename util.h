@@ -20,8 +20,17 @@ void serror(const char *);
 char *path_combine(const char *, const char *);
 int mk_dir(const char *);
 void rm_dir(const char *);
+void rm_file(const char *);
+int file_exists(const char *);
+int file_size(const char *, size_t *);
+int mv_file(const char *, const char *);
+int sync_file(const char *);
 int equal_objects(PyObject *, PyObject *);
 int valid_pickler(PyObject *, PyObject **);
 int valid_unpickler(PyObject *, PyObject **);
+int valid_compression(const char *, int *);
+int valid_durability(const char *, int *);
+int valid_prefault(const char *, int *);
+int valid_access(const char *, int *);
 
 #endif /* _UTIL_H_ */
@@ -0,0 +1,670 @@
+/* pyrsistence - A Python extension for External Memory Data Structures (EMDs)
+ * huku <huku@grhack.net>
+ *
+ * wal.c - Write-ahead logs of modifications.
+ *
+ * Modifications of memory mapped files only reach the disk when the operating
+ * system decides so, or when the files are synchronized on close, which takes a
+ * long time for large data structures. When a durability mode other than "none"
+ * is requested, each modification is first logged in "wal.bin", as a marshalled
+ * key and value, so that it can be replayed on the next open if the process or
+ * the system crashes before the data structure is closed. The log is written
+ * using plain file I/O and is synchronized to disk depending on the durability
+ * mode:
+ *
+ *   "async" - never; the operating system writes it back eventually
+ *   "batch" - every `WAL_BATCH_SIZE' bytes, and whenever `commit()' is called
+ *   "op"    - after every operation
+ *
+ * In "op" mode, threads wait for the log to be synchronized after releasing the
+ * lock of the EM object, and a single flush covers all records appended by the
+ * time it starts (group commit).
+ *
+ * Once the log has grown past `WAL_CHECKPOINT_SIZE' bytes, and when the index
+ * is resized, the memory mapped files are synchronized, a copy of the index is
+ * saved in "index.ckpt" and the log is emptied (checkpoint). The operating
+ * system may write back any subset of the pages of the memory mapped files
+ * after that, so, when the data structure is opened again, the index is
+ * restored from "index.ckpt" before replaying the log on top of it. Chunks the
+ * saved index refers to must stay intact until then; while the log is open,
+ * freed chunks aren't reused before the next checkpoint (see `pending' in
+ * "mapped_file.h"). Replaying relies on logged operations being idempotent.
+ *
+ * When the data structure is closed, the memory mapped files are synchronized,
+ * and "index.ckpt" and the log are removed. Recovery is up to the writer; the
+ * files of a data structure left behind by a crash are only consistent once it
+ * has been opened for writing again.
+ */
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#include "util.h"
+#include "marshaller.h"
+#include "mapped_file.h"
+#include "class_table.h"
+#include "wal.h"
+
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME        16777619U
+
+
+/* Update FNV-1a hash `hash' with `size' bytes at `data'. */
+static uint32_t wal_checksum(const void *data, size_t size, uint32_t hash)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for(i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/* Compute the checksum of the record whose header is `rec_hdr' and whose key
+ * and value, stored consecutively, are at `data'.
+ */
+static uint32_t wal_rec_checksum(wal_rec_hdr_t *rec_hdr, const char *data)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    hash = wal_checksum(&rec_hdr->op, sizeof(wal_rec_hdr_t) -
+        offsetof(wal_rec_hdr_t, op), hash);
+    return wal_checksum(data, rec_hdr->key_size + rec_hdr->value_size, hash);
+}
+
+
+#ifdef _WIN32
+
+/* Open or create file `filename'. */
+static int wal_open_file(wal_t *wal, const char *filename)
+{
+    int ret = -1;
+
+    if((wal->fd = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+            OPEN_ALWAYS, 0, NULL)) == INVALID_HANDLE_VALUE)
+    {
+        serror("wal_open_file: CreateFileA");
+        goto _err;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Return the size of the log file or -1 on error. */
+static ssize_t wal_file_size(wal_t *wal)
+{
+    LARGE_INTEGER size;
+
+    ssize_t ret = -1;
+
+    if(GetFileSizeEx(wal->fd, &size) == FALSE)
+        goto _err;
+
+    ret = (ssize_t)size.QuadPart;
+
+_err:
+    return ret;
+}
+
+
+/* Read or write, depending on `write', `size' bytes at position `pos'. */
+static int wal_io(wal_t *wal, void *buf, size_t size, size_t pos, int write)
+{
+    OVERLAPPED ov;
+    DWORD n;
+    BOOL ok = TRUE;
+
+    while(ok && size > 0)
+    {
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = LODWORD(pos);
+        ov.OffsetHigh = HIDWORD(pos);
+
+        n = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        if(write)
+            ok = WriteFile(wal->fd, buf, n, &n, &ov);
+        else
+            ok = ReadFile(wal->fd, buf, n, &n, &ov) && n > 0;
+
+        buf = (char *)buf + n;
+        size -= n;
+        pos += n;
+    }
+
+    return ok ? 0 : -1;
+}
+
+
+/* Truncate the log file at `size' bytes. */
+static int wal_truncate_file(wal_t *wal, size_t size)
+{
+    LARGE_INTEGER lsize;
+
+    lsize.QuadPart = size;
+    return SetFilePointerEx(wal->fd, lsize, NULL, FILE_BEGIN) &&
+        SetEndOfFile(wal->fd) ? 0 : -1;
+}
+
+
+/* Flush the log file to disk. */
+static int wal_sync_file(wal_t *wal)
+{
+    return FlushFileBuffers(wal->fd) ? 0 : -1;
+}
+
+
+/* Close the log file. */
+static void wal_close_file(wal_t *wal)
+{
+    CloseHandle(wal->fd);
+}
+
+#else
+
+/* Open or create file `filename'. */
+static int wal_open_file(wal_t *wal, const char *filename)
+{
+    int ret = -1;
+
+    if((wal->fd = open(filename, O_RDWR | O_CREAT, 0600)) < 0)
+    {
+        serror("wal_open_file: open");
+        goto _err;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Return the size of the log file or -1 on error. */
+static ssize_t wal_file_size(wal_t *wal)
+{
+    struct stat st;
+
+    ssize_t ret = -1;
+
+    if(fstat(wal->fd, &st) != 0)
+        goto _err;
+
+    ret = (ssize_t)st.st_size;
+
+_err:
+    return ret;
+}
+
+
+/* Read or write, depending on `write', `size' bytes at position `pos'. */
+static int wal_io(wal_t *wal, void *buf, size_t size, size_t pos, int write)
+{
+    ssize_t n;
+
+    while(size > 0)
+    {
+        if(write)
+            n = pwrite(wal->fd, buf, size, (off_t)pos);
+        else
+            n = pread(wal->fd, buf, size, (off_t)pos);
+
+        if(n <= 0)
+            return -1;
+
+        buf = (char *)buf + n;
+        size -= n;
+        pos += n;
+    }
+
+    return 0;
+}
+
+
+/* Truncate the log file at `size' bytes. */
+static int wal_truncate_file(wal_t *wal, size_t size)
+{
+    return ftruncate(wal->fd, (off_t)size);
+}
+
+
+/* Flush the log file to disk. Metadata other than the file's size need not be
+ * flushed, where the operating system allows for it.
+ */
+static int wal_sync_file(wal_t *wal)
+{
+#ifdef __APPLE__
+    return fsync(wal->fd);
+#else
+    return fdatasync(wal->fd);
+#endif
+}
+
+
+/* Close the log file. */
+static void wal_close_file(wal_t *wal)
+{
+    close(wal->fd);
+}
+
+#endif /* _WIN32 */
+
+
+/* Initialize write-ahead log `wal', which is initially closed. Raises
+ * `MemoryError' on failure.
+ */
+int wal_init(wal_t *wal)
+{
+    wal->is_open = 0;
+    return lock_init(&wal->lock);
+}
+
+
+/* Open, or create, "wal.bin" in directory `dirname'. Records are synchronized
+ * to disk as requested by `durability'. Existing records are kept, so that they
+ * can be replayed with `wal_replay()'.
+ */
+int wal_open(wal_t *wal, const char *dirname, int durability)
+{
+    wal_hdr_t hdr;
+    ssize_t size;
+    char *filename;
+    int ok;
+
+    int ret = -1;
+
+    filename = path_combine(dirname, "wal.bin");
+
+    if((wal->filename = PyMem_MALLOC(strlen(filename) + 1)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err1;
+    }
+
+    strcpy(wal->filename, filename);
+
+    if(wal_open_file(wal, filename) != 0)
+        goto _err2;
+
+    if((size = wal_file_size(wal)) < 0)
+        goto _err3;
+
+    /* Write the header of new (or truncated) logs. */
+    if((size_t)size < sizeof(hdr))
+    {
+        hdr.magic = MAGIC;
+
+        Py_BEGIN_ALLOW_THREADS
+        ok = wal_truncate_file(wal, 0) == 0 &&
+            wal_io(wal, &hdr, sizeof(hdr), 0, 1) == 0 &&
+            wal_sync_file(wal) == 0;
+        Py_END_ALLOW_THREADS
+
+        if(ok == 0)
+            goto _err3;
+    }
+    else if(wal_io(wal, &hdr, sizeof(hdr), 0, 0) != 0 || hdr.magic != MAGIC)
+        goto _err3;
+
+    wal->durability = durability;
+    wal->pos = wal->synced = sizeof(hdr);
+    wal->is_open = 1;
+
+    ret = 0;
+    goto _err1;
+
+_err3:
+    wal_close_file(wal);
+
+_err2:
+    PyMem_FREE(wal->filename);
+
+_err1:
+    if(ret != 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot open write-ahead log");
+    return ret;
+}
+
+
+/* Check if write-ahead log `wal' is open. May only be called with the lock of
+ * the owning EM object held.
+ */
+int wal_is_open(wal_t *wal)
+{
+    return wal->is_open;
+}
+
+
+/* Replay the records in write-ahead log `wal' by calling `apply()' for each,
+ * with `arg', the logged operation, and the unmarshalled key and value (the
+ * latter is `NULL' for deletions). Replaying stops at the first incomplete or
+ * corrupted record; records after it were never acknowledged. Returns the
+ * number of records replayed, or -1 on error.
+ */
+int wal_replay(wal_t *wal, em_common_t *em_obj, wal_apply_t apply, void *arg)
+{
+    wal_rec_hdr_t rec_hdr;
+    size_t pos = sizeof(wal_hdr_t), avail;
+    ssize_t size;
+    char *data;
+    PyObject *key_str, *value_str, *key = NULL, *value = NULL;
+    int count = 0;
+
+    int ret = -1;
+
+    if((size = wal_file_size(wal)) < 0)
+        goto _err1;
+
+    while(pos + sizeof(rec_hdr) <= (size_t)size)
+    {
+        if(wal_io(wal, &rec_hdr, sizeof(rec_hdr), pos, 0) != 0)
+            goto _err1;
+
+        avail = (size_t)size - pos - sizeof(rec_hdr);
+        if(rec_hdr.key_size > avail || rec_hdr.value_size > avail - rec_hdr.key_size)
+            break;
+
+        if((data = PyMem_MALLOC(rec_hdr.key_size + rec_hdr.value_size + 1)) == NULL)
+        {
+            PyErr_NoMemory();
+            goto _err1;
+        }
+
+        if(wal_io(wal, data, rec_hdr.key_size + rec_hdr.value_size,
+                pos + sizeof(rec_hdr), 0) != 0)
+            goto _err2;
+
+        if(wal_rec_checksum(&rec_hdr, data) != rec_hdr.checksum)
+        {
+            PyMem_FREE(data);
+            break;
+        }
+
+#if PY_MAJOR_VERSION >= 3
+        key_str = PyBytes_FromStringAndSize(data, rec_hdr.key_size);
+#else
+        key_str = PyString_FromStringAndSize(data, rec_hdr.key_size);
+#endif
+        if(key_str == NULL)
+            goto _err2;
+
+        key = unmarshal(em_obj, key_str);
+        Py_DECREF(key_str);
+
+        if(key == NULL)
+            goto _err2;
+
+        if(rec_hdr.value_size > 0)
+        {
+#if PY_MAJOR_VERSION >= 3
+            value_str = PyBytes_FromStringAndSize(data + rec_hdr.key_size,
+                rec_hdr.value_size);
+#else
+            value_str = PyString_FromStringAndSize(data + rec_hdr.key_size,
+                rec_hdr.value_size);
+#endif
+            if(value_str == NULL)
+                goto _err3;
+
+            value = unmarshal(em_obj, value_str);
+            Py_DECREF(value_str);
+
+            if(value == NULL)
+                goto _err3;
+        }
+
+        PyMem_FREE(data);
+
+        if(apply(arg, (int)rec_hdr.op, key, value) != 0)
+            goto _err4;
+
+        Py_CLEAR(value);
+        Py_CLEAR(key);
+
+        pos += ALIGN(sizeof(rec_hdr) + rec_hdr.key_size + rec_hdr.value_size);
+        count += 1;
+    }
+
+    wal->pos = wal->synced = pos;
+
+    ret = count;
+    goto _err1;
+
+_err4:
+    Py_XDECREF(value);
+    Py_DECREF(key);
+    goto _err1;
+
+_err3:
+    Py_DECREF(key);
+
+_err2:
+    PyMem_FREE(data);
+
+_err1:
+    if(ret < 0 && PyErr_Occurred() == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Cannot replay write-ahead log");
+    return ret;
+}
+
+
+/* Append a record for operation `op' on marshalled key `key_str' and value
+ * `value_str', which is `NULL' for deletions, to write-ahead log `wal' of EM
+ * object `em_obj'. Must be called with the lock of `em_obj' held exclusively,
+ * before the operation is applied. Returns the position right after the record,
+ * to be passed to `wal_complete()', 0 if nothing is logged in durability mode
+ * "none", or -1 on error.
+ */
+ssize_t wal_append(wal_t *wal, em_common_t *em_obj, int op, PyObject *key_str,
+        PyObject *value_str)
+{
+    wal_rec_hdr_t *rec_hdr;
+    char *key, *value = NULL, *buf;
+    Py_ssize_t key_size, value_size = 0;
+    size_t size, pos = wal->pos;
+    int written;
+
+    ssize_t ret = -1;
+
+    if(wal->durability == DURABILITY_NONE)
+    {
+        ret = 0;
+        goto _err1;
+    }
+
+    /* Class IDs in marshalled objects must remain valid after a crash. */
+    if(wal->durability != DURABILITY_ASYNC && em_obj->classes != NULL &&
+            class_table_sync(em_obj->classes) != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize class table");
+        goto _err1;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if(PyBytes_AsStringAndSize(key_str, &key, &key_size) == -1)
+        goto _err1;
+
+    if(value_str != NULL &&
+            PyBytes_AsStringAndSize(value_str, &value, &value_size) == -1)
+        goto _err1;
+#else
+    if(PyString_AsStringAndSize(key_str, &key, &key_size) == -1)
+        goto _err1;
+
+    if(value_str != NULL &&
+            PyString_AsStringAndSize(value_str, &value, &value_size) == -1)
+        goto _err1;
+#endif
+
+    size = ALIGN(sizeof(wal_rec_hdr_t) + key_size + value_size);
+
+    if((buf = PyMem_MALLOC(size)) == NULL)
+    {
+        PyErr_NoMemory();
+        goto _err1;
+    }
+
+    memset(buf, 0, size);
+
+    rec_hdr = (wal_rec_hdr_t *)buf;
+    rec_hdr->op = (uint32_t)op;
+    rec_hdr->key_size = (size_t)key_size;
+    rec_hdr->value_size = (size_t)value_size;
+
+    memcpy(buf + sizeof(wal_rec_hdr_t), key, key_size);
+    if(value_size > 0)
+        memcpy(buf + sizeof(wal_rec_hdr_t) + key_size, value, value_size);
+
+    rec_hdr->checksum = wal_rec_checksum(rec_hdr, buf + sizeof(wal_rec_hdr_t));
+
+    Py_BEGIN_ALLOW_THREADS
+    written = wal_io(wal, buf, size, pos, 1) == 0;
+    Py_END_ALLOW_THREADS
+
+    if(written == 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot write to write-ahead log");
+        goto _err2;
+    }
+
+    /* Only publish the record to `wal_commit()' once it has been written. */
+    pos += size;
+    wal->pos = pos;
+
+    ret = (ssize_t)pos;
+
+_err2:
+    PyMem_FREE(buf);
+
+_err1:
+    return ret;
+}
+
+
+/* Make sure records up to position `lsn', as returned by `wal_append()', are
+ * on disk. If another thread is already flushing the log, wait for it, as its
+ * flush may cover `lsn' as well. May be called without holding the lock of the
+ * owning EM object.
+ */
+int wal_commit(wal_t *wal, size_t lsn)
+{
+    size_t pos;
+    int synced = 1;
+
+    int ret = -1;
+
+    lock_acquire(&wal->lock);
+
+    if(wal->is_open && wal->synced < lsn)
+    {
+        pos = wal->pos;
+
+        Py_BEGIN_ALLOW_THREADS
+        synced = wal_sync_file(wal) == 0;
+        Py_END_ALLOW_THREADS
+
+        if(synced)
+            wal->synced = pos;
+    }
+
+    lock_release(&wal->lock);
+
+    if(synced == 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot synchronize write-ahead log");
+        goto _err;
+    }
+
+    ret = 0;
+
+_err:
+    return ret;
+}
+
+
+/* Called once the operation logged at position `lsn' of write-ahead log `wal'
+ * has been applied, and the lock of the owning EM object has been released, to
+ * synchronize the log as requested by its durability mode.
+ */
+int wal_complete(wal_t *wal, size_t lsn)
+{
+    int ret = 0;
+
+    if(wal->durability == DURABILITY_OP ||
+            (wal->durability == DURABILITY_BATCH && lsn - wal->synced >= WAL_BATCH_SIZE))
+        ret = wal_commit(wal, lsn);
+    return ret;
+}
+
+
+/* Empty write-ahead log `wal', after the files of the owning EM object have been
+ * synchronized to disk. Must be called with the lock of the owning EM object
+ * held exclusively.
+ */
+int wal_reset(wal_t *wal)
+{
+    int ok;
+
+    int ret = -1;
+
+    lock_acquire(&wal->lock);
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = wal_truncate_file(wal, sizeof(wal_hdr_t)) == 0 &&
+        wal_sync_file(wal) == 0;
+    Py_END_ALLOW_THREADS
+
+    if(ok)
+    {
+        wal->pos = wal->synced = sizeof(wal_hdr_t);
+        ret = 0;
+    }
+    else
+        PyErr_SetString(PyExc_RuntimeError, "Cannot reset write-ahead log");
+
+    lock_release(&wal->lock);
+    return ret;
+}
+
+
+/* Close write-ahead log `wal'. Records not yet synchronized to disk are left to
+ * the operating system.
+ */
+void wal_close(wal_t *wal)
+{
+    lock_acquire(&wal->lock);
+
+    if(wal->is_open)
+    {
+        wal_close_file(wal);
+        PyMem_FREE(wal->filename);
+        wal->durability = DURABILITY_NONE;
+        wal->is_open = 0;
+    }
+
+    lock_release(&wal->lock);
+}
+
+
+/* Free resources held by write-ahead log `wal'. */
+void wal_fini(wal_t *wal)
+{
+    if(wal->lock.initialized)
+    {
+        wal_close(wal);
+        lock_fini(&wal->lock);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include "common.h"
+#include "lock.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+
+/* Operations logged in "wal.bin". */
+#define WAL_OP_SET 1
+#define WAL_OP_DEL 2
+
+/* In "batch" durability mode, the log is synchronized to disk whenever this
+ * many bytes have been logged since the last time.
+ */
+#define WAL_BATCH_SIZE (1 << 20)
+
+/* Once the log grows past this size, the data structure's files are synced to
+ * disk and the log is emptied.
+ */
+#define WAL_CHECKPOINT_SIZE (64 << 20)
+
+
+/* In-file header; "wal.bin" begins with this structure. */
+typedef struct wal_hdr
+{
+    uint64_t magic;           /* Log file magic */
+} wal_hdr_t;
+
+
+/* Each record in "wal.bin" begins with this structure, followed by a marshalled
+ * key and a marshalled value, and is padded to a multiple of `sizeof(size_t)'.
+ */
+typedef struct wal_rec_hdr
+{
+    uint32_t checksum;        /* FNV-1a hash of the rest of the record */
+    uint32_t op;              /* One of the `WAL_OP_XXX' constants */
+    size_t key_size;          /* Size of marshalled key */
+    size_t value_size;        /* Size of marshalled value, 0 if none */
+} wal_rec_hdr_t;
+
+
+/* A write-ahead log of modifications. Records are appended by the thread that
+ * holds the lock of the owning EM object exclusively, but may be synchronized
+ * to disk by `wal_commit()' after that lock is released, so that operations of
+ * several threads share a single flush.
+ */
+typedef struct wal
+{
+    char *filename;           /* Path to "wal.bin" */
+#ifdef _WIN32
+    HANDLE fd;                /* Handle of "wal.bin" */
+#else
+    int fd;                   /* Descriptor of "wal.bin" */
+#endif
+    char is_open;             /* Non-zero if "wal.bin" is open */
+    int durability;           /* Durability mode, "none" while replaying or closed */
+    volatile size_t pos;      /* End of the last record appended */
+    size_t synced;            /* End of the last record synchronized to disk */
+    lock_t lock;              /* Serializes `wal_commit()' and `wal_close()' */
+} wal_t;
+
+
+/* Called by `wal_replay()' for each logged operation. */
+typedef int (*wal_apply_t)(void *, int, PyObject *, PyObject *);
+
+int wal_init(wal_t *);
+int wal_open(wal_t *, const char *, int);
+int wal_is_open(wal_t *);
+int wal_replay(wal_t *, em_common_t *, wal_apply_t, void *);
+ssize_t wal_append(wal_t *, em_common_t *, int, PyObject *, PyObject *);
+int wal_commit(wal_t *, size_t);
+int wal_complete(wal_t *, size_t);
+int wal_reset(wal_t *);
+void wal_close(wal_t *);
+void wal_fini(wal_t *);
+
+#endif /* _WAL_H_ */